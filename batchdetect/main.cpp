@@ -0,0 +1,451 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cocodetectionbatcher.h"
+#include "cocodetectionmodel.h"
+#include "cocodetectionworker.h"
+#include "jsonlines.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QTextStream>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/*
+ * Runs detection over a directory of images or a file of raw frames without
+ * a display and streams the detections as JSON Lines or CSV to stdout (or
+ * --output). Images are decoded in parallel on the global thread pool, every
+ * interpreter gets its own CocoDetectionBatcher.
+ */
+
+namespace {
+
+struct RawFormat {
+    const char* name;
+    PixelLayout layout;
+    bool swapChroma;
+};
+
+const RawFormat RawFormats[] = {
+    { "rgb24", PixelLayout::RGB888, false },
+    { "bgr24", PixelLayout::BGR888, false },
+    { "rgbx", PixelLayout::RGBX8888, false },
+    { "bgrx", PixelLayout::BGRX8888, false },
+    { "xrgb", PixelLayout::XRGB8888, false },
+    { "xbgr", PixelLayout::XBGR8888, false },
+    { "nv12", PixelLayout::NV12, false },
+    { "nv21", PixelLayout::NV21, false },
+    { "yuv420p", PixelLayout::YUV420P, false },
+    { "yv12", PixelLayout::YUV420P, true },
+    { "yuyv", PixelLayout::YUYV, false },
+    { "uyvy", PixelLayout::UYVY, false },
+};
+
+// QRunnable::create() needs Qt 5.15
+class FunctionTask : public QRunnable
+{
+public:
+    explicit FunctionTask(std::function<void()> function)
+        : m_function(std::move(function))
+    {
+    }
+
+    void run() override { m_function(); }
+
+private:
+    std::function<void()> m_function;
+};
+
+const RawFormat* rawFormat(const QString& name)
+{
+    for (const RawFormat& format : RawFormats) {
+        if (name.compare(QLatin1String(format.name), Qt::CaseInsensitive) == 0) {
+            return &format;
+        }
+    }
+    return nullptr;
+}
+
+qint64 rawFrameSize(PixelLayout layout, int width, int height)
+{
+    const qint64 pixels = qint64(width) * height;
+    switch (layout) {
+    case PixelLayout::RGB888:
+    case PixelLayout::BGR888:
+        return pixels * 3;
+    case PixelLayout::NV12:
+    case PixelLayout::NV21:
+    case PixelLayout::YUV420P:
+        return pixels + 2 * (qint64((width + 1) / 2) * ((height + 1) / 2));
+    case PixelLayout::YUYV:
+    case PixelLayout::UYVY:
+        return pixels * 2;
+    default:
+        return pixels * 4;
+    }
+}
+
+// tightly packed frame at data
+SourceImage rawFrame(const uchar* data, const RawFormat& format, int width, int height)
+{
+    SourceImage image;
+    image.layout = format.layout;
+    image.width = width;
+    image.height = height;
+    image.data[0] = data;
+
+    const int chromaWidth = (width + 1) / 2;
+    const int chromaHeight = (height + 1) / 2;
+
+    switch (format.layout) {
+    case PixelLayout::RGB888:
+    case PixelLayout::BGR888:
+        image.stride[0] = width * 3;
+        break;
+    case PixelLayout::NV12:
+    case PixelLayout::NV21:
+        image.stride[0] = width;
+        image.data[1] = data + width * height;
+        image.stride[1] = 2 * chromaWidth;
+        break;
+    case PixelLayout::YUV420P:
+        image.stride[0] = width;
+        image.data[1] = data + width * height;
+        image.data[2] = image.data[1] + chromaWidth * chromaHeight;
+        image.stride[1] = chromaWidth;
+        image.stride[2] = chromaWidth;
+        if (format.swapChroma) {
+            std::swap(image.data[1], image.data[2]);
+        }
+        break;
+    case PixelLayout::YUYV:
+    case PixelLayout::UYVY:
+        image.stride[0] = width * 2;
+        break;
+    default:
+        image.stride[0] = width * 4;
+        break;
+    }
+    return image;
+}
+
+QString csvString(const QString& value)
+{
+    QString escaped = value;
+    escaped.replace(QLatin1Char('"'), QLatin1String("\"\""));
+    return QLatin1Char('"') + escaped + QLatin1Char('"');
+}
+
+/*
+ * Streams the results, called from the batcher threads.
+ */
+class ResultWriter
+{
+public:
+    ResultWriter(QIODevice* device, bool csv, const CocoDetectionModel& labels)
+        : m_stream(device), m_csv(csv), m_labels(labels)
+    {
+        if (m_csv) {
+            m_stream << "source,frame,class,label,score,x,y,width,height\n";
+        }
+    }
+
+    void write(const QString& source, quint64 frame, const QVector<CocoDetectionModel::DetectedObject>& detectedObjects)
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        QMutexLocker locker(&m_mutex);
+        if (m_csv) {
+            for (const auto& detectedObject : detectedObjects) {
+                const QRectF& rect = detectedObject.boundingRect;
+                m_stream << csvString(source) << ',' << frame << ',' << detectedObject.classIndex << ','
+                         << csvString(m_labels.label(detectedObject.classIndex)) << ',' << detectedObject.score << ','
+                         << rect.x() << ',' << rect.y() << ',' << rect.width() << ',' << rect.height() << '\n';
+            }
+        } else {
+            m_stream << "{\"source\":" << JsonLines::quoted(source) << ",\"frame\":" << frame << ",\"detections\":[";
+            for (int i = 0; i < detectedObjects.size(); i++) {
+                const auto& detectedObject = detectedObjects.at(i);
+                const QRectF& rect = detectedObject.boundingRect;
+                m_stream << (i > 0 ? "," : "") << "{\"class\":" << detectedObject.classIndex
+                         << ",\"label\":" << JsonLines::quoted(m_labels.label(detectedObject.classIndex))
+                         << ",\"score\":" << detectedObject.score << ",\"x\":" << rect.x() << ",\"y\":" << rect.y()
+                         << ",\"width\":" << rect.width() << ",\"height\":" << rect.height() << '}';
+            }
+            m_stream << "]}\n";
+        }
+        m_stream.flush();
+
+        m_writeTime += timer.nsecsElapsed();
+    }
+
+    qint64 writeTime() const { return m_writeTime; }
+
+private:
+    QMutex m_mutex;
+    QTextStream m_stream;
+    bool m_csv;
+    const CocoDetectionModel& m_labels;
+    qint64 m_writeTime = 0;
+};
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("qmlmobilenet-detect"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Runs COCO object detection over images or raw video frames."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("input"), QStringLiteral("Directory of images or file of raw frames."));
+
+    const QCommandLineOption modelOption(QStringLiteral("model"), QStringLiteral("TFLite model file."), QStringLiteral("file"),
+                                         QStringLiteral("model/ssd_mobilenet_v1_1_metadata_1.tflite"));
+    const QCommandLineOption labelsOption(QStringLiteral("labels"), QStringLiteral("Label file."), QStringLiteral("file"),
+                                          QStringLiteral("model/coco_labels.txt"));
+    const QCommandLineOption formatOption(QStringLiteral("format"), QStringLiteral("Output format, jsonl or csv."),
+                                          QStringLiteral("format"), QStringLiteral("jsonl"));
+    const QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Output file instead of stdout."),
+                                          QStringLiteral("file"));
+    const QCommandLineOption interpretersOption(QStringLiteral("interpreters"), QStringLiteral("Parallel interpreters."),
+                                                QStringLiteral("count"),
+                                                QString::number(std::max(1, QThread::idealThreadCount() / 2)));
+    const QCommandLineOption threadsOption(QStringLiteral("threads"), QStringLiteral("TFLite threads per interpreter."),
+                                           QStringLiteral("count"), QStringLiteral("2"));
+    const QCommandLineOption inFlightOption(QStringLiteral("in-flight"),
+                                            QStringLiteral("Frames decoded or queued for inference at most, 0 picks four per interpreter."),
+                                            QStringLiteral("count"), QStringLiteral("0"));
+    const QCommandLineOption batchOption(QStringLiteral("batch"), QStringLiteral("Frames per Invoke()."),
+                                         QStringLiteral("count"), QStringLiteral("1"));
+    const QCommandLineOption maxWaitOption(QStringLiteral("max-wait"), QStringLiteral("Longest wait for a batch to fill, in ms."),
+                                           QStringLiteral("ms"), QStringLiteral("10"));
+    const QCommandLineOption decodersOption(QStringLiteral("decoders"), QStringLiteral("Parallel image decoders."),
+                                            QStringLiteral("count"), QString::number(QThread::idealThreadCount()));
+    const QCommandLineOption delegateOption(QStringLiteral("delegate"),
+                                            QStringLiteral("Delegate: %1.").arg(DelegateOptions::availableModes().join(QStringLiteral(", "))),
+                                            QStringLiteral("name"), QStringLiteral("default"));
+    const QCommandLineOption rawFormatOption(QStringLiteral("raw-format"),
+                                             QStringLiteral("Pixel format of a raw frame file (rgb24, bgr24, rgbx, bgrx, xrgb, xbgr, nv12, nv21, yuv420p, yv12, yuyv, uyvy)."),
+                                             QStringLiteral("format"));
+    const QCommandLineOption rawWidthOption(QStringLiteral("raw-width"), QStringLiteral("Width of the raw frames."), QStringLiteral("pixels"));
+    const QCommandLineOption rawHeightOption(QStringLiteral("raw-height"), QStringLiteral("Height of the raw frames."), QStringLiteral("pixels"));
+
+    parser.addOptions({ modelOption, labelsOption, formatOption, outputOption, interpretersOption, threadsOption,
+                        inFlightOption, batchOption, maxWaitOption, decodersOption, delegateOption,
+                        rawFormatOption, rawWidthOption, rawHeightOption });
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+    const QString input = parser.positionalArguments().first();
+
+    const QString format = parser.value(formatOption);
+    if (format != QLatin1String("jsonl") && format != QLatin1String("csv")) {
+        fprintf(stderr, "Unknown output format %s\n", qPrintable(format));
+        return 1;
+    }
+
+    DelegateOptions delegateOptions;
+    if (!DelegateOptions::modeFromName(parser.value(delegateOption), &delegateOptions.mode)) {
+        fprintf(stderr, "Unknown delegate %s\n", qPrintable(parser.value(delegateOption)));
+        return 1;
+    }
+
+    const int interpreters = std::max(1, parser.value(interpretersOption).toInt());
+    const int threads = std::max(1, parser.value(threadsOption).toInt());
+    const int batchSize = std::max(1, parser.value(batchOption).toInt());
+    const int maxWait = std::max(0, parser.value(maxWaitOption).toInt());
+    int inFlight = parser.value(inFlightOption).toInt();
+    if (inFlight <= 0) {
+        inFlight = 4 * interpreters * batchSize;
+    }
+
+    // collect the frames: image files or slices of the mapped raw file
+    QStringList sources;
+    std::vector<SourceImage> rawFrames;
+    QFile rawFile;
+
+    if (QFileInfo(input).isDir()) {
+        QStringList filters;
+        for (const QByteArray& suffix : QImageReader::supportedImageFormats()) {
+            filters << QStringLiteral("*.") + QString::fromLatin1(suffix);
+        }
+        QDirIterator it(input, filters, QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            sources << it.next();
+        }
+        sources.sort();
+    } else {
+        const RawFormat* raw = rawFormat(parser.value(rawFormatOption));
+        const int width = parser.value(rawWidthOption).toInt();
+        const int height = parser.value(rawHeightOption).toInt();
+        if (!raw || width <= 0 || height <= 0) {
+            fprintf(stderr, "Raw frame files need --raw-format, --raw-width and --raw-height\n");
+            return 1;
+        }
+
+        rawFile.setFileName(input);
+        const qint64 frameSize = rawFrameSize(raw->layout, width, height);
+        const uchar* data = rawFile.open(QIODevice::ReadOnly) ? rawFile.map(0, rawFile.size()) : nullptr;
+        if (!data) {
+            fprintf(stderr, "Cannot map %s\n", qPrintable(input));
+            return 1;
+        }
+
+        for (qint64 offset = 0; offset + frameSize <= rawFile.size(); offset += frameSize) {
+            rawFrames.push_back(rawFrame(data + offset, *raw, width, height));
+            sources << QStringLiteral("%1@%2").arg(QFileInfo(input).fileName()).arg(rawFrames.size() - 1);
+        }
+    }
+
+    if (sources.isEmpty()) {
+        fprintf(stderr, "Nothing to process in %s\n", qPrintable(input));
+        return 1;
+    }
+
+    std::shared_ptr<tflite::FlatBufferModel> model = CocoDetectionWorker::loadModel(parser.value(modelOption));
+    if (!model) {
+        return 1;
+    }
+
+    CocoDetectionModel labels(parser.value(labelsOption));
+
+    QFile outputFile;
+    if (parser.isSet(outputOption)) {
+        outputFile.setFileName(parser.value(outputOption));
+        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(outputFile.fileName()));
+            return 1;
+        }
+    } else {
+        outputFile.open(stdout, QIODevice::WriteOnly);
+    }
+    ResultWriter writer(&outputFile, format == QLatin1String("csv"), labels);
+
+    // bounds the decoded frames waiting for an interpreter, released once a result was written
+    QSemaphore inFlightSlots(inFlight);
+    QSemaphore finished;
+    std::atomic<qint64> decodeTime { 0 };
+    std::atomic<qint64> inferenceTime { 0 };
+    std::atomic<int> batches { 0 };
+    std::atomic<int> failedFrames { 0 };
+
+    std::vector<std::unique_ptr<CocoDetectionBatcher>> batchers;
+    for (int i = 0; i < interpreters; i++) {
+        std::unique_ptr<CocoDetectionBatcher> batcher(new CocoDetectionBatcher(model, threads, batchSize, maxWait, delegateOptions));
+        if (!batcher->isValid()) {
+            fprintf(stderr, "Interpreter %d could not be initialized\n", i);
+            return 1;
+        }
+
+        QObject::connect(batcher.get(), &CocoDetectionBatcher::predictionFinished, batcher.get(),
+                         [&](quint64 id, const QVector<CocoDetectionModel::DetectedObject>& detectedObjects) {
+            writer.write(sources.at(static_cast<int>(id)), id, detectedObjects);
+            inFlightSlots.release();
+            finished.release();
+        }, Qt::DirectConnection);
+        QObject::connect(batcher.get(), &CocoDetectionBatcher::batchFinished, batcher.get(),
+                         [&](int, qint64 nsecs) {
+            inferenceTime += nsecs;
+            batches++;
+        }, Qt::DirectConnection);
+
+        batchers.push_back(std::move(batcher));
+    }
+
+    std::atomic<size_t> nextBatcher { 0 };
+    // spreads frames over the batchers; if all of them are full, waits for room at the next one in turn
+    auto submit = [&](quint64 id, const QImage* image, const SourceImage* source) {
+        for (size_t i = 0; i < batchers.size(); i++) {
+            CocoDetectionBatcher* batcher = batchers[(nextBatcher++) % batchers.size()].get();
+            if (image ? batcher->submit(*image, id) : batcher->submit(*source, id)) {
+                return;
+            }
+        }
+        CocoDetectionBatcher* batcher = batchers[(nextBatcher++) % batchers.size()].get();
+        if (image) {
+            batcher->submit(*image, id, true);
+        } else {
+            batcher->submit(*source, id, true);
+        }
+    };
+
+    QElapsedTimer wallClock;
+    wallClock.start();
+
+    QThreadPool decoders;
+    decoders.setMaxThreadCount(std::max(1, parser.value(decodersOption).toInt()));
+
+    for (int id = 0; id < sources.size(); id++) {
+        inFlightSlots.acquire();
+
+        if (!rawFrames.empty()) {
+            submit(id, nullptr, &rawFrames[id]);
+            continue;
+        }
+
+        decoders.start(new FunctionTask([&, id]() {
+            QElapsedTimer timer;
+            timer.start();
+            QImageReader reader(sources.at(id));
+            // the preprocessor reads RGB888 directly, so convert while decoding in parallel
+            const QImage image = reader.read().convertToFormat(QImage::Format_RGB888);
+            decodeTime += timer.nsecsElapsed();
+
+            if (image.isNull()) {
+                fprintf(stderr, "Cannot decode %s: %s\n", qPrintable(sources.at(id)), qPrintable(reader.errorString()));
+                failedFrames++;
+                writer.write(sources.at(id), id, QVector<CocoDetectionModel::DetectedObject>());
+                inFlightSlots.release();
+                finished.release();
+                return;
+            }
+            submit(id, &image, nullptr);
+        }));
+    }
+
+    finished.acquire(sources.size());
+    decoders.waitForDone();
+    const qint64 wallTime = wallClock.nsecsElapsed();
+    batchers.clear();
+
+    const int frames = sources.size();
+    const double seconds = wallTime / 1e9;
+    fprintf(stderr, "Processed %d frames (%d failed) in %.3f s: %.2f frames/s\n",
+            frames, failedFrames.load(), seconds, frames / std::max(seconds, 1e-9));
+    if (rawFrames.empty()) {
+        fprintf(stderr, "  decode:    %8.3f ms/frame (summed over %d decoders)\n",
+                decodeTime / 1e6 / frames, decoders.maxThreadCount());
+    }
+    fprintf(stderr, "  inference: %8.3f ms/frame, %.3f ms/batch, %.2f frames/batch (summed over %d interpreters)\n",
+            inferenceTime / 1e6 / frames, inferenceTime / 1e6 / std::max(1, batches.load()),
+            double(frames) / std::max(1, batches.load()), interpreters);
+    fprintf(stderr, "  output:    %8.3f ms/frame\n", writer.writeTime() / 1e6 / frames);
+
+    return failedFrames > 0 ? 2 : 0;
+}
@@ -0,0 +1,539 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cocodetectionmodel.h"
+#include "cocodetectionworker.h"
+#include "detectiondecoder.h"
+#include "framebufferpool.h"
+#include "imagepreprocessor.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QRegularExpression>
+#include <QSysInfo>
+#include <QThread>
+#include <QVideoFrame>
+#include <QVideoSurfaceFormat>
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <vector>
+
+/*
+ * Micro and macro benchmarks of the detection hot path. Everything but the
+ * Invoke() benchmark runs on synthetic, seeded data, so results are
+ * comparable between runs and builds on the same machine. Results are
+ * written as JSON, one entry per benchmark with the statistics in
+ * microseconds.
+ */
+
+namespace {
+
+struct Options {
+    int iterations = 200;
+    int warmup = 20;
+    QRegularExpression filter;
+};
+
+class BenchmarkRunner
+{
+public:
+    explicit BenchmarkRunner(const Options& options) : m_options(options) {}
+
+    // body runs once per iteration, only the body is timed
+    void run(const QString& name, const QJsonObject& parameters, const std::function<void()>& body,
+             int iterations = 0)
+    {
+        if (!m_options.filter.match(name).hasMatch()) {
+            return;
+        }
+
+        iterations = iterations > 0 ? iterations : m_options.iterations;
+        const int warmup = std::min(m_options.warmup, iterations);
+
+        for (int i = 0; i < warmup; i++) {
+            body();
+        }
+
+        std::vector<double> samples;
+        samples.reserve(iterations);
+        QElapsedTimer timer;
+        for (int i = 0; i < iterations; i++) {
+            timer.start();
+            body();
+            samples.push_back(timer.nsecsElapsed() / 1000.0);
+        }
+        std::sort(samples.begin(), samples.end());
+
+        double sum = 0.0;
+        for (double sample : samples) {
+            sum += sample;
+        }
+
+        auto percentile = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+        };
+
+        QJsonObject result;
+        result[QStringLiteral("name")] = name;
+        result[QStringLiteral("parameters")] = parameters;
+        result[QStringLiteral("iterations")] = iterations;
+        result[QStringLiteral("min_us")] = samples.front();
+        result[QStringLiteral("median_us")] = percentile(0.5);
+        result[QStringLiteral("mean_us")] = sum / samples.size();
+        result[QStringLiteral("p95_us")] = percentile(0.95);
+        result[QStringLiteral("max_us")] = samples.back();
+        m_results.append(result);
+
+        fprintf(stderr, "%-60s median %10.2f us  p95 %10.2f us\n", qPrintable(name), percentile(0.5), percentile(0.95));
+    }
+
+    QJsonArray results() const { return m_results; }
+
+private:
+    Options m_options;
+    QJsonArray m_results;
+};
+
+QString typeName(TfLiteType type)
+{
+    switch (type) {
+    case kTfLiteFloat32:
+        return QStringLiteral("float32");
+    case kTfLiteUInt8:
+        return QStringLiteral("uint8");
+    case kTfLiteInt8:
+        return QStringLiteral("int8");
+    default:
+        return QString::number(type);
+    }
+}
+
+QString pixelFormatName(QVideoFrame::PixelFormat format)
+{
+    switch (format) {
+    case QVideoFrame::Format_ARGB32:
+        return QStringLiteral("ARGB32");
+    case QVideoFrame::Format_RGB32:
+        return QStringLiteral("RGB32");
+    case QVideoFrame::Format_BGRA32:
+        return QStringLiteral("BGRA32");
+    case QVideoFrame::Format_RGB24:
+        return QStringLiteral("RGB24");
+    case QVideoFrame::Format_NV12:
+        return QStringLiteral("NV12");
+    case QVideoFrame::Format_NV21:
+        return QStringLiteral("NV21");
+    case QVideoFrame::Format_YUV420P:
+        return QStringLiteral("YUV420P");
+    case QVideoFrame::Format_YV12:
+        return QStringLiteral("YV12");
+    case QVideoFrame::Format_YUYV:
+        return QStringLiteral("YUYV");
+    case QVideoFrame::Format_UYVY:
+        return QStringLiteral("UYVY");
+    default:
+        return QString::number(format);
+    }
+}
+
+void fillRandom(uchar* data, size_t size, std::mt19937& random)
+{
+    for (size_t i = 0; i < size; i++) {
+        data[i] = static_cast<uchar>(random());
+    }
+}
+
+// memory backed frame with seeded noise
+QVideoFrame syntheticFrame(const QSize& size, QVideoFrame::PixelFormat format, std::mt19937& random)
+{
+    int bytesPerLine = size.width() * 4;
+    int bytes = bytesPerLine * size.height();
+
+    switch (format) {
+    case QVideoFrame::Format_RGB24:
+        bytesPerLine = size.width() * 3;
+        bytes = bytesPerLine * size.height();
+        break;
+    case QVideoFrame::Format_NV12:
+    case QVideoFrame::Format_NV21:
+    case QVideoFrame::Format_YUV420P:
+    case QVideoFrame::Format_YV12:
+        bytesPerLine = size.width();
+        bytes = size.width() * size.height() * 3 / 2;
+        break;
+    case QVideoFrame::Format_YUYV:
+    case QVideoFrame::Format_UYVY:
+        bytesPerLine = size.width() * 2;
+        bytes = bytesPerLine * size.height();
+        break;
+    default:
+        break;
+    }
+
+    QVideoFrame frame(bytes, size, bytesPerLine, format);
+    if (frame.map(QAbstractVideoBuffer::WriteOnly)) {
+        fillRandom(frame.bits(), static_cast<size_t>(frame.mappedBytes()), random);
+        frame.unmap();
+    }
+    return frame;
+}
+
+void benchmarkPreprocessing(BenchmarkRunner& runner, std::mt19937& random)
+{
+    const QSize sizes[] = { QSize(640, 480), QSize(1280, 720), QSize(1920, 1080) };
+    const TfLiteType types[] = { kTfLiteFloat32, kTfLiteUInt8, kTfLiteInt8 };
+
+    for (const QSize& size : sizes) {
+        std::vector<uchar> pixels(static_cast<size_t>(size.width()) * size.height() * 3);
+        fillRandom(pixels.data(), pixels.size(), random);
+
+        SourceImage image;
+        image.layout = PixelLayout::RGB888;
+        image.data[0] = pixels.data();
+        image.stride[0] = size.width() * 3;
+        image.width = size.width();
+        image.height = size.height();
+
+        for (TfLiteType type : types) {
+            ImagePreprocessor preprocessor;
+            preprocessor.configure(300, 300, 3, type);
+            std::vector<uchar> target(preprocessor.targetSize());
+
+            QJsonObject parameters;
+            parameters[QStringLiteral("source")] = QStringLiteral("%1x%2 RGB888").arg(size.width()).arg(size.height());
+            parameters[QStringLiteral("target")] = QStringLiteral("300x300 %1").arg(typeName(type));
+
+            runner.run(QStringLiteral("resize/%1x%2/%3").arg(size.width()).arg(size.height()).arg(typeName(type)),
+                       parameters, [&]() { preprocessor.process(image, target.data()); });
+        }
+    }
+}
+
+void benchmarkFrameConversion(BenchmarkRunner& runner, std::mt19937& random)
+{
+    const QSize sizes[] = { QSize(640, 480), QSize(1280, 720), QSize(1920, 1080) };
+    const QVideoFrame::PixelFormat formats[] = {
+        QVideoFrame::Format_ARGB32, QVideoFrame::Format_RGB32, QVideoFrame::Format_BGRA32,
+        QVideoFrame::Format_RGB24, QVideoFrame::Format_NV12, QVideoFrame::Format_NV21,
+        QVideoFrame::Format_YUV420P, QVideoFrame::Format_YV12, QVideoFrame::Format_YUYV,
+        QVideoFrame::Format_UYVY
+    };
+
+    FrameBufferPool pool(1);
+    ImagePreprocessor preprocessor;
+    preprocessor.configure(300, 300, 3, kTfLiteFloat32);
+    std::vector<uchar> target(preprocessor.targetSize());
+
+    for (const QSize& size : sizes) {
+        for (QVideoFrame::PixelFormat format : formats) {
+            QVideoFrame frame = syntheticFrame(size, format, random);
+            const QVideoSurfaceFormat surfaceFormat(size, format);
+
+            QJsonObject parameters;
+            parameters[QStringLiteral("size")] = QStringLiteral("%1x%2").arg(size.width()).arg(size.height());
+            parameters[QStringLiteral("format")] = pixelFormatName(format);
+            const QString suffix = QStringLiteral("%1x%2/%3").arg(size.width()).arg(size.height()).arg(pixelFormatName(format));
+
+            // what CocoDetectionFilterRunnable::run() does for every frame that goes to detection
+            runner.run(QStringLiteral("frame/fill/") + suffix, parameters, [&]() {
+                FrameBufferRef buffer = pool.acquire();
+                buffer->fill(frame, surfaceFormat);
+            });
+
+            // fill plus the preprocessing up to the model input
+            runner.run(QStringLiteral("frame/to_tensor/") + suffix, parameters, [&]() {
+                FrameBufferRef buffer = pool.acquire();
+                if (buffer->fill(frame, surfaceFormat)) {
+                    preprocessor.process(buffer->image(), target.data());
+                }
+            });
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+            // the full resolution RGB conversion the filter used to do, for comparison
+            runner.run(QStringLiteral("frame/qimage_rgb888/") + suffix, parameters, [&]() {
+                const QImage image = frame.image().convertToFormat(QImage::Format_RGB888);
+                Q_UNUSED(image)
+            }, 50);
+#endif
+        }
+    }
+}
+
+void benchmarkDecoding(BenchmarkRunner& runner, std::mt19937& random)
+{
+    // the shape of TFLite_Detection_PostProcess of ssd_mobilenet_v1: ten detections
+    const int maxDetections = 10;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    DetectionOutput output;
+    std::vector<float> locations(4 * maxDetections);
+    std::vector<float> classes(maxDetections);
+    std::vector<float> scores(maxDetections);
+    for (int i = 0; i < maxDetections; i++) {
+        const float top = unit(random) * 0.5f;
+        const float left = unit(random) * 0.5f;
+        locations[4 * i] = top;
+        locations[4 * i + 1] = left;
+        locations[4 * i + 2] = top + 0.5f * unit(random);
+        locations[4 * i + 3] = left + 0.5f * unit(random);
+        classes[i] = static_cast<float>(random() % 90);
+        // half of them pass the threshold
+        scores[i] = i % 2 ? 0.3f : 0.8f;
+    }
+    const float count = maxDetections;
+
+    auto assignFloats = [](OutputTensor* tensor, const float* values, size_t size) {
+        tensor->type = kTfLiteFloat32;
+        const uchar* bytes = reinterpret_cast<const uchar*>(values);
+        tensor->data.assign(bytes, bytes + size * sizeof(float));
+    };
+    assignFloats(&output.locations, locations.data(), locations.size());
+    assignFloats(&output.classes, classes.data(), classes.size());
+    assignFloats(&output.scores, scores.data(), scores.size());
+    assignFloats(&output.count, &count, 1);
+
+    QVector<CocoDetectionModel::DetectedObject> detectedObjects;
+    detectedObjects.reserve(maxDetections);
+
+    DetectionDecoder decoder;
+    decoder.configurePostProcessed();
+
+    runner.run(QStringLiteral("decode/float32"), QJsonObject { { QStringLiteral("detections"), maxDetections } }, [&]() {
+        decoder.decode(output, ImageRotation::None, &detectedObjects);
+    }, 10000);
+
+    // the same detections quantized to uint8 with scale 1/255
+    DetectionOutput quantized = output;
+    auto quantize = [](OutputTensor* tensor, const float* values, size_t size, float scale) {
+        tensor->type = kTfLiteUInt8;
+        tensor->scale = scale;
+        tensor->zeroPoint = 0;
+        tensor->data.resize(size);
+        for (size_t i = 0; i < size; i++) {
+            tensor->data[i] = static_cast<uchar>(std::min(255.0f, values[i] / scale + 0.5f));
+        }
+    };
+    quantize(&quantized.locations, locations.data(), locations.size(), 1.0f / 255.0f);
+    quantize(&quantized.scores, scores.data(), scores.size(), 1.0f / 255.0f);
+
+    runner.run(QStringLiteral("decode/uint8"), QJsonObject { { QStringLiteral("detections"), maxDetections } }, [&]() {
+        decoder.decode(quantized, ImageRotation::None, &detectedObjects);
+    }, 10000);
+
+    // raw SSD heads of ssd_mobilenet_v1: 1917 anchors with 91 class logits each, a handful
+    // of anchors find an object, everything else is background
+    SsdOptions ssdOptions;
+    const int numAnchors = ssdOptions.anchorCount();
+    const int numClasses = 91;
+    std::normal_distribution<float> encoding(0.0f, 1.0f);
+    std::vector<float> boxEncodings(4 * numAnchors);
+    std::vector<float> logits(static_cast<size_t>(numAnchors) * numClasses);
+    for (float& value : boxEncodings) {
+        value = encoding(random);
+    }
+    for (float& value : logits) {
+        value = -6.0f + encoding(random);
+    }
+    for (int i = 0; i < 50; i++) {
+        logits[static_cast<size_t>(random() % numAnchors) * numClasses + 1 + random() % (numClasses - 1)] = 3.0f;
+    }
+
+    DetectionOutput rawOutput;
+    assignFloats(&rawOutput.locations, boxEncodings.data(), boxEncodings.size());
+    assignFloats(&rawOutput.scores, logits.data(), logits.size());
+
+    DetectionDecoder rawDecoder;
+    rawDecoder.configureRawSsd(ssdOptions, numAnchors, numClasses);
+    const QJsonObject rawParameters { { QStringLiteral("anchors"), numAnchors }, { QStringLiteral("classes"), numClasses } };
+
+    runner.run(QStringLiteral("decode/raw_ssd_float32"), rawParameters, [&]() {
+        rawDecoder.decode(rawOutput, ImageRotation::None, &detectedObjects);
+    }, 1000);
+
+    // logits quantized to uint8 around zero point 128
+    DetectionOutput rawQuantized = rawOutput;
+    rawQuantized.scores.type = kTfLiteUInt8;
+    rawQuantized.scores.scale = 0.1f;
+    rawQuantized.scores.zeroPoint = 128;
+    rawQuantized.scores.data.resize(logits.size());
+    for (size_t i = 0; i < logits.size(); i++) {
+        rawQuantized.scores.data[i] = static_cast<uchar>(qBound(0.0f, logits[i] / 0.1f + 128.5f, 255.0f));
+    }
+
+    runner.run(QStringLiteral("decode/raw_ssd_uint8"), rawParameters, [&]() {
+        rawDecoder.decode(rawQuantized, ImageRotation::None, &detectedObjects);
+    }, 1000);
+
+    // only scanning two classes instead of all 90
+    rawDecoder.setClassFilter(QVector<int> { 0, 2 });
+    runner.run(QStringLiteral("decode/raw_ssd_float32_class_filter"), rawParameters, [&]() {
+        rawDecoder.decode(rawOutput, ImageRotation::None, &detectedObjects);
+    }, 1000);
+}
+
+void benchmarkModelUpdate(BenchmarkRunner& runner, const QString& labelsFile)
+{
+    auto detection = [](int classIndex, double position) {
+        CocoDetectionModel::DetectedObject detectedObject;
+        detectedObject.classIndex = classIndex;
+        detectedObject.score = 0.9f;
+        detectedObject.boundingRect = QRectF(position, position, 0.2, 0.2);
+        return detectedObject;
+    };
+
+    // alternating between the two sets moves four objects, removes one and adds two, and back again
+    QVector<CocoDetectionModel::DetectedObject> detectedObjects[2];
+    for (int i = 0; i < 5; i++) {
+        detectedObjects[0] << detection(i, 0.1 * i);
+    }
+    for (int i = 0; i < 4; i++) {
+        detectedObjects[1] << detection(i, 0.1 * i + 0.02);
+    }
+    detectedObjects[1] << detection(5, 0.6) << detection(6, 0.7);
+
+    for (bool incremental : { true, false }) {
+        CocoDetectionModel model(labelsFile);
+        model.setIncrementalUpdates(incremental);
+
+        QJsonObject parameters;
+        parameters[QStringLiteral("detections")] = QStringLiteral("5/6");
+        parameters[QStringLiteral("incremental")] = incremental;
+        const QString name = QStringLiteral("model/set_detected_objects/") + QLatin1String(incremental ? "incremental" : "reset");
+        int iteration = 0;
+        // the rows change through a queued connection, so the event loop is part of it
+        runner.run(name, parameters, [&]() {
+            model.setDetectedObjects(detectedObjects[iteration++ % 2]);
+            QCoreApplication::processEvents();
+        }, 2000);
+    }
+}
+
+void benchmarkInvoke(BenchmarkRunner& runner, const QString& modelFile, int threads)
+{
+    if (!QFileInfo::exists(modelFile)) {
+        fprintf(stderr, "Skipping the Invoke() benchmarks, %s does not exist\n", qPrintable(modelFile));
+        return;
+    }
+
+    std::shared_ptr<tflite::FlatBufferModel> model = CocoDetectionWorker::loadModel(modelFile);
+    if (!model) {
+        return;
+    }
+
+    CocoDetectionWorker worker(model, threads, DelegateOptions(), false);
+    if (!worker.isValid()) {
+        return;
+    }
+
+    // mid grey, the network does not care for the timing
+    ImagePreprocessor preprocessor;
+    preprocessor.configure(worker.inputWidth(), worker.inputHeight(), worker.inputChannels(), worker.inputType());
+    std::vector<uint8_t> input(preprocessor.targetSize());
+    std::vector<uchar> pixels(static_cast<size_t>(worker.inputWidth()) * worker.inputHeight() * 3, 128);
+    SourceImage image;
+    image.data[0] = pixels.data();
+    image.stride[0] = worker.inputWidth() * 3;
+    image.width = worker.inputWidth();
+    image.height = worker.inputHeight();
+    preprocessor.process(image, input.data());
+    worker.setInput(input);
+
+    QJsonObject parameters;
+    parameters[QStringLiteral("model")] = QFileInfo(modelFile).fileName();
+    parameters[QStringLiteral("threads")] = threads;
+
+    DetectionOutput output;
+    runner.run(QStringLiteral("invoke/%1_threads").arg(threads), parameters, [&]() {
+        worker.invoke(&output);
+    }, 50);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("qmlmobilenet-benchmark"));
+
+    // keep the per-detection logging of the worker out of the measurements
+    QLoggingCategory::setFilterRules(QStringLiteral("tensorflow.*.info=false"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Benchmarks the stages of the detection hot path."));
+    parser.addHelpOption();
+
+    const QCommandLineOption modelOption(QStringLiteral("model"), QStringLiteral("TFLite model for the Invoke() benchmarks."),
+                                         QStringLiteral("file"), QStringLiteral("model/ssd_mobilenet_v1_1_metadata_1.tflite"));
+    const QCommandLineOption labelsOption(QStringLiteral("labels"), QStringLiteral("Label file."), QStringLiteral("file"),
+                                          QStringLiteral("model/coco_labels.txt"));
+    const QCommandLineOption filterOption(QStringLiteral("filter"), QStringLiteral("Only run benchmarks matching this regular expression."),
+                                          QStringLiteral("regex"), QStringLiteral("."));
+    const QCommandLineOption iterationsOption(QStringLiteral("iterations"), QStringLiteral("Timed iterations of the micro benchmarks."),
+                                              QStringLiteral("count"), QStringLiteral("200"));
+    const QCommandLineOption seedOption(QStringLiteral("seed"), QStringLiteral("Seed of the synthetic frames."),
+                                        QStringLiteral("seed"), QStringLiteral("42"));
+    const QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("JSON file instead of stdout."),
+                                          QStringLiteral("file"));
+
+    parser.addOptions({ modelOption, labelsOption, filterOption, iterationsOption, seedOption, outputOption });
+    parser.process(app);
+
+    Options options;
+    options.iterations = std::max(1, parser.value(iterationsOption).toInt());
+    options.filter.setPattern(parser.value(filterOption));
+    if (!options.filter.isValid()) {
+        fprintf(stderr, "Invalid filter: %s\n", qPrintable(options.filter.errorString()));
+        return 1;
+    }
+
+    std::mt19937 random(parser.value(seedOption).toUInt());
+    BenchmarkRunner runner(options);
+
+    benchmarkPreprocessing(runner, random);
+    benchmarkFrameConversion(runner, random);
+    benchmarkDecoding(runner, random);
+    benchmarkModelUpdate(runner, parser.value(labelsOption));
+    for (int threads : { 1, 2, 4 }) {
+        benchmarkInvoke(runner, parser.value(modelOption), threads);
+    }
+
+    QJsonObject system;
+    system[QStringLiteral("cpu")] = QSysInfo::currentCpuArchitecture();
+    system[QStringLiteral("cores")] = QThread::idealThreadCount();
+    system[QStringLiteral("kernel")] = QSysInfo::kernelVersion();
+    system[QStringLiteral("qt")] = QString::fromLatin1(qVersion());
+
+    QJsonObject report;
+    report[QStringLiteral("date")] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    report[QStringLiteral("seed")] = static_cast<qint64>(parser.value(seedOption).toUInt());
+    report[QStringLiteral("system")] = system;
+    report[QStringLiteral("benchmarks")] = runner.results();
+
+    const QByteArray json = QJsonDocument(report).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(file.fileName()));
+            return 1;
+        }
+    } else {
+        fwrite(json.constData(), 1, static_cast<size_t>(json.size()), stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "allocationcounter.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+
+namespace {
+
+std::atomic<bool> enabled { false };
+std::atomic<quint64> allocations { 0 };
+// plain data, readable from within malloc() without initializing anything
+thread_local bool threadIgnored = false;
+
+// not inlined, so a debugger breakpoint here shows where a counted allocation comes from
+Q_DECL_NOINLINE void countAllocation()
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void recordAllocation()
+{
+    if (enabled.load(std::memory_order_relaxed) && !threadIgnored) {
+        countAllocation();
+    }
+}
+
+} // namespace
+
+#if defined(__GLIBC__)
+
+// the allocator behind the public names, the replacements below forward to it
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* memory, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* memory);
+}
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+    recordAllocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    recordAllocation();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* memory, size_t size)
+{
+    recordAllocation();
+    return __libc_realloc(memory, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    recordAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    recordAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** memory, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    recordAllocation();
+    void* aligned = __libc_memalign(alignment, size);
+    if (!aligned && size != 0) {
+        return ENOMEM;
+    }
+    *memory = aligned;
+    return 0;
+}
+
+void free(void* memory)
+{
+    __libc_free(memory);
+}
+
+} // extern "C"
+
+#endif
+
+namespace AllocationCounter {
+
+bool isSupported()
+{
+#if defined(__GLIBC__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+void setEnabled(bool enable)
+{
+    enabled.store(enable, std::memory_order_relaxed);
+}
+
+void setThreadIgnored(bool ignored)
+{
+    threadIgnored = ignored;
+}
+
+quint64 count()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+} // namespace AllocationCounter
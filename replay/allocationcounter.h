@@ -0,0 +1,33 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __ALLOCATION_COUNTER__
+#define __ALLOCATION_COUNTER__
+
+#include <QtGlobal>
+
+/*
+ * Counts the heap allocations of the process by replacing malloc() and its
+ * relatives, which operator new, QVector and TFLite all end up in. Linking
+ * it into an executable is enough; counting is off until enabled, so it
+ * costs an atomic load per allocation. Only glibc can be hooked like this,
+ * elsewhere isSupported() is false and nothing is counted.
+ */
+namespace AllocationCounter {
+
+bool isSupported();
+
+void setEnabled(bool enabled);
+// allocations of the calling thread are not counted while it is ignored, e.g. a tool's own bookkeeping
+void setThreadIgnored(bool ignored);
+
+// allocations while enabled, including reallocations
+quint64 count();
+
+} // namespace AllocationCounter
+
+#endif // __ALLOCATION_COUNTER__
@@ -0,0 +1,339 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "allocationcounter.h"
+#include "cocodetectionfilter.h"
+#include "cocodetectionmodel.h"
+#include "cocodetectionworker.h"
+#include "framerecording.h"
+#include "jsonlines.h"
+#include "pipelinestats.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QTextStream>
+#include <QTimer>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+/*
+ * Replays a recording of CocoDetectionFilter.recordFile through the filter's
+ * runnable, i.e. the same pipeline a camera feeds, without a display. The
+ * frames go to CocoDetectionFilterRunnable::run() either at the pace they
+ * were recorded at, or one by one as soon as the previous frame's detections
+ * are published, which detects every frame and makes the results of two runs
+ * comparable. The detections are written as JSON Lines, the per-stage
+ * latencies of PipelineStats to stderr (and --stats as JSON).
+ *
+ * --check-allocations counts the heap allocations of the pipeline once the
+ * warm-up frames are through: everything on the pipeline's threads, and on
+ * the main thread run() and the model update. Any allocation fails the run.
+ */
+
+namespace {
+
+// p50/p95/p99 in ms of every stage that recorded something
+QJsonObject stageSummary(const PipelineStats& stats)
+{
+    QJsonObject stages;
+    for (int stage = 0; stage < PipelineStats::StageCount; stage++) {
+        LatencyHistogram::Counts counts;
+        stats.histograms[stage].snapshot(&counts);
+
+        quint64 count = 0;
+        for (quint64 bucket : counts) {
+            count += bucket;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        QJsonObject values;
+        values[QStringLiteral("count")] = static_cast<qint64>(count);
+        values[QStringLiteral("p50")] = LatencyHistogram::percentile(counts, 0.50) / 1000.0;
+        values[QStringLiteral("p95")] = LatencyHistogram::percentile(counts, 0.95) / 1000.0;
+        values[QStringLiteral("p99")] = LatencyHistogram::percentile(counts, 0.99) / 1000.0;
+        stages[PipelineStats::stageName(static_cast<PipelineStats::Stage>(stage))] = values;
+    }
+    return stages;
+}
+
+// runs the event loop (which applies the model updates) for at most timeout ms or until stop() returns true
+template <typename Condition>
+void processEventsUntil(CocoDetectionModel* model, int timeout, Condition stop)
+{
+    if (stop()) {
+        return;
+    }
+
+    QEventLoop loop;
+    QObject::connect(model, &CocoDetectionModel::rowsUpdated, &loop, [&]() {
+        if (stop()) {
+            loop.quit();
+        }
+    });
+    QTimer::singleShot(timeout, Qt::PreciseTimer, &loop, &QEventLoop::quit);
+    loop.exec();
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("qmlmobilenet-replay"));
+
+    // only warnings next to the results, the loading messages are info output
+    QLoggingCategory::setFilterRules(QStringLiteral("tensorflow.*.info=false"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Replays a frame recording through the detection filter."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("recording"), QStringLiteral("File recorded with CocoDetectionFilter.recordFile."));
+
+    const QCommandLineOption modelOption(QStringLiteral("model"), QStringLiteral("TFLite model file."), QStringLiteral("file"),
+                                         QStringLiteral("model/ssd_mobilenet_v1_1_metadata_1.tflite"));
+    const QCommandLineOption labelsOption(QStringLiteral("labels"), QStringLiteral("Label file."), QStringLiteral("file"),
+                                          QStringLiteral("model/coco_labels.txt"));
+    const QCommandLineOption speedOption(QStringLiteral("speed"),
+                                         QStringLiteral("original (the recorded pace) or fast (every frame, one after the other)."),
+                                         QStringLiteral("speed"), QStringLiteral("original"));
+    const QCommandLineOption timeoutOption(QStringLiteral("timeout"),
+                                           QStringLiteral("Longest wait for the detections of a frame with --speed fast, in ms."),
+                                           QStringLiteral("ms"), QStringLiteral("2000"));
+    const QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Detections file instead of stdout."),
+                                          QStringLiteral("file"));
+    const QCommandLineOption statsOption(QStringLiteral("stats"), QStringLiteral("JSON file for the pipeline statistics."),
+                                         QStringLiteral("file"));
+    const QCommandLineOption interpretersOption(QStringLiteral("interpreters"), QStringLiteral("Parallel interpreters, 0 picks one per two cores."),
+                                                QStringLiteral("count"), QStringLiteral("0"));
+    const QCommandLineOption threadsOption(QStringLiteral("threads"), QStringLiteral("TFLite threads per interpreter, 0 picks two."),
+                                           QStringLiteral("count"), QStringLiteral("0"));
+    const QCommandLineOption delegateOption(QStringLiteral("delegate"),
+                                            QStringLiteral("Delegate: %1.").arg(DelegateOptions::availableModes().join(QStringLiteral(", "))),
+                                            QStringLiteral("name"), QStringLiteral("default"));
+    const QCommandLineOption allocationsOption(QStringLiteral("check-allocations"),
+                                               QStringLiteral("Fail if the pipeline allocates after this many warm-up frames; "
+                                                              "the rows are then matched to the previous frame's."),
+                                               QStringLiteral("frames"));
+
+    parser.addOptions({ modelOption, labelsOption, speedOption, timeoutOption, outputOption, statsOption,
+                        interpretersOption, threadsOption, delegateOption, allocationsOption });
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+
+    const QString speed = parser.value(speedOption);
+    if (speed != QLatin1String("original") && speed != QLatin1String("fast")) {
+        fprintf(stderr, "Unknown speed %s\n", qPrintable(speed));
+        return 1;
+    }
+    const bool fast = speed == QLatin1String("fast");
+    const int timeout = std::max(1, parser.value(timeoutOption).toInt());
+
+    DelegateOptions::Mode delegateMode;
+    if (!DelegateOptions::modeFromName(parser.value(delegateOption), &delegateMode)) {
+        fprintf(stderr, "Unknown delegate %s\n", qPrintable(parser.value(delegateOption)));
+        return 1;
+    }
+
+    const FrameRecording recording(parser.positionalArguments().first());
+    if (!recording.isValid()) {
+        fprintf(stderr, "Cannot replay %s: %s\n", qPrintable(parser.positionalArguments().first()),
+                qPrintable(recording.errorString()));
+        return 1;
+    }
+
+    const bool checkAllocations = parser.isSet(allocationsOption);
+    const int warmupFrames = std::max(0, parser.value(allocationsOption).toInt());
+    if (checkAllocations && !AllocationCounter::isSupported()) {
+        fprintf(stderr, "Allocations cannot be counted on this platform\n");
+        return 1;
+    }
+    if (checkAllocations && warmupFrames >= recording.frameCount()) {
+        fprintf(stderr, "The recording has no frames after the %d warm-up frames\n", warmupFrames);
+        return 1;
+    }
+    // the main thread only counts inside run() and the model update, not the replay's own work
+    AllocationCounter::setThreadIgnored(true);
+
+    QFile outputFile;
+    if (parser.isSet(outputOption)) {
+        outputFile.setFileName(parser.value(outputOption));
+        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(outputFile.fileName()));
+            return 1;
+        }
+    } else if (!outputFile.open(stdout, QIODevice::WriteOnly)) {
+        return 1;
+    }
+    QTextStream output(&outputFile);
+
+    auto settings = std::make_shared<CocoDetectionSettings>();
+    settings->workerCount = std::max(0, parser.value(interpretersOption).toInt());
+    settings->inferenceThreads = std::max(0, parser.value(threadsOption).toInt());
+    settings->delegateMode = delegateMode;
+    if (fast) {
+        // waiting for a frame's detections must not make them too old to publish
+        settings->maxResultAge = 0;
+    }
+
+    auto stats = std::make_shared<PipelineStats>();
+    CocoDetectionModel model(parser.value(labelsOption));
+    // the rows are the detections in the decoder's order, not matched to the previous frame's; the
+    // allocation check runs the incremental updates of the app instead, resetting the model allocates in Qt
+    model.setIncrementalUpdates(checkAllocations);
+
+    // when run() was called for every frame, on the clock of the capture times the model reports
+    std::vector<qint64> runTimes;
+    runTimes.reserve(static_cast<size_t>(recording.frameCount()));
+    qint64 publishedFrames = 0;
+    qint64 modelUpdateStart = 0;
+
+    QObject::connect(&model, &CocoDetectionModel::rowsAboutToBeUpdated, [&]() {
+        modelUpdateStart = stats->now();
+        AllocationCounter::setThreadIgnored(false);
+    });
+    QObject::connect(&model, &CocoDetectionModel::rowsUpdated, [&]() {
+        AllocationCounter::setThreadIgnored(true);
+        const qint64 now = stats->now();
+        stats->record(PipelineStats::ModelUpdate, now - modelUpdateStart);
+        stats->record(PipelineStats::EndToEnd, now - model.captureTime());
+
+        // the frame whose run() call the capture time falls into
+        const auto next = std::upper_bound(runTimes.begin(), runTimes.end(), model.captureTime());
+        if (next == runTimes.begin()) {
+            return;
+        }
+        const int frame = static_cast<int>(next - runTimes.begin()) - 1;
+        publishedFrames++;
+
+        output << "{\"frame\":" << frame << ",\"startTime\":" << recording.frame(frame).startTime() << ",\"detections\":[";
+        for (int row = 0; row < model.rowCount(); row++) {
+            const CocoDetectionModel::DetectedObject& detectedObject = model.detectedObject(row);
+            const QRectF& rect = detectedObject.boundingRect;
+            output << (row > 0 ? "," : "") << "{\"class\":" << detectedObject.classIndex
+                   << ",\"label\":" << JsonLines::quoted(model.label(detectedObject.classIndex))
+                   << ",\"score\":" << detectedObject.score << ",\"x\":" << rect.x() << ",\"y\":" << rect.y()
+                   << ",\"width\":" << rect.width() << ",\"height\":" << rect.height() << '}';
+        }
+        output << "]}\n";
+    });
+
+    CocoDetectionFilterRunnable runnable(parser.value(modelOption), QStringList(), QString(), settings, stats, &model);
+    CocoDetectionWorkerPool* pool = runnable.workerPool();
+    pool->start();
+
+    // frames before Ready would pass through undetected
+    while (pool->status() == CocoDetectionWorkerPool::Loading || pool->status() == CocoDetectionWorkerPool::Warming) {
+        QThread::msleep(10);
+    }
+    if (pool->status() != CocoDetectionWorkerPool::Ready) {
+        fprintf(stderr, "Cannot load %s\n", qPrintable(parser.value(modelOption)));
+        return 1;
+    }
+
+    int firstAllocatingFrame = -1;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < recording.frameCount(); i++) {
+        if (checkAllocations && i == warmupFrames) {
+            AllocationCounter::setEnabled(true);
+        }
+
+        if (!fast) {
+            const qint64 wait = (recording.captureTime(i) - timer.nsecsElapsed()) / 1000000;
+            if (wait > 0) {
+                processEventsUntil(&model, static_cast<int>(wait), []() { return false; });
+            }
+        }
+
+        QVideoFrame frame = recording.frame(i);
+        const QVideoSurfaceFormat surfaceFormat = recording.surfaceFormat(i);
+        runTimes.push_back(stats->now());
+        AllocationCounter::setThreadIgnored(false);
+        runnable.run(&frame, surfaceFormat, QVideoFilterRunnable::RunFlags());
+        AllocationCounter::setThreadIgnored(true);
+
+        if (fast) {
+            const qint64 runTime = runTimes.back();
+            processEventsUntil(&model, timeout, [&]() { return model.captureTime() >= runTime; });
+        } else {
+            QCoreApplication::processEvents();
+        }
+
+        // with --speed fast the frame is through the pipeline, otherwise it is a frame or two off
+        if (firstAllocatingFrame < 0 && AllocationCounter::count() > 0) {
+            firstAllocatingFrame = i;
+        }
+    }
+
+    // the last frames are still on their way through the pipeline
+    const qint64 lastRunTime = runTimes.empty() ? 0 : runTimes.back();
+    processEventsUntil(&model, timeout, [&]() { return model.captureTime() >= lastRunTime; });
+    AllocationCounter::setEnabled(false);
+    const quint64 allocations = AllocationCounter::count();
+    output.flush();
+
+    const double seconds = timer.nsecsElapsed() / 1e9;
+    const QJsonObject stages = stageSummary(*stats);
+
+    fprintf(stderr, "Replayed %d frames in %.3f s (%.2f frames/s), %lld published, %llu dropped, %llu unchanged, %llu discarded\n",
+            recording.frameCount(), seconds, recording.frameCount() / seconds, publishedFrames,
+            static_cast<unsigned long long>(stats->droppedFrames.load()),
+            static_cast<unsigned long long>(stats->unchangedFrames.load()),
+            static_cast<unsigned long long>(stats->discardedResults.load()));
+    for (auto it = stages.constBegin(); it != stages.constEnd(); ++it) {
+        const QJsonObject values = it.value().toObject();
+        fprintf(stderr, "  %-12s p50 %8.3f ms  p95 %8.3f ms  p99 %8.3f ms\n", qPrintable(it.key()),
+                values.value(QStringLiteral("p50")).toDouble(), values.value(QStringLiteral("p95")).toDouble(),
+                values.value(QStringLiteral("p99")).toDouble());
+    }
+    if (checkAllocations && allocations > 0) {
+        fprintf(stderr, "%llu allocations in the %d frames after warm-up, the first around frame %d\n",
+                static_cast<unsigned long long>(allocations), recording.frameCount() - warmupFrames, firstAllocatingFrame);
+    } else if (checkAllocations) {
+        fprintf(stderr, "No allocations in the %d frames after warm-up\n", recording.frameCount() - warmupFrames);
+    }
+
+    if (parser.isSet(statsOption)) {
+        QJsonObject report;
+        report[QStringLiteral("recording")] = parser.positionalArguments().first();
+        report[QStringLiteral("speed")] = speed;
+        report[QStringLiteral("frames")] = recording.frameCount();
+        report[QStringLiteral("seconds")] = seconds;
+        report[QStringLiteral("published")] = publishedFrames;
+        report[QStringLiteral("dropped")] = static_cast<qint64>(stats->droppedFrames.load());
+        report[QStringLiteral("unchanged")] = static_cast<qint64>(stats->unchangedFrames.load());
+        report[QStringLiteral("discarded")] = static_cast<qint64>(stats->discardedResults.load());
+        report[QStringLiteral("stages")] = stages;
+        if (checkAllocations) {
+            report[QStringLiteral("allocations")] = static_cast<qint64>(allocations);
+        }
+
+        QFile statsFile(parser.value(statsOption));
+        const QByteArray json = QJsonDocument(report).toJson();
+        if (!statsFile.open(QIODevice::WriteOnly | QIODevice::Truncate) || statsFile.write(json) != json.size()) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(statsFile.fileName()));
+            return 1;
+        }
+    }
+
+    return checkAllocations && allocations > 0 ? 2 : 0;
+}
@@ -0,0 +1,212 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __BOUNDED_QUEUE__
+#define __BOUNDED_QUEUE__
+
+#include <QSemaphore>
+#include <QThread>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/*
+ * Lock-free multi-producer/multi-consumer queue with a fixed capacity
+ * (rounded up to a power of two), after Dmitry Vyukov's bounded MPMC queue.
+ * Neither push nor pop allocate. Items are moved in and out, so a popped
+ * cell does not keep e.g. a FrameBufferRef alive.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+
+        m_cells.reset(new Cell[size]);
+        m_mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool tryPush(const T& value)
+    {
+        T copy(value);
+        return tryPush(std::move(copy));
+    }
+
+    // value is only moved from if the push succeeds
+    bool tryPush(T&& value)
+    {
+        Cell* cell = nullptr;
+        size_t position = m_enqueuePosition.load(std::memory_order_relaxed);
+
+        for (;;) {
+            cell = &m_cells[position & m_mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+            if (difference == 0) {
+                if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = m_enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value)
+    {
+        Cell* cell = nullptr;
+        size_t position = m_dequeuePosition.load(std::memory_order_relaxed);
+
+        for (;;) {
+            cell = &m_cells[position & m_mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+            if (difference == 0) {
+                if (m_dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = m_dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = std::move(cell->value);
+        cell->sequence.store(position + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask = 0;
+
+    // producers and consumers work on different cache lines
+    alignas(64) std::atomic<size_t> m_enqueuePosition { 0 };
+    alignas(64) std::atomic<size_t> m_dequeuePosition { 0 };
+};
+
+/*
+ * BoundedQueue whose consumers sleep while it is empty. The semaphore counts
+ * the queued items, so a successful acquire always finds one to pop. With
+ * several producers that item may still be in the middle of being written,
+ * the consumer then spins until it is complete.
+ */
+template <typename T>
+class BlockingBoundedQueue
+{
+public:
+    explicit BlockingBoundedQueue(size_t capacity) : m_queue(capacity) {}
+
+    bool push(const T& value)
+    {
+        T copy(value);
+        return push(std::move(copy));
+    }
+
+    bool push(T&& value)
+    {
+        if (!m_queue.tryPush(std::move(value))) {
+            return false;
+        }
+        m_available.release();
+        return true;
+    }
+
+    // latest wins: drops everything still queued, returns the number of dropped items
+    int pushLatest(T&& value)
+    {
+        int dropped = 0;
+        T stale;
+        while (tryPop(stale)) {
+            dropped++;
+        }
+        stale = T();
+
+        while (!m_queue.tryPush(std::move(value))) {
+            // a concurrent producer took the room, make some again
+            if (tryPop(stale)) {
+                stale = T();
+                dropped++;
+            }
+        }
+        m_available.release();
+        return dropped;
+    }
+
+    bool tryPop(T& value)
+    {
+        if (!m_available.tryAcquire()) {
+            return false;
+        }
+        popAcquired(value);
+        return true;
+    }
+
+    // blocks until an item is available, returns false once stop is set and wakeAll() was called
+    bool pop(T& value, const std::atomic<bool>& stop)
+    {
+        m_available.acquire();
+        if (stop.load(std::memory_order_acquire)) {
+            return false;
+        }
+        popAcquired(value);
+        return true;
+    }
+
+    // like pop(), but waits at most timeout ms for an item
+    bool pop(T& value, const std::atomic<bool>& stop, int timeout)
+    {
+        if (!m_available.tryAcquire(1, timeout) || stop.load(std::memory_order_acquire)) {
+            return false;
+        }
+        popAcquired(value);
+        return true;
+    }
+
+    void wakeAll(int consumers) { m_available.release(consumers); }
+
+private:
+    void popAcquired(T& value)
+    {
+        while (!m_queue.tryPop(value)) {
+            QThread::yieldCurrentThread();
+        }
+    }
+
+    BoundedQueue<T> m_queue;
+    QSemaphore m_available;
+};
+
+#endif // __BOUNDED_QUEUE__
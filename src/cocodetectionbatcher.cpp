@@ -0,0 +1,137 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cocodetectionbatcher.h"
+
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <utility>
+
+CocoDetectionBatcher::CocoDetectionBatcher(const std::shared_ptr<tflite::FlatBufferModel>& model, int numThreads,
+                                           int batchSize, int maxWait, const DelegateOptions& delegateOptions,
+                                           QObject* parent)
+    : QObject(parent)
+    , m_batchSize(std::max(1, batchSize))
+    , m_maxWait(std::max(0, maxWait))
+    , m_worker(new CocoDetectionWorker(model, numThreads, delegateOptions, false))
+    , m_queue(2 * static_cast<size_t>(m_batchSize))
+    , m_freeSlots(2 * m_batchSize)
+{
+    if (!m_worker->isValid()) {
+        return;
+    }
+
+    m_thread = QThread::create([this]() { processBatches(); });
+    m_thread->setObjectName(QStringLiteral("CocoDetectionBatcher"));
+    m_thread->start();
+}
+
+CocoDetectionBatcher::~CocoDetectionBatcher()
+{
+    if (m_thread) {
+        m_stopRequested.store(true, std::memory_order_release);
+        m_queue.wakeAll(1);
+        m_thread->wait();
+        delete m_thread;
+    }
+}
+
+bool CocoDetectionBatcher::submit(const QImage& image, quint64 id, bool wait)
+{
+    QueuedImage queued;
+    queued.image = image;
+    queued.id = id;
+    return enqueue(std::move(queued), wait);
+}
+
+bool CocoDetectionBatcher::submit(const SourceImage& image, quint64 id, bool wait)
+{
+    QueuedImage queued;
+    queued.source = image;
+    queued.id = id;
+    return enqueue(std::move(queued), wait);
+}
+
+bool CocoDetectionBatcher::enqueue(QueuedImage&& queued, bool wait)
+{
+    if (!m_thread) {
+        return false;
+    }
+
+    if (wait) {
+        m_freeSlots.acquire();
+    } else if (!m_freeSlots.tryAcquire()) {
+        return false;
+    }
+    return m_queue.push(std::move(queued));
+}
+
+void CocoDetectionBatcher::processBatches()
+{
+    // QImages are converted here and kept alive until their batch ran
+    QVector<QImage> images;
+    QVector<SourceImage> sources;
+    QVector<quint64> ids;
+    images.reserve(m_batchSize);
+    sources.reserve(m_batchSize);
+    ids.reserve(m_batchSize);
+
+    auto append = [&](const QueuedImage& queued) {
+        if (queued.image.isNull()) {
+            sources << queued.source;
+        } else {
+            images << queued.image.convertToFormat(QImage::Format_RGB888);
+            const QImage& rgbImage = images.last();
+
+            SourceImage source;
+            source.layout = PixelLayout::RGB888;
+            source.data[0] = rgbImage.constBits();
+            source.stride[0] = rgbImage.bytesPerLine();
+            source.width = rgbImage.width();
+            source.height = rgbImage.height();
+            sources << source;
+        }
+        ids << queued.id;
+    };
+
+    forever {
+        QueuedImage queued;
+        if (!m_queue.pop(queued, m_stopRequested)) {
+            break;
+        }
+        m_freeSlots.release();
+
+        // the wait starts with the first image of the batch
+        QElapsedTimer waiting;
+        waiting.start();
+        append(queued);
+
+        while (ids.size() < m_batchSize) {
+            const int remaining = m_maxWait - static_cast<int>(waiting.elapsed());
+            if (remaining <= 0 || !m_queue.pop(queued, m_stopRequested, remaining)) {
+                break;
+            }
+            m_freeSlots.release();
+            append(queued);
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        const QVector<QVector<CocoDetectionModel::DetectedObject>> results = m_worker->predictBatch(sources);
+        const qint64 elapsed = timer.nsecsElapsed();
+
+        for (int i = 0; i < ids.size(); i++) {
+            emit predictionFinished(ids.at(i), results.value(i));
+        }
+        emit batchFinished(ids.size(), elapsed);
+
+        images.clear();
+        sources.clear();
+        ids.clear();
+    }
+}
@@ -0,0 +1,75 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __COCO_DETECTION_BATCHER__
+#define __COCO_DETECTION_BATCHER__
+
+#include "boundedqueue.h"
+#include "cocodetectionworker.h"
+#include "cocodetectionmodel.h"
+
+#include <QImage>
+#include <QObject>
+#include <QSemaphore>
+#include <QThread>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+
+/*
+ * Collects submitted images into batches for CocoDetectionWorker::predictBatch().
+ * A batch runs once it is full or maxWait ms after its first image arrived,
+ * whatever comes first. Runs its own interpreter on its own thread and
+ * reports every image through predictionFinished(), in submission order.
+ */
+class CocoDetectionBatcher : public QObject
+{
+    Q_OBJECT
+public:
+    CocoDetectionBatcher(const std::shared_ptr<tflite::FlatBufferModel>& model, int numThreads,
+                         int batchSize, int maxWait, const DelegateOptions& delegateOptions = DelegateOptions(),
+                         QObject* parent = nullptr);
+    ~CocoDetectionBatcher();
+
+    bool isValid() const { return m_worker->isValid(); }
+    int batchSize() const { return m_batchSize; }
+
+    // thread-safe, returns false if two batches are already waiting; with wait it blocks until there is
+    // room instead, the batcher must not be destroyed meanwhile
+    bool submit(const QImage& image, quint64 id, bool wait = false);
+    // the pixels must stay valid until predictionFinished() was emitted for id
+    bool submit(const SourceImage& image, quint64 id, bool wait = false);
+
+signals:
+    // emitted on the batcher thread
+    void predictionFinished(quint64 id, const QVector<CocoDetectionModel::DetectedObject>& detectedObjects);
+    // emitted on the batcher thread after the results of a batch, with the time predictBatch() took
+    void batchFinished(int batchSize, qint64 nsecs);
+
+private:
+    // either a QImage or pixels owned by the caller
+    struct QueuedImage {
+        QImage image;
+        SourceImage source;
+        quint64 id = 0;
+    };
+
+    bool enqueue(QueuedImage&& queued, bool wait);
+    void processBatches();
+
+    int m_batchSize;
+    int m_maxWait;
+    std::unique_ptr<CocoDetectionWorker> m_worker;
+    BlockingBoundedQueue<QueuedImage> m_queue;
+    // room for two batches, the queue itself may round its capacity up
+    QSemaphore m_freeSlots;
+    std::atomic<bool> m_stopRequested { false };
+    QThread* m_thread = nullptr;
+};
+
+#endif // __COCO_DETECTION_BATCHER__
@@ -6,13 +6,16 @@
  */
 
 #include "cocodetectionfilter.h"
-#include "bitmap_helpers_impl.h"
+#include "framerecording.h"
+#include "threadtuning.h"
 
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDir>
 #include <QStandardPaths>
 
+#include <algorithm>
+
 Q_LOGGING_CATEGORY(objectdetector, "tensorflow.cocodetectionfilter")
 
 const auto PathToMachineLearningModels = QStringLiteral("../model");
@@ -21,15 +24,66 @@ const auto CocoLabels = QStringLiteral("coco_labels.txt");
 
 CocoDetectionFilter::CocoDetectionFilter( QObject* parent )
     : QAbstractVideoFilter( parent )
+    , m_settings(std::make_shared<CocoDetectionSettings>())
+    , m_pipelineStats(std::make_shared<PipelineStats>())
 {
     auto labelFile = QDir(PathToMachineLearningModels).filePath(CocoLabels);
     m_detectionModel = new CocoDetectionModel(labelFile, this);
+    m_stats = new DetectionStats(m_pipelineStats, this);
+
+    // the update runs on this thread, the views follow the row changes in between
+    connect(m_detectionModel, &CocoDetectionModel::rowsAboutToBeUpdated, this, [this]() {
+        m_modelUpdateStart = m_pipelineStats->now();
+    });
+    connect(m_detectionModel, &CocoDetectionModel::rowsUpdated, this, [this]() {
+        const qint64 now = m_pipelineStats->now();
+        m_pipelineStats->record(PipelineStats::ModelUpdate, now - m_modelUpdateStart);
+
+        // every update is a new snapshot, which knows when its frame was captured
+        const qint64 captureTime = m_detectionModel->captureTime();
+        if (captureTime >= 0) {
+            m_pipelineStats->record(PipelineStats::EndToEnd, now - captureTime);
+        }
+    });
 }
 
 QVideoFilterRunnable* CocoDetectionFilter::createFilterRunnable()
 {
-    auto modelFile = QDir(PathToMachineLearningModels).filePath(CocoModelSSD);
-    return new CocoDetectionFilterRunnable(modelFile, m_detectionModel);
+    const QDir modelDir(PathToMachineLearningModels);
+    auto modelFile = modelDir.filePath(CocoModelSSD);
+    QStringList qualityLevels;
+    for (const QString& qualityLevel : m_qualityLevels) {
+        qualityLevels.append(modelDir.filePath(qualityLevel));
+    }
+    auto runnable = new CocoDetectionFilterRunnable(modelFile, qualityLevels, m_source, m_settings, m_pipelineStats,
+                                                    m_detectionModel);
+    CocoDetectionWorkerPool* workerPool = runnable->workerPool();
+
+    // createFilterRunnable() is called on the render thread, which must not wait for the model
+    const auto updateStatus = [this](int status, qint64 loadTime, qint64 warmupTime) {
+        m_status = static_cast<Status>(status);
+        m_loadTime = loadTime;
+        m_warmupTime = warmupTime;
+        emit statusChanged();
+    };
+    connect(workerPool, &CocoDetectionWorkerPool::statusChanged, this, updateStatus, Qt::QueuedConnection);
+    // a pool shared with another filter of the source may be running already
+    const int status = workerPool->status();
+    const qint64 loadTime = workerPool->loadTime();
+    const qint64 warmupTime = workerPool->warmupTime();
+    QMetaObject::invokeMethod(this, [=]() { updateStatus(status, loadTime, warmupTime); }, Qt::QueuedConnection);
+
+    const auto updateQualityLevel = [this](int qualityLevel) {
+        if (m_qualityLevel != qualityLevel) {
+            m_qualityLevel = qualityLevel;
+            emit qualityLevelChanged();
+        }
+    };
+    connect(workerPool, &CocoDetectionWorkerPool::qualityLevelChanged, this, updateQualityLevel, Qt::QueuedConnection);
+    const int qualityLevel = workerPool->qualityLevel();
+    QMetaObject::invokeMethod(this, [=]() { updateQualityLevel(qualityLevel); }, Qt::QueuedConnection);
+    workerPool->start();
+    return runnable;
 }
 
 
@@ -38,28 +92,470 @@ CocoDetectionModel* CocoDetectionFilter::detectionModel() const
     return m_detectionModel;
 }
 
+DetectionStats* CocoDetectionFilter::stats() const
+{
+    return m_stats;
+}
 
-CocoDetectionFilterRunnable::CocoDetectionFilterRunnable(const QString &modelFilename, CocoDetectionModel* detectionModel)
+int CocoDetectionFilter::orientation() const
 {
-    m_detectionWorker = std::unique_ptr<CocoDetectionWorker>(new CocoDetectionWorker(modelFilename));
-    m_detectionWorker->setDetectionModel(detectionModel);
+    return m_settings->orientation.load();
+}
 
-    m_workerThread = new QThread;
-    m_detectionWorker->moveToThread(m_workerThread);
+int CocoDetectionFilter::workerCount() const
+{
+    return m_settings->workerCount.load();
+}
 
-    connect(this, &CocoDetectionFilterRunnable::imageReady, m_detectionWorker.get(), &CocoDetectionWorker::predict);
-    connect(m_detectionWorker.get(), &CocoDetectionWorker::finishedPrediction, this, [this]() {
-        m_detectionWorkerIsBusy = false;
-    });
+void CocoDetectionFilter::setWorkerCount(int workerCount)
+{
+    workerCount = std::max(0, workerCount);
+    if (m_settings->workerCount.exchange(workerCount) != workerCount) {
+        emit workerCountChanged();
+    }
+}
+
+int CocoDetectionFilter::maxBatchSize() const
+{
+    return m_settings->maxBatchSize.load();
+}
+
+void CocoDetectionFilter::setMaxBatchSize(int maxBatchSize)
+{
+    maxBatchSize = std::max(1, maxBatchSize);
+    if (m_settings->maxBatchSize.exchange(maxBatchSize) != maxBatchSize) {
+        emit maxBatchSizeChanged();
+    }
+}
+
+int CocoDetectionFilter::streamWeight() const
+{
+    return m_settings->streamWeight.load();
+}
+
+void CocoDetectionFilter::setStreamWeight(int streamWeight)
+{
+    streamWeight = std::max(1, streamWeight);
+    if (m_settings->streamWeight.exchange(streamWeight) != streamWeight) {
+        emit streamWeightChanged();
+    }
+}
+
+QString CocoDetectionFilter::source() const
+{
+    return m_source;
+}
+
+void CocoDetectionFilter::setSource(const QString& source)
+{
+    if (m_source != source) {
+        m_source = source;
+        emit sourceChanged();
+    }
+}
+
+bool CocoDetectionFilter::tracking() const
+{
+    return m_settings->tracking.load();
+}
+
+void CocoDetectionFilter::setTracking(bool tracking)
+{
+    if (m_settings->tracking.exchange(tracking) != tracking) {
+        emit trackingChanged();
+    }
+}
+
+int CocoDetectionFilter::detectionInterval() const
+{
+    return m_settings->detectionInterval.load();
+}
+
+void CocoDetectionFilter::setDetectionInterval(int detectionInterval)
+{
+    detectionInterval = std::max(1, detectionInterval);
+    if (m_settings->detectionInterval.exchange(detectionInterval) != detectionInterval) {
+        emit detectionIntervalChanged();
+    }
+}
+
+bool CocoDetectionFilter::motionGating() const
+{
+    return m_settings->motionGating.load();
+}
+
+void CocoDetectionFilter::setMotionGating(bool motionGating)
+{
+    if (m_settings->motionGating.exchange(motionGating) != motionGating) {
+        emit motionGatingChanged();
+    }
+}
+
+double CocoDetectionFilter::motionThreshold() const
+{
+    return m_settings->motionThreshold.load();
+}
+
+void CocoDetectionFilter::setMotionThreshold(double motionThreshold)
+{
+    motionThreshold = qBound(0.0, motionThreshold, 1.0);
+    if (!qFuzzyCompare(m_settings->motionThreshold.exchange(motionThreshold), motionThreshold)) {
+        emit motionThresholdChanged();
+    }
+}
+
+int CocoDetectionFilter::motionGridSize() const
+{
+    return m_settings->motionGridSize.load();
+}
+
+void CocoDetectionFilter::setMotionGridSize(int motionGridSize)
+{
+    motionGridSize = std::max(1, motionGridSize);
+    if (m_settings->motionGridSize.exchange(motionGridSize) != motionGridSize) {
+        emit motionGridSizeChanged();
+    }
+}
+
+int CocoDetectionFilter::motionMaxInterval() const
+{
+    return m_settings->motionMaxInterval.load();
+}
+
+void CocoDetectionFilter::setMotionMaxInterval(int motionMaxInterval)
+{
+    motionMaxInterval = std::max(0, motionMaxInterval);
+    if (m_settings->motionMaxInterval.exchange(motionMaxInterval) != motionMaxInterval) {
+        emit motionMaxIntervalChanged();
+    }
+}
+
+int CocoDetectionFilter::tileColumns() const
+{
+    return m_settings->tileColumns.load();
+}
+
+void CocoDetectionFilter::setTileColumns(int tileColumns)
+{
+    tileColumns = std::max(1, tileColumns);
+    if (m_settings->tileColumns.exchange(tileColumns) != tileColumns) {
+        emit tileColumnsChanged();
+    }
+}
+
+int CocoDetectionFilter::tileRows() const
+{
+    return m_settings->tileRows.load();
+}
+
+void CocoDetectionFilter::setTileRows(int tileRows)
+{
+    tileRows = std::max(1, tileRows);
+    if (m_settings->tileRows.exchange(tileRows) != tileRows) {
+        emit tileRowsChanged();
+    }
+}
+
+double CocoDetectionFilter::tileOverlap() const
+{
+    return m_settings->tileOverlap.load();
+}
+
+void CocoDetectionFilter::setTileOverlap(double tileOverlap)
+{
+    tileOverlap = qBound(0.0, tileOverlap, 0.5);
+    if (!qFuzzyCompare(m_settings->tileOverlap.exchange(tileOverlap), tileOverlap)) {
+        emit tileOverlapChanged();
+    }
+}
+
+QRectF CocoDetectionFilter::regionOfInterest() const
+{
+    return QRectF(m_settings->regionX.load(), m_settings->regionY.load(),
+                  m_settings->regionWidth.load(), m_settings->regionHeight.load());
+}
+
+void CocoDetectionFilter::setRegionOfInterest(const QRectF& regionOfInterest)
+{
+    const QRectF region = regionOfInterest.isEmpty() ? QRectF() : regionOfInterest.intersected(QRectF(0.0, 0.0, 1.0, 1.0));
+    if (region == this->regionOfInterest()) {
+        return;
+    }
+
+    // the pipeline may read a mix of old and new values for one frame, which is harmless
+    m_settings->regionX.store(region.x());
+    m_settings->regionY.store(region.y());
+    m_settings->regionWidth.store(region.width());
+    m_settings->regionHeight.store(region.height());
+    emit regionOfInterestChanged();
+}
+
+double CocoDetectionFilter::detectionThreshold() const
+{
+    return m_settings->detectionThreshold.load();
+}
+
+void CocoDetectionFilter::setDetectionThreshold(double detectionThreshold)
+{
+    detectionThreshold = qBound(0.0, detectionThreshold, 1.0);
+    if (!qFuzzyCompare(m_settings->detectionThreshold.exchange(detectionThreshold), detectionThreshold)) {
+        emit detectionThresholdChanged();
+    }
+}
+
+double CocoDetectionFilter::nmsThreshold() const
+{
+    return m_settings->nmsThreshold.load();
+}
+
+void CocoDetectionFilter::setNmsThreshold(double nmsThreshold)
+{
+    nmsThreshold = qBound(0.0, nmsThreshold, 1.0);
+    if (!qFuzzyCompare(m_settings->nmsThreshold.exchange(nmsThreshold), nmsThreshold)) {
+        emit nmsThresholdChanged();
+    }
+}
 
-    m_workerThread->start();
+int CocoDetectionFilter::maxDetections() const
+{
+    return m_settings->maxDetections.load();
+}
+
+void CocoDetectionFilter::setMaxDetections(int maxDetections)
+{
+    maxDetections = std::max(1, maxDetections);
+    if (m_settings->maxDetections.exchange(maxDetections) != maxDetections) {
+        emit maxDetectionsChanged();
+    }
+}
+
+QList<int> CocoDetectionFilter::classFilter() const
+{
+    const std::shared_ptr<const QVector<int>> classes = std::atomic_load(&m_settings->classFilter);
+    return classes ? classes->toList() : QList<int>();
+}
+
+void CocoDetectionFilter::setClassFilter(const QList<int>& classFilter)
+{
+    if (classFilter == this->classFilter()) {
+        return;
+    }
+
+    std::shared_ptr<const QVector<int>> classes;
+    if (!classFilter.isEmpty()) {
+        classes = std::make_shared<const QVector<int>>(classFilter.toVector());
+    }
+    std::atomic_store(&m_settings->classFilter, classes);
+    emit classFilterChanged();
+}
+
+int CocoDetectionFilter::maxResultAge() const
+{
+    return m_settings->maxResultAge.load();
+}
+
+void CocoDetectionFilter::setMaxResultAge(int maxResultAge)
+{
+    maxResultAge = std::max(0, maxResultAge);
+    if (m_settings->maxResultAge.exchange(maxResultAge) != maxResultAge) {
+        emit maxResultAgeChanged();
+    }
+}
+
+int CocoDetectionFilter::latencyBudget() const
+{
+    return m_settings->latencyBudget.load();
+}
+
+void CocoDetectionFilter::setLatencyBudget(int latencyBudget)
+{
+    latencyBudget = std::max(0, latencyBudget);
+    if (m_settings->latencyBudget.exchange(latencyBudget) != latencyBudget) {
+        emit latencyBudgetChanged();
+    }
+}
+
+QStringList CocoDetectionFilter::qualityLevels() const
+{
+    return m_qualityLevels;
+}
+
+void CocoDetectionFilter::setQualityLevels(const QStringList& qualityLevels)
+{
+    if (m_qualityLevels != qualityLevels) {
+        m_qualityLevels = qualityLevels;
+        emit qualityLevelsChanged();
+    }
+}
+
+QString CocoDetectionFilter::recordFile() const
+{
+    return m_recordFile;
+}
+
+void CocoDetectionFilter::setRecordFile(const QString& recordFile)
+{
+    if (m_recordFile == recordFile) {
+        return;
+    }
+
+    m_recordFile = recordFile;
+    std::shared_ptr<FrameRecorder> recorder;
+    if (!m_recordFile.isEmpty()) {
+        recorder = std::make_shared<FrameRecorder>(m_recordFile);
+    }
+    // the previous recording is complete once the runnable let go of it
+    std::atomic_store(&m_settings->recorder, recorder);
+    emit recordFileChanged();
+}
+
+int CocoDetectionFilter::inferenceThreads() const
+{
+    return m_settings->inferenceThreads.load();
+}
+
+void CocoDetectionFilter::setInferenceThreads(int inferenceThreads)
+{
+    inferenceThreads = std::max(0, inferenceThreads);
+    if (m_settings->inferenceThreads.exchange(inferenceThreads) != inferenceThreads) {
+        m_settings->threadingGeneration++;
+        emit inferenceThreadsChanged();
+    }
+}
+
+QList<int> CocoDetectionFilter::workerCpus() const
+{
+    return ThreadTuning::cpuList(m_settings->workerCpus.load());
+}
+
+void CocoDetectionFilter::setWorkerCpus(const QList<int>& cpus)
+{
+    const quint64 mask = ThreadTuning::cpuMask(cpus);
+    if (m_settings->workerCpus.exchange(mask) != mask) {
+        m_settings->threadingGeneration++;
+        emit workerCpusChanged();
+    }
+}
+
+QList<int> CocoDetectionFilter::inferenceCpus() const
+{
+    return ThreadTuning::cpuList(m_settings->inferenceCpus.load());
+}
+
+void CocoDetectionFilter::setInferenceCpus(const QList<int>& cpus)
+{
+    const quint64 mask = ThreadTuning::cpuMask(cpus);
+    if (m_settings->inferenceCpus.exchange(mask) != mask) {
+        m_settings->threadingGeneration++;
+        emit inferenceCpusChanged();
+    }
+}
+
+CocoDetectionFilter::Priority CocoDetectionFilter::workerPriority() const
+{
+    return static_cast<Priority>(m_settings->workerPriority.load());
+}
+
+void CocoDetectionFilter::setWorkerPriority(Priority priority)
+{
+    if (m_settings->workerPriority.exchange(priority) != priority) {
+        m_settings->threadingGeneration++;
+        emit workerPriorityChanged();
+    }
+}
+
+QStringList CocoDetectionFilter::availableDelegates() const
+{
+    return DelegateOptions::availableModes();
+}
+
+QString CocoDetectionFilter::delegate() const
+{
+    return DelegateOptions::modeName(static_cast<DelegateOptions::Mode>(m_settings->delegateMode.load()));
+}
+
+void CocoDetectionFilter::setDelegate(const QString& delegate)
+{
+    DelegateOptions::Mode mode = DelegateOptions::Default;
+    if (!DelegateOptions::modeFromName(delegate, &mode)) {
+        qCWarning(objectdetector) << "Unknown delegate" << delegate << "- available are" << availableDelegates();
+        return;
+    }
+
+    // an unavailable delegate is still accepted, the workers log it and fall back to the CPU kernels
+    if (m_settings->delegateMode.exchange(mode) != mode) {
+        emit delegateChanged();
+    }
+}
+
+int CocoDetectionFilter::delegateThreads() const
+{
+    return m_settings->delegateThreads.load();
+}
+
+void CocoDetectionFilter::setDelegateThreads(int delegateThreads)
+{
+    delegateThreads = std::max(0, delegateThreads);
+    if (m_settings->delegateThreads.exchange(delegateThreads) != delegateThreads) {
+        emit delegateThreadsChanged();
+    }
+}
+
+bool CocoDetectionFilter::delegateFp16() const
+{
+    return m_settings->delegateFp16.load();
+}
+
+void CocoDetectionFilter::setDelegateFp16(bool delegateFp16)
+{
+    if (m_settings->delegateFp16.exchange(delegateFp16) != delegateFp16) {
+        emit delegateFp16Changed();
+    }
+}
+
+bool CocoDetectionFilter::delegateQuantizedKernels() const
+{
+    return m_settings->delegateQuantizedKernels.load();
+}
+
+void CocoDetectionFilter::setDelegateQuantizedKernels(bool delegateQuantizedKernels)
+{
+    if (m_settings->delegateQuantizedKernels.exchange(delegateQuantizedKernels) != delegateQuantizedKernels) {
+        emit delegateQuantizedKernelsChanged();
+    }
+}
+
+void CocoDetectionFilter::setOrientation(int orientation)
+{
+    // only quarter turns are supported, normalized to [0, 360)
+    orientation = ((orientation % 360) + 360) % 360;
+    orientation = (((orientation + 45) / 90) * 90) % 360;
+
+    if (m_settings->orientation.exchange(orientation) != orientation) {
+        emit orientationChanged();
+    }
+}
+
+
+CocoDetectionFilterRunnable::CocoDetectionFilterRunnable(const QString &modelFilename, const QStringList &qualityLevels,
+                                                         const QString &source,
+                                                         const std::shared_ptr<CocoDetectionSettings> &settings,
+                                                         const std::shared_ptr<PipelineStats> &stats,
+                                                         CocoDetectionModel* detectionModel)
+    : m_settings(settings)
+    , m_stats(stats)
+    , m_detectionModel(detectionModel)
+{
+    m_workerPool = CocoDetectionWorkerPool::forSource(source, modelFilename, m_settings, detectionModel, m_stats);
+    // ignored by a pool another filter of the source started already
+    m_workerPool->setQualityLevels(qualityLevels);
 }
 
 CocoDetectionFilterRunnable::~CocoDetectionFilterRunnable()
 {
-    m_detectionWorker->waitForPredictionToFinish();
-    m_workerThread->quit();
-    m_workerThread->deleteLater();
+    // the pool may live on for the other filters of the source
+    m_workerPool->removeDetectionModel(m_detectionModel);
+    m_workerPool.reset();
 }
 
 
@@ -71,42 +567,66 @@ QVideoFrame CocoDetectionFilterRunnable::run(QVideoFrame *input, const QVideoSur
         return QVideoFrame();
     }
 
-    const QImage::Format imageFormat = QVideoFrame::imageFormatFromPixelFormat(input->pixelFormat());
-    input->map(QAbstractVideoBuffer::ReadOnly);
-    QImage image;
+    const qint64 captureTime = m_stats->now();
+    m_stats->capturedFrames.fetch_add(1, std::memory_order_relaxed);
 
-    if (imageFormat != QImage::Format_Invalid) {
-    QImage image = QImage(input->bits(),
-                 input->width(),
-                 input->height(),
-                 input->bytesPerLine(),
-                 imageFormat).copy();
-    } else {
-#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
-        image = input->image();
-#endif
+    // before anything may skip the frame, so a replay sees what the camera delivered
+    if (std::shared_ptr<FrameRecorder> recorder = std::atomic_load(&m_settings->recorder)) {
+        recorder->record(*input, surfaceFormat, captureTime);
     }
 
-    input->unmap();
+    // the model is still loading or warming up, nothing to convert the frame for
+    if (!m_workerPool->isReady()) {
+        return *input;
+    }
 
-    if (m_detectionWorkerIsBusy) {
-        return image;
+    // another filter of the source got the frame first, its results reach our model too
+    if (!m_workerPool->claimFrame(input->startTime())) {
+        return *input;
     }
 
-    qCInfo(objectdetector) << "Prepare next image";
-    auto sourceImage = image;
-    if (surfaceFormat.scanLineDirection() == QVideoSurfaceFormat::BottomToTop) {
-        sourceImage = sourceImage.mirrored();
+    if (m_settings->tracking.load(std::memory_order_relaxed)) {
+        m_workerPool->publishTrackedObjects(captureTime);
     }
 
-    if (sourceImage.format() != QImage::Format_RGB888) {
-        sourceImage = sourceImage.convertToFormat(QImage::Format_RGB888);
+    // the frames in between only get the tracked boxes (or keep the last detections)
+    const int detectionInterval = m_settings->detectionInterval.load(std::memory_order_relaxed);
+    if (m_frameCount++ % static_cast<quint64>(detectionInterval) != 0) {
+        return *input;
     }
 
-    if (sourceImage.format() != QImage::Format_Invalid) {
-        emit imageReady(sourceImage);
-        m_detectionWorkerIsBusy = true;
+    // the frame is passed through untouched, the pipeline gets a copy (or a mapped reference)
+    // that replaces any frame still waiting for the preprocessor
+    FrameBufferRef frame = m_workerPool->acquireFrame();
+    if (!frame) {
+        m_stats->droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        return *input;
     }
 
-    return image;
+    const auto rotation = static_cast<ImageRotation>(m_settings->orientation.load(std::memory_order_relaxed));
+    // the recording and the published results above are not part of the conversion
+    const qint64 conversionStart = m_stats->now();
+    if (!frame->fill(*input, surfaceFormat, rotation)) {
+        return *input;
+    }
+    m_stats->record(PipelineStats::Conversion, m_stats->now() - conversionStart);
+
+    if (m_settings->motionGating.load(std::memory_order_relaxed)) {
+        m_motionDetector.setGridSize(m_settings->motionGridSize.load(std::memory_order_relaxed));
+        m_motionDetector.setThreshold(m_settings->motionThreshold.load(std::memory_order_relaxed));
+        m_motionDetector.setMaxInterval(qint64(m_settings->motionMaxInterval.load(std::memory_order_relaxed)) * 1000000);
+
+        if (!m_motionDetector.isChanged(frame->image(), captureTime)) {
+            // the previous detections still hold, tracked boxes stop moving
+            m_stats->unchangedFrames.fetch_add(1, std::memory_order_relaxed);
+            m_workerPool->holdTrackedObjects(captureTime);
+            return *input;
+        }
+    } else {
+        m_motionDetector.reset();
+    }
+
+    m_workerPool->submitFrame(std::move(frame), captureTime);
+
+    return *input;
 }
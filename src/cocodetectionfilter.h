@@ -8,10 +8,14 @@
 #ifndef __COCO_DETECTION_FILTER__
 #define __COCO_DETECTION_FILTER__
 
-#include "cocodetectionworker.h"
+#include "cocodetectionworkerpool.h"
 #include "cocodetectionmodel.h"
+#include "cocodetectionsettings.h"
+#include "detectionstats.h"
+#include "motiondetector.h"
 
 #include <QLoggingCategory>
+#include <QStringList>
 #include <QThread>
 #include <QAbstractItemModel>
 #include <QAbstractVideoFilter>
@@ -23,31 +27,294 @@ class CocoDetectionFilter : public QAbstractVideoFilter
 {
     Q_OBJECT
     Q_PROPERTY(QAbstractItemModel* detectionModel READ detectionModel CONSTANT)
+    Q_PROPERTY(DetectionStats* stats READ stats CONSTANT)
+    Q_PROPERTY(Status status READ status NOTIFY statusChanged)
+    Q_PROPERTY(qint64 loadTime READ loadTime NOTIFY statusChanged)
+    Q_PROPERTY(qint64 warmupTime READ warmupTime NOTIFY statusChanged)
+    Q_PROPERTY(int orientation READ orientation WRITE setOrientation NOTIFY orientationChanged)
+    Q_PROPERTY(int workerCount READ workerCount WRITE setWorkerCount NOTIFY workerCountChanged)
+    Q_PROPERTY(int maxBatchSize READ maxBatchSize WRITE setMaxBatchSize NOTIFY maxBatchSizeChanged)
+    Q_PROPERTY(int streamWeight READ streamWeight WRITE setStreamWeight NOTIFY streamWeightChanged)
+    Q_PROPERTY(QString source READ source WRITE setSource NOTIFY sourceChanged)
+    Q_PROPERTY(bool tracking READ tracking WRITE setTracking NOTIFY trackingChanged)
+    Q_PROPERTY(int detectionInterval READ detectionInterval WRITE setDetectionInterval NOTIFY detectionIntervalChanged)
+    Q_PROPERTY(bool motionGating READ motionGating WRITE setMotionGating NOTIFY motionGatingChanged)
+    Q_PROPERTY(double motionThreshold READ motionThreshold WRITE setMotionThreshold NOTIFY motionThresholdChanged)
+    Q_PROPERTY(int motionGridSize READ motionGridSize WRITE setMotionGridSize NOTIFY motionGridSizeChanged)
+    Q_PROPERTY(int motionMaxInterval READ motionMaxInterval WRITE setMotionMaxInterval NOTIFY motionMaxIntervalChanged)
+    Q_PROPERTY(int tileColumns READ tileColumns WRITE setTileColumns NOTIFY tileColumnsChanged)
+    Q_PROPERTY(int tileRows READ tileRows WRITE setTileRows NOTIFY tileRowsChanged)
+    Q_PROPERTY(double tileOverlap READ tileOverlap WRITE setTileOverlap NOTIFY tileOverlapChanged)
+    Q_PROPERTY(QRectF regionOfInterest READ regionOfInterest WRITE setRegionOfInterest NOTIFY regionOfInterestChanged)
+    Q_PROPERTY(double detectionThreshold READ detectionThreshold WRITE setDetectionThreshold NOTIFY detectionThresholdChanged)
+    Q_PROPERTY(double nmsThreshold READ nmsThreshold WRITE setNmsThreshold NOTIFY nmsThresholdChanged)
+    Q_PROPERTY(int maxDetections READ maxDetections WRITE setMaxDetections NOTIFY maxDetectionsChanged)
+    Q_PROPERTY(QList<int> classFilter READ classFilter WRITE setClassFilter NOTIFY classFilterChanged)
+    Q_PROPERTY(int maxResultAge READ maxResultAge WRITE setMaxResultAge NOTIFY maxResultAgeChanged)
+    Q_PROPERTY(int latencyBudget READ latencyBudget WRITE setLatencyBudget NOTIFY latencyBudgetChanged)
+    Q_PROPERTY(QStringList qualityLevels READ qualityLevels WRITE setQualityLevels NOTIFY qualityLevelsChanged)
+    Q_PROPERTY(int qualityLevel READ qualityLevel NOTIFY qualityLevelChanged)
+    Q_PROPERTY(QString recordFile READ recordFile WRITE setRecordFile NOTIFY recordFileChanged)
+    Q_PROPERTY(int inferenceThreads READ inferenceThreads WRITE setInferenceThreads NOTIFY inferenceThreadsChanged)
+    Q_PROPERTY(QList<int> workerCpus READ workerCpus WRITE setWorkerCpus NOTIFY workerCpusChanged)
+    Q_PROPERTY(QList<int> inferenceCpus READ inferenceCpus WRITE setInferenceCpus NOTIFY inferenceCpusChanged)
+    Q_PROPERTY(Priority workerPriority READ workerPriority WRITE setWorkerPriority NOTIFY workerPriorityChanged)
+    Q_PROPERTY(QStringList availableDelegates READ availableDelegates CONSTANT)
+    Q_PROPERTY(QString delegate READ delegate WRITE setDelegate NOTIFY delegateChanged)
+    Q_PROPERTY(int delegateThreads READ delegateThreads WRITE setDelegateThreads NOTIFY delegateThreadsChanged)
+    Q_PROPERTY(bool delegateFp16 READ delegateFp16 WRITE setDelegateFp16 NOTIFY delegateFp16Changed)
+    Q_PROPERTY(bool delegateQuantizedKernels READ delegateQuantizedKernels WRITE setDelegateQuantizedKernels NOTIFY delegateQuantizedKernelsChanged)
 public:
+    // mirrors QThread::Priority for QML
+    enum Priority {
+        IdlePriority = QThread::IdlePriority,
+        LowestPriority = QThread::LowestPriority,
+        LowPriority = QThread::LowPriority,
+        NormalPriority = QThread::NormalPriority,
+        HighPriority = QThread::HighPriority,
+        HighestPriority = QThread::HighestPriority,
+        TimeCriticalPriority = QThread::TimeCriticalPriority,
+        InheritPriority = QThread::InheritPriority
+    };
+    Q_ENUM(Priority)
+
+    // mirrors CocoDetectionWorkerPool::Status for QML
+    enum Status {
+        Loading = CocoDetectionWorkerPool::Loading,
+        Warming = CocoDetectionWorkerPool::Warming,
+        Ready = CocoDetectionWorkerPool::Ready,
+        Error = CocoDetectionWorkerPool::Error
+    };
+    Q_ENUM(Status)
+
     CocoDetectionFilter( QObject* parent = nullptr );
     QVideoFilterRunnable* createFilterRunnable() override;
 
     CocoDetectionModel* detectionModel() const;
 
+    // the model is loaded and warmed up in the background whenever the video pipeline creates a
+    // runnable; frames are passed through undetected until the status is Ready
+    Status status() const { return m_status; }
+    // ms the last runnable took to load the model and build its interpreters, and to warm them up
+    qint64 loadTime() const { return m_loadTime; }
+    qint64 warmupTime() const { return m_warmupTime; }
+
+    // frame rates, drop counters and per-stage latencies of the pipeline
+    DetectionStats* stats() const;
+
+    // clockwise rotation in degrees (multiple of 90) that makes the frames upright, e.g. Camera.orientation
+    int orientation() const;
+    void setOrientation(int orientation);
+
+    // number of parallel interpreters, 0 (default) chooses based on the core count; the interpreters
+    // of a model are shared by all filters of the process, so this takes effect when the first
+    // filter of the model starts (again)
+    int workerCount() const;
+    void setWorkerCount(int workerCount);
+
+    // most frames, of different filters, that run through an interpreter at once if the model can
+    // be batched, default 1; like workerCount it is taken from the first filter of the model
+    int maxBatchSize() const;
+    void setMaxBatchSize(int maxBatchSize);
+
+    // share of the interpreters this filter gets while others wait for them too, default 1
+    int streamWeight() const;
+    void setStreamWeight(int streamWeight);
+
+    // name of the video source; filters with the same source (e.g. two VideoOutputs of one Camera)
+    // detect every frame once and share the results, empty (default) never shares;
+    // takes effect when the video pipeline creates the next runnable
+    QString source() const;
+    void setSource(const QString& source);
+
+    // follow the detected objects with a tracker and show its boxes, predicted for every frame;
+    // detectionModel then provides a stable trackId per object
+    bool tracking() const;
+    void setTracking(bool tracking);
+
+    // run the detector on every n-th frame only (default 1), with tracking the boxes still move every frame
+    int detectionInterval() const;
+    void setDetectionInterval(int detectionInterval);
+
+    // skip the detector while the scene does not change, the last detections stay visible
+    bool motionGating() const;
+    void setMotionGating(bool motionGating);
+
+    // fraction of the grid cells (0..1) that have to change for a frame to be detected, default 0.01
+    double motionThreshold() const;
+    void setMotionThreshold(double motionThreshold);
+
+    // cells of the change detection grid along the frame width, default 32
+    int motionGridSize() const;
+    void setMotionGridSize(int motionGridSize);
+
+    // ms after which a frame is detected even without a change, default 2000, 0 waits for a change
+    int motionMaxInterval() const;
+    void setMotionMaxInterval(int motionMaxInterval);
+
+    // tiled inference: the region of interest is split into tileColumns x tileRows tiles (default 1 x 1)
+    // that are detected in parallel at the model's input resolution each
+    int tileColumns() const;
+    void setTileColumns(int tileColumns);
+    int tileRows() const;
+    void setTileRows(int tileRows);
+
+    // fraction of a tile that overlaps with its neighbours (0..0.5, default 0.1)
+    double tileOverlap() const;
+    void setTileOverlap(double tileOverlap);
+
+    // part of the frame to detect in, normalized frame coordinates like the detected boxes;
+    // an empty rect (default) is the whole frame
+    QRectF regionOfInterest() const;
+    void setRegionOfInterest(const QRectF& regionOfInterest);
+
+    // minimum score of a reported object (0..1, default 0.5)
+    double detectionThreshold() const;
+    void setDetectionThreshold(double detectionThreshold);
+
+    // models with raw SSD heads: boxes of the same class overlapping more than this are merged
+    // into the best scoring one (IoU 0..1, default 0.6)
+    double nmsThreshold() const;
+    void setNmsThreshold(double nmsThreshold);
+
+    // the best scoring objects reported per frame (or tile), default 10
+    int maxDetections() const;
+    void setMaxDetections(int maxDetections);
+
+    // class indices to report, empty (default) reports all; with raw SSD heads the other
+    // classes are not even looked at
+    QList<int> classFilter() const;
+    void setClassFilter(const QList<int>& classFilter);
+
+    // detections of frames captured more than this many ms ago are discarded, 0 publishes all
+    int maxResultAge() const;
+    void setMaxResultAge(int maxResultAge);
+
+    // ms from capture to detection to aim for, e.g. 1000 / fps; when the frames miss it for a while
+    // the filter steps down to the next of qualityLevels, and back up once there is plenty of room.
+    // 0 (default) always runs the full model
+    int latencyBudget() const;
+    void setLatencyBudget(int latencyBudget);
+
+    // lighter models to step down to, in order, e.g. smaller inputs or quantized; relative paths are
+    // in the model directory. Takes effect when the video pipeline creates the next runnable
+    QStringList qualityLevels() const;
+    void setQualityLevels(const QStringList& qualityLevels);
+
+    // running level, 0 is the full model and n the n-th of qualityLevels
+    int qualityLevel() const { return m_qualityLevel; }
+
+    // file the frames are recorded to for qmlmobilenet-replay, as the camera delivers them;
+    // setting it starts a new recording, empty (default) stops recording
+    QString recordFile() const;
+    void setRecordFile(const QString& recordFile);
+
+    // TFLite threads per interpreter, 0 (default) uses two; changes apply without reloading the model
+    int inferenceThreads() const;
+    void setInferenceThreads(int inferenceThreads);
+
+    // CPUs the pipeline threads (preprocess, invoke, postprocess) may run on, empty (default) allows all
+    QList<int> workerCpus() const;
+    void setWorkerCpus(const QList<int>& cpus);
+
+    // CPUs TFLite's own worker threads may run on, empty (default) allows all
+    QList<int> inferenceCpus() const;
+    void setInferenceCpus(const QList<int>& cpus);
+
+    // scheduling of the pipeline and TFLite threads; on Linux Idle and TimeCritical switch to
+    // SCHED_IDLE and SCHED_RR, the others set the nice value (raising it needs CAP_SYS_NICE)
+    Priority workerPriority() const;
+    void setWorkerPriority(Priority priority);
+
+    // "default", "cpu" and the delegates this build has, e.g. "xnnpack"
+    QStringList availableDelegates() const;
+
+    // the delegate settings take effect when the video pipeline creates the next runnable
+    QString delegate() const;
+    void setDelegate(const QString& delegate);
+
+    // threads of the delegate, 0 (default) uses inferenceThreads
+    int delegateThreads() const;
+    void setDelegateThreads(int delegateThreads);
+
+    // XNNPACK: run float models in half precision where the CPU supports it
+    bool delegateFp16() const;
+    void setDelegateFp16(bool delegateFp16);
+
+    // XNNPACK: use the 8 bit kernels for quantized models (default)
+    bool delegateQuantizedKernels() const;
+    void setDelegateQuantizedKernels(bool delegateQuantizedKernels);
+
+signals:
+    void statusChanged();
+    void orientationChanged();
+    void workerCountChanged();
+    void maxBatchSizeChanged();
+    void streamWeightChanged();
+    void sourceChanged();
+    void trackingChanged();
+    void detectionIntervalChanged();
+    void motionGatingChanged();
+    void tileColumnsChanged();
+    void tileRowsChanged();
+    void tileOverlapChanged();
+    void regionOfInterestChanged();
+    void motionThresholdChanged();
+    void motionGridSizeChanged();
+    void motionMaxIntervalChanged();
+    void detectionThresholdChanged();
+    void nmsThresholdChanged();
+    void maxDetectionsChanged();
+    void classFilterChanged();
+    void maxResultAgeChanged();
+    void latencyBudgetChanged();
+    void qualityLevelsChanged();
+    void qualityLevelChanged();
+    void recordFileChanged();
+    void inferenceThreadsChanged();
+    void workerCpusChanged();
+    void inferenceCpusChanged();
+    void workerPriorityChanged();
+    void delegateChanged();
+    void delegateThreadsChanged();
+    void delegateFp16Changed();
+    void delegateQuantizedKernelsChanged();
+
 private:
     CocoDetectionModel* m_detectionModel = nullptr;
+    std::shared_ptr<CocoDetectionSettings> m_settings;
+    std::shared_ptr<PipelineStats> m_pipelineStats;
+    DetectionStats* m_stats = nullptr;
+    qint64 m_modelUpdateStart = 0;
+    Status m_status = Loading;
+    qint64 m_loadTime = 0;
+    qint64 m_warmupTime = 0;
+    QString m_source;
+    QStringList m_qualityLevels;
+    int m_qualityLevel = 0;
+    QString m_recordFile;
 };
 
 class CocoDetectionFilterRunnable : public QObject, public QVideoFilterRunnable
 {
     Q_OBJECT
 public:
-    CocoDetectionFilterRunnable(const QString &modelFilename, CocoDetectionModel* detectionModel = nullptr);
+    CocoDetectionFilterRunnable(const QString &modelFilename, const QStringList &qualityLevels, const QString &source,
+                                const std::shared_ptr<CocoDetectionSettings> &settings,
+                                const std::shared_ptr<PipelineStats> &stats, CocoDetectionModel* detectionModel = nullptr);
     ~CocoDetectionFilterRunnable();
     QVideoFrame run( QVideoFrame *input, const QVideoSurfaceFormat &surfaceFormat, RunFlags flags ) override;
 
-signals:
-    void imageReady(const QImage &image);
+    CocoDetectionWorkerPool* workerPool() const { return m_workerPool.get(); }
 
 private:
-    bool m_detectionWorkerIsBusy = false;
-    std::unique_ptr<CocoDetectionWorker> m_detectionWorker = nullptr;
-    QThread* m_workerThread = nullptr;
+    std::shared_ptr<CocoDetectionSettings> m_settings;
+    std::shared_ptr<PipelineStats> m_stats;
+    QPointer<CocoDetectionModel> m_detectionModel;
+    // possibly shared with the runnables of other filters of the source
+    std::shared_ptr<CocoDetectionWorkerPool> m_workerPool;
+    quint64 m_frameCount = 0;
+    MotionDetector m_motionDetector;
 };
 
 #endif // __COCO_DETECTION_FILTER__
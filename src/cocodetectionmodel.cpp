@@ -6,23 +6,68 @@
  */
 
 #include "cocodetectionmodel.h"
+#include "boundedqueue.h"
 
 #include <QStringList>
 #include <QMutexLocker>
 #include <QFile>
 #include <QTextStream>
+#include <QCoreApplication>
+#include <QEvent>
 #include <QDebug>
 
+#include <algorithm>
+#include <new>
+
+namespace {
+
+/*
+ * Posted by setDetectedObjects() to apply the latest snapshot on the model's
+ * thread. A queued signal would allocate a QMetaCallEvent per update, these
+ * events are recycled: QCoreApplication deletes them after delivery, which
+ * returns their memory to a small lock-free pool shared by all models.
+ */
+class UpdateEvent : public QEvent
+{
+public:
+    UpdateEvent() : QEvent(updateType()) {}
+
+    static QEvent::Type updateType()
+    {
+        static const QEvent::Type eventType = static_cast<QEvent::Type>(QEvent::registerEventType());
+        return eventType;
+    }
+
+    static void *operator new(size_t size)
+    {
+        void *memory = nullptr;
+        return size == sizeof(UpdateEvent) && pool().tryPop(memory) ? memory : ::operator new(size);
+    }
+
+    static void operator delete(void *memory, size_t size)
+    {
+        if (size != sizeof(UpdateEvent) || !pool().tryPush(memory)) {
+            ::operator delete(memory);
+        }
+    }
+
+private:
+    // at most one event per model is pending, a few cover every model of the process; never
+    // destroyed, as events may still be deleted while static objects are
+    static BoundedQueue<void *> &pool()
+    {
+        static BoundedQueue<void *> *recycled = new BoundedQueue<void *>(16);
+        return *recycled;
+    }
+};
+
+} // namespace
+
 CocoDetectionModel::CocoDetectionModel(const QString &labelsFilename, QObject *parent )
     : QAbstractListModel(parent)
 {
     loadLabels(labelsFilename);
     createPalette();
-    // avoid deadlocks
-    connect(this, &CocoDetectionModel::detectionObjectsChanged, this, [this]() {
-        beginResetModel();
-        endResetModel();
-    }, Qt::QueuedConnection);
 }
 
 
@@ -33,29 +78,29 @@ QHash<int, QByteArray> CocoDetectionModel::roleNames() const
     roles[DetectedObjectName] = QByteArray("detectedObject");
     roles[Score] = QByteArray("score");
     roles[BoundingRectColor] = QByteArray("boundingRectColor");
+    roles[TrackId] = QByteArray("trackId");
     return roles;
 }
 
 QVariant CocoDetectionModel::data(const QModelIndex &index, int role) const
 {
-
-    QMutexLocker locker(&m_detectedObjectsMutex);
-
-    if (index.row() < 0 || index.row() >= m_detectedObjects.count()) {
+    if (index.row() < 0 || index.row() >= m_rows.count()) {
         return QVariant();
     }
 
-    const DetectedObject& detectedObject = m_detectedObjects.at(index.row());
+    const DetectedObject& detectedObject = m_rows.at(index.row()).detectedObject;
 
     switch(role) {
     case BoundingRect:
         return detectedObject.boundingRect;
     case DetectedObjectName:
-        return m_labels.value(detectedObject.classIndex, QString::number(detectedObject.classIndex));
+        return label(detectedObject.classIndex);
     case Score:
         return detectedObject.score;
+    case TrackId:
+        return detectedObject.trackId;
     case BoundingRectColor:
-        return m_palette.at(index.row() % m_palette.length());
+        return color(index.row());
     default:
         return QVariant();
     }
@@ -66,15 +111,210 @@ QVariant CocoDetectionModel::data(const QModelIndex &index, int role) const
 int CocoDetectionModel::rowCount(const QModelIndex &parent) const
 {
     Q_UNUSED(parent)
-    QMutexLocker locker(&m_detectedObjectsMutex);
-    return m_detectedObjects.count();
+    return m_rows.count();
+}
+
+void CocoDetectionModel::setDetectedObjects(const QVector<DetectedObject> &detectedObjects, qint64 captureTime)
+{
+    {
+        QMutexLocker locker(&m_publishMutex);
+        Snapshot &snapshot = m_snapshots.writeBuffer();
+        snapshot.sequence = ++m_publishedSequence;
+        snapshot.captureTime = captureTime;
+        // copied into the buffer's own storage, sharing the caller's vector would make it detach later
+        snapshot.detectedObjects.resize(detectedObjects.size());
+        std::copy(detectedObjects.cbegin(), detectedObjects.cend(), snapshot.detectedObjects.begin());
+        m_snapshots.publish();
+    }
+
+    // the queued update has not run yet and picks up this snapshot
+    if (!m_updatePending.exchange(true, std::memory_order_acq_rel)) {
+        // posted instead of taking the model's thread, avoids deadlocks
+        QCoreApplication::postEvent(this, new UpdateEvent);
+        emit detectionObjectsChanged();
+    }
+}
+
+qint64 CocoDetectionModel::sequence() const
+{
+    return m_sequence;
+}
+
+qint64 CocoDetectionModel::captureTime() const
+{
+    return m_captureTime;
+}
+
+double CocoDetectionModel::intersectionOverUnion(const QRectF &a, const QRectF &b)
+{
+    const QRectF intersection = a.intersected(b);
+    const double intersectionArea = intersection.width() * intersection.height();
+    const double unionArea = a.width() * a.height() + b.width() * b.height() - intersectionArea;
+    return unionArea > 0.0 ? intersectionArea / unionArea : 0.0;
+}
+
+bool CocoDetectionModel::incrementalUpdates() const
+{
+    return m_incrementalUpdates;
+}
+
+void CocoDetectionModel::setIncrementalUpdates(bool incrementalUpdates)
+{
+    if (m_incrementalUpdates != incrementalUpdates) {
+        m_incrementalUpdates = incrementalUpdates;
+        emit incrementalUpdatesChanged();
+    }
+}
+
+double CocoDetectionModel::matchThreshold() const
+{
+    return m_matchThreshold;
+}
+
+void CocoDetectionModel::setMatchThreshold(double matchThreshold)
+{
+    matchThreshold = qBound(0.0, matchThreshold, 1.0);
+    if (!qFuzzyCompare(m_matchThreshold, matchThreshold)) {
+        m_matchThreshold = matchThreshold;
+        emit matchThresholdChanged();
+    }
+}
+
+bool CocoDetectionModel::event(QEvent *event)
+{
+    if (event->type() == UpdateEvent::updateType()) {
+        applyPendingObjects();
+        return true;
+    }
+    return QAbstractListModel::event(event);
+}
+
+void CocoDetectionModel::applyPendingObjects()
+{
+    // cleared first: a snapshot published from here on either is picked up below or queues another update
+    m_updatePending.store(false, std::memory_order_release);
+    if (!m_snapshots.update()) {
+        return;
+    }
+    const Snapshot &snapshot = m_snapshots.readBuffer();
+
+    emit rowsAboutToBeUpdated();
+    if (m_incrementalUpdates) {
+        updateRows(snapshot.detectedObjects);
+    } else {
+        resetRows(snapshot.detectedObjects);
+    }
+    m_sequence = snapshot.sequence;
+    m_captureTime = snapshot.captureTime;
+    emit rowsUpdated();
+}
+
+void CocoDetectionModel::resetRows(const QVector<DetectedObject> &detectedObjects)
+{
+    beginResetModel();
+    m_rows.clear();
+    for (int i = 0; i < detectedObjects.size(); i++) {
+        m_rows.append(Row { detectedObjects.at(i), i });
+    }
+    endResetModel();
+}
+
+void CocoDetectionModel::updateRows(const QVector<DetectedObject> &detectedObjects)
+{
+    // candidate pairs of row and detection with their overlap
+    m_matcher.clear();
+    for (int row = 0; row < m_rows.size(); row++) {
+        const DetectedObject &current = m_rows.at(row).detectedObject;
+        for (int detection = 0; detection < detectedObjects.size(); detection++) {
+            const DetectedObject &next = detectedObjects.at(detection);
+            if (current.trackId >= 0 && next.trackId >= 0) {
+                // tracked objects are the same if they have the same ID, however far they moved
+                if (current.trackId == next.trackId) {
+                    m_matcher.addCandidate(row, detection, 2.0);
+                }
+                continue;
+            }
+            if (current.classIndex != next.classIndex) {
+                continue;
+            }
+            const double iou = intersectionOverUnion(current.boundingRect, next.boundingRect);
+            if (iou >= m_matchThreshold) {
+                m_matcher.addCandidate(row, detection, iou);
+            }
+        }
+    }
+    m_matcher.match(m_rows.size(), detectedObjects.size());
+    QVector<int> &rowToDetection = m_matcher.objectToDetection();
+
+    // objects that disappeared, from the back so the indices stay valid; adjacent rows go in one step
+    for (int last = m_rows.size() - 1; last >= 0; last--) {
+        if (rowToDetection.at(last) >= 0) {
+            continue;
+        }
+        int first = last;
+        while (first > 0 && rowToDetection.at(first - 1) < 0) {
+            first--;
+        }
+        beginRemoveRows(QModelIndex(), first, last);
+        m_rows.remove(first, last - first + 1);
+        rowToDetection.remove(first, last - first + 1);
+        endRemoveRows();
+        last = first;
+    }
+
+    // objects that moved
+    int firstChanged = -1;
+    int lastChanged = -1;
+    for (int row = 0; row < m_rows.size(); row++) {
+        DetectedObject &current = m_rows[row].detectedObject;
+        const DetectedObject &next = detectedObjects.at(rowToDetection.at(row));
+        // a row matched by overlap may change its track ID, e.g. when tracking is switched on
+        if (current.boundingRect != next.boundingRect || current.score != next.score
+            || current.trackId != next.trackId || current.classIndex != next.classIndex) {
+            current = next;
+            firstChanged = firstChanged < 0 ? row : firstChanged;
+            lastChanged = row;
+        }
+    }
+    if (firstChanged >= 0) {
+        static const QVector<int> changedRoles { BoundingRect, Score, TrackId, DetectedObjectName };
+        emit dataChanged(index(firstChanged), index(lastChanged), changedRoles);
+    }
+
+    // objects that appeared
+    const int newObjects = m_matcher.unmatchedDetectionCount();
+    if (newObjects > 0) {
+        beginInsertRows(QModelIndex(), m_rows.size(), m_rows.size() + newObjects - 1);
+        for (int detection = 0; detection < detectedObjects.size(); detection++) {
+            if (!m_matcher.isDetectionMatched(detection)) {
+                m_rows.append(Row { detectedObjects.at(detection), unusedColorIndex() });
+            }
+        }
+        endInsertRows();
+    }
+}
+
+int CocoDetectionModel::unusedColorIndex() const
+{
+    for (int colorIndex = 0; colorIndex < m_palette.size(); colorIndex++) {
+        const bool used = std::any_of(m_rows.cbegin(), m_rows.cend(), [colorIndex](const Row &row) {
+            return row.colorIndex == colorIndex;
+        });
+        if (!used) {
+            return colorIndex;
+        }
+    }
+    return m_rows.size();
+}
+
+QColor CocoDetectionModel::color(int row) const
+{
+    return m_palette.at(m_rows.at(row).colorIndex % m_palette.length());
 }
 
-void CocoDetectionModel::setDetectedObjects(const QVector<DetectedObject> &detectedObjects)
+QString CocoDetectionModel::label(int classIndex) const
 {
-    QMutexLocker locker(&m_detectedObjectsMutex);
-    m_detectedObjects = detectedObjects;
-    emit detectionObjectsChanged();
+    return m_labels.value(classIndex, QString::number(classIndex));
 }
 
 void CocoDetectionModel::loadLabels(const QString &labelsFilename)
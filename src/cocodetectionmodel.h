@@ -8,6 +8,9 @@
 #ifndef __COCO_DETECTION_MODEL__
 #define __COCO_DETECTION_MODEL__
 
+#include "greedymatcher.h"
+#include "triplebuffer.h"
+
 #include <QAbstractListModel>
 #include <QVector>
 #include <QRectF>
@@ -16,21 +19,41 @@
 #include <QColor>
 #include <QObject>
 
+#include <atomic>
+
+/*
+ * Detections of the latest frame. setDetectedObjects() may be called from
+ * any thread: it publishes an immutable, numbered snapshot through a
+ * TripleBuffer, and the model's thread picks up the latest one and changes
+ * the rows. Neither side waits for the other, and data() and rowCount() read
+ * the rows without any lock. In the incremental mode (default) new
+ * detections are matched to the current rows by class and overlap, or by
+ * their track ID: matched rows are updated in place with dataChanged(), only
+ * objects that appear or disappear insert or remove rows, so views keep
+ * their delegates. Otherwise every update resets the model.
+ */
 class CocoDetectionModel : public QAbstractListModel
 {
     Q_OBJECT
+    Q_PROPERTY(bool incrementalUpdates READ incrementalUpdates WRITE setIncrementalUpdates NOTIFY incrementalUpdatesChanged)
+    Q_PROPERTY(double matchThreshold READ matchThreshold WRITE setMatchThreshold NOTIFY matchThresholdChanged)
+    Q_PROPERTY(qint64 sequence READ sequence NOTIFY rowsUpdated)
+    Q_PROPERTY(qint64 captureTime READ captureTime NOTIFY rowsUpdated)
 public:
     struct DetectedObject {
         int classIndex;
         float score;
         QRectF boundingRect;
+        // stable ID while an ObjectTracker follows the object, -1 for plain detections
+        int trackId = -1;
     };
 
     enum DetectedObjectRole {
         BoundingRect = Qt::UserRole + 1,
         DetectedObjectName,
         Score,
-        BoundingRectColor
+        BoundingRectColor,
+        TrackId
     };
     Q_ENUMS(DetectedObjectRole)
 
@@ -41,21 +64,81 @@ public:
     QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
     int rowCount(const QModelIndex &parent = QModelIndex()) const override;
 
-    void setDetectedObjects(const QVector<DetectedObject> &detectedObjects);
+    // thread-safe, updates that arrive faster than the model's thread applies them are coalesced;
+    // captureTime is the time of the frame the objects were detected in (e.g. PipelineStats::now())
+    void setDetectedObjects(const QVector<DetectedObject> &detectedObjects, qint64 captureTime = -1);
+
+    // number and capture time of the snapshot the rows show, 0 and -1 before the first one
+    qint64 sequence() const;
+    qint64 captureTime() const;
+
+    bool incrementalUpdates() const;
+    void setIncrementalUpdates(bool incrementalUpdates);
+
+    // minimum intersection over union for a detection to continue a row of the same class
+    double matchThreshold() const;
+    void setMatchThreshold(double matchThreshold);
+
+    // display name of a class, the index itself if the labels do not know it
+    QString label(int classIndex) const;
+    const QHash<int, QString> &labels() const { return m_labels; }
+
+    // direct row access for C++ views, on the model's thread or while it is blocked (scene graph sync)
+    const DetectedObject &detectedObject(int row) const { return m_rows.at(row).detectedObject; }
+    QColor color(int row) const;
+
+    static double intersectionOverUnion(const QRectF &a, const QRectF &b);
 
 signals:
+    // emitted by setDetectedObjects() on the calling thread
     void detectionObjectsChanged();
+    // around applying an update to the rows, on the model's thread
+    void rowsAboutToBeUpdated();
+    void rowsUpdated();
+    void incrementalUpdatesChanged();
+    void matchThresholdChanged();
+
+protected:
+    bool event(QEvent *event) override;
 
 private:
+    struct Snapshot {
+        qint64 sequence = 0;
+        qint64 captureTime = -1;
+        QVector<DetectedObject> detectedObjects;
+    };
+
+    struct Row {
+        DetectedObject detectedObject;
+        // keeps the color of an object while it stays in the model
+        int colorIndex;
+    };
+
     void loadLabels(const QString &labelsFilename);
     void createPalette();
 
-    mutable QMutex m_detectedObjectsMutex;
+    void applyPendingObjects();
+    void resetRows(const QVector<DetectedObject> &detectedObjects);
+    void updateRows(const QVector<DetectedObject> &detectedObjects);
+    int unusedColorIndex() const;
+
+    // hand-over from setDetectedObjects(); the mutex only serializes publishers (e.g. the
+    // postprocess and the video thread when tracking is switched), the model's thread never takes it
+    QMutex m_publishMutex;
+    qint64 m_publishedSequence = 0;
+    TripleBuffer<Snapshot> m_snapshots;
+    std::atomic<bool> m_updatePending { false };
+
+    // only touched on the model's thread
+    QVector<Row> m_rows;
+    GreedyMatcher m_matcher;
+    qint64 m_sequence = 0;
+    qint64 m_captureTime = -1;
+    bool m_incrementalUpdates = true;
+    double m_matchThreshold = 0.3;
+
     QHash<int, QString> m_labels;
-    QVector<DetectedObject> m_detectedObjects;
     QVector<QColor> m_palette;
-
-
 };
 
 
@@ -0,0 +1,96 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __COCO_DETECTION_SETTINGS__
+#define __COCO_DETECTION_SETTINGS__
+
+#include <QThread>
+#include <QVector>
+#include <QtGlobal>
+
+#include <atomic>
+#include <memory>
+
+class FrameRecorder;
+
+/*
+ * Settings shared between the CocoDetectionFilter on the GUI thread and its
+ * runnables and workers on the video and worker threads. The filter writes,
+ * everybody else reads the current value whenever it is needed, so QML
+ * property changes take effect at runtime.
+ */
+struct CocoDetectionSettings
+{
+    // clockwise rotation in degrees that makes the camera frames upright
+    std::atomic<int> orientation { 0 };
+
+    // number of interpreters, 0 picks one per two cores; used when the InferenceScheduler of the
+    // model is created, so it limits the inferences of all streams of the process that share it
+    std::atomic<int> workerCount { 0 };
+    // most inputs, of different streams, the scheduler runs as one batch (if the model can), 1 runs them
+    // one by one; also fixed when the scheduler is created
+    std::atomic<int> maxBatchSize { 1 };
+    // share of the interpreters this stream gets while other streams wait too
+    std::atomic<int> streamWeight { 1 };
+
+    // results of frames captured longer ago than this (in ms) are dropped instead of published, 0 keeps all
+    std::atomic<int> maxResultAge { 500 };
+    // ms from capture to result the pool aims for by switching to lighter models, 0 always runs the first
+    std::atomic<int> latencyBudget { 0 };
+
+    // TFLite threads per interpreter, 0 picks two
+    std::atomic<int> inferenceThreads { 0 };
+    // CPU masks (bit n = CPU n) for the pipeline threads and TFLite's own threads, 0 leaves them unpinned
+    std::atomic<quint64> workerCpus { 0 };
+    std::atomic<quint64> inferenceCpus { 0 };
+    // QThread::Priority of the pipeline and TFLite threads
+    std::atomic<int> workerPriority { QThread::InheritPriority };
+    // bumped whenever one of the threading values above changes, the pipeline re-applies them before its next frame
+    std::atomic<int> threadingGeneration { 0 };
+
+    // publish the boxes of an ObjectTracker for every frame instead of the raw detections
+    std::atomic<bool> tracking { false };
+    // run the detector on every n-th frame only, the tracker fills the gaps
+    std::atomic<int> detectionInterval { 1 };
+
+    // only run the detector on frames that differ from the last detected one (see MotionDetector)
+    std::atomic<bool> motionGating { false };
+    std::atomic<double> motionThreshold { 0.01 };
+    std::atomic<int> motionGridSize { 32 };
+    // ms after which a frame is detected even if nothing changed, 0 waits for a change
+    std::atomic<int> motionMaxInterval { 2000 };
+
+    // tiled inference: the region of interest (normalized frame coordinates, an empty one is the whole
+    // frame) is split into tileColumns x tileRows tiles overlapping by tileOverlap of their size
+    std::atomic<int> tileColumns { 1 };
+    std::atomic<int> tileRows { 1 };
+    std::atomic<double> tileOverlap { 0.1 };
+    std::atomic<double> regionX { 0.0 };
+    std::atomic<double> regionY { 0.0 };
+    std::atomic<double> regionWidth { 0.0 };
+    std::atomic<double> regionHeight { 0.0 };
+
+    // decoding (see DetectionDecoder): minimum score, overlap above which NMS suppresses a box of the same
+    // class (raw SSD heads only) and the most objects reported per frame
+    std::atomic<double> detectionThreshold { 0.5 };
+    std::atomic<double> nmsThreshold { 0.6 };
+    std::atomic<int> maxDetections { 10 };
+    // class indices to report, null reports all; replaced as a whole with std::atomic_store()
+    // and read with std::atomic_load(), the decoder only rebuilds its mask when the pointer changes
+    std::shared_ptr<const QVector<int>> classFilter;
+
+    // records every frame reaching the filter while set; replaced as a whole like classFilter
+    std::shared_ptr<FrameRecorder> recorder;
+
+    // DelegateOptions of the interpreters, used when a runnable is created
+    std::atomic<int> delegateMode { 0 };
+    std::atomic<int> delegateThreads { 0 };
+    std::atomic<bool> delegateFp16 { false };
+    std::atomic<bool> delegateQuantizedKernels { true };
+};
+
+#endif // __COCO_DETECTION_SETTINGS__
@@ -6,55 +6,293 @@
  */
 
 #include "cocodetectionworker.h"
-#include "bitmap_helpers_impl.h"
+#include "modelcache.h"
 
-#include <QImage>
 #include <QElapsedTimer>
+#include <QMap>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
 
-Q_LOGGING_CATEGORY(objectworker, "tensorflow.cocodetectionworker")
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 
-// ToDo: should be an QML property
-const float Threshold = 0.5;
+// per-frame messages are debug output, off unless enabled with QT_LOGGING_RULES
+Q_LOGGING_CATEGORY(objectworker, "tensorflow.cocodetectionworker", QtInfoMsg)
+
+namespace {
+
+// preprocesses one slot of a batch on the thread pool; QRunnable::create() needs Qt 5.15
+class BatchSlotTask : public QRunnable
+{
+public:
+    BatchSlotTask(ImagePreprocessor* preprocessor, const SourceImage& image, void* target, std::atomic<bool>* succeeded,
+                  QSemaphore* finished)
+        : m_preprocessor(preprocessor), m_image(image), m_target(target), m_succeeded(succeeded), m_finished(finished)
+    {
+    }
+
+    void run() override
+    {
+        if (!m_preprocessor->process(m_image, m_target)) {
+            m_succeeded->store(false);
+        }
+        m_finished->release();
+    }
+
+private:
+    ImagePreprocessor* m_preprocessor;
+    const SourceImage& m_image;
+    void* m_target;
+    std::atomic<bool>* m_succeeded;
+    QSemaphore* m_finished;
+};
+
+int elementCount(const TfLiteTensor* tensor)
+{
+    if (!tensor->dims || tensor->dims->size == 0) {
+        return 0;
+    }
+    int count = 1;
+    for (int i = 0; i < tensor->dims->size; i++) {
+        count *= tensor->dims->data[i];
+    }
+    return count;
+}
+
+int lastDimension(const TfLiteTensor* tensor)
+{
+    return tensor->dims && tensor->dims->size > 0 ? tensor->dims->data[tensor->dims->size - 1] : 0;
+}
+
+} // namespace
+
+bool OutputTensor::isSupported(TfLiteType type)
+{
+    return type == kTfLiteFloat32 || type == kTfLiteUInt8 || type == kTfLiteInt8;
+}
+
+void OutputTensor::assign(const TfLiteTensor* tensor)
+{
+    type = tensor->type;
+    scale = tensor->params.scale;
+    zeroPoint = tensor->params.zero_point;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(tensor->data.raw);
+    data.assign(bytes, bytes + tensor->bytes);
+}
+
+void OutputTensor::assign(const TfLiteTensor* tensor, int batchIndex, int batchSize)
+{
+    type = tensor->type;
+    scale = tensor->params.scale;
+    zeroPoint = tensor->params.zero_point;
+    const size_t sliceSize = tensor->bytes / static_cast<size_t>(batchSize);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(tensor->data.raw) + batchIndex * sliceSize;
+    data.assign(bytes, bytes + sliceSize);
+}
+
+int OutputTensor::size() const
+{
+    return static_cast<int>(type == kTfLiteFloat32 ? data.size() / sizeof(float) : data.size());
+}
+
+int OutputTensor::rawValue(int index) const
+{
+    return type == kTfLiteInt8 ? static_cast<int>(reinterpret_cast<const int8_t*>(data.data())[index])
+                               : static_cast<int>(data[index]);
+}
+
+float OutputTensor::value(int index) const
+{
+    if (type == kTfLiteFloat32) {
+        return reinterpret_cast<const float*>(data.data())[index];
+    }
+    return (rawValue(index) - zeroPoint) * scale;
+}
+
+int OutputTensor::quantizedThreshold(float threshold) const
+{
+    if (scale <= 0.0f) {
+        return zeroPoint;
+    }
+    // (raw - zeroPoint) * scale >= threshold  <=>  raw >= zeroPoint + threshold / scale
+    return zeroPoint + static_cast<int>(std::ceil(threshold / scale));
+}
+
+QStringList DelegateOptions::availableModes()
+{
+    QStringList modes;
+    modes << modeName(Default) << modeName(Cpu);
+#ifdef HAVE_XNNPACK_DELEGATE
+    modes << modeName(XnnPack);
+#endif
+    return modes;
+}
+
+bool DelegateOptions::modeFromName(const QString& name, Mode* mode)
+{
+    for (Mode candidate : { Default, Cpu, XnnPack }) {
+        if (name.compare(modeName(candidate), Qt::CaseInsensitive) == 0) {
+            *mode = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+QString DelegateOptions::modeName(Mode mode)
+{
+    switch (mode) {
+    case Cpu:
+        return QStringLiteral("cpu");
+    case XnnPack:
+        return QStringLiteral("xnnpack");
+    default:
+        return QStringLiteral("default");
+    }
+}
 
 CocoDetectionWorker::CocoDetectionWorker(const QString& tfLiteFile)
 {
-    initializeModel(tfLiteFile);
+    const std::shared_ptr<const CachedModel> cachedModel = ModelCache::instance().acquire(tfLiteFile);
+    if (cachedModel) {
+        m_model = cachedModel->model;
+        m_hasSsdOptions = cachedModel->hasSsdOptions;
+        m_ssdOptions = cachedModel->ssdOptions;
+    }
+    initializeInterpreter(2, DelegateOptions(), true);
 }
 
-void CocoDetectionWorker::setDetectionModel(CocoDetectionModel* detectionModel)
+CocoDetectionWorker::CocoDetectionWorker(const std::shared_ptr<tflite::FlatBufferModel>& model, int numThreads,
+                                         const DelegateOptions& delegateOptions, bool verbose)
+    : m_model(model)
 {
-    m_detectionModel = QPointer<CocoDetectionModel>(detectionModel);
+    initializeInterpreter(numThreads, delegateOptions, verbose);
 }
 
-void CocoDetectionWorker::initializeModel(const QString& filename)
+std::shared_ptr<tflite::FlatBufferModel> CocoDetectionWorker::loadModel(const QString& filename)
 {
-    qCInfo(objectworker) << "Loading model ...";
-    m_model = tflite::FlatBufferModel::BuildFromFile(filename.toLocal8Bit());
+    const std::shared_ptr<const CachedModel> cachedModel = ModelCache::instance().acquire(filename);
+    return cachedModel ? cachedModel->model : nullptr;
+}
+
+void CocoDetectionWorker::buildInterpreter(int numThreads, bool withDefaultDelegates)
+{
+    m_interpreter.reset();
+
+    qCInfo(objectworker) << "Building interpreter ...";
+    tflite::InterpreterBuilder builder(*m_model, ModelCache::resolver(withDefaultDelegates));
+    // has to be known while building, delegates applied by the builder and the kernels'
+    // Prepare() pick their strategy from it
+    builder.SetNumThreads(numThreads);
+    builder(&m_interpreter);
+}
+
+bool CocoDetectionWorker::applyDelegate(int numThreads, const DelegateOptions& delegateOptions)
+{
+    if (delegateOptions.mode != DelegateOptions::XnnPack) {
+        return true;
+    }
+
+#ifdef HAVE_XNNPACK_DELEGATE
+    TfLiteXNNPackDelegateOptions options = TfLiteXNNPackDelegateOptionsDefault();
+    options.num_threads = delegateOptions.numThreads > 0 ? delegateOptions.numThreads : numThreads;
+    if (delegateOptions.quantizedKernels) {
+        options.flags |= TFLITE_XNNPACK_DELEGATE_FLAG_QS8 | TFLITE_XNNPACK_DELEGATE_FLAG_QU8;
+    } else {
+        options.flags &= ~(TFLITE_XNNPACK_DELEGATE_FLAG_QS8 | TFLITE_XNNPACK_DELEGATE_FLAG_QU8);
+    }
+    if (delegateOptions.forceFp16) {
+        options.flags |= TFLITE_XNNPACK_DELEGATE_FLAG_FORCE_FP16;
+    }
+
+    m_delegate = std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)>(
+        TfLiteXNNPackDelegateCreate(&options), TfLiteXNNPackDelegateDelete);
+    if (!m_delegate) {
+        qCWarning(objectworker) << "Could not create the XNNPACK delegate";
+        return false;
+    }
+
+    const TfLiteStatus status = m_interpreter->ModifyGraphWithDelegate(m_delegate.get());
+    if (status != kTfLiteOk) {
+        qCWarning(objectworker) << "Could not apply the XNNPACK delegate" << status;
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(numThreads)
+    qCWarning(objectworker) << "Built without the XNNPACK delegate (QMLMOBILENET_ENABLE_XNNPACK)";
+    return false;
+#endif
+}
+
+void CocoDetectionWorker::logPartitioning() const
+{
+    // nodes replaced by a delegate leave the execution plan, every delegated partition
+    // shows up as one extra node run by the delegate kernel
+    QMap<QString, int> partitions;
+    int cpuNodes = 0;
+    for (int nodeIndex : m_interpreter->execution_plan()) {
+        const auto* nodeAndRegistration = m_interpreter->node_and_registration(nodeIndex);
+        if (nodeAndRegistration->first.delegate == nullptr) {
+            cpuNodes++;
+            continue;
+        }
+        const char* name = nodeAndRegistration->second.custom_name;
+        partitions[QString::fromLatin1(name ? name : "unnamed delegate")]++;
+    }
+
+    int delegateKernels = 0;
+    for (int count : partitions) {
+        delegateKernels += count;
+    }
+    const int modelNodes = static_cast<int>(m_interpreter->nodes_size()) - delegateKernels;
 
+    qCInfo(objectworker) << "Partitioning:" << modelNodes - cpuNodes << "of" << modelNodes
+                         << "nodes delegated," << cpuNodes << "run on the builtin CPU kernels";
+    for (auto it = partitions.constBegin(); it != partitions.constEnd(); ++it) {
+        qCInfo(objectworker) << "  " << it.key() << "runs" << it.value() << "partition(s)";
+    }
+}
+
+void CocoDetectionWorker::initializeInterpreter(int numThreads, const DelegateOptions& delegateOptions, bool verbose)
+{
     if (m_model == nullptr) {
-        qCWarning(objectworker) << "Could not load model";
         return;
     }
 
-    qCInfo(objectworker) << "Building interpreter ...";
-    tflite::ops::builtin::BuiltinOpResolver resolver;
-    tflite::InterpreterBuilder builder(*m_model, resolver);
-    builder(&m_interpreter);
+    buildInterpreter(numThreads, delegateOptions.mode == DelegateOptions::Default);
 
     if (m_interpreter == nullptr) {
         qCWarning(objectworker) << "Could not build interpreter ...";
         return;
     }
 
+    if (!applyDelegate(numThreads, delegateOptions)) {
+        // a failed ModifyGraphWithDelegate() may leave the graph half delegated, start over
+        qCWarning(objectworker) << "Falling back to the builtin CPU kernels";
+        buildInterpreter(numThreads, false);
+        m_delegate.reset();
+
+        if (m_interpreter == nullptr) {
+            qCWarning(objectworker) << "Could not build interpreter ...";
+            return;
+        }
+    }
+
     if (m_interpreter->AllocateTensors() != kTfLiteOk) {
         qCWarning(objectworker) << "Could not allocate tensors";
+        m_interpreter.reset();
         return;
     }
 
-    m_interpreter->SetNumThreads(4);
-
-    qCInfo(objectworker) << "Interpreter state:";
-    tflite::PrintInterpreterState(m_interpreter.get());
+    if (verbose) {
+        qCInfo(objectworker) << "Interpreter state:";
+        tflite::PrintInterpreterState(m_interpreter.get());
+        logPartitioning();
+    }
 
     qCInfo(objectworker) << "****************************************************";
     qCInfo(objectworker) << "Tensors size: " << m_interpreter->tensors_size();
@@ -83,6 +321,12 @@ void CocoDetectionWorker::initializeModel(const QString& filename)
         counter++;
     }
 
+    const TfLiteType inputType = m_interpreter->input_tensor(0)->type;
+    if (!m_preprocessor.configure(m_requestedInputWidth, m_requestedInputHeight, m_requestedInputChannels, inputType)) {
+        qCWarning(objectworker) << "Cannot handle input type" << inputType << "with" << m_requestedInputChannels
+                                << "channels - Incompatible Model loaded?";
+    }
+
     counter = 0;
     for (auto tensorOutput : m_interpreter->outputs()) {
         TfLiteIntArray* dims = m_interpreter->tensor(tensorOutput)->dims;
@@ -96,50 +340,157 @@ void CocoDetectionWorker::initializeModel(const QString& filename)
         counter++;
     }
 
+    configureOutputs();
+}
+
+void CocoDetectionWorker::configureOutputs()
+{
+    m_boxesOutput = -1;
+    m_scoresOutput = -1;
+
+    const int outputCount = static_cast<int>(m_interpreter->outputs().size());
+    // TFLite_Detection_PostProcess: boxes [1, N, 4], classes [1, N], scores [1, N], count [1]
+    if (outputCount >= 4 && lastDimension(m_interpreter->output_tensor(0)) == 4
+        && elementCount(m_interpreter->output_tensor(3)) == 1) {
+        qCInfo(objectworker) << "Decoding the outputs of TFLite_Detection_PostProcess";
+        m_decoder.configurePostProcessed();
+        return;
+    }
+
+    // raw SSD heads: box encodings [1, anchors, 4] (or [1, anchors, 1, 4]) and scores [1, anchors, classes]
+    for (int boxes = 0; boxes < outputCount && m_scoresOutput < 0; boxes++) {
+        const TfLiteTensor* boxesTensor = m_interpreter->output_tensor(boxes);
+        if (lastDimension(boxesTensor) != 4 || boxesTensor->dims->size < 2) {
+            continue;
+        }
+        const int numAnchors = boxesTensor->dims->data[1];
+        for (int scores = 0; scores < outputCount; scores++) {
+            const TfLiteTensor* scoresTensor = m_interpreter->output_tensor(scores);
+            if (scores != boxes && scoresTensor->dims && scoresTensor->dims->size >= 2
+                && scoresTensor->dims->data[1] == numAnchors) {
+                m_boxesOutput = boxes;
+                m_scoresOutput = scores;
+                break;
+            }
+        }
+    }
+
+    if (m_scoresOutput < 0) {
+        qCWarning(objectworker) << "Cannot find detections in the outputs - Incompatible Model loaded?";
+        return;
+    }
+
+    const TfLiteTensor* scoresTensor = m_interpreter->output_tensor(m_scoresOutput);
+    const int numAnchors = scoresTensor->dims->data[1];
+    const int numClasses = elementCount(scoresTensor) / (scoresTensor->dims->data[0] * numAnchors);
+    qCInfo(objectworker) << "Decoding raw SSD heads with" << numAnchors << "anchors and" << numClasses << "classes";
+
+    if (!m_hasSsdOptions) {
+        // the default anchors at the model's input size
+        m_ssdOptions.inputWidth = m_requestedInputWidth;
+        m_ssdOptions.inputHeight = m_requestedInputHeight;
+    }
+    if (!m_decoder.configureRawSsd(m_ssdOptions, numAnchors, numClasses)) {
+        qCWarning(objectworker) << "Describe the anchors of the model in <model>.anchors.json";
+        m_boxesOutput = -1;
+        m_scoresOutput = -1;
+    }
 }
 
-float* CocoDetectionWorker::extractOutputAsFloats(int tensorIndex) const
+bool CocoDetectionWorker::setSsdOptions(const SsdOptions& options)
 {
-    TfLiteTensor* tensor = m_interpreter->tensor(tensorIndex);
-    Q_ASSERT(tensor && tensor->type == kTfLiteFloat32);
-    return tensor->data.f;
+    m_ssdOptions = options;
+    m_hasSsdOptions = true;
+    if (!m_interpreter) {
+        return false;
+    }
+    configureOutputs();
+    return m_decoder.format() == DetectionDecoder::RawSsd;
 }
 
-void CocoDetectionWorker::predict(const QImage &image) const
+void CocoDetectionWorker::setNumThreads(int numThreads)
 {
-    if (Q_UNLIKELY(m_interpreter->inputs().size() <= 0)) {
-        qCWarning(objectworker) << "Model not loaded - Detection does not work!";
+    if (!m_interpreter) {
         return;
     }
 
-    const int channels = 3; // we enfoce QImage::Format_RGB888
-
-    int imageInput = m_interpreter->inputs()[0];
-    TfLiteType inputType = m_interpreter->tensor(imageInput)->type;
-
-    // tflite::label_image:::resize: the method resizes, normalizes and assigns image to input tensor
-    switch(inputType) {
-    case kTfLiteFloat32:
-        tflite::label_image::resize(m_interpreter->typed_tensor<float>(imageInput),
-                                    image.constBits(), image.height(), image.width(), channels,
-                                    m_requestedInputHeight, m_requestedInputWidth,
-                                    m_requestedInputChannels, inputType);
-        break;
-    case kTfLiteInt8:
-        tflite::label_image::resize(m_interpreter->typed_tensor<int8_t>(imageInput),
-                                    image.constBits(), image.height(), image.width(), channels,
-                                    m_requestedInputHeight, m_requestedInputWidth,
-                                    m_requestedInputChannels, inputType);
-        break;
-    case kTfLiteUInt8:
-        tflite::label_image::resize(m_interpreter->typed_tensor<uint8_t>(imageInput),
-                                    image.constBits(), image.height(), image.width(), channels,
-                                    m_requestedInputHeight, m_requestedInputWidth,
-                                    m_requestedInputChannels, inputType);
-        break;
-     default:
-        qCWarning(objectworker) << "Cannot handle input type " << inputType << " - Incompatible Model loaded?";
-        return;
+    // resizes the shared Eigen/ruy contexts, kernels keep the partitioning chosen at build time
+    if (m_interpreter->SetNumThreads(numThreads) != kTfLiteOk) {
+        qCWarning(objectworker) << "Could not change the number of threads to" << numThreads;
+    }
+}
+
+bool CocoDetectionWorker::setInput(const std::vector<uint8_t>& input)
+{
+    if (Q_UNLIKELY(!m_interpreter || m_interpreter->inputs().size() <= 0)) {
+        qCWarning(objectworker) << "Model not loaded - Detection does not work!";
+        return false;
+    }
+
+    // a batch of setInputs() ran before
+    if (m_batchSize != 1 && !setBatchSize(1)) {
+        return false;
+    }
+
+    TfLiteTensor* tensor = m_interpreter->input_tensor(0);
+    if (tensor->bytes != input.size()) {
+        qCWarning(objectworker) << "Input of" << input.size() << "bytes does not fit tensor of" << tensor->bytes;
+        return false;
+    }
+
+    std::memcpy(tensor->data.raw, input.data(), input.size());
+    return true;
+}
+
+bool CocoDetectionWorker::setInputs(const QVector<const std::vector<uint8_t>*>& inputs)
+{
+    if (Q_UNLIKELY(!m_interpreter || m_interpreter->inputs().size() <= 0)) {
+        qCWarning(objectworker) << "Model not loaded - Detection does not work!";
+        return false;
+    }
+    if (inputs.size() > 1 && !m_batchingSupported) {
+        return false;
+    }
+    if (!setBatchSize(inputs.size())) {
+        return false;
+    }
+
+    TfLiteTensor* tensor = m_interpreter->input_tensor(0);
+    const size_t frameSize = tensor->bytes / static_cast<size_t>(inputs.size());
+    for (int slot = 0; slot < inputs.size(); slot++) {
+        if (inputs.at(slot)->size() != frameSize) {
+            qCWarning(objectworker) << "Input of" << inputs.at(slot)->size() << "bytes does not fit batch slot of" << frameSize;
+            return false;
+        }
+        std::memcpy(tensor->data.raw + slot * frameSize, inputs.at(slot)->data(), frameSize);
+    }
+    return true;
+}
+
+bool CocoDetectionWorker::invoke(DetectionOutput* output)
+{
+    return runInterpreter() && copyOutputs(output, 0, 1);
+}
+
+bool CocoDetectionWorker::invoke(const QVector<DetectionOutput*>& outputs)
+{
+    if (outputs.size() != m_batchSize || !runInterpreter()) {
+        return false;
+    }
+    for (int slot = 0; slot < outputs.size(); slot++) {
+        if (!copyOutputs(outputs.at(slot), slot, outputs.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CocoDetectionWorker::runInterpreter()
+{
+    const bool rawSsd = m_decoder.format() == DetectionDecoder::RawSsd;
+    if (Q_UNLIKELY(!m_interpreter || (rawSsd ? m_scoresOutput < 0 : m_interpreter->outputs().size() < 4))) {
+        qCWarning(objectworker) << "Model not loaded - Detection does not work!";
+        return false;
     }
 
     // finally run the network :-)
@@ -152,50 +503,208 @@ void CocoDetectionWorker::predict(const QImage &image) const
 
     if (status != kTfLiteOk) {
         qCWarning(objectworker) << "Failed to inference the image" << status;
-        return;
+        return false;
     }
 
-    qCInfo(objectworker) << "Inference Done - Returned with status" << status << "in" << timer.elapsed() << "ms";
+    qCDebug(objectworker) << "Inference Done - Returned with status" << status << "in" << timer.elapsed() << "ms";
+    return true;
+}
+
+bool CocoDetectionWorker::copyOutputs(DetectionOutput* output, int batchIndex, int batchSize)
+{
+    const auto assign = [batchIndex, batchSize](OutputTensor* target, const TfLiteTensor* tensor) {
+        if (batchSize == 1) {
+            target->assign(tensor);
+        } else {
+            target->assign(tensor, batchIndex, batchSize);
+        }
+    };
+
+    if (m_decoder.format() == DetectionDecoder::RawSsd) {
+        const TfLiteTensor* boxes = m_interpreter->output_tensor(m_boxesOutput);
+        const TfLiteTensor* scores = m_interpreter->output_tensor(m_scoresOutput);
+        if (Q_UNLIKELY(!OutputTensor::isSupported(boxes->type) || !OutputTensor::isSupported(scores->type))) {
+            qCWarning(objectworker) << "Cannot decode outputs of type" << boxes->type << "and" << scores->type;
+            return false;
+        }
+        // the decoder only looks at anchors that pass the threshold
+        assign(&output->locations, boxes);
+        assign(&output->scores, scores);
+        return true;
+    }
 
     // inspired by https://github.com/YijinLiu/tf-cpu/blob/master/benchmark/obj_detect_lite.cc
-    const auto outputTensors = m_interpreter->outputs();
-    const float* locations          = extractOutputAsFloats(outputTensors[0]);
-    const float* outputClasses      = extractOutputAsFloats(outputTensors[1]);
-    const float* outputScores       = extractOutputAsFloats(outputTensors[2]);
-    const float* foundDetections    = extractOutputAsFloats(outputTensors[3]);
+    for (int index = 0; index < 4; index++) {
+        const TfLiteTensor* tensor = m_interpreter->output_tensor(index);
+        if (Q_UNLIKELY(!OutputTensor::isSupported(tensor->type))) {
+            qCWarning(objectworker) << "Cannot decode output" << index << "of type" << tensor->type;
+            return false;
+        }
+    }
+
+    // quantized outputs are copied as they are, the decoder dequantizes what passes the threshold
+    assign(&output->locations, m_interpreter->output_tensor(0));
+    assign(&output->classes, m_interpreter->output_tensor(1));
+    assign(&output->scores, m_interpreter->output_tensor(2));
+    assign(&output->count, m_interpreter->output_tensor(3));
+    return true;
+}
 
+QVector<CocoDetectionModel::DetectedObject> CocoDetectionWorker::predict(const QImage &image)
+{
     QVector<CocoDetectionModel::DetectedObject> detectedObjects;
 
-    for (int detectionIndex = 0; detectionIndex < static_cast<int>(*foundDetections); detectionIndex++) {
+    if (Q_UNLIKELY(!m_interpreter || m_interpreter->inputs().size() <= 0)) {
+        qCWarning(objectworker) << "Model not loaded - Detection does not work!";
+        return detectedObjects;
+    }
 
-        const float score = outputScores[detectionIndex];
+    if (!setBatchSize(1)) {
+        return detectedObjects;
+    }
 
-        if (score < Threshold) {
-            continue;
-        }
+    const QImage rgbImage = image.convertToFormat(QImage::Format_RGB888);
+
+    SourceImage sourceImage;
+    sourceImage.layout = PixelLayout::RGB888;
+    sourceImage.data[0] = rgbImage.constBits();
+    sourceImage.stride[0] = rgbImage.bytesPerLine();
+    sourceImage.width = rgbImage.width();
+    sourceImage.height = rgbImage.height();
+
+    // resizes, normalizes and assigns the image to the input tensor in one pass
+    if (!m_preprocessor.process(sourceImage, m_interpreter->input_tensor(0))) {
+        qCWarning(objectworker) << "Cannot preprocess image of size" << sourceImage.width << "x" << sourceImage.height
+                                << "- Incompatible Model loaded?";
+        return detectedObjects;
+    }
+
+    if (invoke(&m_output)) {
+        m_decoder.decode(m_output, sourceImage.rotation, &detectedObjects);
+    }
+    return detectedObjects;
+}
+
+bool CocoDetectionWorker::setBatchSize(int batchSize)
+{
+    if (batchSize == m_batchSize) {
+        return true;
+    }
+
+    const int input = m_interpreter->inputs()[0];
+    const std::vector<int> dims = { batchSize, m_requestedInputHeight, m_requestedInputWidth, m_requestedInputChannels };
+
+    if (m_interpreter->ResizeInputTensor(input, dims) == kTfLiteOk && m_interpreter->AllocateTensors() == kTfLiteOk) {
+        m_batchSize = batchSize;
+        return true;
+    }
 
-        const int classIndex = static_cast<int>(outputClasses[detectionIndex]);
-        const float top    = locations[4 * detectionIndex];
-        const float left   = locations[4 * detectionIndex + 1];
-        const float bottom = locations[4 * detectionIndex + 2];
-        const float right  = locations[4 * detectionIndex + 3];
+    // the interpreter is still sized for the failed batch, go back to single frames
+    qCWarning(objectworker) << "Model cannot run batches of" << batchSize << "- falling back to single frames";
+    m_batchingSupported = false;
+    const std::vector<int> single = { 1, m_requestedInputHeight, m_requestedInputWidth, m_requestedInputChannels };
+    if (m_interpreter->ResizeInputTensor(input, single) != kTfLiteOk || m_interpreter->AllocateTensors() != kTfLiteOk) {
+        qCWarning(objectworker) << "Could not restore the input size - Detection does not work!";
+        m_interpreter.reset();
+        return false;
+    }
+    m_batchSize = 1;
+    return batchSize == 1;
+}
 
-        const QRectF boundingRect(left, top, right - left, bottom - top);
-        qCInfo(objectworker) << "Found object" << classIndex << "with score" << score << "at:" << boundingRect;
+bool CocoDetectionWorker::preprocessBatch(const QVector<SourceImage>& images)
+{
+    TfLiteTensor* tensor = m_interpreter->input_tensor(0);
+    const size_t frameSize = m_preprocessor.targetSize();
+    if (tensor->bytes < frameSize * images.size()) {
+        return false;
+    }
 
-        CocoDetectionModel::DetectedObject detectedObject;
-        detectedObject.classIndex = classIndex;
-        detectedObject.score = score;
-        detectedObject.boundingRect = boundingRect;
+    while (m_batchPreprocessors.size() + 1 < static_cast<size_t>(images.size())) {
+        std::unique_ptr<ImagePreprocessor> preprocessor(new ImagePreprocessor);
+        preprocessor->configure(m_requestedInputWidth, m_requestedInputHeight, m_requestedInputChannels,
+                                m_preprocessor.targetType());
+        m_batchPreprocessors.push_back(std::move(preprocessor));
+    }
 
-        detectedObjects << detectedObject;
+    // every slot has its own preprocessor and a disjoint part of the tensor
+    std::atomic<bool> succeeded { true };
+    QSemaphore finished;
+    for (int slot = 1; slot < images.size(); slot++) {
+        ImagePreprocessor* preprocessor = m_batchPreprocessors[slot - 1].get();
+        void* target = tensor->data.raw + slot * frameSize;
+        const SourceImage& image = images.at(slot);
+        QThreadPool::globalInstance()->start(new BatchSlotTask(preprocessor, image, target, &succeeded, &finished));
+    }
 
+    // the first slot runs here instead of waiting
+    if (!m_preprocessor.process(images.first(), tensor->data.raw)) {
+        succeeded = false;
     }
+    finished.acquire(images.size() - 1);
+    return succeeded;
+}
 
-    if (!m_detectionModel.isNull()) {
-        m_detectionModel->setDetectedObjects(detectedObjects);
+QVector<QVector<CocoDetectionModel::DetectedObject>> CocoDetectionWorker::predictBatch(const QVector<SourceImage>& images)
+{
+    QVector<QVector<CocoDetectionModel::DetectedObject>> results(images.size());
+
+    if (Q_UNLIKELY(!m_interpreter || m_interpreter->inputs().size() <= 0)) {
+        qCWarning(objectworker) << "Model not loaded - Detection does not work!";
+        return results;
     }
 
+    if (images.isEmpty()) {
+        return results;
+    }
+
+    int first = 0;
+    while (first < images.size()) {
+        // one frame at a time if the model cannot be resized, with the same API for the caller
+        const int batchSize = m_batchingSupported ? images.size() - first : 1;
+        const QVector<SourceImage> batch = images.mid(first, batchSize);
+
+        if (!setBatchSize(batch.size())) {
+            if (!m_interpreter) {
+                return results;
+            }
+            // batching is switched off now, go on with single frames
+            continue;
+        }
+
+        if (!preprocessBatch(batch)) {
+            qCWarning(objectworker) << "Cannot preprocess batch of" << batch.size() << "images - Incompatible Model loaded?";
+        } else if (invoke(&m_output)) {
+            for (int slot = 0; slot < batch.size(); slot++) {
+                m_decoder.decode(m_output, batch.at(slot).rotation, &results[first + slot], slot, batch.size());
+            }
+        }
+        first += batch.size();
+    }
+
+    return results;
+}
+
+QVector<QVector<CocoDetectionModel::DetectedObject>> CocoDetectionWorker::predictBatch(const QVector<QImage>& images)
+{
+    // keeps the converted pixels alive until the batch ran
+    QVector<QImage> rgbImages;
+    QVector<SourceImage> sourceImages;
+    rgbImages.reserve(images.size());
+    sourceImages.reserve(images.size());
+
+    for (const QImage& image : images) {
+        rgbImages << image.convertToFormat(QImage::Format_RGB888);
+        const QImage& rgbImage = rgbImages.last();
+
+        SourceImage sourceImage;
+        sourceImage.layout = PixelLayout::RGB888;
+        sourceImage.data[0] = rgbImage.constBits();
+        sourceImage.stride[0] = rgbImage.bytesPerLine();
+        sourceImage.width = rgbImage.width();
+        sourceImage.height = rgbImage.height();
+        sourceImages << sourceImage;
+    }
 
-    emit finishedPrediction();
+    return predictBatch(sourceImages);
 }
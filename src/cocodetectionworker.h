@@ -9,48 +9,192 @@
 #define __COCO_DETECTION_WORKER__
 
 #include "cocodetectionmodel.h"
+#include "detectiondecoder.h"
+#include "imagepreprocessor.h"
 
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/kernels/register.h"
 #include "tensorflow/lite/model.h"
 #include "tensorflow/lite/optional_debug_tools.h"
+#ifdef HAVE_XNNPACK_DELEGATE
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
+#endif
 
+#include <QImage>
 #include <QObject>
 #include <QMutex>
 #include <QMutexLocker>
-#include <QPointer>
+#include <QStringList>
+#include <QVector>
 #include <QLoggingCategory>
 
+#include <memory>
+#include <vector>
+
 Q_DECLARE_LOGGING_CATEGORY(objectworker)
 
+/*
+ * Copy of one output tensor as it came out of the interpreter. Quantized
+ * (uint8/int8) tensors stay quantized, value() dequantizes single elements
+ * so only what is actually used gets converted.
+ */
+struct OutputTensor
+{
+    TfLiteType type = kTfLiteFloat32;
+    float scale = 1.0f;
+    int zeroPoint = 0;
+    std::vector<uint8_t> data;
+
+    static bool isSupported(TfLiteType type);
+    // copies the tensor, the storage is only allocated for the first frame
+    void assign(const TfLiteTensor* tensor);
+    // copies the part of a batched tensor that belongs to frame batchIndex
+    void assign(const TfLiteTensor* tensor, int batchIndex, int batchSize);
+
+    int size() const;
+    float value(int index) const;
+    // smallest raw value that dequantizes to at least threshold, for comparing without converting
+    int quantizedThreshold(float threshold) const;
+    int rawValue(int index) const;
+};
+
+/*
+ * Raw outputs of TFLite_Detection_PostProcess (locations, classes, scores,
+ * count), copied out so the interpreter can take the next frame while they
+ * are decoded. Models with raw SSD heads only fill locations (the box
+ * encodings) and scores (the class scores of every anchor).
+ */
+struct DetectionOutput
+{
+    OutputTensor locations;
+    OutputTensor classes;
+    OutputTensor scores;
+    OutputTensor count;
+};
+
+/*
+ * Which kernels run the graph. Default keeps whatever the TFLite build
+ * applies on its own (XNNPACK if it was built with TFLITE_ENABLE_XNNPACK),
+ * Cpu forces the builtin kernels and XnnPack applies the XNNPACK delegate
+ * explicitly with the options below.
+ */
+struct DelegateOptions
+{
+    enum Mode {
+        Default,
+        Cpu,
+        XnnPack
+    };
+
+    Mode mode = Default;
+    // threads of the delegate, 0 uses the interpreter's
+    int numThreads = 0;
+    // run float models in half precision where the CPU supports it
+    bool forceFp16 = false;
+    // use the signed/unsigned 8 bit kernels for quantized models
+    bool quantizedKernels = true;
+
+    static QStringList availableModes();
+    static bool modeFromName(const QString& name, Mode* mode);
+    static QString modeName(Mode mode);
+};
+
+/*
+ * Owns one interpreter for a (possibly shared) model. The InferenceScheduler
+ * calls it from the inference thread it runs it on.
+ */
 class CocoDetectionWorker : public QObject {
     Q_OBJECT
 public:
     CocoDetectionWorker(const QString& tfLiteFile);
-    void setDetectionModel(CocoDetectionModel* detectionModel);
-
-    void waitForPredictionToFinish() { QMutexLocker locker(&m_invocationMutex); }
-
-public slots:
-    void predict(const QImage& image) const;
-
-signals:
-    void finishedPrediction() const;
+    // the model is shared with other workers, only the interpreter is private to this one
+    CocoDetectionWorker(const std::shared_ptr<tflite::FlatBufferModel>& model, int numThreads,
+                        const DelegateOptions& delegateOptions = DelegateOptions(), bool verbose = true);
+
+    // the model of the ModelCache, loaded once per process and file
+    static std::shared_ptr<tflite::FlatBufferModel> loadModel(const QString& filename);
+
+    bool isValid() const { return m_interpreter != nullptr && m_preprocessor.isConfigured(); }
+
+    // geometry and type of the input tensor, for preprocessing on another thread
+    int inputWidth() const { return m_requestedInputWidth; }
+    int inputHeight() const { return m_requestedInputHeight; }
+    int inputChannels() const { return m_requestedInputChannels; }
+    TfLiteType inputType() const { return m_preprocessor.targetType(); }
+
+    // takes effect with the next invoke(), without reloading the model
+    void setNumThreads(int numThreads);
+
+    // copies an input prepared by an ImagePreprocessor configured like this worker's
+    bool setInput(const std::vector<uint8_t>& input);
+    // runs the network on the current input and copies the raw outputs
+    bool invoke(DetectionOutput* output);
+
+    // Same for several prepared inputs (e.g. of different streams) that run
+    // as one batch. False if the model cannot run a batch of that size, the
+    // inputs have to go through setInput()/invoke() one by one then.
+    bool setInputs(const QVector<const std::vector<uint8_t>*>& inputs);
+    // runs the batch of setInputs() and copies every frame's part of the outputs
+    bool invoke(const QVector<DetectionOutput*>& outputs);
+    bool supportsBatching() const { return m_batchingSupported; }
+
+    // configured for the outputs of the model, predict() and predictBatch() decode with it;
+    // stages decoding on another thread take a copy
+    DetectionDecoder& decoder() { return m_decoder; }
+    const DetectionDecoder& decoder() const { return m_decoder; }
+    // anchors of a model with raw SSD heads, the defaults (at the model's input size) or
+    // SsdOptions::fileFor() the model file are used otherwise
+    bool setSsdOptions(const SsdOptions& options);
+
+    // synchronous prediction on the calling thread
+    QVector<CocoDetectionModel::DetectedObject> predict(const QImage& image);
+
+    // Synchronous prediction of several frames with a single Invoke(). The
+    // input tensor is resized to the number of images, which are preprocessed
+    // in parallel on the global thread pool. Models that cannot run batched
+    // (e.g. because of TFLite_Detection_PostProcess) fall back to one Invoke()
+    // per frame. Must not be mixed with setInput()/invoke().
+    QVector<QVector<CocoDetectionModel::DetectedObject>> predictBatch(const QVector<SourceImage>& images);
+    QVector<QVector<CocoDetectionModel::DetectedObject>> predictBatch(const QVector<QImage>& images);
+
+    int batchSize() const { return m_batchSize; }
 
 private:
     mutable QMutex m_invocationMutex;
-    void initializeModel(const QString &filename);
-    float* extractOutputAsFloats(int tensorIndex) const;
+    void initializeInterpreter(int numThreads, const DelegateOptions& delegateOptions, bool verbose);
+    void buildInterpreter(int numThreads, bool withDefaultDelegates);
+    bool applyDelegate(int numThreads, const DelegateOptions& delegateOptions);
+    void logPartitioning() const;
+    bool runInterpreter();
+    bool copyOutputs(DetectionOutput* output, int batchIndex, int batchSize);
+    // picks the decoder for the model's outputs
+    void configureOutputs();
+    bool setBatchSize(int batchSize);
+    bool preprocessBatch(const QVector<SourceImage>& images);
 
     int m_requestedInputHeight = 0;
     int m_requestedInputWidth = 0;
     int m_requestedInputChannels = 0;
 
-    std::unique_ptr<tflite::FlatBufferModel> m_model = nullptr;
+    std::shared_ptr<tflite::FlatBufferModel> m_model = nullptr;
+    // declared before the interpreter, which must be destroyed first
+    std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate*)> m_delegate { nullptr, nullptr };
     std::unique_ptr<tflite::Interpreter> m_interpreter = nullptr;
 
-    QPointer<CocoDetectionModel> m_detectionModel;
-
+    ImagePreprocessor m_preprocessor;
+    DetectionOutput m_output;
+    DetectionDecoder m_decoder;
+    SsdOptions m_ssdOptions;
+    bool m_hasSsdOptions = false;
+    // outputs copied by invoke() for raw SSD heads
+    int m_boxesOutput = -1;
+    int m_scoresOutput = -1;
+
+    // batch the input tensor is currently sized for, models that refused to be resized stay at 1
+    int m_batchSize = 1;
+    bool m_batchingSupported = true;
+    // one preprocessor per batch slot after the first, which uses m_preprocessor
+    std::vector<std::unique_ptr<ImagePreprocessor>> m_batchPreprocessors;
 };
 
 
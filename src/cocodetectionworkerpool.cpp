@@ -0,0 +1,780 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cocodetectionworkerpool.h"
+#include "nonmaximumsuppression.h"
+
+#include <QHash>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace {
+
+size_t inputBufferCount(int workerCount)
+{
+    // every interpreter may still be copying its input while the next one is prepared
+    return static_cast<size_t>(workerCount) + 1;
+}
+
+// overlap (intersection over the smaller box) from which two boxes of neighbouring tiles are one object
+const double TileMergeThreshold = 0.6;
+
+size_t outputBufferCount(int workerCount)
+{
+    // one per interpreter plus room for a postprocess stage that fell behind
+    return 2 * static_cast<size_t>(workerCount) + 1;
+}
+
+// most interpreters a stream keeps busy; the scheduler may have been created with more by another stream
+int maxInterpreterCount(const CocoDetectionSettings& settings)
+{
+    return std::max({ 1, settings.workerCount.load(), QThread::idealThreadCount() });
+}
+
+QMutex sourcesMutex;
+QHash<QString, std::weak_ptr<CocoDetectionWorkerPool>> sources;
+
+} // namespace
+
+CocoDetectionWorkerPool::CocoDetectionWorkerPool(const QString& modelFilename,
+                                                 const std::shared_ptr<CocoDetectionSettings>& settings,
+                                                 CocoDetectionModel* detectionModel,
+                                                 const std::shared_ptr<PipelineStats>& stats)
+    : m_settings(settings)
+    , m_modelFilename(modelFilename)
+    , m_stats(stats ? stats : std::make_shared<PipelineStats>())
+    , m_framePool(frameBufferCount())
+    , m_frameQueue(1)
+    , m_freeInputs(inputBufferCount(maxInterpreterCount(*settings)))
+    , m_readyInputs(1)
+    , m_freeOutputs(outputBufferCount(maxInterpreterCount(*settings)))
+    , m_outputs(outputBufferCount(maxInterpreterCount(*settings)))
+{
+    m_levelFiles.append(modelFilename);
+    addDetectionModel(detectionModel);
+}
+
+std::shared_ptr<CocoDetectionWorkerPool> CocoDetectionWorkerPool::forSource(const QString& source, const QString& modelFilename,
+                                                                            const std::shared_ptr<CocoDetectionSettings>& settings,
+                                                                            CocoDetectionModel* detectionModel,
+                                                                            const std::shared_ptr<PipelineStats>& stats)
+{
+    if (source.isEmpty()) {
+        return std::make_shared<CocoDetectionWorkerPool>(modelFilename, settings, detectionModel, stats);
+    }
+
+    const QString key = source + QLatin1Char('|') + modelFilename;
+    QMutexLocker locker(&sourcesMutex);
+    std::shared_ptr<CocoDetectionWorkerPool> pool = sources.value(key).lock();
+    if (pool) {
+        qCInfo(objectworker) << "Sharing the detections of" << source << "with another filter";
+        pool->addDetectionModel(detectionModel);
+        return pool;
+    }
+
+    pool = std::make_shared<CocoDetectionWorkerPool>(modelFilename, settings, detectionModel, stats);
+    sources.insert(key, pool);
+    return pool;
+}
+
+void CocoDetectionWorkerPool::setQualityLevels(const QStringList& modelFilenames)
+{
+    if (m_loader) {
+        return;
+    }
+
+    // the quality controller tracks at most 64 levels
+    m_levelFiles = QStringList(m_modelFilename) + modelFilenames.mid(0, 63);
+}
+
+void CocoDetectionWorkerPool::start()
+{
+    if (m_loader) {
+        return;
+    }
+
+    m_loader = QThread::create([this]() { initialize(); });
+    m_loader->setObjectName(QStringLiteral("CocoDetectionLoader"));
+    m_loader->start();
+}
+
+qint64 CocoDetectionWorkerPool::loadTime() const
+{
+    return isReady() ? std::atomic_load(&m_scheduler)->loadTime() : 0;
+}
+
+qint64 CocoDetectionWorkerPool::warmupTime() const
+{
+    return isReady() ? std::atomic_load(&m_scheduler)->warmupTime() : 0;
+}
+
+void CocoDetectionWorkerPool::addBuffers(int interpreterCount)
+{
+    // the queues have room for the buffers of the most interpreters a stream keeps busy
+    while (m_inputBuffers.size() < inputBufferCount(interpreterCount)) {
+        std::unique_ptr<InputBuffer> buffer(new InputBuffer);
+        buffer->data.resize(m_preprocessor.targetSize());
+        if (!m_freeInputs.push(buffer.get())) {
+            break;
+        }
+        m_inputBuffers.push_back(std::move(buffer));
+    }
+
+    while (m_outputBuffers.size() < outputBufferCount(interpreterCount)) {
+        std::unique_ptr<OutputBuffer> buffer(new OutputBuffer);
+        if (!m_freeOutputs.tryPush(buffer.get())) {
+            break;
+        }
+        m_outputBuffers.push_back(std::move(buffer));
+    }
+}
+
+void CocoDetectionWorkerPool::updateStatus()
+{
+    // also guards m_scheduler against a switch of the quality level
+    QMutexLocker locker(&m_statusMutex);
+
+    Status status = Loading;
+    qint64 loadTime = 0;
+    qint64 warmupTime = 0;
+    if (m_scheduler) {
+        status = static_cast<Status>(m_scheduler->status());
+        loadTime = m_scheduler->loadTime();
+        warmupTime = m_scheduler->warmupTime();
+        // ready interpreters are of no use before the stage threads run
+        if (status == Ready && !m_initialized) {
+            status = Warming;
+        }
+    }
+
+    if (m_status.exchange(status, std::memory_order_acq_rel) != status) {
+        emit statusChanged(status, loadTime, warmupTime);
+    }
+}
+
+void CocoDetectionWorkerPool::initialize()
+{
+    // the scheduler of the model is shared by every stream of the process, the first one loads it
+    m_scheduler = InferenceScheduler::acquire(m_modelFilename, m_settings);
+    connect(m_scheduler.get(), &InferenceScheduler::statusChanged, this, [this]() { updateStatus(); },
+            Qt::DirectConnection);
+    updateStatus();
+
+    if (!m_scheduler->waitUntilLoaded() || m_stopRequested.load(std::memory_order_acquire)) {
+        updateStatus();
+        return;
+    }
+
+    // all interpreters share the model, so one preprocessor serves them all
+    const CocoDetectionWorker* prototype = m_scheduler->prototype();
+    if (!m_preprocessor.configure(prototype->inputWidth(), prototype->inputHeight(), prototype->inputChannels(),
+                                  prototype->inputType())) {
+        qCWarning(objectworker) << "Cannot preprocess for input type" << prototype->inputType();
+        QMutexLocker locker(&m_statusMutex);
+        m_status.store(Error, std::memory_order_release);
+        emit statusChanged(Error, 0, 0);
+        return;
+    }
+    // the postprocess stage decodes for all of them
+    m_levelDecoder = std::make_shared<const DetectionDecoder>(prototype->decoder());
+    m_interpreterCount.store(std::min(m_scheduler->interpreterCount(), maxInterpreterCount(*m_settings)));
+    addBuffers(m_interpreterCount);
+    m_pendingResults.resize(static_cast<size_t>(m_interpreterCount) + 1);
+    m_quality.setLevelCount(m_levelFiles.size());
+
+    QThread* thread = QThread::create([this]() { preprocessFrames(); });
+    thread->setObjectName(QStringLiteral("CocoDetectionPreprocess"));
+    m_threads.push_back(thread);
+
+    thread = QThread::create([this]() { postprocessOutputs(); });
+    thread->setObjectName(QStringLiteral("CocoDetectionPostprocess"));
+    m_threads.push_back(thread);
+
+    for (QThread* stageThread : m_threads) {
+        stageThread->start();
+    }
+
+    m_scheduler->addStream(this);
+
+    {
+        QMutexLocker locker(&m_statusMutex);
+        m_initialized = true;
+    }
+    updateStatus();
+}
+
+CocoDetectionWorkerPool::~CocoDetectionWorkerPool()
+{
+    m_stopRequested.store(true, std::memory_order_release);
+
+    // the stage threads are started by the loader, so they are all known once it is done
+    if (m_loader) {
+        m_loader->wait();
+        delete m_loader;
+    }
+
+    // wake every stage wherever it sleeps; the preprocessor stops first, it may be switching the scheduler
+    m_readySlot.release();
+    m_frameQueue.wakeAll(1);
+    m_freeInputs.wakeAll(1);
+    if (!m_threads.empty()) {
+        m_threads.front()->wait();
+    }
+
+    if (m_scheduler) {
+        disconnect(m_scheduler.get(), nullptr, this, nullptr);
+        // the inputs the interpreters are running still come back
+        m_scheduler->removeStream(this);
+    }
+
+    m_outputs.wakeAll(1);
+
+    for (QThread* thread : m_threads) {
+        thread->wait();
+        delete thread;
+    }
+
+    // the last stream of a model shuts its interpreters down
+    m_scheduler.reset();
+}
+
+void CocoDetectionWorkerPool::addDetectionModel(CocoDetectionModel* detectionModel)
+{
+    if (detectionModel) {
+        QMutexLocker locker(&m_modelsMutex);
+        m_detectionModels.append(detectionModel);
+        m_subscribers.store(m_detectionModels.size(), std::memory_order_relaxed);
+    }
+}
+
+void CocoDetectionWorkerPool::removeDetectionModel(CocoDetectionModel* detectionModel)
+{
+    QMutexLocker locker(&m_modelsMutex);
+    // a filter that got a new runnable is in the list twice for a moment
+    m_detectionModels.removeOne(detectionModel);
+    m_subscribers.store(m_detectionModels.size(), std::memory_order_relaxed);
+}
+
+bool CocoDetectionWorkerPool::claimFrame(qint64 startTime)
+{
+    // a single filter, or a backend without timestamps, cannot see copies
+    if (m_subscribers.load(std::memory_order_relaxed) < 2 || startTime < 0) {
+        return true;
+    }
+
+    qint64 last = m_lastFrameTime.load(std::memory_order_relaxed);
+    do {
+        if (startTime <= last) {
+            return false;
+        }
+    } while (!m_lastFrameTime.compare_exchange_weak(last, startTime, std::memory_order_relaxed));
+    return true;
+}
+
+void CocoDetectionWorkerPool::submitFrame(FrameBufferRef frame, qint64 captureTime)
+{
+    if (!isReady()) {
+        return;
+    }
+
+    QueuedFrame queued;
+    queued.frame = std::move(frame);
+    queued.arrivalTime = captureTime;
+
+    // latest frame wins, the dropped one goes straight back to the frame pool
+    const int dropped = m_frameQueue.pushLatest(std::move(queued));
+    if (dropped > 0) {
+        m_stats->droppedFrames.fetch_add(static_cast<quint64>(dropped), std::memory_order_relaxed);
+        qCDebug(objectworker) << "Dropped a frame the preprocessor did not get to";
+    }
+}
+
+void CocoDetectionWorkerPool::publishTrackedObjects(qint64 captureTime)
+{
+    if (!isReady()) {
+        return;
+    }
+
+    QMutexLocker locker(&m_trackedMutex);
+    m_tracker.predict(captureTime, &m_trackedObjects);
+    publish(m_trackedObjects, captureTime);
+}
+
+void CocoDetectionWorkerPool::holdTrackedObjects(qint64 captureTime)
+{
+    QMutexLocker locker(&m_trackedMutex);
+    m_tracker.hold(captureTime);
+}
+
+void CocoDetectionWorkerPool::publish(const QVector<CocoDetectionModel::DetectedObject>& detectedObjects,
+                                      qint64 captureTime)
+{
+    QMutexLocker locker(&m_modelsMutex);
+    for (const QPointer<CocoDetectionModel>& detectionModel : m_detectionModels) {
+        if (!detectionModel.isNull()) {
+            detectionModel->setDetectedObjects(detectedObjects, captureTime);
+        }
+    }
+}
+
+bool CocoDetectionWorkerPool::isTooOld(qint64 arrivalTime) const
+{
+    const int maxResultAge = m_settings->maxResultAge.load(std::memory_order_relaxed);
+    return maxResultAge > 0 && m_stats->now() - arrivalTime > qint64(maxResultAge) * 1000000;
+}
+
+void CocoDetectionWorkerPool::preprocessFrames()
+{
+    ThreadTuningState tuning;
+
+    forever {
+        InferenceScheduler::tuneStageThread(*m_settings, &tuning);
+
+        // wait for the previous input to be taken, then prepare the newest frame
+        m_readySlot.acquire();
+        if (m_stopRequested.load(std::memory_order_acquire)) {
+            break;
+        }
+
+        // no input of ours is ready, the model can be swapped before the next frame
+        updateQualityLevel();
+
+        QueuedFrame queued;
+        if (!m_frameQueue.pop(queued, m_stopRequested)) {
+            break;
+        }
+
+        const SourceImage& image = queued.frame->image();
+        computeTiles(image, &m_tiles);
+        const quint64 sequence = m_nextSequence++;
+        const qint64 queuedTime = m_stats->now() - queued.arrivalTime;
+
+        // every tile goes to the interpreters like a frame of its own, all of them reach the
+        // postprocess stage (failed ones as such) so it knows when the frame is complete
+        for (int tile = 0; tile < m_tiles.size(); tile++) {
+            if (tile > 0) {
+                m_readySlot.acquire();
+                if (m_stopRequested.load(std::memory_order_acquire)) {
+                    return;
+                }
+            }
+
+            // at most one input is ready or in here, the others are held by the interpreters; the
+            // scheduler gives them no more inputs than there are buffers, the wait is only a safeguard
+            InputBuffer* input = nullptr;
+            if (!m_freeInputs.pop(input, m_stopRequested)) {
+                return;
+            }
+
+            const qint64 preprocessStart = m_stats->now();
+
+            const QRect& tileRect = m_tiles.at(tile);
+            const SourceImage tileImage = image.cropped(tileRect.x(), tileRect.y(), tileRect.width(), tileRect.height());
+            input->valid = m_preprocessor.process(tileImage, input->data.data());
+            if (!input->valid) {
+                qCWarning(objectworker) << "Cannot preprocess image of size" << tileImage.width << "x" << tileImage.height
+                                        << "- Incompatible Model loaded?";
+            }
+
+            input->sequence = sequence;
+            input->tile.index = tile;
+            input->tile.count = m_tiles.size();
+            input->tile.rect = QRectF(double(tileRect.x()) / image.width, double(tileRect.y()) / image.height,
+                                      double(tileRect.width()) / image.width, double(tileRect.height()) / image.height);
+            input->arrivalTime = queued.arrivalTime;
+            input->rotation = image.rotation;
+            input->level = m_activeLevel.load(std::memory_order_relaxed);
+            input->decoder = m_levelDecoder;
+            input->queuedTime = queuedTime;
+            input->readyTime = m_stats->now();
+            m_stats->record(PipelineStats::Preprocess, input->readyTime - preprocessStart);
+
+            // hand the frame back to the pool before the interpreter even starts
+            if (tile + 1 == m_tiles.size()) {
+                queued.frame.reset();
+            }
+            m_readyInputs.tryPush(input);
+            m_scheduler->notify();
+        }
+    }
+}
+
+void CocoDetectionWorkerPool::computeTiles(const SourceImage& image, QVector<QRect>* tiles) const
+{
+    tiles->clear();
+
+    // the region of interest in pixels, the whole frame if there is none
+    QRect region(0, 0, image.width, image.height);
+    const double regionWidth = m_settings->regionWidth.load(std::memory_order_relaxed);
+    const double regionHeight = m_settings->regionHeight.load(std::memory_order_relaxed);
+    if (regionWidth > 0.0 && regionHeight > 0.0) {
+        const QRectF normalized(m_settings->regionX.load(std::memory_order_relaxed),
+                                m_settings->regionY.load(std::memory_order_relaxed), regionWidth, regionHeight);
+        const QRect pixels(qRound(normalized.x() * image.width), qRound(normalized.y() * image.height),
+                           qRound(normalized.width() * image.width), qRound(normalized.height() * image.height));
+        region = pixels.intersected(region);
+        if (region.width() < 2 || region.height() < 2) {
+            region = QRect(0, 0, image.width, image.height);
+        }
+    }
+
+    const int columns = std::max(1, m_settings->tileColumns.load(std::memory_order_relaxed));
+    const int rows = std::max(1, m_settings->tileRows.load(std::memory_order_relaxed));
+    const double overlap = qBound(0.0, m_settings->tileOverlap.load(std::memory_order_relaxed), 0.5);
+
+    // columns tiles of tileWidth with (columns - 1) overlaps cover the region exactly
+    const double tileWidth = region.width() / (columns - (columns - 1) * overlap);
+    const double tileHeight = region.height() / (rows - (rows - 1) * overlap);
+    const double stepX = tileWidth * (1.0 - overlap);
+    const double stepY = tileHeight * (1.0 - overlap);
+
+    for (int row = 0; row < rows; row++) {
+        for (int column = 0; column < columns; column++) {
+            const int left = (region.x() + qRound(column * stepX)) & ~1;
+            const int top = (region.y() + qRound(row * stepY)) & ~1;
+            const int right = std::min(region.x() + qRound(column * stepX + tileWidth), image.width);
+            const int bottom = std::min(region.y() + qRound(row * stepY + tileHeight), image.height);
+            const QRect tile(left, top, (right - left) & ~1, (bottom - top) & ~1);
+            if (!tile.isEmpty()) {
+                tiles->append(tile);
+            }
+        }
+    }
+
+    if (tiles->isEmpty()) {
+        tiles->append(QRect(0, 0, image.width, image.height));
+    }
+}
+
+bool CocoDetectionWorkerPool::takeJob(Job* job)
+{
+    // the scheduler serializes the takes, so what is popped here can be pushed back
+    OutputBuffer* result = nullptr;
+    if (!m_freeOutputs.tryPop(result)) {
+        return false;
+    }
+    InputBuffer* input = nullptr;
+    if (!m_readyInputs.tryPop(input)) {
+        m_freeOutputs.tryPush(result);
+        return false;
+    }
+    m_readySlot.release();
+
+    const qint64 invokeStart = m_stats->now();
+    m_stats->record(PipelineStats::Queued, input->queuedTime + invokeStart - input->readyTime);
+
+    result->input = input;
+    result->invokeStart = invokeStart;
+    result->sequence = input->sequence;
+    result->tile = input->tile;
+    result->arrivalTime = input->arrivalTime;
+    result->rotation = input->rotation;
+    result->level = input->level;
+    result->decoder = input->decoder;
+
+    // a frame that waited too long is not worth an inference, but the reorder stage still needs to hear of it
+    const bool stale = isTooOld(input->arrivalTime);
+    if (stale && input->tile.index == 0) {
+        m_stats->droppedFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    job->input = input->valid && !stale ? &input->data : nullptr;
+    job->output = &result->output;
+    job->context = result;
+    return true;
+}
+
+void CocoDetectionWorkerPool::finishJob(const Job& job, bool succeeded)
+{
+    OutputBuffer* result = static_cast<OutputBuffer*>(job.context);
+    if (succeeded) {
+        m_stats->record(PipelineStats::Invoke, m_stats->now() - result->invokeStart);
+    }
+
+    // the preprocessor may fill the staging buffer again
+    m_freeInputs.push(result->input);
+    result->input = nullptr;
+
+    result->succeeded = succeeded;
+    m_outputs.push(result);
+}
+
+int CocoDetectionWorkerPool::weight() const
+{
+    return m_settings->streamWeight.load(std::memory_order_relaxed);
+}
+
+int CocoDetectionWorkerPool::maxJobsInFlight() const
+{
+    // one input more than this is allocated, so the preprocessor always has one to fill
+    return m_interpreterCount.load(std::memory_order_relaxed);
+}
+
+void CocoDetectionWorkerPool::postprocessOutputs()
+{
+    ThreadTuningState tuning;
+
+    forever {
+        InferenceScheduler::tuneStageThread(*m_settings, &tuning);
+
+        OutputBuffer* output = nullptr;
+        if (!m_outputs.pop(output, m_stopRequested)) {
+            break;
+        }
+
+        PendingResult& result = m_tileResult;
+        result.sequence = output->sequence;
+        result.arrivalTime = output->arrivalTime;
+        result.level = output->level;
+        result.succeeded = output->succeeded;
+        result.missingTiles = output->tile.count - 1;
+        result.detectedObjects.clear();
+        if (result.succeeded) {
+            const qint64 decodeStart = m_stats->now();
+            if (output->decoder != m_decoderSource) {
+                // the first output of another quality level, its model may have other anchors and classes
+                m_decoderSource = output->decoder;
+                m_decoder = *m_decoderSource;
+                m_classFilter.reset();
+            }
+            updateDecoder();
+            result.detectedObjects.reserve(m_decoder.maxDetections());
+            m_decoder.decode(output->output, output->rotation, &result.detectedObjects);
+
+            // boxes are relative to the tile, move them into the frame
+            const QRectF& tileRect = output->tile.rect;
+            for (auto& detectedObject : result.detectedObjects) {
+                const QRectF& box = detectedObject.boundingRect;
+                detectedObject.boundingRect = QRectF(tileRect.x() + box.x() * tileRect.width(),
+                                                     tileRect.y() + box.y() * tileRect.height(),
+                                                     box.width() * tileRect.width(), box.height() * tileRect.height());
+            }
+            m_stats->record(PipelineStats::Decode, m_stats->now() - decodeStart);
+        }
+
+        const Tile tile = output->tile;
+        m_freeOutputs.tryPush(output);
+        // the scheduler may have skipped an input of ours for lack of an output
+        std::atomic_load(&m_scheduler)->notify();
+        handleResult(tile, &result);
+    }
+}
+
+void CocoDetectionWorkerPool::updateDecoder()
+{
+    m_decoder.setScoreThreshold(static_cast<float>(m_settings->detectionThreshold.load(std::memory_order_relaxed)));
+    m_decoder.setIouThreshold(static_cast<float>(m_settings->nmsThreshold.load(std::memory_order_relaxed)));
+    m_decoder.setMaxDetections(m_settings->maxDetections.load(std::memory_order_relaxed));
+
+    // the filter replaces the list as a whole, an unchanged pointer is an unchanged list
+    std::shared_ptr<const QVector<int>> classFilter = std::atomic_load(&m_settings->classFilter);
+    if (classFilter != m_classFilter) {
+        m_classFilter = std::move(classFilter);
+        m_decoder.setClassFilter(m_classFilter ? *m_classFilter : QVector<int>());
+    }
+}
+
+void CocoDetectionWorkerPool::handleResult(const Tile& tile, PendingResult* result)
+{
+    if (result->sequence < m_nextSequenceToPublish) {
+        // we stopped waiting for this frame, newer results are already visible
+        return;
+    }
+
+    // the other tiles of the frame may already be here
+    PendingResult* pending = nullptr;
+    if (tile.count > 1) {
+        for (auto& candidate : m_pendingResults) {
+            if (candidate.used && candidate.sequence == result->sequence) {
+                pending = &candidate;
+                break;
+            }
+        }
+    }
+
+    if (pending) {
+        pending->detectedObjects += result->detectedObjects;
+        pending->succeeded = pending->succeeded && result->succeeded;
+        pending->missingTiles--;
+    } else {
+        // swapped rather than copied, the free slot's vector becomes the one the next output is decoded into
+        pending = freePendingResult();
+        std::swap(*pending, *result);
+        pending->used = true;
+        // room for the other tiles of the frame
+        pending->detectedObjects.reserve(tile.count * m_decoder.maxDetections());
+    }
+
+    if (pending->missingTiles == 0 && tile.count > 1 && pending->succeeded) {
+        // an object on a seam was found by both tiles, possibly cut in one of them
+        NonMaximumSuppression::apply(&pending->detectedObjects, TileMergeThreshold,
+                                     NonMaximumSuppression::Overlap::IntersectionOverMinimum, true);
+    }
+
+    // a stalled frame must not hold back the newer ones forever: once every
+    // worker has delivered a newer frame, skip ahead to the oldest one we have
+    int complete = 0;
+    quint64 oldest = std::numeric_limits<quint64>::max();
+    for (const auto& candidate : m_pendingResults) {
+        if (candidate.used && candidate.missingTiles == 0) {
+            complete++;
+            oldest = std::min(oldest, candidate.sequence);
+        }
+    }
+    if (complete > m_interpreterCount) {
+        m_nextSequenceToPublish = oldest;
+    }
+
+    publishInOrder();
+}
+
+CocoDetectionWorkerPool::PendingResult* CocoDetectionWorkerPool::freePendingResult()
+{
+    for (auto& candidate : m_pendingResults) {
+        if (!candidate.used) {
+            return &candidate;
+        }
+    }
+    // more frames in flight than slots, e.g. after a quality level brought more interpreters
+    m_pendingResults.emplace_back();
+    return &m_pendingResults.back();
+}
+
+void CocoDetectionWorkerPool::publishInOrder()
+{
+    // frames we skipped will not be completed any more
+    for (auto& candidate : m_pendingResults) {
+        if (candidate.used && candidate.sequence < m_nextSequenceToPublish) {
+            candidate.used = false;
+            candidate.detectedObjects.clear();
+        }
+    }
+
+    bool published = true;
+    while (published) {
+        published = false;
+        for (auto& result : m_pendingResults) {
+            if (!result.used || result.sequence != m_nextSequenceToPublish || result.missingTiles > 0) {
+                continue;
+            }
+
+            if (result.succeeded) {
+                m_stats->inferredFrames.fetch_add(1, std::memory_order_relaxed);
+                updateQualityController(result);
+            }
+            if (result.succeeded && isTooOld(result.arrivalTime)) {
+                qCDebug(objectworker) << "Discarding result of frame" << result.sequence << "- too old";
+                m_stats->discardedResults.fetch_add(1, std::memory_order_relaxed);
+            } else if (result.succeeded && m_settings->tracking.load(std::memory_order_relaxed)) {
+                m_tracker.update(result.detectedObjects, result.arrivalTime);
+            } else if (result.succeeded) {
+                // the model update on the GUI thread completes the end to end latency
+                publish(result.detectedObjects, result.arrivalTime);
+            }
+
+            // the slot keeps the capacity of its vector
+            result.used = false;
+            result.detectedObjects.clear();
+            m_nextSequenceToPublish++;
+            published = true;
+            break;
+        }
+    }
+}
+
+void CocoDetectionWorkerPool::updateQualityController(const PendingResult& result)
+{
+    if (m_levelFiles.size() < 2) {
+        return;
+    }
+
+    const qint64 now = m_stats->now();
+    m_quality.setBudget(qint64(m_settings->latencyBudget.load(std::memory_order_relaxed)) * 1000000);
+
+    const quint64 failedLevels = m_failedLevels.load(std::memory_order_acquire);
+    if (failedLevels != m_knownFailedLevels) {
+        for (int level = 1; level < m_levelFiles.size(); level++) {
+            if (failedLevels & (quint64(1) << level)) {
+                m_quality.disableLevel(level);
+            }
+        }
+        m_knownFailedLevels = failedLevels;
+        // continue from the level the stream is still running at
+        m_quality.setLevel(m_activeLevel.load(std::memory_order_relaxed), now);
+    }
+
+    // frames of the previous level still come in after a step, they say nothing about the new one
+    if (result.level == m_quality.level()) {
+        m_requestedLevel.store(m_quality.update(now - result.arrivalTime, now), std::memory_order_relaxed);
+    }
+}
+
+void CocoDetectionWorkerPool::updateQualityLevel()
+{
+    const int requested = m_requestedLevel.load(std::memory_order_relaxed);
+    const int active = m_activeLevel.load(std::memory_order_relaxed);
+    if (requested == active || (m_failedLevels.load(std::memory_order_acquire) & (quint64(1) << requested))) {
+        // the controller may have changed its mind while the level was loading
+        m_pendingScheduler.reset();
+        return;
+    }
+
+    if (!m_pendingScheduler || m_pendingLevel != requested) {
+        // loads in the background (unless another stream runs the model already), the stream stays at its level
+        qCInfo(objectworker) << "Preparing quality level" << requested << m_levelFiles.at(requested);
+        m_pendingLevel = requested;
+        m_pendingScheduler = InferenceScheduler::acquire(m_levelFiles.at(requested), m_settings);
+        return;
+    }
+
+    const InferenceScheduler::Status status = m_pendingScheduler->status();
+    if (status == InferenceScheduler::Loading || status == InferenceScheduler::Warming) {
+        return;
+    }
+
+    const CocoDetectionWorker* prototype = m_pendingScheduler->prototype();
+    if (status == InferenceScheduler::Error
+        || !m_preprocessor.configure(prototype->inputWidth(), prototype->inputHeight(), prototype->inputChannels(),
+                                     prototype->inputType())) {
+        qCWarning(objectworker) << "Cannot switch to quality level" << requested << "- staying at level" << active;
+        const CocoDetectionWorker* current = m_scheduler->prototype();
+        m_preprocessor.configure(current->inputWidth(), current->inputHeight(), current->inputChannels(),
+                                 current->inputType());
+        m_failedLevels.fetch_or(quint64(1) << requested, std::memory_order_release);
+        m_pendingScheduler.reset();
+        return;
+    }
+
+    // once the jobs the old interpreters run are back every input is free, none is ready
+    std::shared_ptr<InferenceScheduler> previous = m_scheduler;
+    disconnect(previous.get(), nullptr, this, nullptr);
+    previous->removeStream(this);
+
+    for (auto& input : m_inputBuffers) {
+        input->data.resize(m_preprocessor.targetSize());
+    }
+    const int interpreterCount = std::min(m_pendingScheduler->interpreterCount(), maxInterpreterCount(*m_settings));
+    addBuffers(interpreterCount);
+    m_interpreterCount.store(interpreterCount, std::memory_order_relaxed);
+    m_levelDecoder = std::make_shared<const DetectionDecoder>(prototype->decoder());
+
+    {
+        QMutexLocker locker(&m_statusMutex);
+        std::atomic_store(&m_scheduler, std::move(m_pendingScheduler));
+    }
+    connect(m_scheduler.get(), &InferenceScheduler::statusChanged, this, [this]() { updateStatus(); },
+            Qt::DirectConnection);
+    m_scheduler->addStream(this);
+
+    m_activeLevel.store(requested, std::memory_order_relaxed);
+    qCInfo(objectworker) << "Switched to quality level" << requested << m_levelFiles.at(requested);
+    emit qualityLevelChanged(requested);
+    // the last stream of the previous model shuts its interpreters down here
+}
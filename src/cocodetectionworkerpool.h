@@ -0,0 +1,313 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __COCO_DETECTION_WORKER_POOL__
+#define __COCO_DETECTION_WORKER_POOL__
+
+#include "boundedqueue.h"
+#include "cocodetectionworker.h"
+#include "cocodetectionmodel.h"
+#include "cocodetectionsettings.h"
+#include "framebufferpool.h"
+#include "imagepreprocessor.h"
+#include "inferencescheduler.h"
+#include "objecttracker.h"
+#include "pipelinestats.h"
+#include "qualitycontroller.h"
+
+#include <QMutex>
+#include <QObject>
+#include <QPointer>
+#include <QRect>
+#include <QSemaphore>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/*
+ * Runs detection of one stream as a pipeline of stages connected by bounded
+ * lock-free queues:
+ *
+ *   video thread -> preprocess -> InferenceScheduler -> postprocess
+ *
+ * Only the newest captured frame waits for the preprocessor, older ones are
+ * dropped. The preprocessor prepares the next input in a staging buffer while
+ * the interpreters run, so the throughput is bounded by the slowest stage
+ * rather than the sum of all of them. The interpreters belong to the
+ * process-wide InferenceScheduler of the model, which serves every stream in
+ * turn. The postprocess stage decodes the raw outputs, restores the frame
+ * order and drops results that are older than
+ * CocoDetectionSettings::maxResultAge before publishing them.
+ *
+ * In tiled mode the preprocessor cuts the region of interest of a frame into
+ * tiles that the interpreters detect in parallel like separate frames; the
+ * postprocess stage maps the boxes back to the frame and merges the
+ * duplicates at the seams before the frame is published. With
+ * CocoDetectionSettings::tracking the results feed an ObjectTracker instead,
+ * whose predictions the video thread publishes for every frame.
+ *
+ * Every stage records its latency and the frame counters in PipelineStats.
+ *
+ * Every stage thread re-applies the threading settings (CPU affinity,
+ * priority and TFLite thread count) before its next frame when they change.
+ *
+ * With CocoDetectionSettings::latencyBudget the postprocess stage feeds the
+ * frame latencies to a QualityController, which picks a level of the quality
+ * ladder: the model and the lighter ones of setQualityLevels(). The
+ * preprocessor gets the scheduler of the picked model in the background and
+ * only switches to it once it is Ready, so the stream keeps running at the
+ * old level while the new one loads.
+ *
+ * Nothing is loaded by the constructor: start() gets the scheduler (loading
+ * the model if this is its first stream) on a loader thread. Frames
+ * submitted before the pool is Ready are ignored, statusChanged() reports the
+ * progress.
+ *
+ * Filters showing the same source (e.g. two VideoOutputs of one Camera) share
+ * one pool through forSource(): every frame is detected once, claimFrame()
+ * turns away the copies the other filters receive, and the results go to the
+ * detection models of all of them.
+ */
+class CocoDetectionWorkerPool : public QObject, private InferenceStream
+{
+    Q_OBJECT
+public:
+    enum Status {
+        Loading,
+        Warming,
+        Ready,
+        Error
+    };
+    Q_ENUM(Status)
+
+    CocoDetectionWorkerPool(const QString& modelFilename, const std::shared_ptr<CocoDetectionSettings>& settings,
+                            CocoDetectionModel* detectionModel = nullptr,
+                            const std::shared_ptr<PipelineStats>& stats = nullptr);
+    ~CocoDetectionWorkerPool();
+
+    // the pool of the source, shared with every filter that passes the same source and model;
+    // created with the settings and stats of the first one. An empty source is never shared.
+    static std::shared_ptr<CocoDetectionWorkerPool> forSource(const QString& source, const QString& modelFilename,
+                                                              const std::shared_ptr<CocoDetectionSettings>& settings,
+                                                              CocoDetectionModel* detectionModel,
+                                                              const std::shared_ptr<PipelineStats>& stats);
+
+    // lighter (smaller input or quantized) models to step down to, in order, when the frames
+    // miss the latency budget; only before start()
+    void setQualityLevels(const QStringList& modelFilenames);
+
+    // gets the scheduler of the model and starts the pipeline in the background, once
+    void start();
+
+    Status status() const { return static_cast<Status>(m_status.load(std::memory_order_acquire)); }
+    bool isReady() const { return status() == Ready; }
+    qint64 loadTime() const;
+    qint64 warmupTime() const;
+
+    // frame buffers the video thread needs: the queued, the preprocessed and the one being filled
+    static int frameBufferCount() { return 3; }
+
+    // interpreters of the scheduler, shared with its other streams
+    int workerCount() const { return isReady() ? m_interpreterCount.load(std::memory_order_relaxed) : 0; }
+
+    // level of the quality ladder running now, 0 is the model itself
+    int qualityLevel() const { return m_activeLevel.load(std::memory_order_relaxed); }
+
+    // further detection models the results are published to, e.g. of filters sharing the pool
+    void addDetectionModel(CocoDetectionModel* detectionModel);
+    void removeDetectionModel(CocoDetectionModel* detectionModel);
+
+    // called from a video thread: false if another filter of the source already claimed the frame
+    // with this start time (QVideoFrame::startTime()), which is detected once for all of them
+    bool claimFrame(qint64 startTime);
+
+    // called from a video thread, null if all buffers are in use
+    FrameBufferRef acquireFrame() { return m_framePool.acquire(); }
+
+    // called from a video thread, replaces a frame the preprocessor has not picked up yet;
+    // captureTime is PipelineStats::now() when the frame reached the filter
+    void submitFrame(FrameBufferRef frame, qint64 captureTime);
+
+    // called from the video thread while tracking, publishes the tracked boxes at captureTime
+    void publishTrackedObjects(qint64 captureTime);
+    // called from the video thread for frames that did not change, see ObjectTracker::hold()
+    void holdTrackedObjects(qint64 captureTime);
+
+signals:
+    // emitted from the loader and worker threads; the times are in ms, 0 until known
+    void statusChanged(int status, qint64 loadTime, qint64 warmupTime);
+    // emitted from the preprocess thread once it runs the level
+    void qualityLevelChanged(int level);
+
+private:
+    struct QueuedFrame {
+        FrameBufferRef frame;
+        qint64 arrivalTime = 0;
+    };
+
+    // part of a frame that is detected on its own
+    struct Tile {
+        int index = 0;
+        int count = 1;
+        // normalized frame coordinates of the tile
+        QRectF rect { 0.0, 0.0, 1.0, 1.0 };
+    };
+
+    // preprocessed input in the layout of the input tensor
+    struct InputBuffer {
+        std::vector<uint8_t> data;
+        bool valid = false;
+        quint64 sequence = 0;
+        Tile tile;
+        qint64 arrivalTime = 0;
+        // time the frame waited for the preprocessor, and when it was handed to the interpreters
+        qint64 queuedTime = 0;
+        qint64 readyTime = 0;
+        ImageRotation rotation = ImageRotation::None;
+        // of the model the input was prepared for
+        int level = 0;
+        std::shared_ptr<const DetectionDecoder> decoder;
+    };
+
+    struct OutputBuffer {
+        DetectionOutput output;
+        // the input while the scheduler runs it
+        InputBuffer* input = nullptr;
+        qint64 invokeStart = 0;
+        quint64 sequence = 0;
+        Tile tile;
+        qint64 arrivalTime = 0;
+        ImageRotation rotation = ImageRotation::None;
+        int level = 0;
+        std::shared_ptr<const DetectionDecoder> decoder;
+        bool succeeded = false;
+    };
+
+    struct PendingResult {
+        // false for a slot free for the next frame
+        bool used = false;
+        quint64 sequence = 0;
+        qint64 arrivalTime = 0;
+        int level = 0;
+        bool succeeded = false;
+        // tiles of the frame that have not been decoded yet
+        int missingTiles = 0;
+        QVector<CocoDetectionModel::DetectedObject> detectedObjects;
+    };
+
+    using ThreadTuningState = InferenceScheduler::ThreadTuningState;
+
+    void initialize();
+    // grows the inputs and outputs to what interpreterCount interpreters keep busy
+    void addBuffers(int interpreterCount);
+    // derives the status from the scheduler's and whether this pool is set up
+    void updateStatus();
+    // starts getting the scheduler of the requested level, switches to it once it is Ready
+    void updateQualityLevel();
+    // feeds the latency of a published frame to the quality controller
+    void updateQualityController(const PendingResult& result);
+
+    // InferenceStream, called by the scheduler's inference threads
+    bool takeJob(Job* job) override;
+    void finishJob(const Job& job, bool succeeded) override;
+    int weight() const override;
+    int maxJobsInFlight() const override;
+
+    void preprocessFrames();
+    void postprocessOutputs();
+    // applies threshold, NMS overlap, top-K and class filter of the settings to m_decoder
+    void updateDecoder();
+
+    // pixel rects of the tiles of a frame, even aligned so chroma subsampled frames can be cropped exactly
+    void computeTiles(const SourceImage& image, QVector<QRect>* tiles) const;
+
+    bool isTooOld(qint64 arrivalTime) const;
+    // takes the detections of result, leaving it with an empty vector to decode the next output into
+    void handleResult(const Tile& tile, PendingResult* result);
+    PendingResult* freePendingResult();
+    void publishInOrder();
+    void publish(const QVector<CocoDetectionModel::DetectedObject>& detectedObjects, qint64 captureTime);
+
+    std::shared_ptr<CocoDetectionSettings> m_settings;
+    QString m_modelFilename;
+
+    // written by the loader before the stage threads start, then replaced by the preprocessor when the
+    // quality level changes; other threads read it with std::atomic_load()
+    QThread* m_loader = nullptr;
+    std::shared_ptr<InferenceScheduler> m_scheduler;
+    std::atomic<int> m_interpreterCount { 0 };
+    std::vector<QThread*> m_threads;
+    QMutex m_statusMutex;
+    bool m_initialized = false;
+    std::atomic<int> m_status { Loading };
+
+    // arrival times are ns on its clock
+    std::shared_ptr<PipelineStats> m_stats;
+    std::atomic<bool> m_stopRequested { false };
+
+    // start time of the newest frame claimed by one of the filters sharing the pool, and their number
+    std::atomic<qint64> m_lastFrameTime { -1 };
+    std::atomic<int> m_subscribers { 0 };
+
+    // declared before the queues, frames still queued return to it on destruction
+    FrameBufferPool m_framePool;
+
+    // video thread -> preprocess
+    BlockingBoundedQueue<QueuedFrame> m_frameQueue;
+
+    // preprocess -> invoke; at most one input is ready or being prepared, so
+    // the preprocessor always picks the newest frame once an interpreter frees up
+    ImagePreprocessor m_preprocessor;
+    QSemaphore m_readySlot { 1 };
+    std::vector<std::unique_ptr<InputBuffer>> m_inputBuffers;
+    BlockingBoundedQueue<InputBuffer*> m_freeInputs;
+    BoundedQueue<InputBuffer*> m_readyInputs;
+    quint64 m_nextSequence = 0;
+    QVector<QRect> m_tiles;
+
+    // quality ladder, level 0 is m_modelFilename; the decoder and the pending scheduler belong to the preprocessor
+    QStringList m_levelFiles;
+    std::shared_ptr<const DetectionDecoder> m_levelDecoder;
+    std::shared_ptr<InferenceScheduler> m_pendingScheduler;
+    int m_pendingLevel = 0;
+    std::atomic<int> m_activeLevel { 0 };
+    // picked by the postprocess stage, and the levels whose model could not be loaded
+    std::atomic<int> m_requestedLevel { 0 };
+    std::atomic<quint64> m_failedLevels { 0 };
+
+    // invoke -> postprocess
+    std::vector<std::unique_ptr<OutputBuffer>> m_outputBuffers;
+    BoundedQueue<OutputBuffer*> m_freeOutputs;
+    BlockingBoundedQueue<OutputBuffer*> m_outputs;
+
+    // copy of the decoder of the outputs' model, only touched by the postprocess thread
+    DetectionDecoder m_decoder;
+    std::shared_ptr<const DetectionDecoder> m_decoderSource;
+    std::shared_ptr<const QVector<int>> m_classFilter;
+    QualityController m_quality;
+    quint64 m_knownFailedLevels = 0;
+
+    // reorder stage, only touched by the postprocess thread; the slots and their vectors are reused,
+    // once they grew to the most detections of a frame no output allocates any more
+    quint64 m_nextSequenceToPublish = 0;
+    std::vector<PendingResult> m_pendingResults;
+    PendingResult m_tileResult;
+    // the models published to, guarded by m_modelsMutex
+    QMutex m_modelsMutex;
+    QVector<QPointer<CocoDetectionModel>> m_detectionModels;
+
+    // updated by the postprocess thread, predicted by the video threads one at a time
+    ObjectTracker m_tracker;
+    QMutex m_trackedMutex;
+    QVector<CocoDetectionModel::DetectedObject> m_trackedObjects;
+};
+
+#endif // __COCO_DETECTION_WORKER_POOL__
@@ -0,0 +1,570 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "detectiondecoder.h"
+#include "cocodetectionworker.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// candidates that go into the NMS at most, relative to maxDetections
+const int CandidatesPerDetection = 20;
+const int MinCandidates = 100;
+
+// maps a normalized rect of the upright image back to the unrotated source frame
+QRectF unrotatedRect(const QRectF& rect, ImageRotation rotation)
+{
+    switch (rotation) {
+    case ImageRotation::Clockwise90:
+        return QRectF(rect.top(), 1.0 - rect.right(), rect.height(), rect.width());
+    case ImageRotation::Clockwise180:
+        return QRectF(1.0 - rect.right(), 1.0 - rect.bottom(), rect.width(), rect.height());
+    case ImageRotation::Clockwise270:
+        return QRectF(1.0 - rect.bottom(), rect.left(), rect.height(), rect.width());
+    default:
+        return rect;
+    }
+}
+
+float anchorScale(const SsdOptions& options, int layer)
+{
+    if (options.numLayers == 1) {
+        return (options.minScale + options.maxScale) / 2.0f;
+    }
+    return options.minScale + (options.maxScale - options.minScale) * layer / (options.numLayers - 1);
+}
+
+// true if any of the values reaches the threshold; the common case for a
+// background anchor is to scan the whole row and find nothing
+bool anyAtLeast(const float* values, int count, float threshold)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 limit = _mm_set1_ps(threshold);
+    for (; i + 8 <= count; i += 8) {
+        const __m128 a = _mm_cmpge_ps(_mm_loadu_ps(values + i), limit);
+        const __m128 b = _mm_cmpge_ps(_mm_loadu_ps(values + i + 4), limit);
+        if (_mm_movemask_ps(_mm_or_ps(a, b)) != 0) {
+            return true;
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const float32x4_t limit = vdupq_n_f32(threshold);
+    for (; i + 8 <= count; i += 8) {
+        const uint32x4_t mask = vorrq_u32(vcgeq_f32(vld1q_f32(values + i), limit),
+                                          vcgeq_f32(vld1q_f32(values + i + 4), limit));
+        const uint32x2_t folded = vorr_u32(vget_low_u32(mask), vget_high_u32(mask));
+        if ((vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1)) != 0) {
+            return true;
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        if (values[i] >= threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool anyAtLeast(const uint8_t* values, int count, int threshold)
+{
+    if (threshold <= 0) {
+        return count > 0;
+    }
+    if (threshold > 255) {
+        return false;
+    }
+
+    int i = 0;
+#if defined(__SSE2__)
+    // max(v, t) == v  <=>  v >= t
+    const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold));
+    for (; i + 16 <= count; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, limit), v)) != 0) {
+            return true;
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t limit = vdupq_n_u8(static_cast<uint8_t>(threshold));
+    for (; i + 16 <= count; i += 16) {
+        const uint8x16_t mask = vcgeq_u8(vld1q_u8(values + i), limit);
+        const uint8x8_t folded = vorr_u8(vget_low_u8(mask), vget_high_u8(mask));
+        if (vget_lane_u64(vreinterpret_u64_u8(folded), 0) != 0) {
+            return true;
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        if (values[i] >= threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool anyAtLeast(const int8_t* values, int count, int threshold)
+{
+    for (int i = 0; i < count; i++) {
+        if (values[i] >= threshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+float sigmoid(float x)
+{
+    return 1.0f / (1.0f + std::exp(-x));
+}
+
+} // namespace
+
+QString SsdOptions::fileFor(const QString& modelFilename)
+{
+    const QFileInfo info(modelFilename);
+    return info.dir().filePath(info.completeBaseName() + QStringLiteral(".anchors.json"));
+}
+
+bool SsdOptions::load(const QString& filename, SsdOptions* options)
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+    if (!document.isObject()) {
+        qCWarning(objectworker) << "Cannot parse" << filename << ":" << error.errorString();
+        return false;
+    }
+
+    const QJsonObject object = document.object();
+    auto readInt = [&object](const char* key, int* value) {
+        *value = object.value(QLatin1String(key)).toInt(*value);
+    };
+    auto readFloat = [&object](const char* key, float* value) {
+        *value = static_cast<float>(object.value(QLatin1String(key)).toDouble(*value));
+    };
+    auto readBool = [&object](const char* key, bool* value) {
+        *value = object.value(QLatin1String(key)).toBool(*value);
+    };
+
+    readInt("inputWidth", &options->inputWidth);
+    readInt("inputHeight", &options->inputHeight);
+    readInt("numLayers", &options->numLayers);
+    readFloat("minScale", &options->minScale);
+    readFloat("maxScale", &options->maxScale);
+    readFloat("interpolatedScaleAspectRatio", &options->interpolatedScaleAspectRatio);
+    readBool("reduceBoxesInLowestLayer", &options->reduceBoxesInLowestLayer);
+    readFloat("yScale", &options->yScale);
+    readFloat("xScale", &options->xScale);
+    readFloat("heightScale", &options->heightScale);
+    readFloat("widthScale", &options->widthScale);
+    readBool("backgroundClass", &options->backgroundClass);
+    readBool("sigmoidScores", &options->sigmoidScores);
+
+    if (object.contains(QLatin1String("strides"))) {
+        options->strides.clear();
+        for (const QJsonValue& stride : object.value(QLatin1String("strides")).toArray()) {
+            options->strides << stride.toInt();
+        }
+    }
+    if (object.contains(QLatin1String("aspectRatios"))) {
+        options->aspectRatios.clear();
+        for (const QJsonValue& aspectRatio : object.value(QLatin1String("aspectRatios")).toArray()) {
+            options->aspectRatios << static_cast<float>(aspectRatio.toDouble());
+        }
+    }
+
+    qCInfo(objectworker) << "Read the SSD anchor options from" << filename;
+    return true;
+}
+
+int SsdOptions::anchorCount() const
+{
+    int count = 0;
+    for (int layer = 0; layer < numLayers && layer < strides.size(); layer++) {
+        if (strides.at(layer) <= 0) {
+            return 0;
+        }
+        const int rows = (inputHeight + strides.at(layer) - 1) / strides.at(layer);
+        const int columns = (inputWidth + strides.at(layer) - 1) / strides.at(layer);
+        int perCell = 3;
+        if (layer > 0 || !reduceBoxesInLowestLayer) {
+            perCell = aspectRatios.size() + (interpolatedScaleAspectRatio > 0.0f ? 1 : 0);
+        }
+        count += rows * columns * perCell;
+    }
+    return count;
+}
+
+void DetectionDecoder::configurePostProcessed()
+{
+    m_format = PostProcessed;
+    m_numClasses = 0;
+    m_anchors.clear();
+    m_candidates.clear();
+    m_candidateCount = 0;
+}
+
+bool DetectionDecoder::configureRawSsd(const SsdOptions& options, int numAnchors, int numClasses)
+{
+    if (options.numLayers < 1 || options.strides.size() < options.numLayers || numClasses < 1) {
+        qCWarning(objectworker) << "Invalid SSD anchor options";
+        return false;
+    }
+    if (options.anchorCount() != numAnchors) {
+        qCWarning(objectworker) << "The SSD anchor options give" << options.anchorCount() << "anchors, the model has"
+                                << numAnchors;
+        return false;
+    }
+
+    m_format = RawSsd;
+    m_options = options;
+    m_numClasses = numClasses;
+    m_anchors.clear();
+    m_anchors.reserve(numAnchors);
+
+    // same generator as the TF object detection API's multiple_grid_anchor_generator, layers
+    // sharing a stride are merged into one grid
+    QVector<float> aspectRatios;
+    QVector<float> scales;
+    int layer = 0;
+    while (layer < options.numLayers) {
+        aspectRatios.clear();
+        scales.clear();
+
+        int sameStrideLayer = layer;
+        while (sameStrideLayer < options.numLayers
+               && options.strides.at(sameStrideLayer) == options.strides.at(layer)) {
+            const float scale = anchorScale(options, sameStrideLayer);
+            if (sameStrideLayer == 0 && options.reduceBoxesInLowestLayer) {
+                aspectRatios << 1.0f << 2.0f << 0.5f;
+                scales << 0.1f << scale << scale;
+            } else {
+                for (float aspectRatio : options.aspectRatios) {
+                    aspectRatios << aspectRatio;
+                    scales << scale;
+                }
+                if (options.interpolatedScaleAspectRatio > 0.0f) {
+                    const float nextScale = sameStrideLayer == options.numLayers - 1
+                                                ? 1.0f
+                                                : anchorScale(options, sameStrideLayer + 1);
+                    scales << std::sqrt(scale * nextScale);
+                    aspectRatios << options.interpolatedScaleAspectRatio;
+                }
+            }
+            sameStrideLayer++;
+        }
+
+        const int stride = options.strides.at(layer);
+        const int rows = (options.inputHeight + stride - 1) / stride;
+        const int columns = (options.inputWidth + stride - 1) / stride;
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < columns; x++) {
+                for (int i = 0; i < scales.size(); i++) {
+                    const float ratio = std::sqrt(aspectRatios.at(i));
+                    m_anchors.push_back(Anchor { (x + 0.5f) / columns, (y + 0.5f) / rows,
+                                                 scales.at(i) * ratio, scales.at(i) / ratio });
+                }
+            }
+        }
+        layer = sameStrideLayer;
+    }
+
+    if (static_cast<int>(m_anchors.size()) != numAnchors) {
+        qCWarning(objectworker) << "Generated" << m_anchors.size() << "anchors, the model has" << numAnchors;
+        configurePostProcessed();
+        return false;
+    }
+
+    m_candidates.resize(m_anchors.size());
+    m_candidateCount = 0;
+    // the score row indices depend on the background class
+    setClassFilter(QVector<int>(m_classes));
+    return true;
+}
+
+void DetectionDecoder::setScoreThreshold(float scoreThreshold)
+{
+    m_scoreThreshold = scoreThreshold;
+}
+
+void DetectionDecoder::setIouThreshold(float iouThreshold)
+{
+    m_iouThreshold = iouThreshold;
+}
+
+void DetectionDecoder::setMaxDetections(int maxDetections)
+{
+    m_maxDetections = std::max(1, maxDetections);
+    m_keptBoxes.reserve(m_maxDetections);
+    m_keptClasses.reserve(m_maxDetections);
+}
+
+void DetectionDecoder::setClassFilter(const QVector<int>& classes)
+{
+    m_classes = classes;
+    m_filterClasses = !classes.isEmpty();
+    m_classAllowed.clear();
+    m_allowedScoreIndices.clear();
+
+    const int scoreOffset = m_options.backgroundClass ? 1 : 0;
+    for (int classIndex : classes) {
+        if (classIndex < 0) {
+            continue;
+        }
+        if (classIndex >= static_cast<int>(m_classAllowed.size())) {
+            m_classAllowed.resize(classIndex + 1, false);
+        }
+        if (m_classAllowed[classIndex]) {
+            continue;
+        }
+        m_classAllowed[classIndex] = true;
+        if (m_format == RawSsd && classIndex + scoreOffset < m_numClasses) {
+            m_allowedScoreIndices.push_back(classIndex + scoreOffset);
+        }
+    }
+}
+
+bool DetectionDecoder::isAllowed(int classIndex) const
+{
+    return !m_filterClasses
+           || (classIndex >= 0 && classIndex < static_cast<int>(m_classAllowed.size()) && m_classAllowed[classIndex]);
+}
+
+void DetectionDecoder::decode(const DetectionOutput& output, ImageRotation rotation,
+                              QVector<CocoDetectionModel::DetectedObject>* detectedObjects, int batchIndex,
+                              int batchSize)
+{
+    detectedObjects->clear();
+
+    if (batchSize < 1 || batchIndex < 0 || batchIndex >= batchSize) {
+        return;
+    }
+
+    if (m_format == RawSsd) {
+        decodeRawSsd(output, rotation, detectedObjects, batchIndex, batchSize);
+    } else {
+        decodePostProcessed(output, rotation, detectedObjects, batchIndex, batchSize);
+    }
+}
+
+void DetectionDecoder::decodePostProcessed(const DetectionOutput& output, ImageRotation rotation,
+                                           QVector<CocoDetectionModel::DetectedObject>* detectedObjects,
+                                           int batchIndex, int batchSize)
+{
+    if (output.count.size() < batchSize) {
+        return;
+    }
+
+    // every output holds batchSize equally sized slices
+    const int maxDetections = std::min(output.classes.size(), output.scores.size()) / batchSize;
+    const int first = batchIndex * maxDetections;
+
+    // never trust the count beyond what the other outputs hold
+    int count = static_cast<int>(output.count.value(batchIndex));
+    count = std::min(count, maxDetections);
+    count = std::min(count, output.locations.size() / (4 * batchSize));
+
+    // quantized scores are compared in their raw form
+    const bool floatScores = output.scores.type == kTfLiteFloat32;
+    const int rawThreshold = floatScores ? 0 : output.scores.quantizedThreshold(m_scoreThreshold);
+
+    // the post processing op sorts by score, so the first maxDetections that pass are the best ones
+    for (int slot = 0; slot < count && detectedObjects->size() < m_maxDetections; slot++) {
+        const int detectionIndex = first + slot;
+
+        if (floatScores ? output.scores.value(detectionIndex) < m_scoreThreshold
+                        : output.scores.rawValue(detectionIndex) < rawThreshold) {
+            continue;
+        }
+
+        const int classIndex = static_cast<int>(output.classes.value(detectionIndex));
+        if (!isAllowed(classIndex)) {
+            continue;
+        }
+
+        const float score = output.scores.value(detectionIndex);
+        const float top    = output.locations.value(4 * detectionIndex);
+        const float left   = output.locations.value(4 * detectionIndex + 1);
+        const float bottom = output.locations.value(4 * detectionIndex + 2);
+        const float right  = output.locations.value(4 * detectionIndex + 3);
+
+        // the model saw the upright image, report the box in frame coordinates
+        const QRectF boundingRect = unrotatedRect(QRectF(left, top, right - left, bottom - top), rotation);
+        qCDebug(objectworker) << "Found object" << classIndex << "with score" << score << "at:" << boundingRect;
+
+        CocoDetectionModel::DetectedObject detectedObject;
+        detectedObject.classIndex = classIndex;
+        detectedObject.score = score;
+        detectedObject.boundingRect = boundingRect;
+
+        *detectedObjects << detectedObject;
+    }
+}
+
+template <typename T, typename Threshold>
+void DetectionDecoder::collectCandidates(const T* scores, Threshold threshold)
+{
+    const int numAnchors = static_cast<int>(m_anchors.size());
+    const int firstClass = m_options.backgroundClass ? 1 : 0;
+    const int* allowed = m_allowedScoreIndices.data();
+    const int allowedCount = static_cast<int>(m_allowedScoreIndices.size());
+
+    m_candidateCount = 0;
+    for (int anchor = 0; anchor < numAnchors; anchor++) {
+        const T* row = scores + static_cast<size_t>(anchor) * m_numClasses;
+
+        int best = -1;
+        if (m_filterClasses) {
+            // only the classes of interest are looked at
+            for (int i = 0; i < allowedCount; i++) {
+                const int index = allowed[i];
+                if (row[index] >= threshold && (best < 0 || row[index] > row[best])) {
+                    best = index;
+                }
+            }
+        } else if (anyAtLeast(row + firstClass, m_numClasses - firstClass, threshold)) {
+            best = firstClass;
+            for (int index = firstClass + 1; index < m_numClasses; index++) {
+                if (row[index] > row[best]) {
+                    best = index;
+                }
+            }
+        }
+
+        if (best >= 0) {
+            // still raw, the conversion to a score is monotonic and only done for what gets reported
+            m_candidates[m_candidateCount++] = Candidate { anchor, best, static_cast<float>(row[best]) };
+        }
+    }
+}
+
+void DetectionDecoder::decodeRawSsd(const DetectionOutput& output, ImageRotation rotation,
+                                    QVector<CocoDetectionModel::DetectedObject>* detectedObjects, int batchIndex,
+                                    int batchSize)
+{
+    const int numAnchors = static_cast<int>(m_anchors.size());
+    if (numAnchors == 0 || output.locations.size() < 4 * numAnchors * batchSize
+        || output.scores.size() < numAnchors * m_numClasses * batchSize) {
+        return;
+    }
+    if (m_filterClasses && m_allowedScoreIndices.empty()) {
+        return;
+    }
+
+    // compare in the domain of the tensor: logits and/or quantized values
+    const float threshold = qBound(1e-6f, m_scoreThreshold, 1.0f - 1e-6f);
+    const float domainThreshold = m_options.sigmoidScores ? std::log(threshold / (1.0f - threshold)) : threshold;
+
+    const size_t scoreOffset = static_cast<size_t>(batchIndex) * numAnchors * m_numClasses;
+    switch (output.scores.type) {
+    case kTfLiteFloat32:
+        collectCandidates(reinterpret_cast<const float*>(output.scores.data.data()) + scoreOffset, domainThreshold);
+        break;
+    case kTfLiteUInt8:
+        collectCandidates(output.scores.data.data() + scoreOffset, output.scores.quantizedThreshold(domainThreshold));
+        break;
+    case kTfLiteInt8:
+        collectCandidates(reinterpret_cast<const int8_t*>(output.scores.data.data()) + scoreOffset,
+                          output.scores.quantizedThreshold(domainThreshold));
+        break;
+    default:
+        return;
+    }
+
+    // heap based partial sort, the NMS only ever looks at the best candidates
+    const int candidateLimit = std::min(m_candidateCount,
+                                        std::max(MinCandidates, m_maxDetections * CandidatesPerDetection));
+    auto byScore = [](const Candidate& a, const Candidate& b) {
+        return a.score > b.score || (a.score == b.score && a.anchor < b.anchor);
+    };
+    std::partial_sort(m_candidates.begin(), m_candidates.begin() + candidateLimit,
+                      m_candidates.begin() + m_candidateCount, byScore);
+
+    const bool quantized = output.scores.type != kTfLiteFloat32;
+    const int firstClass = m_options.backgroundClass ? 1 : 0;
+    const int boxOffset = batchIndex * numAnchors;
+
+    m_keptBoxes.clear();
+    m_keptClasses.clear();
+    for (int i = 0; i < candidateLimit && static_cast<int>(m_keptBoxes.size()) < m_maxDetections; i++) {
+        const Candidate& candidate = m_candidates[i];
+        const int classIndex = candidate.scoreIndex - firstClass;
+
+        // boxes are only decoded for candidates that made it this far
+        const QRectF box = decodeBox(output, boxOffset + candidate.anchor, m_anchors[candidate.anchor]);
+        if (box.isEmpty()) {
+            continue;
+        }
+
+        bool suppressed = false;
+        for (size_t kept = 0; kept < m_keptBoxes.size(); kept++) {
+            if (m_keptClasses[kept] == classIndex
+                && CocoDetectionModel::intersectionOverUnion(m_keptBoxes[kept], box) > m_iouThreshold) {
+                suppressed = true;
+                break;
+            }
+        }
+        if (suppressed) {
+            continue;
+        }
+        m_keptBoxes.push_back(box);
+        m_keptClasses.push_back(classIndex);
+
+        float score = quantized ? (candidate.score - output.scores.zeroPoint) * output.scores.scale : candidate.score;
+        if (m_options.sigmoidScores) {
+            score = sigmoid(score);
+        }
+
+        // the model saw the upright image, report the box in frame coordinates
+        const QRectF boundingRect = unrotatedRect(box, rotation);
+        qCDebug(objectworker) << "Found object" << classIndex << "with score" << score << "at:" << boundingRect;
+
+        CocoDetectionModel::DetectedObject detectedObject;
+        detectedObject.classIndex = classIndex;
+        detectedObject.score = score;
+        detectedObject.boundingRect = boundingRect;
+
+        *detectedObjects << detectedObject;
+    }
+}
+
+QRectF DetectionDecoder::decodeBox(const DetectionOutput& output, int boxIndex, const Anchor& anchor) const
+{
+    const float ty = output.locations.value(4 * boxIndex);
+    const float tx = output.locations.value(4 * boxIndex + 1);
+    const float th = output.locations.value(4 * boxIndex + 2);
+    const float tw = output.locations.value(4 * boxIndex + 3);
+
+    const float centerY = ty / m_options.yScale * anchor.height + anchor.y;
+    const float centerX = tx / m_options.xScale * anchor.width + anchor.x;
+    const float height = std::exp(th / m_options.heightScale) * anchor.height;
+    const float width = std::exp(tw / m_options.widthScale) * anchor.width;
+
+    const QRectF box(centerX - width / 2.0f, centerY - height / 2.0f, width, height);
+    return box.intersected(QRectF(0.0, 0.0, 1.0, 1.0));
+}
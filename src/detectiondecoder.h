@@ -0,0 +1,161 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DETECTION_DECODER__
+#define __DETECTION_DECODER__
+
+#include "cocodetectionmodel.h"
+#include "imagepreprocessor.h"
+
+#include <QString>
+#include <QVector>
+
+#include <vector>
+
+struct DetectionOutput;
+
+/*
+ * Anchors and box coder of an SSD model exported without
+ * TFLite_Detection_PostProcess. The defaults are those of the TF object
+ * detection API's ssd_mobilenet_v1 (6 layers, 1917 anchors at 300x300);
+ * other models describe theirs in a JSON file next to the .tflite (see
+ * fileFor()) with the same keys as the members, e.g.
+ *
+ *   { "numLayers": 6, "minScale": 0.2, "maxScale": 0.95, "strides": [16, 32, 64, 128, 256, 512] }
+ */
+struct SsdOptions
+{
+    // the input size only defines the feature map sizes
+    int inputWidth = 300;
+    int inputHeight = 300;
+    int numLayers = 6;
+    float minScale = 0.2f;
+    float maxScale = 0.95f;
+    QVector<int> strides { 16, 32, 64, 128, 256, 512 };
+    QVector<float> aspectRatios { 1.0f, 2.0f, 0.5f, 3.0f, 1.0f / 3.0f };
+    // extra anchor per cell with the geometric mean of this and the next layer's scale, 0 disables it
+    float interpolatedScaleAspectRatio = 1.0f;
+    // the first layer only gets three anchors (0.1 at 1:1, scale at 2:1 and 1:2)
+    bool reduceBoxesInLowestLayer = true;
+
+    // box encodings are (ty, tx, th, tw) divided by these
+    float yScale = 10.0f;
+    float xScale = 10.0f;
+    float heightScale = 5.0f;
+    float widthScale = 5.0f;
+
+    // class 0 of the scores is the background and never reported
+    bool backgroundClass = true;
+    // the scores are logits, thresholds are compared in the logit domain and only survivors go through the sigmoid
+    bool sigmoidScores = true;
+
+    // <model>.anchors.json, e.g. ssd.anchors.json for ssd.tflite
+    static QString fileFor(const QString& modelFilename);
+    // reads the keys present in the file over the values in options, false if it is missing or broken
+    static bool load(const QString& filename, SsdOptions* options);
+
+    int anchorCount() const;
+};
+
+/*
+ * Turns the output tensors of a detection model into detected objects. Two
+ * kinds of models are understood:
+ *
+ *  - PostProcessed: the graph ends in TFLite_Detection_PostProcess (boxes,
+ *    classes, scores, count), only thresholding and the class filter are left
+ *  - RawSsd: the graph outputs the box encodings and class scores of every
+ *    anchor. Anchors are generated once from SsdOptions; decode() rejects
+ *    anchors whose best class stays below the threshold with a vectorized
+ *    pass over the raw (logit or quantized) scores, decodes only the boxes of
+ *    the survivors and runs a class-aware greedy NMS up to maxDetections.
+ *
+ * All buffers are sized by configure*(), decode() does not allocate apart
+ * from growing the result vector the first time. A decoder is not thread-safe,
+ * every thread decoding in parallel owns a copy.
+ */
+class DetectionDecoder
+{
+public:
+    enum Format {
+        PostProcessed,
+        RawSsd
+    };
+
+    void configurePostProcessed();
+    // false if the options do not produce numAnchors anchors
+    bool configureRawSsd(const SsdOptions& options, int numAnchors, int numClasses);
+
+    Format format() const { return m_format; }
+    int numAnchors() const { return static_cast<int>(m_anchors.size()); }
+    int numClasses() const { return m_numClasses; }
+
+    float scoreThreshold() const { return m_scoreThreshold; }
+    void setScoreThreshold(float scoreThreshold);
+    // boxes of the same class overlapping more than this are suppressed (RawSsd only)
+    float iouThreshold() const { return m_iouThreshold; }
+    void setIouThreshold(float iouThreshold);
+    // at most this many objects per frame, the best scoring ones
+    int maxDetections() const { return m_maxDetections; }
+    void setMaxDetections(int maxDetections);
+    // class indices (as reported in DetectedObject::classIndex) to report, empty reports all;
+    // allocates, call it when the list changes and not per frame
+    void setClassFilter(const QVector<int>& classes);
+
+    // decodes frame batchIndex of a batch of batchSize frames
+    void decode(const DetectionOutput& output, ImageRotation rotation,
+                QVector<CocoDetectionModel::DetectedObject>* detectedObjects, int batchIndex = 0, int batchSize = 1);
+
+private:
+    struct Anchor {
+        // normalized center and size
+        float x;
+        float y;
+        float width;
+        float height;
+    };
+
+    struct Candidate {
+        int anchor;
+        // index into the score row, including the background class
+        int scoreIndex;
+        float score;
+    };
+
+    bool isAllowed(int classIndex) const;
+    void decodePostProcessed(const DetectionOutput& output, ImageRotation rotation,
+                             QVector<CocoDetectionModel::DetectedObject>* detectedObjects, int batchIndex, int batchSize);
+    void decodeRawSsd(const DetectionOutput& output, ImageRotation rotation,
+                      QVector<CocoDetectionModel::DetectedObject>* detectedObjects, int batchIndex, int batchSize);
+    // threshold is in the domain of T, i.e. raw for quantized scores
+    template <typename T, typename Threshold>
+    void collectCandidates(const T* scores, Threshold threshold);
+    QRectF decodeBox(const DetectionOutput& output, int boxIndex, const Anchor& anchor) const;
+
+    Format m_format = PostProcessed;
+    SsdOptions m_options;
+    int m_numClasses = 0;
+    std::vector<Anchor> m_anchors;
+
+    float m_scoreThreshold = 0.5f;
+    float m_iouThreshold = 0.6f;
+    int m_maxDetections = 10;
+
+    QVector<int> m_classes;
+    // indexed by classIndex, only looked at with m_filterClasses
+    bool m_filterClasses = false;
+    std::vector<bool> m_classAllowed;
+    // score row indices of the allowed classes, scanned instead of the whole row when filtering
+    std::vector<int> m_allowedScoreIndices;
+
+    // scratch space of decode(), sized for all anchors
+    std::vector<Candidate> m_candidates;
+    int m_candidateCount = 0;
+    std::vector<QRectF> m_keptBoxes;
+    std::vector<int> m_keptClasses;
+};
+
+#endif // __DETECTION_DECODER__
@@ -0,0 +1,450 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "detectionoverlay.h"
+
+#include <QDebug>
+#include <QFontMetricsF>
+#include <QPainter>
+#include <QQuickWindow>
+#include <QScopedPointer>
+#include <QSGGeometryNode>
+#include <QSGTexture>
+#include <QSGTextureMaterial>
+#include <QSGVertexColorMaterial>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+// characters of the score suffix " (0.87)", also used for classes the labels do not know
+const char atlasCharacters[] = " (0123456789.)-";
+
+const int atlasWidth = 1024;
+const qreal labelPadding = 4.0;
+const qreal labelMargin = 16.0;
+
+// 16 bit indices, 4 vertices per quad
+const int maxQuads = 65536 / 4;
+
+/*
+ * The label texts rendered once into one texture: every class name of the
+ * model and the characters above, white on transparent, packed in rows.
+ * The entries are looked up by class index and character, so composing a
+ * label needs neither strings nor hashing.
+ */
+struct GlyphAtlas
+{
+    QImage image;
+    // entries in logical pixels of the atlas, null for classes without a label
+    QVector<QRectF> classEntries;
+    // indexed by the ASCII code, null for characters that are not in atlasCharacters
+    QRectF characterEntries[128];
+    qreal lineHeight = 0;
+    qreal ascent = 0;
+};
+
+GlyphAtlas renderAtlas(const QFont& font, const QHash<int, QString>& labels, qreal devicePixelRatio)
+{
+    const QFontMetricsF metrics(font);
+
+    QStringList texts = labels.values();
+    for (const char* character = atlasCharacters; *character; ++character) {
+        texts.append(QString(QLatin1Char(*character)));
+    }
+    texts.removeDuplicates();
+
+    GlyphAtlas atlas;
+    atlas.lineHeight = std::ceil(metrics.height());
+    atlas.ascent = metrics.ascent();
+
+    // shelf packing, one row of the line height after the other
+    QHash<QString, QRectF> entries;
+    QPointF position;
+    for (const QString& text : texts) {
+        const qreal width = std::ceil(metrics.horizontalAdvance(text)) + 1;
+        if (position.x() + width > atlasWidth && position.x() > 0) {
+            position = QPointF(0, position.y() + atlas.lineHeight + 1);
+        }
+        entries.insert(text, QRectF(position, QSizeF(std::min<qreal>(width, atlasWidth), atlas.lineHeight)));
+        position.rx() += width + 1;
+    }
+    const int height = int(position.y() + atlas.lineHeight + 1);
+
+    for (auto it = labels.constBegin(); it != labels.constEnd(); ++it) {
+        if (it.key() < 0) {
+            continue;
+        }
+        if (it.key() >= atlas.classEntries.size()) {
+            atlas.classEntries.resize(it.key() + 1);
+        }
+        atlas.classEntries[it.key()] = entries.value(it.value());
+    }
+    for (const char* character = atlasCharacters; *character; ++character) {
+        atlas.characterEntries[uchar(*character)] = entries.value(QString(QLatin1Char(*character)));
+    }
+
+    atlas.image = QImage(QSize(atlasWidth, height) * devicePixelRatio, QImage::Format_ARGB32_Premultiplied);
+    atlas.image.setDevicePixelRatio(devicePixelRatio);
+    atlas.image.fill(Qt::transparent);
+
+    QPainter painter(&atlas.image);
+    painter.setFont(font);
+    painter.setPen(Qt::white);
+    for (auto it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        painter.drawText(QPointF(it->x(), it->y() + atlas.ascent), it.key());
+    }
+    return atlas;
+}
+
+// one piece of a label text, taken from the atlas
+struct TextQuad {
+    QRectF rect;
+    QRectF textureRect;
+};
+
+void setQuadIndices(quint16* indices, int quad)
+{
+    const quint16 first = quint16(quad * 4);
+    indices[0] = first;
+    indices[1] = first + 1;
+    indices[2] = first + 2;
+    indices[3] = first + 2;
+    indices[4] = first + 1;
+    indices[5] = first + 3;
+}
+
+void setColoredQuad(QSGGeometry::ColoredPoint2D* vertices, const QRectF& rect, const QColor& color)
+{
+    const uchar r = uchar(color.red());
+    const uchar g = uchar(color.green());
+    const uchar b = uchar(color.blue());
+    const uchar a = uchar(color.alpha());
+    vertices[0].set(float(rect.left()), float(rect.top()), r, g, b, a);
+    vertices[1].set(float(rect.right()), float(rect.top()), r, g, b, a);
+    vertices[2].set(float(rect.left()), float(rect.bottom()), r, g, b, a);
+    vertices[3].set(float(rect.right()), float(rect.bottom()), r, g, b, a);
+}
+
+void setTexturedQuad(QSGGeometry::TexturedPoint2D* vertices, const QRectF& rect, const QRectF& textureRect)
+{
+    vertices[0].set(float(rect.left()), float(rect.top()), float(textureRect.left()), float(textureRect.top()));
+    vertices[1].set(float(rect.right()), float(rect.top()), float(textureRect.right()), float(textureRect.top()));
+    vertices[2].set(float(rect.left()), float(rect.bottom()), float(textureRect.left()), float(textureRect.bottom()));
+    vertices[3].set(float(rect.right()), float(rect.bottom()), float(textureRect.right()), float(textureRect.bottom()));
+}
+
+/*
+ * Root of the overlay: the colored boxes and label backgrounds, the label
+ * texts on top, and the atlas texture the texts are taken from.
+ */
+class OverlayNode : public QSGNode
+{
+public:
+    OverlayNode()
+        : m_boxGeometry(QSGGeometry::defaultAttributes_ColoredPoint2D(), 0, 0, QSGGeometry::UnsignedShortType)
+        , m_textGeometry(QSGGeometry::defaultAttributes_TexturedPoint2D(), 0, 0, QSGGeometry::UnsignedShortType)
+    {
+        m_boxGeometry.setDrawingMode(QSGGeometry::DrawTriangles);
+        m_boxNode.setGeometry(&m_boxGeometry);
+        m_boxNode.setMaterial(&m_boxMaterial);
+        appendChildNode(&m_boxNode);
+
+        m_textGeometry.setDrawingMode(QSGGeometry::DrawTriangles);
+        m_textMaterial.setFiltering(QSGTexture::Linear);
+        m_textNode.setGeometry(&m_textGeometry);
+        m_textNode.setMaterial(&m_textMaterial);
+        appendChildNode(&m_textNode);
+    }
+
+    ~OverlayNode() override
+    {
+        // the nodes are members, they must not be deleted with the children
+        removeAllChildNodes();
+    }
+
+    QSGGeometryNode m_boxNode;
+    QSGGeometry m_boxGeometry;
+    QSGVertexColorMaterial m_boxMaterial;
+
+    QSGGeometryNode m_textNode;
+    QSGGeometry m_textGeometry;
+    QSGTextureMaterial m_textMaterial;
+
+    GlyphAtlas m_atlas;
+    QScopedPointer<QSGTexture> m_atlasTexture;
+    qreal m_devicePixelRatio = 0;
+
+    // scratch of updatePaintNode(), kept so its capacity is reused
+    QVector<TextQuad> m_textQuads;
+};
+
+} // namespace
+
+DetectionOverlay::DetectionOverlay(QQuickItem* parent)
+    : QQuickItem(parent)
+{
+    setFlag(ItemHasContents, true);
+    m_font.setPixelSize(14);
+}
+
+QAbstractItemModel* DetectionOverlay::model() const
+{
+    return m_model;
+}
+
+void DetectionOverlay::setModel(QAbstractItemModel* model)
+{
+    CocoDetectionModel* detectionModel = qobject_cast<CocoDetectionModel*>(model);
+    if (model && !detectionModel) {
+        qWarning() << "DetectionOverlay only draws a CocoDetectionModel";
+    }
+    if (m_model == detectionModel) {
+        return;
+    }
+    if (m_model) {
+        disconnect(m_model, nullptr, this, nullptr);
+    }
+    m_model = detectionModel;
+    if (m_model) {
+        connect(m_model, &CocoDetectionModel::rowsUpdated, this, &QQuickItem::update);
+        connect(m_model, &QAbstractItemModel::modelReset, this, &QQuickItem::update);
+    }
+    m_atlasDirty = true;
+    update();
+    emit modelChanged();
+}
+
+QRectF DetectionOverlay::contentRect() const
+{
+    return m_contentRect;
+}
+
+void DetectionOverlay::setContentRect(const QRectF& contentRect)
+{
+    if (m_contentRect == contentRect) {
+        return;
+    }
+    m_contentRect = contentRect;
+    update();
+    emit contentRectChanged();
+}
+
+int DetectionOverlay::orientation() const
+{
+    return m_orientation;
+}
+
+void DetectionOverlay::setOrientation(int orientation)
+{
+    if (m_orientation == orientation) {
+        return;
+    }
+    m_orientation = orientation;
+    update();
+    emit orientationChanged();
+}
+
+qreal DetectionOverlay::lineWidth() const
+{
+    return m_lineWidth;
+}
+
+void DetectionOverlay::setLineWidth(qreal lineWidth)
+{
+    if (qFuzzyCompare(m_lineWidth, lineWidth)) {
+        return;
+    }
+    m_lineWidth = lineWidth;
+    update();
+    emit lineWidthChanged();
+}
+
+QFont DetectionOverlay::font() const
+{
+    return m_font;
+}
+
+void DetectionOverlay::setFont(const QFont& font)
+{
+    if (m_font == font) {
+        return;
+    }
+    m_font = font;
+    m_atlasDirty = true;
+    update();
+    emit fontChanged();
+}
+
+bool DetectionOverlay::labelsVisible() const
+{
+    return m_labelsVisible;
+}
+
+void DetectionOverlay::setLabelsVisible(bool labelsVisible)
+{
+    if (m_labelsVisible == labelsVisible) {
+        return;
+    }
+    m_labelsVisible = labelsVisible;
+    update();
+    emit labelsVisibleChanged();
+}
+
+QRectF DetectionOverlay::mapNormalizedRect(const QRectF& rect) const
+{
+    // same mapping as QDeclarativeVideoOutput::mapNormalizedPointToItem()
+    const auto mapPoint = [this](const QPointF& point) -> QPointF {
+        const qreal dx = point.x();
+        const qreal dy = point.y();
+        const QRectF& content = m_contentRect;
+        switch ((m_orientation % 360 + 360) % 360) {
+        case 90:
+            return content.bottomLeft() + QPointF(dy * content.width(), -dx * content.height());
+        case 180:
+            return content.bottomRight() + QPointF(-dx * content.width(), -dy * content.height());
+        case 270:
+            return content.topRight() + QPointF(-dy * content.width(), dx * content.height());
+        default:
+            return content.topLeft() + QPointF(dx * content.width(), dy * content.height());
+        }
+    };
+    return QRectF(mapPoint(rect.topLeft()), mapPoint(rect.bottomRight())).normalized();
+}
+
+QSGNode* DetectionOverlay::updatePaintNode(QSGNode* oldNode, UpdatePaintNodeData*)
+{
+    OverlayNode* node = static_cast<OverlayNode*>(oldNode);
+    if (!node) {
+        node = new OverlayNode;
+    }
+
+    const int rows = m_model ? std::min(m_model->rowCount(), maxQuads / 5) : 0;
+
+    // the atlas is rendered for the labels, the font and the screen, not per update
+    const qreal devicePixelRatio = window() ? window()->effectiveDevicePixelRatio() : 1.0;
+    if (m_model && window() && (m_atlasDirty || !qFuzzyCompare(node->m_devicePixelRatio, devicePixelRatio))) {
+        node->m_atlas = renderAtlas(m_font, m_model->labels(), devicePixelRatio);
+        node->m_atlasTexture.reset(window()->createTextureFromImage(node->m_atlas.image));
+        node->m_textMaterial.setTexture(node->m_atlasTexture.data());
+        node->m_devicePixelRatio = devicePixelRatio;
+        m_atlasDirty = false;
+        node->m_textNode.markDirty(QSGNode::DirtyMaterial);
+    }
+
+    const GlyphAtlas& atlas = node->m_atlas;
+    const bool drawLabels = m_labelsVisible && node->m_atlasTexture;
+    const qreal labelHeight = atlas.lineHeight + 2 * labelPadding;
+    const QSizeF atlasSize(atlasWidth, atlas.image.height() / std::max<qreal>(atlas.image.devicePixelRatio(), 1));
+
+    // 4 outline quads and a label background per box
+    const int boxQuads = rows * (drawLabels ? 5 : 4);
+    QSGGeometry* boxGeometry = &node->m_boxGeometry;
+    boxGeometry->allocate(boxQuads * 4, boxQuads * 6);
+    QSGGeometry::ColoredPoint2D* boxVertices = boxGeometry->vertexDataAsColoredPoint2D();
+    quint16* boxIndices = boxGeometry->indexDataAsUShort();
+
+    // the label texts are assembled from the atlas entries, clipped to the label width
+    QVector<TextQuad>& textQuads = node->m_textQuads;
+    textQuads.clear();
+    qreal x = 0;
+    qreal right = 0;
+    qreal y = 0;
+    // false once the label is full
+    const auto appendEntry = [&](const QRectF& entry) {
+        if (entry.isNull()) {
+            return true;
+        }
+        const qreal width = std::min(entry.width(), right - x);
+        if (width <= 0 || textQuads.size() >= maxQuads) {
+            return false;
+        }
+        const QRectF source(entry.topLeft(), QSizeF(width, entry.height()));
+        textQuads.append({ QRectF(QPointF(x, y), source.size()),
+                           QRectF(source.x() / atlasSize.width(), source.y() / atlasSize.height(),
+                                  source.width() / atlasSize.width(), source.height() / atlasSize.height()) });
+        x += entry.width();
+        return true;
+    };
+    const auto appendCharacters = [&](const char* characters) {
+        for (; *characters; ++characters) {
+            if (!appendEntry(atlas.characterEntries[uchar(*characters) & 0x7f])) {
+                return false;
+            }
+        }
+        return true;
+    };
+    char text[32];
+
+    int quad = 0;
+    for (int row = 0; row < rows; ++row) {
+        const CocoDetectionModel::DetectedObject& object = m_model->detectedObject(row);
+        const QColor color = m_model->color(row);
+        const QRectF box = mapNormalizedRect(object.boundingRect);
+        const qreal line = std::min({ m_lineWidth, box.width() / 2, box.height() / 2 });
+
+        const QRectF outlines[] = {
+            QRectF(box.left(), box.top(), box.width(), line),
+            QRectF(box.left(), box.bottom() - line, box.width(), line),
+            QRectF(box.left(), box.top() + line, line, box.height() - 2 * line),
+            QRectF(box.right() - line, box.top() + line, line, box.height() - 2 * line),
+        };
+        for (const QRectF& outline : outlines) {
+            setColoredQuad(boxVertices + quad * 4, outline, color);
+            setQuadIndices(boxIndices + quad * 6, quad);
+            ++quad;
+        }
+
+        if (!drawLabels) {
+            continue;
+        }
+
+        const QRectF background(box.left(), box.top() - labelHeight, box.width(), labelHeight);
+        setColoredQuad(boxVertices + quad * 4, background, color);
+        setQuadIndices(boxIndices + quad * 6, quad);
+        ++quad;
+
+        x = background.left() + labelMargin;
+        right = background.right() - labelMargin;
+        y = background.top() + labelPadding;
+
+        // classes the labels do not know show their index, like CocoDetectionModel::label()
+        const bool labeled = object.classIndex >= 0 && object.classIndex < atlas.classEntries.size()
+            && !atlas.classEntries.at(object.classIndex).isNull();
+        if (labeled) {
+            if (!appendEntry(atlas.classEntries.at(object.classIndex))) {
+                continue;
+            }
+        } else {
+            std::snprintf(text, sizeof(text), "%d", object.classIndex);
+            if (!appendCharacters(text)) {
+                continue;
+            }
+        }
+        // %f would follow the C locale Qt sets up, the atlas only has the point
+        const int hundredths = qRound(double(object.score) * 100);
+        std::snprintf(text, sizeof(text), " (%s%d.%02d)", hundredths < 0 ? "-" : "", std::abs(hundredths) / 100,
+                      std::abs(hundredths) % 100);
+        appendCharacters(text);
+    }
+    node->m_boxNode.markDirty(QSGNode::DirtyGeometry);
+
+    QSGGeometry* textGeometry = &node->m_textGeometry;
+    textGeometry->allocate(textQuads.size() * 4, textQuads.size() * 6);
+    QSGGeometry::TexturedPoint2D* textVertices = textGeometry->vertexDataAsTexturedPoint2D();
+    quint16* textIndices = textGeometry->indexDataAsUShort();
+    for (int i = 0; i < textQuads.size(); ++i) {
+        setTexturedQuad(textVertices + i * 4, textQuads.at(i).rect, textQuads.at(i).textureRect);
+        setQuadIndices(textIndices + i * 6, i);
+    }
+    node->m_textNode.markDirty(QSGNode::DirtyGeometry);
+
+    return node;
+}
@@ -0,0 +1,88 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DETECTION_OVERLAY__
+#define __DETECTION_OVERLAY__
+
+#include "cocodetectionmodel.h"
+
+#include <QAbstractItemModel>
+#include <QFont>
+#include <QPointer>
+#include <QQuickItem>
+
+/*
+ * Draws the boxes and labels of a CocoDetectionModel on top of a
+ * VideoOutput. Instead of items per detection there are two scene graph
+ * nodes for all of them: one geometry with the box outlines and label
+ * backgrounds, and one textured geometry with the label texts, composed
+ * from a glyph atlas that is rendered once from the model's label table
+ * (plus the characters of the scores). An update only rewrites the vertices.
+ *
+ * contentRect and orientation follow the VideoOutput, like its
+ * mapNormalizedRectToItem().
+ */
+class DetectionOverlay : public QQuickItem
+{
+    Q_OBJECT
+    Q_PROPERTY(QAbstractItemModel* model READ model WRITE setModel NOTIFY modelChanged)
+    Q_PROPERTY(QRectF contentRect READ contentRect WRITE setContentRect NOTIFY contentRectChanged)
+    Q_PROPERTY(int orientation READ orientation WRITE setOrientation NOTIFY orientationChanged)
+    Q_PROPERTY(qreal lineWidth READ lineWidth WRITE setLineWidth NOTIFY lineWidthChanged)
+    Q_PROPERTY(QFont font READ font WRITE setFont NOTIFY fontChanged)
+    Q_PROPERTY(bool labelsVisible READ labelsVisible WRITE setLabelsVisible NOTIFY labelsVisibleChanged)
+public:
+    explicit DetectionOverlay(QQuickItem* parent = nullptr);
+
+    // a CocoDetectionModel, e.g. CocoDetectionFilter.detectionModel
+    QAbstractItemModel* model() const;
+    void setModel(QAbstractItemModel* model);
+
+    // area of the item the video is shown in, VideoOutput.contentRect
+    QRectF contentRect() const;
+    void setContentRect(const QRectF& contentRect);
+
+    // VideoOutput.orientation
+    int orientation() const;
+    void setOrientation(int orientation);
+
+    // width of the box outlines, default 2
+    qreal lineWidth() const;
+    void setLineWidth(qreal lineWidth);
+
+    // font of the labels, changing it renders the glyph atlas again
+    QFont font() const;
+    void setFont(const QFont& font);
+
+    bool labelsVisible() const;
+    void setLabelsVisible(bool labelsVisible);
+
+signals:
+    void modelChanged();
+    void contentRectChanged();
+    void orientationChanged();
+    void lineWidthChanged();
+    void fontChanged();
+    void labelsVisibleChanged();
+
+protected:
+    QSGNode* updatePaintNode(QSGNode* oldNode, UpdatePaintNodeData* data) override;
+
+private:
+    QRectF mapNormalizedRect(const QRectF& rect) const;
+
+    QPointer<CocoDetectionModel> m_model;
+    QRectF m_contentRect;
+    int m_orientation = 0;
+    qreal m_lineWidth = 2.0;
+    QFont m_font;
+    bool m_labelsVisible = true;
+    // the font or the labels changed since the atlas was rendered
+    bool m_atlasDirty = true;
+};
+
+#endif // __DETECTION_OVERLAY__
@@ -0,0 +1,125 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "detectionstats.h"
+
+#include <algorithm>
+
+Q_LOGGING_CATEGORY(detectionstats, "tensorflow.detectionstats")
+
+DetectionStats::DetectionStats(const std::shared_ptr<PipelineStats>& stats, QObject* parent)
+    : QObject(parent)
+    , m_stats(stats)
+{
+    m_lastUpdate = m_stats->now();
+
+    m_timer.setInterval(1000);
+    connect(&m_timer, &QTimer::timeout, this, &DetectionStats::update);
+    m_timer.start();
+}
+
+int DetectionStats::interval() const
+{
+    return m_timer.interval();
+}
+
+void DetectionStats::setInterval(int interval)
+{
+    interval = std::max(100, interval);
+    if (m_timer.interval() != interval) {
+        m_timer.setInterval(interval);
+        emit intervalChanged();
+    }
+}
+
+bool DetectionStats::logging() const
+{
+    return m_logging;
+}
+
+void DetectionStats::setLogging(bool logging)
+{
+    if (m_logging != logging) {
+        m_logging = logging;
+        emit loggingChanged();
+    }
+}
+
+QString DetectionStats::summary() const
+{
+    QString text = QStringLiteral("camera %1 fps, inference %2 fps, dropped %3, unchanged %4, discarded %5")
+                       .arg(m_cameraFps, 0, 'f', 1)
+                       .arg(m_inferenceFps, 0, 'f', 1)
+                       .arg(m_droppedFrames)
+                       .arg(m_unchangedFrames)
+                       .arg(m_discardedResults);
+
+    for (int stage = 0; stage < PipelineStats::StageCount; stage++) {
+        const QString name = PipelineStats::stageName(static_cast<PipelineStats::Stage>(stage));
+        const QVariantMap values = m_stages.value(name).toMap();
+        if (values.value(QStringLiteral("count")).toLongLong() == 0) {
+            continue;
+        }
+        text += QStringLiteral(" | %1 %2/%3/%4 ms")
+                    .arg(name)
+                    .arg(values.value(QStringLiteral("p50")).toDouble(), 0, 'f', 2)
+                    .arg(values.value(QStringLiteral("p95")).toDouble(), 0, 'f', 2)
+                    .arg(values.value(QStringLiteral("p99")).toDouble(), 0, 'f', 2);
+    }
+    return text;
+}
+
+void DetectionStats::update()
+{
+    const qint64 now = m_stats->now();
+    const double seconds = (now - m_lastUpdate) / 1e9;
+    m_lastUpdate = now;
+
+    const quint64 captured = m_stats->capturedFrames.load(std::memory_order_relaxed);
+    const quint64 inferred = m_stats->inferredFrames.load(std::memory_order_relaxed);
+    m_cameraFps = seconds > 0.0 ? (captured - m_lastCaptured) / seconds : 0.0;
+    m_inferenceFps = seconds > 0.0 ? (inferred - m_lastInferred) / seconds : 0.0;
+    m_lastCaptured = captured;
+    m_lastInferred = inferred;
+
+    m_capturedFrames = static_cast<qint64>(captured);
+    m_inferredFrames = static_cast<qint64>(inferred);
+    m_droppedFrames = static_cast<qint64>(m_stats->droppedFrames.load(std::memory_order_relaxed));
+    m_unchangedFrames = static_cast<qint64>(m_stats->unchangedFrames.load(std::memory_order_relaxed));
+    m_discardedResults = static_cast<qint64>(m_stats->discardedResults.load(std::memory_order_relaxed));
+
+    LatencyHistogram::Counts counts;
+    for (int stage = 0; stage < PipelineStats::StageCount; stage++) {
+        m_stats->histograms[stage].snapshot(&counts);
+
+        LatencyHistogram::Counts interval;
+        quint64 count = 0;
+        int last = -1;
+        for (int i = 0; i < LatencyHistogram::BucketCount; i++) {
+            interval[i] = counts[i] - m_lastCounts[stage][i];
+            count += interval[i];
+            if (interval[i] > 0) {
+                last = i;
+            }
+        }
+        m_lastCounts[stage] = counts;
+
+        QVariantMap values;
+        values[QStringLiteral("count")] = static_cast<qint64>(count);
+        values[QStringLiteral("p50")] = LatencyHistogram::percentile(interval, 0.50) / 1000.0;
+        values[QStringLiteral("p95")] = LatencyHistogram::percentile(interval, 0.95) / 1000.0;
+        values[QStringLiteral("p99")] = LatencyHistogram::percentile(interval, 0.99) / 1000.0;
+        values[QStringLiteral("max")] = last >= 0 ? LatencyHistogram::bucketUpperBound(last) / 1000.0 : 0.0;
+        m_stages[PipelineStats::stageName(static_cast<PipelineStats::Stage>(stage))] = values;
+    }
+
+    if (m_logging) {
+        qCInfo(detectionstats) << qPrintable(summary());
+    }
+
+    emit updated();
+}
@@ -0,0 +1,95 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DETECTION_STATS__
+#define __DETECTION_STATS__
+
+#include "pipelinestats.h"
+
+#include <QLoggingCategory>
+#include <QObject>
+#include <QTimer>
+#include <QVariantMap>
+
+#include <memory>
+
+Q_DECLARE_LOGGING_CATEGORY(detectionstats)
+
+/*
+ * Publishes the PipelineStats of a CocoDetectionFilter to QML. Every interval
+ * it takes a snapshot and computes rates and per-stage percentiles over the
+ * frames of that interval only, so the values follow the current load instead
+ * of averaging over the whole session. The frame counters are totals.
+ */
+class DetectionStats : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(int interval READ interval WRITE setInterval NOTIFY intervalChanged)
+    Q_PROPERTY(bool logging READ logging WRITE setLogging NOTIFY loggingChanged)
+    Q_PROPERTY(double cameraFps READ cameraFps NOTIFY updated)
+    Q_PROPERTY(double inferenceFps READ inferenceFps NOTIFY updated)
+    Q_PROPERTY(qint64 capturedFrames READ capturedFrames NOTIFY updated)
+    Q_PROPERTY(qint64 inferredFrames READ inferredFrames NOTIFY updated)
+    Q_PROPERTY(qint64 droppedFrames READ droppedFrames NOTIFY updated)
+    Q_PROPERTY(qint64 unchangedFrames READ unchangedFrames NOTIFY updated)
+    Q_PROPERTY(qint64 discardedResults READ discardedResults NOTIFY updated)
+    Q_PROPERTY(QVariantMap stages READ stages NOTIFY updated)
+    Q_PROPERTY(QString summary READ summary NOTIFY updated)
+public:
+    explicit DetectionStats(const std::shared_ptr<PipelineStats>& stats, QObject* parent = nullptr);
+
+    // update period in ms
+    int interval() const;
+    void setInterval(int interval);
+
+    // writes the summary to the log on every update
+    bool logging() const;
+    void setLogging(bool logging);
+
+    double cameraFps() const { return m_cameraFps; }
+    double inferenceFps() const { return m_inferenceFps; }
+    qint64 capturedFrames() const { return m_capturedFrames; }
+    qint64 inferredFrames() const { return m_inferredFrames; }
+    qint64 droppedFrames() const { return m_droppedFrames; }
+    qint64 unchangedFrames() const { return m_unchangedFrames; }
+    qint64 discardedResults() const { return m_discardedResults; }
+
+    // stage name -> { count, p50, p95, p99, max } with the latencies in ms
+    QVariantMap stages() const { return m_stages; }
+
+    // one line with the rates and the p50/p95/p99 of every stage
+    QString summary() const;
+
+signals:
+    void intervalChanged();
+    void loggingChanged();
+    void updated();
+
+private:
+    void update();
+
+    std::shared_ptr<PipelineStats> m_stats;
+    QTimer m_timer;
+    bool m_logging = false;
+
+    qint64 m_lastUpdate = 0;
+    quint64 m_lastCaptured = 0;
+    quint64 m_lastInferred = 0;
+    // counts of the previous snapshot, the difference is the current interval
+    std::array<LatencyHistogram::Counts, PipelineStats::StageCount> m_lastCounts {};
+
+    double m_cameraFps = 0.0;
+    double m_inferenceFps = 0.0;
+    qint64 m_capturedFrames = 0;
+    qint64 m_inferredFrames = 0;
+    qint64 m_droppedFrames = 0;
+    qint64 m_unchangedFrames = 0;
+    qint64 m_discardedResults = 0;
+    QVariantMap m_stages;
+};
+
+#endif // __DETECTION_STATS__
@@ -0,0 +1,272 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "framebufferpool.h"
+
+#include <QtGlobal>
+
+#include <cstring>
+#include <utility>
+
+namespace {
+
+// swapChroma is set for formats that only differ from the layout by the order of the U and V planes
+bool pixelLayoutFromPixelFormat(QVideoFrame::PixelFormat pixelFormat, PixelLayout* layout, bool* swapChroma)
+{
+    // the 32 bit formats are defined as native-endian words, e.g. 0xAARRGGBB for ARGB32
+    const bool littleEndian = Q_BYTE_ORDER == Q_LITTLE_ENDIAN;
+    *swapChroma = false;
+
+    switch (pixelFormat) {
+    case QVideoFrame::Format_RGB24:
+        *layout = PixelLayout::RGB888;
+        return true;
+    case QVideoFrame::Format_BGR24:
+        *layout = PixelLayout::BGR888;
+        return true;
+    case QVideoFrame::Format_RGB32:
+    case QVideoFrame::Format_ARGB32:
+    case QVideoFrame::Format_ARGB32_Premultiplied:
+        *layout = littleEndian ? PixelLayout::BGRX8888 : PixelLayout::XRGB8888;
+        return true;
+    case QVideoFrame::Format_BGR32:
+    case QVideoFrame::Format_BGRA32:
+    case QVideoFrame::Format_BGRA32_Premultiplied:
+        *layout = littleEndian ? PixelLayout::XRGB8888 : PixelLayout::BGRX8888;
+        return true;
+    case QVideoFrame::Format_ABGR32:
+        *layout = littleEndian ? PixelLayout::RGBX8888 : PixelLayout::XBGR8888;
+        return true;
+    case QVideoFrame::Format_NV12:
+        *layout = PixelLayout::NV12;
+        return true;
+    case QVideoFrame::Format_NV21:
+        *layout = PixelLayout::NV21;
+        return true;
+    case QVideoFrame::Format_YUV420P:
+        *layout = PixelLayout::YUV420P;
+        return true;
+    case QVideoFrame::Format_YV12:
+        *layout = PixelLayout::YUV420P;
+        *swapChroma = true;
+        return true;
+    case QVideoFrame::Format_YUYV:
+        *layout = PixelLayout::YUYV;
+        return true;
+    case QVideoFrame::Format_UYVY:
+        *layout = PixelLayout::UYVY;
+        return true;
+    default:
+        return false;
+    }
+}
+
+YuvColorSpace yuvColorSpaceFromSurfaceFormat(const QVideoSurfaceFormat& surfaceFormat)
+{
+    switch (surfaceFormat.yCbCrColorSpace()) {
+    case QVideoSurfaceFormat::YCbCr_BT709:
+    case QVideoSurfaceFormat::YCbCr_xvYCC709:
+        return YuvColorSpace::BT709;
+    case QVideoSurfaceFormat::YCbCr_JPEG:
+        return YuvColorSpace::JPEG;
+    default:
+        return YuvColorSpace::BT601;
+    }
+}
+
+} // namespace
+
+bool FrameBuffer::fill(QVideoFrame& frame, const QVideoSurfaceFormat& surfaceFormat, ImageRotation rotation)
+{
+    const bool bottomToTop = surfaceFormat.scanLineDirection() == QVideoSurfaceFormat::BottomToTop;
+    m_startTime = frame.startTime();
+
+    m_image = SourceImage();
+    m_image.colorSpace = yuvColorSpaceFromSurfaceFormat(surfaceFormat);
+    m_image.rotation = rotation;
+    m_image.width = frame.width();
+    m_image.height = frame.height();
+
+    bool swapChroma = false;
+    if (pixelLayoutFromPixelFormat(frame.pixelFormat(), &m_image.layout, &swapChroma)) {
+        if (!frame.map(QAbstractVideoBuffer::ReadOnly)) {
+            return false;
+        }
+
+        if (frame.planeCount() < m_image.planeCount()) {
+            frame.unmap();
+            return false;
+        }
+
+        // plain memory can stay mapped until the worker is done with it,
+        // anything else (e.g. GL readbacks) has to be unmapped on this thread
+        if (frame.handleType() == QAbstractVideoBuffer::NoHandle) {
+            m_mappedFrame = frame;
+            m_holdsMapping = true;
+            setPlanes(frame, nullptr, bottomToTop, swapChroma);
+            return true;
+        }
+
+        const bool copied = copyMappedFrame(frame, bottomToTop, swapChroma);
+        frame.unmap();
+        return copied;
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    // slow path for formats the preprocessor cannot read directly
+    const QImage image = frame.image();
+    if (image.isNull()) {
+        return false;
+    }
+
+    m_convertedImage = image.convertToFormat(QImage::Format_RGB888);
+    m_image.layout = PixelLayout::RGB888;
+    setPlane(0, m_convertedImage.constBits(), m_convertedImage.bytesPerLine(), m_convertedImage.height(), bottomToTop);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool FrameBuffer::copyMappedFrame(const QVideoFrame& frame, bool bottomToTop, bool swapChroma)
+{
+    const size_t size = static_cast<size_t>(frame.mappedBytes());
+
+    // the plane offsets are kept, so all planes have to live in the mapped range
+    for (int plane = 1; plane < frame.planeCount(); plane++) {
+        const ptrdiff_t offset = frame.bits(plane) - frame.bits(0);
+        if (offset < 0 || static_cast<size_t>(offset) >= size) {
+            return false;
+        }
+    }
+
+    // only grows, so a steady stream of equally sized frames does not allocate
+    if (m_storage.size() < size) {
+        m_storage.resize(size);
+    }
+    std::memcpy(m_storage.data(), frame.bits(), size);
+
+    setPlanes(frame, m_storage.data(), bottomToTop, swapChroma);
+    return true;
+}
+
+void FrameBuffer::setPlanes(const QVideoFrame& frame, const uchar* copy, bool bottomToTop, bool swapChroma)
+{
+    const int planeCount = m_image.planeCount();
+
+    for (int plane = 0; plane < planeCount; plane++) {
+        const uchar* bits = copy ? copy + (frame.bits(plane) - frame.bits(0)) : frame.bits(plane);
+        // all multi-planar layouts are 4:2:0
+        const int rows = plane == 0 ? m_image.height : (m_image.height + 1) / 2;
+        int target = plane;
+        if (swapChroma && plane > 0) {
+            target = 3 - plane;
+        }
+        setPlane(target, bits, frame.bytesPerLine(plane), rows, bottomToTop);
+    }
+}
+
+void FrameBuffer::setPlane(int plane, const uchar* bits, int bytesPerLine, int rows, bool bottomToTop)
+{
+    if (bottomToTop) {
+        m_image.data[plane] = bits + static_cast<ptrdiff_t>(rows - 1) * bytesPerLine;
+        m_image.stride[plane] = -bytesPerLine;
+    } else {
+        m_image.data[plane] = bits;
+        m_image.stride[plane] = bytesPerLine;
+    }
+}
+
+
+FrameBufferRef::FrameBufferRef(const FrameBufferRef& other)
+    : m_buffer(other.m_buffer)
+{
+    if (m_buffer) {
+        m_buffer->m_refCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+FrameBufferRef::FrameBufferRef(FrameBufferRef&& other)
+    : m_buffer(other.m_buffer)
+{
+    other.m_buffer = nullptr;
+}
+
+FrameBufferRef::~FrameBufferRef()
+{
+    reset();
+}
+
+FrameBufferRef& FrameBufferRef::operator=(const FrameBufferRef& other)
+{
+    FrameBufferRef copy(other);
+    std::swap(m_buffer, copy.m_buffer);
+    return *this;
+}
+
+FrameBufferRef& FrameBufferRef::operator=(FrameBufferRef&& other)
+{
+    if (this != &other) {
+        reset();
+        m_buffer = other.m_buffer;
+        other.m_buffer = nullptr;
+    }
+    return *this;
+}
+
+void FrameBufferRef::reset()
+{
+    if (m_buffer && m_buffer->m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        m_buffer->m_pool->recycle(m_buffer);
+    }
+    m_buffer = nullptr;
+}
+
+
+FrameBufferPool::FrameBufferPool(int size)
+{
+    m_buffers.reserve(size);
+    for (int i = 0; i < size; i++) {
+        std::unique_ptr<FrameBuffer> buffer(new FrameBuffer);
+        buffer->m_pool = this;
+        m_buffers.push_back(std::move(buffer));
+    }
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+    for (const auto& buffer : m_buffers) {
+        Q_ASSERT_X(buffer->m_free.load(), "~FrameBufferPool", "frame buffer still referenced");
+        Q_UNUSED(buffer)
+    }
+}
+
+FrameBufferRef FrameBufferPool::acquire()
+{
+    for (const auto& buffer : m_buffers) {
+        bool expected = true;
+        if (buffer->m_free.compare_exchange_strong(expected, false, std::memory_order_acquire)) {
+            buffer->m_refCount.store(1, std::memory_order_relaxed);
+            return FrameBufferRef(buffer.get());
+        }
+    }
+    return FrameBufferRef();
+}
+
+void FrameBufferPool::recycle(FrameBuffer* buffer)
+{
+    if (buffer->m_holdsMapping) {
+        buffer->m_mappedFrame.unmap();
+        buffer->m_holdsMapping = false;
+    }
+    buffer->m_mappedFrame = m_nullFrame;
+    buffer->m_convertedImage = QImage();
+    buffer->m_image = SourceImage();
+    buffer->m_startTime = -1;
+
+    buffer->m_free.store(true, std::memory_order_release);
+}
@@ -0,0 +1,112 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FRAME_BUFFER_POOL__
+#define __FRAME_BUFFER_POOL__
+
+#include "imagepreprocessor.h"
+
+#include <QImage>
+#include <QVideoFrame>
+#include <QVideoSurfaceFormat>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class FrameBufferPool;
+
+/*
+ * A pooled frame on its way from the video thread to the detection worker.
+ * Depending on the frame it either keeps the mapped QVideoFrame alive (zero
+ * copy), holds a copy of the mapped planes in recycled storage or, for pixel
+ * formats the preprocessor cannot read, a converted QImage.
+ */
+class FrameBuffer
+{
+public:
+    const SourceImage& image() const { return m_image; }
+    qint64 startTime() const { return m_startTime; }
+
+    // maps (and possibly copies) the frame, the rotation is applied by the preprocessor
+    bool fill(QVideoFrame& frame, const QVideoSurfaceFormat& surfaceFormat, ImageRotation rotation = ImageRotation::None);
+
+private:
+    friend class FrameBufferPool;
+    friend class FrameBufferRef;
+
+    FrameBuffer() = default;
+
+    bool copyMappedFrame(const QVideoFrame& frame, bool bottomToTop, bool swapChroma);
+    void setPlanes(const QVideoFrame& frame, const uchar* copy, bool bottomToTop, bool swapChroma);
+    void setPlane(int plane, const uchar* bits, int bytesPerLine, int rows, bool bottomToTop);
+
+    SourceImage m_image;
+    qint64 m_startTime = -1;
+
+    FrameBufferPool* m_pool = nullptr;
+    std::atomic<bool> m_free { true };
+    std::atomic<int> m_refCount { 0 };
+
+    std::vector<uchar> m_storage;
+    QVideoFrame m_mappedFrame;
+    bool m_holdsMapping = false;
+    QImage m_convertedImage;
+};
+
+/*
+ * Ref-counted handle to a FrameBuffer. Dropping the last reference returns
+ * the buffer to its pool, which unmaps and releases a held video frame.
+ */
+class FrameBufferRef
+{
+public:
+    FrameBufferRef() = default;
+    FrameBufferRef(const FrameBufferRef& other);
+    FrameBufferRef(FrameBufferRef&& other);
+    ~FrameBufferRef();
+
+    FrameBufferRef& operator=(const FrameBufferRef& other);
+    FrameBufferRef& operator=(FrameBufferRef&& other);
+
+    FrameBuffer* get() const { return m_buffer; }
+    FrameBuffer* operator->() const { return m_buffer; }
+    explicit operator bool() const { return m_buffer != nullptr; }
+
+    void reset();
+
+private:
+    friend class FrameBufferPool;
+    explicit FrameBufferRef(FrameBuffer* buffer) : m_buffer(buffer) {}
+
+    FrameBuffer* m_buffer = nullptr;
+};
+
+/*
+ * Fixed set of frame buffers shared between the video thread and the worker.
+ * acquire() and the release of the last reference are lock-free and do not
+ * allocate once the buffers have grown to the frame size.
+ */
+class FrameBufferPool
+{
+public:
+    explicit FrameBufferPool(int size = 3);
+    ~FrameBufferPool();
+
+    // returns a null reference if all buffers are still in use
+    FrameBufferRef acquire();
+
+private:
+    friend class FrameBufferRef;
+    void recycle(FrameBuffer* buffer);
+
+    std::vector<std::unique_ptr<FrameBuffer>> m_buffers;
+    // assigning a shared null frame releases a held frame without allocating
+    const QVideoFrame m_nullFrame;
+};
+
+#endif // __FRAME_BUFFER_POOL__
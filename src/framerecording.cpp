@@ -0,0 +1,402 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "framerecording.h"
+
+#include <QAbstractPlanarVideoBuffer>
+#include <QRect>
+#include <QVariant>
+
+#include <algorithm>
+#include <cstring>
+
+Q_LOGGING_CATEGORY(framerecording, "tensorflow.framerecording")
+
+namespace {
+
+/*
+ * The file is a FileHeader followed by the frames, each a FrameHeader and the
+ * mapped bytes of the frame, padded to Alignment. The values are in the byte
+ * order of the recording machine.
+ */
+const char FileMagic[8] = { 'Q', 'M', 'N', 'R', 'E', 'C', '\0', '\0' };
+const char FrameMagic[4] = { 'F', 'R', 'M', '\0' };
+const quint32 ByteOrderMark = 0x01020304;
+const quint32 Version = 1;
+
+// frame headers and planes start at this alignment in the mapping, so they can be read in place
+const qint64 Alignment = 64;
+
+struct FileHeader {
+    char magic[8];
+    quint32 byteOrder;
+    quint32 version;
+    // offset of the first frame
+    quint32 headerSize;
+    quint32 reserved[11];
+};
+
+struct FrameHeader {
+    char magic[4];
+    // offset of the planes from the header
+    quint32 headerSize;
+    quint64 payloadSize;
+    // ns since the first recorded frame reached the filter
+    qint64 captureTime;
+    // QVideoFrame::startTime() and endTime() in us, -1 if unknown
+    qint64 startTime;
+    qint64 endTime;
+    qint32 pixelFormat;
+    qint32 width;
+    qint32 height;
+    qint32 planeCount;
+    qint32 bytesPerLine[4];
+    // relative to the first byte of the payload
+    quint32 planeOffset[4];
+    qint32 viewport[4];
+    qint32 scanLineDirection;
+    qint32 yCbCrColorSpace;
+    double frameRate;
+    qint32 mirrored;
+    qint32 reserved;
+};
+
+static_assert(sizeof(FileHeader) == Alignment, "the first frame has to start aligned");
+static_assert(sizeof(FrameHeader) % Alignment == 0, "the planes have to start aligned");
+
+qint64 alignedSize(qint64 size)
+{
+    return (size + Alignment - 1) / Alignment * Alignment;
+}
+
+bool isFrameHeader(const FrameHeader& header, qint64 available)
+{
+    if (std::memcmp(header.magic, FrameMagic, sizeof(FrameMagic)) != 0 || header.headerSize < sizeof(FrameHeader)
+        || header.headerSize % Alignment != 0 || header.width <= 0 || header.height <= 0 || header.planeCount < 1
+        || header.planeCount > 4) {
+        return false;
+    }
+
+    if (header.headerSize > available || header.payloadSize > quint64(available - header.headerSize)) {
+        return false;
+    }
+    for (int plane = 0; plane < header.planeCount; plane++) {
+        if (header.planeOffset[plane] >= header.payloadSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Read-only planes of a recorded frame, in place in the mapped recording.
+ */
+class RecordedVideoBuffer : public QAbstractPlanarVideoBuffer
+{
+public:
+    RecordedVideoBuffer(const std::shared_ptr<const void>& mapping, const FrameHeader& header, const uchar* payload)
+        : QAbstractPlanarVideoBuffer(NoHandle)
+        , m_mapping(mapping)
+        , m_header(header)
+        , m_payload(payload)
+    {
+    }
+
+    MapMode mapMode() const override { return m_mapMode; }
+
+    int map(MapMode mode, int* numBytes, int bytesPerLine[4], uchar* data[4]) override
+    {
+        // the recording is mapped read-only
+        if (mode != ReadOnly) {
+            return 0;
+        }
+
+        *numBytes = static_cast<int>(m_header.payloadSize);
+        for (int plane = 0; plane < m_header.planeCount; plane++) {
+            bytesPerLine[plane] = m_header.bytesPerLine[plane];
+            data[plane] = const_cast<uchar*>(m_payload + m_header.planeOffset[plane]);
+        }
+        m_mapMode = mode;
+        return m_header.planeCount;
+    }
+
+    void unmap() override { m_mapMode = NotMapped; }
+
+private:
+    std::shared_ptr<const void> m_mapping;
+    FrameHeader m_header;
+    const uchar* m_payload;
+    MapMode m_mapMode = NotMapped;
+};
+
+} // namespace
+
+struct FrameRecorder::Frame {
+    FrameHeader header;
+    // only grows, so a steady stream of equally sized frames does not allocate
+    std::vector<uchar> payload;
+};
+
+FrameRecorder::FrameRecorder(const QString& fileName, int bufferedFrames)
+    : m_file(fileName)
+    , m_freeFrames(static_cast<size_t>(std::max(1, bufferedFrames)))
+    , m_queuedFrames(static_cast<size_t>(std::max(1, bufferedFrames)))
+{
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, FileMagic, sizeof(FileMagic));
+    header.byteOrder = ByteOrderMark;
+    header.version = Version;
+    header.headerSize = sizeof(FileHeader);
+
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+        || m_file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)) {
+        qCWarning(framerecording) << "Cannot record to" << fileName << "-" << m_file.errorString();
+        return;
+    }
+
+    for (int i = 0; i < std::max(1, bufferedFrames); i++) {
+        std::unique_ptr<Frame> frame(new Frame);
+        m_freeFrames.tryPush(frame.get());
+        m_frames.push_back(std::move(frame));
+    }
+
+    m_writer = QThread::create([this]() { writeFrames(); });
+    m_writer->setObjectName(QStringLiteral("CocoDetectionRecorder"));
+    m_writer->start();
+    qCInfo(framerecording) << "Recording frames to" << fileName;
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    if (m_writer) {
+        m_stopRequested.store(true, std::memory_order_release);
+        m_queuedFrames.wakeAll(1);
+        m_writer->wait();
+        delete m_writer;
+        qCInfo(framerecording) << "Recorded" << recordedFrames() << "frames to" << m_file.fileName() << "-"
+                               << droppedFrames() << "dropped";
+    }
+}
+
+bool FrameRecorder::record(QVideoFrame& frame, const QVideoSurfaceFormat& surfaceFormat, qint64 captureTime)
+{
+    if (!m_writer) {
+        return false;
+    }
+
+    // better a gap in the recording than a stalled camera
+    Frame* recorded = nullptr;
+    if (!m_freeFrames.tryPop(recorded)) {
+        m_droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    if (!copyFrame(frame, surfaceFormat, captureTime, recorded)) {
+        m_freeFrames.tryPush(recorded);
+        m_droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    m_queuedFrames.push(recorded);
+    return true;
+}
+
+bool FrameRecorder::copyFrame(QVideoFrame& frame, const QVideoSurfaceFormat& surfaceFormat, qint64 captureTime,
+                              Frame* recorded)
+{
+    if (!frame.map(QAbstractVideoBuffer::ReadOnly)) {
+        return false;
+    }
+
+    // the plane offsets are kept, so all planes have to live in the mapped range
+    const qint64 size = frame.mappedBytes();
+    const int planeCount = frame.planeCount();
+    if (size <= 0 || planeCount < 1 || planeCount > 4) {
+        frame.unmap();
+        return false;
+    }
+    for (int plane = 1; plane < planeCount; plane++) {
+        const ptrdiff_t offset = frame.bits(plane) - frame.bits(0);
+        if (offset < 0 || offset >= size) {
+            frame.unmap();
+            return false;
+        }
+    }
+
+    if (m_firstCaptureTime < 0) {
+        m_firstCaptureTime = captureTime;
+    }
+
+    FrameHeader& header = recorded->header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, FrameMagic, sizeof(FrameMagic));
+    header.headerSize = sizeof(FrameHeader);
+    header.payloadSize = static_cast<quint64>(size);
+    header.captureTime = captureTime - m_firstCaptureTime;
+    header.startTime = frame.startTime();
+    header.endTime = frame.endTime();
+    header.pixelFormat = frame.pixelFormat();
+    header.width = frame.width();
+    header.height = frame.height();
+    header.planeCount = planeCount;
+    for (int plane = 0; plane < planeCount; plane++) {
+        header.bytesPerLine[plane] = frame.bytesPerLine(plane);
+        header.planeOffset[plane] = static_cast<quint32>(frame.bits(plane) - frame.bits(0));
+    }
+    const QRect viewport = surfaceFormat.viewport();
+    header.viewport[0] = viewport.x();
+    header.viewport[1] = viewport.y();
+    header.viewport[2] = viewport.width();
+    header.viewport[3] = viewport.height();
+    header.scanLineDirection = surfaceFormat.scanLineDirection();
+    header.yCbCrColorSpace = surfaceFormat.yCbCrColorSpace();
+    header.frameRate = surfaceFormat.frameRate();
+    header.mirrored = surfaceFormat.property("mirrored").toBool() ? 1 : 0;
+
+    if (recorded->payload.size() < static_cast<size_t>(size)) {
+        recorded->payload.resize(static_cast<size_t>(size));
+    }
+    std::memcpy(recorded->payload.data(), frame.bits(), static_cast<size_t>(size));
+
+    frame.unmap();
+    return true;
+}
+
+void FrameRecorder::writeFrames()
+{
+    static const char padding[Alignment] = {};
+    bool failed = false;
+
+    const auto write = [&](Frame* recorded) {
+        const FrameHeader& header = recorded->header;
+        const qint64 payloadSize = static_cast<qint64>(header.payloadSize);
+        const qint64 paddingSize = alignedSize(payloadSize) - payloadSize;
+
+        // after a failed write the file ends with a partial frame, which FrameRecording ignores
+        failed = failed || m_file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)
+            || m_file.write(reinterpret_cast<const char*>(recorded->payload.data()), payloadSize) != payloadSize
+            || m_file.write(padding, paddingSize) != paddingSize;
+        if (failed) {
+            m_droppedFrames.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            m_recordedFrames.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    Frame* recorded = nullptr;
+    while (m_queuedFrames.pop(recorded, m_stopRequested)) {
+        const bool failedBefore = failed;
+        write(recorded);
+        if (failed && !failedBefore) {
+            qCWarning(framerecording) << "Cannot write to" << m_file.fileName() << "-" << m_file.errorString();
+        }
+        m_freeFrames.tryPush(recorded);
+    }
+
+    // the frames queued before the recorder was destroyed still belong to the recording
+    while (m_queuedFrames.tryPop(recorded)) {
+        write(recorded);
+    }
+    m_file.close();
+}
+
+
+struct FrameRecording::Mapping {
+    QFile file;
+    const uchar* data = nullptr;
+    qint64 size = 0;
+};
+
+FrameRecording::FrameRecording(const QString& fileName)
+{
+    std::shared_ptr<Mapping> mapping = std::make_shared<Mapping>();
+    mapping->file.setFileName(fileName);
+    if (!mapping->file.open(QIODevice::ReadOnly)) {
+        m_errorString = mapping->file.errorString();
+        return;
+    }
+
+    mapping->size = mapping->file.size();
+    if (mapping->size < qint64(sizeof(FileHeader))) {
+        m_errorString = QStringLiteral("Not a frame recording");
+        return;
+    }
+    mapping->data = mapping->file.map(0, mapping->size);
+    if (!mapping->data) {
+        m_errorString = mapping->file.errorString();
+        return;
+    }
+
+    FileHeader header;
+    std::memcpy(&header, mapping->data, sizeof(header));
+    if (std::memcmp(header.magic, FileMagic, sizeof(FileMagic)) != 0 || header.headerSize < sizeof(FileHeader)) {
+        m_errorString = QStringLiteral("Not a frame recording");
+        return;
+    }
+    if (header.byteOrder != ByteOrderMark) {
+        m_errorString = QStringLiteral("Recorded on a machine of the other byte order");
+        return;
+    }
+    if (header.version != Version) {
+        m_errorString = QStringLiteral("Unsupported recording version %1").arg(header.version);
+        return;
+    }
+
+    qint64 offset = header.headerSize;
+    while (mapping->size - offset >= qint64(sizeof(FrameHeader))) {
+        FrameHeader frameHeader;
+        std::memcpy(&frameHeader, mapping->data + offset, sizeof(frameHeader));
+        if (!isFrameHeader(frameHeader, mapping->size - offset)) {
+            break;
+        }
+        m_frames.append(offset);
+        offset += frameHeader.headerSize + alignedSize(static_cast<qint64>(frameHeader.payloadSize));
+    }
+
+    if (offset < mapping->size) {
+        qCWarning(framerecording) << fileName << "ends with an incomplete frame after" << m_frames.size() << "frames";
+    }
+    m_mapping = std::move(mapping);
+}
+
+qint64 FrameRecording::captureTime(int index) const
+{
+    FrameHeader header;
+    std::memcpy(&header, m_mapping->data + m_frames.at(index), sizeof(header));
+    return header.captureTime;
+}
+
+QVideoFrame FrameRecording::frame(int index) const
+{
+    FrameHeader header;
+    std::memcpy(&header, m_mapping->data + m_frames.at(index), sizeof(header));
+    const uchar* payload = m_mapping->data + m_frames.at(index) + header.headerSize;
+
+    QVideoFrame frame(new RecordedVideoBuffer(m_mapping, header, payload), QSize(header.width, header.height),
+                      static_cast<QVideoFrame::PixelFormat>(header.pixelFormat));
+    frame.setStartTime(header.startTime);
+    frame.setEndTime(header.endTime);
+    return frame;
+}
+
+QVideoSurfaceFormat FrameRecording::surfaceFormat(int index) const
+{
+    FrameHeader header;
+    std::memcpy(&header, m_mapping->data + m_frames.at(index), sizeof(header));
+
+    QVideoSurfaceFormat format(QSize(header.width, header.height),
+                               static_cast<QVideoFrame::PixelFormat>(header.pixelFormat));
+    format.setViewport(QRect(header.viewport[0], header.viewport[1], header.viewport[2], header.viewport[3]));
+    format.setScanLineDirection(static_cast<QVideoSurfaceFormat::Direction>(header.scanLineDirection));
+    format.setYCbCrColorSpace(static_cast<QVideoSurfaceFormat::YCbCrColorSpace>(header.yCbCrColorSpace));
+    format.setFrameRate(header.frameRate);
+    if (header.mirrored) {
+        format.setProperty("mirrored", true);
+    }
+    return format;
+}
@@ -0,0 +1,103 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FRAME_RECORDING__
+#define __FRAME_RECORDING__
+
+#include "boundedqueue.h"
+
+#include <QFile>
+#include <QLoggingCategory>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include <QVideoFrame>
+#include <QVideoSurfaceFormat>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+Q_DECLARE_LOGGING_CATEGORY(framerecording)
+
+/*
+ * Writes the frames a filter sees into a recording that FrameRecording can
+ * replay: the mapped planes in their native pixel format, the frame times,
+ * the time the frame reached the filter and the QVideoSurfaceFormat.
+ *
+ * record() copies the frame into one of a few recycled buffers, a writer
+ * thread appends them to the file. When the disk does not keep up the frame
+ * is dropped rather than stalling the video thread.
+ */
+class FrameRecorder
+{
+public:
+    explicit FrameRecorder(const QString& fileName, int bufferedFrames = 8);
+    // writes the frames still queued
+    ~FrameRecorder();
+
+    bool isOpen() const { return m_writer != nullptr; }
+    QString fileName() const { return m_file.fileName(); }
+
+    // called from the video thread; captureTime is ns on any steady clock, e.g. PipelineStats::now()
+    bool record(QVideoFrame& frame, const QVideoSurfaceFormat& surfaceFormat, qint64 captureTime);
+
+    quint64 recordedFrames() const { return m_recordedFrames.load(std::memory_order_relaxed); }
+    quint64 droppedFrames() const { return m_droppedFrames.load(std::memory_order_relaxed); }
+
+private:
+    struct Frame;
+
+    bool copyFrame(QVideoFrame& frame, const QVideoSurfaceFormat& surfaceFormat, qint64 captureTime, Frame* recorded);
+    void writeFrames();
+
+    QFile m_file;
+    QThread* m_writer = nullptr;
+    std::atomic<bool> m_stopRequested { false };
+
+    // only touched by the video thread
+    qint64 m_firstCaptureTime = -1;
+
+    std::vector<std::unique_ptr<Frame>> m_frames;
+    BoundedQueue<Frame*> m_freeFrames;
+    BlockingBoundedQueue<Frame*> m_queuedFrames;
+
+    std::atomic<quint64> m_recordedFrames { 0 };
+    std::atomic<quint64> m_droppedFrames { 0 };
+};
+
+/*
+ * A recording of FrameRecorder, memory mapped. The frames it hands out are
+ * read-only QVideoFrames pointing into the mapping, so replaying them costs
+ * no more than a camera delivering mapped memory. A recording cut short,
+ * e.g. by a crash, ends with its last complete frame.
+ */
+class FrameRecording
+{
+public:
+    explicit FrameRecording(const QString& fileName);
+
+    bool isValid() const { return m_mapping != nullptr; }
+    QString errorString() const { return m_errorString; }
+
+    int frameCount() const { return m_frames.size(); }
+    // ns from the first frame reaching the filter to this one
+    qint64 captureTime(int index) const;
+    // shares the mapping, which stays valid as long as the frame exists
+    QVideoFrame frame(int index) const;
+    QVideoSurfaceFormat surfaceFormat(int index) const;
+
+private:
+    struct Mapping;
+
+    std::shared_ptr<const Mapping> m_mapping;
+    QString m_errorString;
+    // offsets of the frame headers
+    QVector<qint64> m_frames;
+};
+
+#endif // __FRAME_RECORDING__
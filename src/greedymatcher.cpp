@@ -0,0 +1,45 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "greedymatcher.h"
+
+#include <algorithm>
+
+void GreedyMatcher::clear()
+{
+    m_candidates.clear();
+}
+
+void GreedyMatcher::addCandidate(int object, int detection, double overlap)
+{
+    m_candidates.append(Candidate { object, detection, overlap });
+}
+
+void GreedyMatcher::match(int objectCount, int detectionCount)
+{
+    // ties in the order the pairs were added, like a stable sort, which would allocate a buffer
+    std::sort(m_candidates.begin(), m_candidates.end(), [](const Candidate& a, const Candidate& b) {
+        if (a.overlap != b.overlap) {
+            return a.overlap > b.overlap;
+        }
+        return a.object != b.object ? a.object < b.object : a.detection < b.detection;
+    });
+
+    m_objectToDetection.fill(-1, objectCount);
+    m_detectionMatched.fill(false, detectionCount);
+    for (const Candidate& candidate : m_candidates) {
+        if (m_objectToDetection.at(candidate.object) < 0 && !m_detectionMatched.at(candidate.detection)) {
+            m_objectToDetection[candidate.object] = candidate.detection;
+            m_detectionMatched[candidate.detection] = true;
+        }
+    }
+}
+
+int GreedyMatcher::unmatchedDetectionCount() const
+{
+    return static_cast<int>(std::count(m_detectionMatched.cbegin(), m_detectionMatched.cend(), false));
+}
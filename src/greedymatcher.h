@@ -0,0 +1,47 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __GREEDY_MATCHER__
+#define __GREEDY_MATCHER__
+
+#include <QVector>
+
+/*
+ * Associates the objects known so far (model rows, tracks) one to one with
+ * new detections. The caller adds every pair that may match with its
+ * overlap, match() then takes the pairs best overlap first, ties in the
+ * order they were added. The buffers are kept, so matching the same number
+ * of objects again does not allocate.
+ */
+class GreedyMatcher
+{
+public:
+    // starts a new round of candidates
+    void clear();
+    void addCandidate(int object, int detection, double overlap);
+    void match(int objectCount, int detectionCount);
+
+    // the detection of every object, -1 for objects without one; valid until the next match(),
+    // the caller may remove entries from it
+    QVector<int>& objectToDetection() { return m_objectToDetection; }
+    const QVector<int>& objectToDetection() const { return m_objectToDetection; }
+    bool isDetectionMatched(int detection) const { return m_detectionMatched.at(detection); }
+    int unmatchedDetectionCount() const;
+
+private:
+    struct Candidate {
+        int object;
+        int detection;
+        double overlap;
+    };
+
+    QVector<Candidate> m_candidates;
+    QVector<int> m_objectToDetection;
+    QVector<bool> m_detectionMatched;
+};
+
+#endif // __GREEDY_MATCHER__
@@ -0,0 +1,662 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "imagepreprocessor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PREPROCESSOR_HAS_VEC4
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PREPROCESSOR_HAS_VEC4
+#endif
+
+namespace {
+
+const int SourceChannels = 3;
+
+struct LayoutInfo {
+    int bytesPerPixel;
+    int red;
+    int green;
+    int blue;
+};
+
+LayoutInfo layoutInfo(PixelLayout layout)
+{
+    switch (layout) {
+    case PixelLayout::BGR888:
+        return { 3, 2, 1, 0 };
+    case PixelLayout::RGBX8888:
+        return { 4, 0, 1, 2 };
+    case PixelLayout::BGRX8888:
+        return { 4, 2, 1, 0 };
+    case PixelLayout::XRGB8888:
+        return { 4, 1, 2, 3 };
+    case PixelLayout::XBGR8888:
+        return { 4, 3, 2, 1 };
+    default:
+        return { 3, 0, 1, 2 };
+    }
+}
+
+struct ColorConversion {
+    float yOffset;
+    float yScale;
+    float redFromV;
+    float greenFromU;
+    float greenFromV;
+    float blueFromU;
+};
+
+ColorConversion colorConversion(YuvColorSpace colorSpace)
+{
+    switch (colorSpace) {
+    case YuvColorSpace::BT709:
+        return { 16.0f, 1.164383f, 1.792741f, -0.213249f, -0.532909f, 2.112402f };
+    case YuvColorSpace::JPEG:
+        return { 0.0f, 1.0f, 1.402f, -0.344136f, -0.714136f, 1.772f };
+    default:
+        return { 16.0f, 1.164383f, 1.596027f, -0.391762f, -0.812968f, 2.017232f };
+    }
+}
+
+template <typename T> inline T castToTarget(float value);
+
+template <> inline float castToTarget<float>(float value)
+{
+    return value;
+}
+
+template <> inline uint8_t castToTarget<uint8_t>(float value)
+{
+    return static_cast<uint8_t>(std::min(255L, std::max(0L, std::lrint(value))));
+}
+
+template <> inline int8_t castToTarget<int8_t>(float value)
+{
+    return static_cast<int8_t>(std::min(127L, std::max(-128L, std::lrint(value))));
+}
+
+// value is a pixel in [0, 255], int8 targets are shifted by the -128 bias
+template <typename T> inline T fixedToTarget(int32_t value);
+
+template <> inline uint8_t fixedToTarget<uint8_t>(int32_t value)
+{
+    return static_cast<uint8_t>(value);
+}
+
+template <> inline int8_t fixedToTarget<int8_t>(int32_t value)
+{
+    return static_cast<int8_t>(value - 128);
+}
+
+const int FixedShift = 8;
+const int32_t FixedOne = 1 << FixedShift;
+
+void toFixedWeights(const std::vector<float>& weights, std::vector<int32_t>& fixedWeights)
+{
+    fixedWeights.resize(weights.size());
+    for (size_t i = 0; i < weights.size(); i++) {
+        fixedWeights[i] = static_cast<int32_t>(std::lrint(weights[i] * FixedOne));
+    }
+}
+
+// same coordinate mapping as TFLite's resize_bilinear with align_corners = false
+// and half_pixel_centers = false
+void buildSamplingTable(int sourceSize, int targetSize, std::vector<int>& lower,
+                        std::vector<int>& upper, std::vector<float>& weight)
+{
+    lower.resize(targetSize);
+    upper.resize(targetSize);
+    weight.resize(targetSize);
+
+    const float scale = static_cast<float>(sourceSize) / static_cast<float>(targetSize);
+    for (int i = 0; i < targetSize; i++) {
+        const float in = i * scale;
+        const int low = std::min(static_cast<int>(in), sourceSize - 1);
+        lower[i] = low;
+        upper[i] = std::min(low + 1, sourceSize - 1);
+        weight[i] = in - low;
+    }
+}
+
+#ifdef PREPROCESSOR_HAS_VEC4
+#if defined(__SSE2__)
+typedef __m128 Vec4;
+inline Vec4 load(const float* p) { return _mm_loadu_ps(p); }
+inline void store(float* p, Vec4 v) { _mm_storeu_ps(p, v); }
+inline Vec4 splat(float value) { return _mm_set1_ps(value); }
+inline Vec4 add(Vec4 a, Vec4 b) { return _mm_add_ps(a, b); }
+inline Vec4 sub(Vec4 a, Vec4 b) { return _mm_sub_ps(a, b); }
+inline Vec4 mul(Vec4 a, Vec4 b) { return _mm_mul_ps(a, b); }
+inline Vec4 clamp(Vec4 v, Vec4 low, Vec4 high) { return _mm_min_ps(_mm_max_ps(v, low), high); }
+#else
+typedef float32x4_t Vec4;
+inline Vec4 load(const float* p) { return vld1q_f32(p); }
+inline void store(float* p, Vec4 v) { vst1q_f32(p, v); }
+inline Vec4 splat(float value) { return vdupq_n_f32(value); }
+inline Vec4 add(Vec4 a, Vec4 b) { return vaddq_f32(a, b); }
+inline Vec4 sub(Vec4 a, Vec4 b) { return vsubq_f32(a, b); }
+inline Vec4 mul(Vec4 a, Vec4 b) { return vmulq_f32(a, b); }
+inline Vec4 clamp(Vec4 v, Vec4 low, Vec4 high) { return vminq_f32(vmaxq_f32(v, low), high); }
+#endif
+#endif
+
+/*
+ * Blends two planar rows vertically, converts YUV to RGB if requested and
+ * applies the normalization. Input and output hold the three channels as
+ * consecutive blocks of width floats.
+ */
+template <bool Yuv>
+void blendRows(const float* top, const float* bottom, float weight, int width,
+               const ColorConversion& conversion, float scale, float bias, float* out)
+{
+    int x = 0;
+
+#ifdef PREPROCESSOR_HAS_VEC4
+    const Vec4 w = splat(weight);
+    const Vec4 s = splat(scale);
+    const Vec4 b = splat(bias);
+    const Vec4 yOffset = splat(conversion.yOffset);
+    const Vec4 yScale = splat(conversion.yScale);
+    const Vec4 chromaOffset = splat(128.0f);
+    const Vec4 redFromV = splat(conversion.redFromV);
+    const Vec4 greenFromU = splat(conversion.greenFromU);
+    const Vec4 greenFromV = splat(conversion.greenFromV);
+    const Vec4 blueFromU = splat(conversion.blueFromU);
+    const Vec4 low = splat(0.0f);
+    const Vec4 high = splat(255.0f);
+
+    for (; x + 4 <= width; x += 4) {
+        Vec4 channel[SourceChannels];
+        for (int c = 0; c < SourceChannels; c++) {
+            const Vec4 upper = load(top + c * width + x);
+            channel[c] = add(upper, mul(sub(load(bottom + c * width + x), upper), w));
+        }
+
+        if (Yuv) {
+            const Vec4 y = mul(sub(channel[0], yOffset), yScale);
+            const Vec4 u = sub(channel[1], chromaOffset);
+            const Vec4 v = sub(channel[2], chromaOffset);
+            channel[0] = clamp(add(y, mul(v, redFromV)), low, high);
+            channel[1] = clamp(add(y, add(mul(u, greenFromU), mul(v, greenFromV))), low, high);
+            channel[2] = clamp(add(y, mul(u, blueFromU)), low, high);
+        }
+
+        for (int c = 0; c < SourceChannels; c++) {
+            store(out + c * width + x, add(mul(channel[c], s), b));
+        }
+    }
+#endif
+
+    for (; x < width; x++) {
+        float channel[SourceChannels];
+        for (int c = 0; c < SourceChannels; c++) {
+            const float upper = top[c * width + x];
+            channel[c] = upper + (bottom[c * width + x] - upper) * weight;
+        }
+
+        if (Yuv) {
+            const float y = (channel[0] - conversion.yOffset) * conversion.yScale;
+            const float u = channel[1] - 128.0f;
+            const float v = channel[2] - 128.0f;
+            channel[0] = std::min(255.0f, std::max(0.0f, y + v * conversion.redFromV));
+            channel[1] = std::min(255.0f, std::max(0.0f, y + u * conversion.greenFromU + v * conversion.greenFromV));
+            channel[2] = std::min(255.0f, std::max(0.0f, y + u * conversion.blueFromU));
+        }
+
+        for (int c = 0; c < SourceChannels; c++) {
+            out[c * width + x] = channel[c] * scale + bias;
+        }
+    }
+}
+
+} // namespace
+
+int SourceImage::planeCount() const
+{
+    switch (layout) {
+    case PixelLayout::NV12:
+    case PixelLayout::NV21:
+        return 2;
+    case PixelLayout::YUV420P:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+bool SourceImage::isValid() const
+{
+    if (width <= 0 || height <= 0) {
+        return false;
+    }
+
+    for (int plane = 0; plane < planeCount(); plane++) {
+        if (!data[plane] || stride[plane] == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int SourceImage::uprightWidth() const
+{
+    return rotation == ImageRotation::Clockwise90 || rotation == ImageRotation::Clockwise270 ? height : width;
+}
+
+int SourceImage::uprightHeight() const
+{
+    return rotation == ImageRotation::Clockwise90 || rotation == ImageRotation::Clockwise270 ? width : height;
+}
+
+SourceImage SourceImage::cropped(int x, int y, int cropWidth, int cropHeight) const
+{
+    x = std::max(0, x);
+    y = std::max(0, y);
+    cropWidth = std::min(cropWidth, width - x);
+    cropHeight = std::min(cropHeight, height - y);
+
+    const bool subsampledColumns = isYuv();
+    const bool subsampledRows = layout == PixelLayout::NV12 || layout == PixelLayout::NV21 || layout == PixelLayout::YUV420P;
+    if (subsampledColumns) {
+        x &= ~1;
+        cropWidth &= ~1;
+    }
+    if (subsampledRows) {
+        y &= ~1;
+        cropHeight &= ~1;
+    }
+
+    SourceImage crop = *this;
+    crop.width = std::max(0, cropWidth);
+    crop.height = std::max(0, cropHeight);
+
+    switch (layout) {
+    case PixelLayout::RGB888:
+    case PixelLayout::BGR888:
+        crop.data[0] += static_cast<ptrdiff_t>(y) * stride[0] + 3 * x;
+        break;
+    case PixelLayout::RGBX8888:
+    case PixelLayout::BGRX8888:
+    case PixelLayout::XRGB8888:
+    case PixelLayout::XBGR8888:
+        crop.data[0] += static_cast<ptrdiff_t>(y) * stride[0] + 4 * x;
+        break;
+    case PixelLayout::NV12:
+    case PixelLayout::NV21:
+        crop.data[0] += static_cast<ptrdiff_t>(y) * stride[0] + x;
+        // interleaved chroma, one pair per two luma columns
+        crop.data[1] += static_cast<ptrdiff_t>(y / 2) * stride[1] + x;
+        break;
+    case PixelLayout::YUV420P:
+        crop.data[0] += static_cast<ptrdiff_t>(y) * stride[0] + x;
+        crop.data[1] += static_cast<ptrdiff_t>(y / 2) * stride[1] + x / 2;
+        crop.data[2] += static_cast<ptrdiff_t>(y / 2) * stride[2] + x / 2;
+        break;
+    case PixelLayout::YUYV:
+    case PixelLayout::UYVY:
+        crop.data[0] += static_cast<ptrdiff_t>(y) * stride[0] + 2 * x;
+        break;
+    }
+    return crop;
+}
+
+bool ImagePreprocessor::configure(int targetWidth, int targetHeight, int targetChannels, TfLiteType targetType)
+{
+    m_targetType = kTfLiteNoType;
+
+    if (targetWidth <= 0 || targetHeight <= 0 || targetChannels != SourceChannels) {
+        return false;
+    }
+
+    if (targetType != kTfLiteFloat32 && targetType != kTfLiteInt8 && targetType != kTfLiteUInt8) {
+        return false;
+    }
+
+    m_targetWidth = targetWidth;
+    m_targetHeight = targetHeight;
+    m_targetType = targetType;
+
+    for (auto& rowBuffer : m_rowBuffer) {
+        rowBuffer.assign(m_targetWidth * SourceChannels, 0.0f);
+    }
+    m_outputRow.assign(m_targetWidth * SourceChannels, 0.0f);
+    for (auto& rowBuffer : m_fixedRowBuffer) {
+        rowBuffer.assign(m_targetWidth * SourceChannels, 0);
+    }
+
+    // force a rebuild of the sampling tables on the next frame
+    m_hasSource = false;
+
+    setNormalization(m_mean, m_stddev);
+    return true;
+}
+
+void ImagePreprocessor::setNormalization(float mean, float stddev)
+{
+    m_mean = mean;
+    m_stddev = stddev;
+
+    switch (m_targetType) {
+    case kTfLiteFloat32:
+        m_scale = 1.0f / m_stddev;
+        m_bias = -m_mean / m_stddev;
+        break;
+    case kTfLiteInt8:
+        m_scale = 1.0f;
+        m_bias = -128.0f;
+        break;
+    default:
+        m_scale = 1.0f;
+        m_bias = 0.0f;
+        break;
+    }
+}
+
+size_t ImagePreprocessor::targetSize() const
+{
+    if (!isConfigured()) {
+        return 0;
+    }
+
+    const size_t elementSize = m_targetType == kTfLiteFloat32 ? sizeof(float) : sizeof(uint8_t);
+    return elementSize * m_targetWidth * m_targetHeight * SourceChannels;
+}
+
+bool ImagePreprocessor::process(const SourceImage& image, TfLiteTensor* tensor)
+{
+    if (!tensor || tensor->type != m_targetType) {
+        return false;
+    }
+
+    if (tensor->bytes < targetSize()) {
+        return false;
+    }
+
+    return process(image, tensor->data.raw);
+}
+
+bool ImagePreprocessor::process(const SourceImage& image, void* target)
+{
+    if (!isConfigured() || !image.isValid() || !target) {
+        return false;
+    }
+
+    if (needsUpdate(image)) {
+        updateSourceGeometry(image);
+    }
+    // the tables stay valid, only the plane pointers change from frame to frame
+    m_source = image;
+
+    // 8 bit targets are not normalized, without a colour conversion there is no need for floats
+    const bool fixedPoint = !m_source.isYuv();
+
+    switch (m_targetType) {
+    case kTfLiteFloat32:
+        processRows(static_cast<float*>(target));
+        break;
+    case kTfLiteInt8:
+        if (fixedPoint) {
+            processRowsFixed(static_cast<int8_t*>(target));
+        } else {
+            processRows(static_cast<int8_t*>(target));
+        }
+        break;
+    case kTfLiteUInt8:
+        if (fixedPoint) {
+            processRowsFixed(static_cast<uint8_t*>(target));
+        } else {
+            processRows(static_cast<uint8_t*>(target));
+        }
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+bool ImagePreprocessor::needsUpdate(const SourceImage& image) const
+{
+    if (!m_hasSource || image.width != m_source.width || image.height != m_source.height
+            || image.layout != m_source.layout || image.rotation != m_source.rotation) {
+        return true;
+    }
+
+    for (int plane = 0; plane < image.planeCount(); plane++) {
+        if (image.stride[plane] != m_source.stride[plane]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ImagePreprocessor::updateSourceGeometry(const SourceImage& image)
+{
+    m_source = image;
+    m_hasSource = true;
+
+    // plane, byte offset, x step, horizontal and vertical subsampling of each component
+    switch (image.layout) {
+    case PixelLayout::NV12:
+    case PixelLayout::NV21: {
+        const bool nv21 = image.layout == PixelLayout::NV21;
+        m_channels[0] = ChannelSampler(0, 0, 1, 1, 1);
+        m_channels[1] = ChannelSampler(1, nv21 ? 1 : 0, 2, 2, 2);
+        m_channels[2] = ChannelSampler(1, nv21 ? 0 : 1, 2, 2, 2);
+        break;
+    }
+    case PixelLayout::YUV420P:
+        m_channels[0] = ChannelSampler(0, 0, 1, 1, 1);
+        m_channels[1] = ChannelSampler(1, 0, 1, 2, 2);
+        m_channels[2] = ChannelSampler(2, 0, 1, 2, 2);
+        break;
+    case PixelLayout::YUYV:
+        m_channels[0] = ChannelSampler(0, 0, 2, 1, 1);
+        m_channels[1] = ChannelSampler(0, 1, 4, 2, 1);
+        m_channels[2] = ChannelSampler(0, 3, 4, 2, 1);
+        break;
+    case PixelLayout::UYVY:
+        m_channels[0] = ChannelSampler(0, 1, 2, 1, 1);
+        m_channels[1] = ChannelSampler(0, 0, 4, 2, 1);
+        m_channels[2] = ChannelSampler(0, 2, 4, 2, 1);
+        break;
+    default: {
+        const LayoutInfo info = layoutInfo(image.layout);
+        m_channels[0] = ChannelSampler(0, info.red, info.bytesPerPixel, 1, 1);
+        m_channels[1] = ChannelSampler(0, info.green, info.bytesPerPixel, 1, 1);
+        m_channels[2] = ChannelSampler(0, info.blue, info.bytesPerPixel, 1, 1);
+        break;
+    }
+    }
+
+    // the sampling grid lives in upright coordinates, the offsets take care of the rotation
+    std::vector<int> left;
+    std::vector<int> right;
+    buildSamplingTable(image.uprightWidth(), m_targetWidth, left, right, m_xWeight);
+
+    for (auto& channel : m_channels) {
+        channel.offsetLeft.resize(m_targetWidth);
+        channel.offsetRight.resize(m_targetWidth);
+        for (int x = 0; x < m_targetWidth; x++) {
+            channel.offsetLeft[x] = columnOffset(channel, left[x]);
+            channel.offsetRight[x] = columnOffset(channel, right[x]);
+        }
+    }
+
+    buildSamplingTable(image.uprightHeight(), m_targetHeight, m_yRowTop, m_yRowBottom, m_yWeight);
+
+    toFixedWeights(m_xWeight, m_xWeightFixed);
+    toFixedWeights(m_yWeight, m_yWeightFixed);
+}
+
+// byte offset of an upright row within a plane
+int ImagePreprocessor::rowOffset(const ChannelSampler& channel, int row) const
+{
+    const int stride = m_source.stride[channel.plane];
+
+    switch (m_source.rotation) {
+    case ImageRotation::Clockwise90:
+        return (row / channel.horizontalSubsampling) * channel.xStep;
+    case ImageRotation::Clockwise180:
+        return ((m_source.height - 1 - row) / channel.verticalSubsampling) * stride;
+    case ImageRotation::Clockwise270:
+        return ((m_source.width - 1 - row) / channel.horizontalSubsampling) * channel.xStep;
+    default:
+        return (row / channel.verticalSubsampling) * stride;
+    }
+}
+
+// byte offset of an upright column relative to the row offset
+int ImagePreprocessor::columnOffset(const ChannelSampler& channel, int column) const
+{
+    const int stride = m_source.stride[channel.plane];
+
+    switch (m_source.rotation) {
+    case ImageRotation::Clockwise90:
+        return ((m_source.height - 1 - column) / channel.verticalSubsampling) * stride;
+    case ImageRotation::Clockwise180:
+        return ((m_source.width - 1 - column) / channel.horizontalSubsampling) * channel.xStep;
+    case ImageRotation::Clockwise270:
+        return (column / channel.verticalSubsampling) * stride;
+    default:
+        return (column / channel.horizontalSubsampling) * channel.xStep;
+    }
+}
+
+void ImagePreprocessor::interpolateRow(int row, float* out) const
+{
+    const float* weight = m_xWeight.data();
+
+    for (const auto& channel : m_channels) {
+        const uint8_t* base = m_source.data[channel.plane] + channel.byteOffset + rowOffset(channel, row);
+        const int* left = channel.offsetLeft.data();
+        const int* right = channel.offsetRight.data();
+
+        for (int x = 0; x < m_targetWidth; x++) {
+            const float value = base[left[x]];
+            out[x] = value + (base[right[x]] - value) * weight[x];
+        }
+        out += m_targetWidth;
+    }
+}
+
+// horizontally interpolated row in 8 bit fixed point, i.e. pixel values scaled by 256
+void ImagePreprocessor::interpolateRowFixed(int row, int32_t* out) const
+{
+    const int32_t* weight = m_xWeightFixed.data();
+
+    for (const auto& channel : m_channels) {
+        const uint8_t* base = m_source.data[channel.plane] + channel.byteOffset + rowOffset(channel, row);
+        const int* left = channel.offsetLeft.data();
+        const int* right = channel.offsetRight.data();
+
+        for (int x = 0; x < m_targetWidth; x++) {
+            const int32_t value = base[left[x]];
+            out[x] = (value << FixedShift) + (base[right[x]] - value) * weight[x];
+        }
+        out += m_targetWidth;
+    }
+}
+
+template <typename T>
+void ImagePreprocessor::processRowsFixed(T* out)
+{
+    const int width = m_targetWidth;
+    int cachedRows[2] = { -1, -1 };
+
+    for (int y = 0; y < m_targetHeight; y++) {
+        const int top = m_yRowTop[y];
+        const int bottom = m_yRowBottom[y];
+
+        if (cachedRows[0] != top) {
+            if (cachedRows[1] == top) {
+                std::swap(m_fixedRowBuffer[0], m_fixedRowBuffer[1]);
+                std::swap(cachedRows[0], cachedRows[1]);
+            } else {
+                interpolateRowFixed(top, m_fixedRowBuffer[0].data());
+                cachedRows[0] = top;
+            }
+        }
+
+        if (cachedRows[1] != bottom) {
+            interpolateRowFixed(bottom, m_fixedRowBuffer[1].data());
+            cachedRows[1] = bottom;
+        }
+
+        // both factors carry 8 fractional bits, round away 16 of them
+        const int32_t bottomWeight = m_yWeightFixed[y];
+        const int32_t topWeight = FixedOne - bottomWeight;
+        const int32_t* upper = m_fixedRowBuffer[0].data();
+        const int32_t* lower = m_fixedRowBuffer[1].data();
+
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < SourceChannels; c++) {
+                const int32_t value = upper[c * width + x] * topWeight + lower[c * width + x] * bottomWeight;
+                out[c] = fixedToTarget<T>((value + (1 << (2 * FixedShift - 1))) >> (2 * FixedShift));
+            }
+            out += SourceChannels;
+        }
+    }
+}
+
+template <typename T>
+void ImagePreprocessor::processRows(T* out)
+{
+    const ColorConversion conversion = colorConversion(m_source.colorSpace);
+    const bool yuv = m_source.isYuv();
+    const float* red = m_outputRow.data();
+    const float* green = red + m_targetWidth;
+    const float* blue = green + m_targetWidth;
+
+    // upright rows currently held by m_rowBuffer[0] and m_rowBuffer[1]
+    int cachedRows[2] = { -1, -1 };
+
+    for (int y = 0; y < m_targetHeight; y++) {
+        const int top = m_yRowTop[y];
+        const int bottom = m_yRowBottom[y];
+
+        // the downscaling case usually advances by more than one source row,
+        // when upscaling the previous bottom row becomes the new top row
+        if (cachedRows[0] != top) {
+            if (cachedRows[1] == top) {
+                std::swap(m_rowBuffer[0], m_rowBuffer[1]);
+                std::swap(cachedRows[0], cachedRows[1]);
+            } else {
+                interpolateRow(top, m_rowBuffer[0].data());
+                cachedRows[0] = top;
+            }
+        }
+
+        if (cachedRows[1] != bottom) {
+            interpolateRow(bottom, m_rowBuffer[1].data());
+            cachedRows[1] = bottom;
+        }
+
+        if (yuv) {
+            blendRows<true>(m_rowBuffer[0].data(), m_rowBuffer[1].data(), m_yWeight[y], m_targetWidth,
+                            conversion, m_scale, m_bias, m_outputRow.data());
+        } else {
+            blendRows<false>(m_rowBuffer[0].data(), m_rowBuffer[1].data(), m_yWeight[y], m_targetWidth,
+                             conversion, m_scale, m_bias, m_outputRow.data());
+        }
+
+        for (int x = 0; x < m_targetWidth; x++) {
+            out[0] = castToTarget<T>(red[x]);
+            out[1] = castToTarget<T>(green[x]);
+            out[2] = castToTarget<T>(blue[x]);
+            out += SourceChannels;
+        }
+    }
+}
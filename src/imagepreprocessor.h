@@ -0,0 +1,179 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __IMAGE_PREPROCESSOR__
+#define __IMAGE_PREPROCESSOR__
+
+#include "tensorflow/lite/c/common.h"
+
+#include <cstdint>
+#include <vector>
+
+// byte order of a pixel in memory, X marks an ignored (alpha/padding) byte
+enum class PixelLayout {
+    RGB888,
+    BGR888,
+    RGBX8888,
+    BGRX8888,
+    XRGB8888,
+    XBGR8888,
+    // Y plane followed by an interleaved U/V (NV12) or V/U (NV21) plane at half resolution
+    NV12,
+    NV21,
+    // Y, U and V planes, chroma at half resolution (YV12 is handled by swapping the chroma planes)
+    YUV420P,
+    // packed 4:2:2, two pixels share four bytes
+    YUYV,
+    UYVY
+};
+
+enum class YuvColorSpace {
+    BT601,
+    BT709,
+    // full range BT.601
+    JPEG
+};
+
+// clockwise rotation that turns the source into an upright image
+enum class ImageRotation {
+    None = 0,
+    Clockwise90 = 90,
+    Clockwise180 = 180,
+    Clockwise270 = 270
+};
+
+/*
+ * Describes the pixels handed to the preprocessor without owning them. A
+ * negative stride walks the rows of a plane bottom to top, in that case the
+ * plane pointer points to its last row in memory.
+ */
+struct SourceImage
+{
+    PixelLayout layout = PixelLayout::RGB888;
+    YuvColorSpace colorSpace = YuvColorSpace::BT601;
+    ImageRotation rotation = ImageRotation::None;
+
+    const uint8_t* data[3] = { nullptr, nullptr, nullptr };
+    int stride[3] = { 0, 0, 0 };
+    int width = 0;
+    int height = 0;
+
+    int planeCount() const;
+    bool isYuv() const { return layout >= PixelLayout::NV12; }
+    bool isValid() const;
+
+    // size after applying the rotation, i.e. the image the model gets to see
+    int uprightWidth() const;
+    int uprightHeight() const;
+
+    // view of a part of the image in source coordinates, clipped to the image; the
+    // origin and size are rounded down to even values where the chroma is subsampled
+    SourceImage cropped(int x, int y, int cropWidth, int cropHeight) const;
+};
+
+/*
+ * Resizes (bilinear, same sampling as TFLite's RESIZE_BILINEAR without
+ * align_corners/half_pixel_centers), converts to RGB, rotates, normalizes
+ * and casts a camera image into a model input buffer in a single pass.
+ *
+ * Only the source pixels that contribute to the model input are read, so a
+ * 1080p NV12 frame costs roughly the same as a 300x300 RGB image. Chroma is
+ * sampled nearest-neighbour at luma resolution and converted after blending;
+ * the conversion is affine, so this only differs where colours clip.
+ *
+ * For 8 bit targets and RGB sources the pixels never leave the integer
+ * domain: the interpolation runs in 8 bit fixed point and the result is
+ * written straight to the uint8/int8 target. Results can differ from the
+ * float path by one step due to rounding.
+ *
+ * The instance is meant to live as long as the interpreter it feeds: sampling
+ * tables and row buffers are only rebuilt if the source or target geometry
+ * changes, so processing a frame does not allocate.
+ */
+class ImagePreprocessor
+{
+public:
+    ImagePreprocessor() = default;
+
+    bool configure(int targetWidth, int targetHeight, int targetChannels, TfLiteType targetType);
+    void setNormalization(float mean, float stddev);
+
+    bool isConfigured() const { return m_targetType != kTfLiteNoType; }
+    int targetWidth() const { return m_targetWidth; }
+    int targetHeight() const { return m_targetHeight; }
+    TfLiteType targetType() const { return m_targetType; }
+    // bytes process() writes to a raw target
+    size_t targetSize() const;
+
+    bool process(const SourceImage& image, TfLiteTensor* tensor);
+    bool process(const SourceImage& image, void* target);
+
+private:
+    // reads one colour (or Y/U/V) component of the source
+    struct ChannelSampler {
+        ChannelSampler(int plane = 0, int byteOffset = 0, int xStep = 1,
+                       int horizontalSubsampling = 1, int verticalSubsampling = 1)
+            : plane(plane), byteOffset(byteOffset), xStep(xStep),
+              horizontalSubsampling(horizontalSubsampling), verticalSubsampling(verticalSubsampling) {}
+
+        int plane;
+        int byteOffset;
+        int xStep;
+        int horizontalSubsampling;
+        int verticalSubsampling;
+
+        // byte offsets of the left/right neighbour of every target column, relative to the row base
+        std::vector<int> offsetLeft;
+        std::vector<int> offsetRight;
+    };
+
+    bool needsUpdate(const SourceImage& image) const;
+    void updateSourceGeometry(const SourceImage& image);
+    int rowOffset(const ChannelSampler& channel, int row) const;
+    int columnOffset(const ChannelSampler& channel, int column) const;
+    void interpolateRow(int row, float* out) const;
+    void interpolateRowFixed(int row, int32_t* out) const;
+    template <typename T> void processRows(T* out);
+    template <typename T> void processRowsFixed(T* out);
+
+    int m_targetWidth = 0;
+    int m_targetHeight = 0;
+    TfLiteType m_targetType = kTfLiteNoType;
+
+    // value * m_scale + m_bias is written to the target
+    float m_mean = 127.5f;
+    float m_stddev = 127.5f;
+    float m_scale = 1.0f;
+    float m_bias = 0.0f;
+
+    // the source the current tables were built for
+    SourceImage m_source;
+    bool m_hasSource = false;
+
+    ChannelSampler m_channels[3];
+
+    // horizontal weight of the right neighbour per target column
+    std::vector<float> m_xWeight;
+
+    // vertical sampling in upright coordinates: upper/lower neighbour and weight of the lower one
+    std::vector<int> m_yRowTop;
+    std::vector<int> m_yRowBottom;
+    std::vector<float> m_yWeight;
+
+    // horizontally interpolated upright rows, planar (one block per channel),
+    // reused between neighbouring target rows
+    std::vector<float> m_rowBuffer[2];
+    // vertically blended, converted and normalized planar row
+    std::vector<float> m_outputRow;
+
+    // the same in 8 bit fixed point (weights scaled by 256) for the integer path
+    std::vector<int32_t> m_xWeightFixed;
+    std::vector<int32_t> m_yWeightFixed;
+    std::vector<int32_t> m_fixedRowBuffer[2];
+};
+
+#endif // __IMAGE_PREPROCESSOR__
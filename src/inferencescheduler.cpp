@@ -0,0 +1,517 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "inferencescheduler.h"
+#include "modelcache.h"
+#include "threadtuning.h"
+
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <atomic>
+
+namespace {
+
+// TFLite starts its threads lazily from the thread that invokes it, the XNNPACK delegate right away from
+// the thread that creates it; they inherit that thread's name, so under a name unique to the call they are
+// told apart from the threads other code starts at the same time
+template <typename Invoke>
+QVector<qint64> threadsStartedBy(Invoke invoke)
+{
+    static std::atomic<int> probeCount { 0 };
+    const QByteArray probeName = QByteArrayLiteral("CocoTFLite") + QByteArray::number(probeCount.fetch_add(1));
+    const QByteArray name = ThreadTuning::currentThreadName();
+    const QVector<qint64> threadsBefore = ThreadTuning::threadIds();
+
+    ThreadTuning::setCurrentThreadName(probeName);
+    invoke();
+    ThreadTuning::setCurrentThreadName(name);
+
+    QVector<qint64> newThreads;
+    for (qint64 threadId : ThreadTuning::threadIds()) {
+        if (!threadsBefore.contains(threadId) && ThreadTuning::threadName(threadId) == probeName) {
+            newThreads << threadId;
+        }
+    }
+    return newThreads;
+}
+
+int defaultInterpreterCount()
+{
+    // intra-op threading of MobileNet-SSD hardly scales beyond two threads,
+    // so spread the cores over interpreters of two threads each
+    return std::max(1, QThread::idealThreadCount() / 2);
+}
+
+DelegateOptions delegateOptions(const CocoDetectionSettings& settings)
+{
+    DelegateOptions options;
+    options.mode = static_cast<DelegateOptions::Mode>(settings.delegateMode.load());
+    options.numThreads = settings.delegateThreads.load();
+    options.forceFp16 = settings.delegateFp16.load();
+    options.quantizedKernels = settings.delegateQuantizedKernels.load();
+    return options;
+}
+
+// interpreters with different delegates are not interchangeable, they get schedulers of their own
+QString schedulerKey(const QString& modelFilename, const DelegateOptions& options)
+{
+    const QString path = QFileInfo(modelFilename).canonicalFilePath();
+    return QStringLiteral("%1|%2|%3|%4|%5")
+        .arg(path.isEmpty() ? modelFilename : path)
+        .arg(options.mode)
+        .arg(options.numThreads)
+        .arg(options.forceFp16)
+        .arg(options.quantizedKernels);
+}
+
+QMutex registryMutex;
+QHash<QString, std::weak_ptr<InferenceScheduler>> registry;
+
+} // namespace
+
+std::shared_ptr<InferenceScheduler> InferenceScheduler::acquire(const QString& modelFilename,
+                                                                const std::shared_ptr<CocoDetectionSettings>& settings)
+{
+    const QString key = schedulerKey(modelFilename, delegateOptions(*settings));
+
+    QMutexLocker locker(&registryMutex);
+    std::shared_ptr<InferenceScheduler> scheduler = registry.value(key).lock();
+    if (scheduler) {
+        qCInfo(objectworker) << "Sharing the interpreters of" << modelFilename << "with another stream";
+        return scheduler;
+    }
+
+    scheduler.reset(new InferenceScheduler(modelFilename, settings));
+    registry.insert(key, scheduler);
+    scheduler->start();
+    return scheduler;
+}
+
+InferenceScheduler::InferenceScheduler(const QString& modelFilename, const std::shared_ptr<CocoDetectionSettings>& settings)
+    : m_modelFilename(modelFilename)
+    , m_settings(settings)
+    , m_maxBatchSize(std::max(1, settings->maxBatchSize.load()))
+{
+}
+
+InferenceScheduler::~InferenceScheduler()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopRequested = true;
+        m_workAvailable.wakeAll();
+    }
+
+    // the inference threads are started by the loader, so they are all known once it is done
+    if (m_loader) {
+        m_loader->wait();
+        delete m_loader;
+    }
+
+    {
+        // a thread that was still warming up waits for work only now
+        QMutexLocker locker(&m_mutex);
+        m_workAvailable.wakeAll();
+    }
+
+    for (QThread* thread : m_threads) {
+        thread->wait();
+        delete thread;
+    }
+
+    m_workers.clear();
+}
+
+void InferenceScheduler::start()
+{
+    m_loader = QThread::create([this]() { initialize(); });
+    m_loader->setObjectName(QStringLiteral("InferenceLoader"));
+    m_loader->start();
+}
+
+void InferenceScheduler::setStatus(Status status)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_status.store(status, std::memory_order_release);
+        m_loaded.wakeAll();
+    }
+    emit statusChanged(status, m_loadTime.load(std::memory_order_relaxed), m_warmupTime.load(std::memory_order_relaxed));
+}
+
+bool InferenceScheduler::waitUntilLoaded()
+{
+    QMutexLocker locker(&m_mutex);
+    while (status() == Loading && !m_stopRequested) {
+        m_loaded.wait(&m_mutex);
+    }
+    return status() == Warming || status() == Ready;
+}
+
+void InferenceScheduler::initialize()
+{
+    setStatus(Loading);
+    QElapsedTimer timer;
+    timer.start();
+
+    // the flatbuffer is read-only and shared, every worker gets its own interpreter and arena
+    const std::shared_ptr<const CachedModel> cachedModel = ModelCache::instance().acquire(m_modelFilename);
+    if (cachedModel == nullptr) {
+        setStatus(Error);
+        return;
+    }
+
+    int workerCount = m_settings->workerCount.load();
+    if (workerCount <= 0) {
+        workerCount = defaultInterpreterCount();
+    }
+    const int threadsPerWorker = inferenceThreadCount(*m_settings);
+    qCInfo(objectworker) << "Starting" << workerCount << "workers with" << threadsPerWorker << "threads each";
+
+    const DelegateOptions options = delegateOptions(*m_settings);
+    qCInfo(objectworker) << "Using the" << DelegateOptions::modeName(options.mode) << "delegate";
+
+    const auto stopRequested = [this]() {
+        QMutexLocker locker(&m_mutex);
+        return m_stopRequested;
+    };
+
+    for (int i = 0; i < workerCount && !stopRequested(); i++) {
+        std::unique_ptr<CocoDetectionWorker> worker;
+        // the delegate's thread pool, tuned by the inference thread once it runs
+        const QVector<qint64> delegateThreads = threadsStartedBy([&]() {
+            worker.reset(new CocoDetectionWorker(cachedModel->model, threadsPerWorker, options, i == 0));
+        });
+        if (!worker->isValid()) {
+            qCWarning(objectworker) << "Worker" << i << "could not be initialized";
+            continue;
+        }
+        if (options.mode == DelegateOptions::XnnPack && delegateThreads.isEmpty()
+            && std::max(options.numThreads, threadsPerWorker) > 1) {
+            qCWarning(objectworker) << "Cannot find the XNNPACK threads of worker" << i
+                                    << "- inferenceCpus and workerPriority do not apply to them";
+        }
+        // anchors of models with raw SSD heads, if they differ from the defaults
+        if (cachedModel->hasSsdOptions) {
+            worker->setSsdOptions(cachedModel->ssdOptions);
+        }
+        m_workers.push_back(std::move(worker));
+        m_delegateThreadIds.push_back(delegateThreads);
+    }
+
+    if (m_workers.empty()) {
+        setStatus(Error);
+        return;
+    }
+
+    m_loadTime.store(timer.elapsed(), std::memory_order_relaxed);
+    qCInfo(objectworker) << "Workers ready in" << m_loadTime.load() << "ms, warming up";
+
+    // every inference thread warms up its interpreter first, the last one to finish makes the scheduler ready
+    m_warmupTimer.start();
+    m_pendingWarmups.store(static_cast<int>(m_workers.size()), std::memory_order_relaxed);
+    setStatus(Warming);
+
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        CocoDetectionWorker* worker = m_workers[i].get();
+        const QVector<qint64> delegateThreads = m_delegateThreadIds[i];
+        QThread* thread = QThread::create([this, worker, delegateThreads]() { invokeInputs(worker, delegateThreads); });
+        thread->setObjectName(QStringLiteral("CocoDetectionWorker%1").arg(i));
+        m_threads.push_back(thread);
+    }
+
+    for (QThread* thread : m_threads) {
+        thread->start();
+    }
+}
+
+int InferenceScheduler::inferenceThreadCount(const CocoDetectionSettings& settings)
+{
+    const int threads = settings.inferenceThreads.load(std::memory_order_relaxed);
+    return threads > 0 ? threads : 2;
+}
+
+bool InferenceScheduler::tuneStageThread(const CocoDetectionSettings& settings, ThreadTuningState* state)
+{
+    const int generation = settings.threadingGeneration.load(std::memory_order_acquire);
+    if (generation == state->generation) {
+        return false;
+    }
+    state->generation = generation;
+
+    const qint64 threadId = ThreadTuning::currentThreadId();
+    const quint64 cpus = settings.workerCpus.load(std::memory_order_relaxed);
+    const int priority = settings.workerPriority.load(std::memory_order_relaxed);
+
+    if (!ThreadTuning::setAffinity(threadId, cpus) && cpus != 0) {
+        qCWarning(objectworker) << QThread::currentThread()->objectName() << "cannot be pinned to CPUs"
+                                << ThreadTuning::cpuList(cpus);
+    }
+    if (!ThreadTuning::setPriority(threadId, priority)) {
+        qCWarning(objectworker) << "Cannot set priority" << priority << "of" << QThread::currentThread()->objectName();
+    }
+    return true;
+}
+
+void InferenceScheduler::tuneInferenceThreads(const CocoDetectionSettings& settings, const QVector<qint64>& threadIds)
+{
+    const quint64 cpus = settings.inferenceCpus.load(std::memory_order_relaxed);
+    const int priority = settings.workerPriority.load(std::memory_order_relaxed);
+
+    for (qint64 threadId : threadIds) {
+        if (!ThreadTuning::setAffinity(threadId, cpus) && cpus != 0) {
+            qCWarning(objectworker) << "Inference thread" << threadId << "cannot be pinned to CPUs"
+                                    << ThreadTuning::cpuList(cpus);
+        }
+        if (!ThreadTuning::setPriority(threadId, priority)) {
+            qCWarning(objectworker) << "Cannot set priority" << priority << "of inference thread" << threadId;
+        }
+    }
+}
+
+void InferenceScheduler::addStream(InferenceStream* stream)
+{
+    QMutexLocker locker(&m_mutex);
+    m_streams.append(StreamEntry { stream, 0, 0, false });
+    m_workAvailable.wakeAll();
+}
+
+void InferenceScheduler::removeStream(InferenceStream* stream)
+{
+    QMutexLocker locker(&m_mutex);
+
+    const auto find = [this, stream]() {
+        for (int i = 0; i < m_streams.size(); i++) {
+            if (m_streams.at(i).stream == stream) {
+                return i;
+            }
+        }
+        return -1;
+    };
+
+    int index = find();
+    if (index < 0) {
+        return;
+    }
+
+    // no new jobs, the ones running still finish into the stream
+    m_streams[index].removed = true;
+    while (m_streams.at(index).jobsInFlight > 0) {
+        m_jobFinished.wait(&m_mutex);
+        index = find();
+    }
+
+    m_streams.remove(index);
+    if (m_nextStream >= m_streams.size()) {
+        m_nextStream = 0;
+    }
+}
+
+void InferenceScheduler::notify()
+{
+    QMutexLocker locker(&m_mutex);
+    m_workAvailable.wakeOne();
+}
+
+bool InferenceScheduler::takeJob(InferenceStream::Job* job, int* streamIndex)
+{
+    const int count = m_streams.size();
+    for (int i = 0; i < count; i++) {
+        const int index = (m_nextStream + i) % count;
+        StreamEntry& entry = m_streams[index];
+        if (entry.removed || entry.jobsInFlight >= std::max(1, entry.stream->maxJobsInFlight())
+            || !entry.stream->takeJob(job)) {
+            // a stream without a ready input (or with all the jobs it may have running) loses the rest of its turn
+            entry.credit = 0;
+            continue;
+        }
+
+        entry.jobsInFlight++;
+        if (++entry.credit >= std::max(1, entry.stream->weight())) {
+            entry.credit = 0;
+            m_nextStream = (index + 1) % count;
+        } else {
+            m_nextStream = index;
+        }
+        *streamIndex = index;
+        return true;
+    }
+    return false;
+}
+
+void InferenceScheduler::finishJobs(const QVector<InferenceStream::Job>& jobs, const QVector<InferenceStream*>& streams,
+                                    bool succeeded)
+{
+    for (int i = 0; i < jobs.size(); i++) {
+        streams.at(i)->finishJob(jobs.at(i), succeeded);
+    }
+
+    QMutexLocker locker(&m_mutex);
+    for (InferenceStream* stream : streams) {
+        for (StreamEntry& entry : m_streams) {
+            if (entry.stream == stream) {
+                entry.jobsInFlight--;
+                break;
+            }
+        }
+    }
+    m_jobFinished.wakeAll();
+}
+
+bool InferenceScheduler::warmUp(CocoDetectionWorker* worker, ThreadTuningState* tuning)
+{
+    tuneStageThread(*m_settings, tuning);
+    // the ones the delegate started while the worker was created
+    tuneInferenceThreads(*m_settings, tuning->inferenceThreadIds);
+
+    // the first invoke prepares the kernels (e.g. XNNPACK packs the weights) and starts TFLite's
+    // threads, do it on a blank input before a live frame has to wait for it
+    ImagePreprocessor layout;
+    layout.configure(worker->inputWidth(), worker->inputHeight(), worker->inputChannels(), worker->inputType());
+    const std::vector<uint8_t> blank(layout.targetSize(), 0);
+    DetectionOutput output;
+    bool succeeded = false;
+    const QVector<qint64> newThreads = threadsStartedBy([&]() {
+        succeeded = worker->setInput(blank) && worker->invoke(&output);
+    });
+    if (succeeded) {
+        tuneInferenceThreads(*m_settings, newThreads);
+        tuning->inferenceThreadIds << newThreads;
+        tuning->inferenceThreadsKnown = true;
+    } else {
+        // an interpreter that cannot invoke (e.g. its delegate fails at runtime) would fail every job
+        qCWarning(objectworker) << "Warm-up of" << QThread::currentThread()->objectName()
+                                << "failed, it does not take jobs";
+        m_failedWarmups.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (m_pendingWarmups.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        m_warmupTime.store(m_warmupTimer.elapsed(), std::memory_order_relaxed);
+        const int failed = m_failedWarmups.load(std::memory_order_relaxed);
+        if (failed == static_cast<int>(m_workers.size())) {
+            qCWarning(objectworker) << "No interpreter could be warmed up";
+            setStatus(Error);
+        } else {
+            qCInfo(objectworker) << "Warm-up done in" << m_warmupTime.load() << "ms," << failed << "interpreter(s) failed";
+            setStatus(Ready);
+        }
+    }
+    return succeeded;
+}
+
+void InferenceScheduler::invokeInputs(CocoDetectionWorker* worker, const QVector<qint64>& delegateThreadIds)
+{
+    ThreadTuningState tuning;
+    tuning.inferenceThreads = inferenceThreadCount(*m_settings);
+    tuning.inferenceThreadIds = delegateThreadIds;
+    if (!warmUp(worker, &tuning)) {
+        return;
+    }
+
+    // reused for every batch
+    QVector<InferenceStream::Job> jobs;
+    QVector<InferenceStream*> streams;
+    QVector<InferenceStream::Job> skippedJobs;
+    QVector<InferenceStream*> skippedStreams;
+    QVector<const std::vector<uint8_t>*> inputs;
+    QVector<DetectionOutput*> outputs;
+    jobs.reserve(m_maxBatchSize);
+    streams.reserve(m_maxBatchSize);
+    skippedJobs.reserve(m_maxBatchSize);
+    skippedStreams.reserve(m_maxBatchSize);
+    inputs.reserve(m_maxBatchSize);
+    outputs.reserve(m_maxBatchSize);
+
+    forever {
+        if (tuneStageThread(*m_settings, &tuning)) {
+            const int inferenceThreads = inferenceThreadCount(*m_settings);
+            if (inferenceThreads != tuning.inferenceThreads) {
+                worker->setNumThreads(inferenceThreads);
+                tuning.inferenceThreads = inferenceThreads;
+                // a larger pool starts new threads on the next invoke
+                tuning.inferenceThreadsKnown = false;
+            }
+            tuneInferenceThreads(*m_settings, tuning.inferenceThreadIds);
+        }
+
+        jobs.clear();
+        streams.clear();
+        skippedJobs.clear();
+        skippedStreams.clear();
+        {
+            QMutexLocker locker(&m_mutex);
+            const int maxBatchSize = worker->supportsBatching() ? m_maxBatchSize : 1;
+            InferenceStream::Job job;
+            int index = 0;
+            while (!m_stopRequested && jobs.size() < maxBatchSize) {
+                if (!takeJob(&job, &index)) {
+                    if (!jobs.isEmpty() || !skippedJobs.isEmpty()) {
+                        // run what is there instead of waiting for a full batch
+                        break;
+                    }
+                    m_workAvailable.wait(&m_mutex);
+                    continue;
+                }
+                if (job.input) {
+                    jobs << job;
+                    streams << m_streams.at(index).stream;
+                } else {
+                    skippedJobs << job;
+                    skippedStreams << m_streams.at(index).stream;
+                }
+            }
+            if (m_stopRequested) {
+                break;
+            }
+        }
+
+        // inputs that are not worth running only have to reach their stream
+        if (!skippedJobs.isEmpty()) {
+            finishJobs(skippedJobs, skippedStreams, false);
+        }
+        if (jobs.isEmpty()) {
+            continue;
+        }
+
+        const auto runJobs = [&]() {
+            if (jobs.size() == 1) {
+                const bool succeeded = worker->setInput(*jobs.first().input) && worker->invoke(jobs.first().output);
+                finishJobs(jobs, streams, succeeded);
+                return;
+            }
+            inputs.clear();
+            outputs.clear();
+            for (const InferenceStream::Job& job : jobs) {
+                inputs << job.input;
+                outputs << job.output;
+            }
+            if (worker->setInputs(inputs)) {
+                finishJobs(jobs, streams, worker->invoke(outputs));
+            } else {
+                // the model cannot be resized, supportsBatching() is false from now on
+                for (int i = 0; i < jobs.size(); i++) {
+                    const bool succeeded = worker->setInput(*jobs.at(i).input) && worker->invoke(jobs.at(i).output);
+                    finishJobs({ jobs.at(i) }, { streams.at(i) }, succeeded);
+                }
+            }
+        };
+
+        if (tuning.inferenceThreadsKnown) {
+            runJobs();
+        } else {
+            // a larger TFLite pool starts its new threads during this invoke
+            const QVector<qint64> newThreads = threadsStartedBy(runJobs);
+            tuneInferenceThreads(*m_settings, newThreads);
+            tuning.inferenceThreadIds << newThreads;
+            tuning.inferenceThreadsKnown = true;
+        }
+    }
+}
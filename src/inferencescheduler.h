@@ -0,0 +1,177 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __INFERENCE_SCHEDULER__
+#define __INFERENCE_SCHEDULER__
+
+#include "cocodetectionsettings.h"
+#include "cocodetectionworker.h"
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QObject>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/*
+ * A source of preprocessed inputs for the InferenceScheduler, e.g. the
+ * pipeline of one camera. The scheduler's inference threads call it, so all
+ * methods must be thread-safe and must not block.
+ */
+class InferenceStream
+{
+public:
+    // one input on its way through an interpreter
+    struct Job {
+        // null if the input is not worth running (e.g. too old), it is finished right away
+        const std::vector<uint8_t>* input = nullptr;
+        DetectionOutput* output = nullptr;
+        // the stream's own bookkeeping
+        void* context = nullptr;
+    };
+
+    virtual ~InferenceStream() = default;
+
+    // takes the next ready input, false if there is none (or no room for its output)
+    virtual bool takeJob(Job* job) = 0;
+    // hands the job back, its output is valid if succeeded
+    virtual void finishJob(const Job& job, bool succeeded) = 0;
+    // share of the interpreters while other streams have inputs too
+    virtual int weight() const = 0;
+    // most of its jobs the interpreters may hold at once, however many the scheduler has
+    virtual int maxJobsInFlight() const = 0;
+};
+
+/*
+ * Runs the interpreters of one model for every stream of the process.
+ *
+ * Instead of a set of interpreters per camera, which oversubscribes the CPU
+ * as soon as a few cameras run with a few TFLite threads each, all streams
+ * of a model (and delegate) submit to one scheduler. Its interpreter count
+ * (CocoDetectionSettings::workerCount of the stream that created it) is the
+ * global concurrency limit, so the TFLite threads stay at interpreters x
+ * inferenceThreads however many streams are added.
+ *
+ * Every inference thread serves the streams in weighted round robin: a
+ * stream keeps its turn for weight() inputs in a row, a stream without a
+ * ready input loses it. With maxBatchSize > 1 a thread takes inputs of
+ * several streams at once and runs them as one batch, if the model can be
+ * resized to it.
+ *
+ * The model is loaded on a loader thread, every interpreter then runs a
+ * warm-up invoke on its inference thread; statusChanged() reports the
+ * progress like CocoDetectionWorkerPool's.
+ */
+class InferenceScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    enum Status {
+        Loading,
+        Warming,
+        Ready,
+        Error
+    };
+    Q_ENUM(Status)
+
+    // what a pipeline thread has applied of the threading settings
+    struct ThreadTuningState {
+        int generation = -1;
+        int inferenceThreads = 0;
+        // TFLite's threads: the delegate's, started while the worker was created, and the ones this
+        // thread started during its first invoke
+        QVector<qint64> inferenceThreadIds;
+        bool inferenceThreadsKnown = false;
+    };
+
+    // the scheduler of the model and delegate settings, created (and loading) with the settings of the
+    // first caller; shut down once the last stream released it
+    static std::shared_ptr<InferenceScheduler> acquire(const QString& modelFilename,
+                                                       const std::shared_ptr<CocoDetectionSettings>& settings);
+    ~InferenceScheduler();
+
+    Status status() const { return static_cast<Status>(m_status.load(std::memory_order_acquire)); }
+    qint64 loadTime() const { return m_loadTime.load(std::memory_order_relaxed); }
+    qint64 warmupTime() const { return m_warmupTime.load(std::memory_order_relaxed); }
+    // blocks until the interpreters exist (or could not be created), false on Error
+    bool waitUntilLoaded();
+
+    // valid once loaded: input geometry and decoder of the interpreters
+    const CocoDetectionWorker* prototype() const { return m_workers.empty() ? nullptr : m_workers.front().get(); }
+    int interpreterCount() const { return static_cast<int>(m_workers.size()); }
+
+    // the stream is served until removeStream(), which waits for its jobs in flight
+    void addStream(InferenceStream* stream);
+    void removeStream(InferenceStream* stream);
+    // a stream has a new input (or room for an output) again
+    void notify();
+
+    // applies the CPU affinity and priority of the settings to the calling thread, true if they changed
+    static bool tuneStageThread(const CocoDetectionSettings& settings, ThreadTuningState* state);
+    static void tuneInferenceThreads(const CocoDetectionSettings& settings, const QVector<qint64>& threadIds);
+    static int inferenceThreadCount(const CocoDetectionSettings& settings);
+
+signals:
+    // emitted from the loader and inference threads; the times are in ms, 0 until known
+    void statusChanged(int status, qint64 loadTime, qint64 warmupTime);
+
+private:
+    struct StreamEntry {
+        InferenceStream* stream;
+        // inputs taken in a row during the current turn
+        int credit;
+        int jobsInFlight;
+        // removeStream() waits for its jobs, no new ones are taken
+        bool removed;
+    };
+
+    InferenceScheduler(const QString& modelFilename, const std::shared_ptr<CocoDetectionSettings>& settings);
+
+    void start();
+    void initialize();
+    void setStatus(Status status);
+    // false if the interpreter failed, its thread ends then
+    bool warmUp(CocoDetectionWorker* worker, ThreadTuningState* tuning);
+    void invokeInputs(CocoDetectionWorker* worker, const QVector<qint64>& delegateThreadIds);
+    // next job in round robin, with m_mutex held
+    bool takeJob(InferenceStream::Job* job, int* streamIndex);
+    void finishJobs(const QVector<InferenceStream::Job>& jobs, const QVector<InferenceStream*>& streams, bool succeeded);
+
+    QString m_modelFilename;
+    std::shared_ptr<CocoDetectionSettings> m_settings;
+    int m_maxBatchSize = 1;
+
+    QThread* m_loader = nullptr;
+    std::atomic<int> m_status { Loading };
+    std::atomic<qint64> m_loadTime { 0 };
+    std::atomic<qint64> m_warmupTime { 0 };
+    QElapsedTimer m_warmupTimer;
+    std::atomic<int> m_pendingWarmups { 0 };
+    std::atomic<int> m_failedWarmups { 0 };
+
+    // written by the loader before the inference threads start
+    std::vector<std::unique_ptr<CocoDetectionWorker>> m_workers;
+    // threads each worker's delegate started on the loader
+    std::vector<QVector<qint64>> m_delegateThreadIds;
+    std::vector<QThread*> m_threads;
+
+    // guards the streams, the round robin position and the stop flag
+    QMutex m_mutex;
+    QWaitCondition m_workAvailable;
+    QWaitCondition m_jobFinished;
+    QWaitCondition m_loaded;
+    QVector<StreamEntry> m_streams;
+    int m_nextStream = 0;
+    bool m_stopRequested = false;
+};
+
+#endif // __INFERENCE_SCHEDULER__
@@ -0,0 +1,52 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "jsonlines.h"
+
+namespace JsonLines {
+
+QString quoted(const QString& value)
+{
+    QString escaped;
+    escaped.reserve(value.size() + 2);
+    escaped += QLatin1Char('"');
+    for (const QChar character : value) {
+        switch (character.unicode()) {
+        case '"':
+            escaped += QLatin1String("\\\"");
+            break;
+        case '\\':
+            escaped += QLatin1String("\\\\");
+            break;
+        case '\b':
+            escaped += QLatin1String("\\b");
+            break;
+        case '\f':
+            escaped += QLatin1String("\\f");
+            break;
+        case '\n':
+            escaped += QLatin1String("\\n");
+            break;
+        case '\r':
+            escaped += QLatin1String("\\r");
+            break;
+        case '\t':
+            escaped += QLatin1String("\\t");
+            break;
+        default:
+            if (character.unicode() < 0x20) {
+                escaped += QStringLiteral("\\u%1").arg(character.unicode(), 4, 16, QLatin1Char('0'));
+            } else {
+                escaped += character;
+            }
+        }
+    }
+    escaped += QLatin1Char('"');
+    return escaped;
+}
+
+} // namespace JsonLines
@@ -0,0 +1,25 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __JSON_LINES__
+#define __JSON_LINES__
+
+#include <QString>
+
+/*
+ * Helpers for tools that stream their results as JSON Lines, one record per
+ * line written field by field instead of building a QJsonDocument for it.
+ */
+namespace JsonLines {
+
+// the value as a JSON string, quotes included; control characters are escaped, so a record
+// stays on its line whatever file names it contains
+QString quoted(const QString& value);
+
+} // namespace JsonLines
+
+#endif // __JSON_LINES__
@@ -6,6 +6,7 @@
  */
 
 #include "cocodetectionfilter.h"
+#include "detectionoverlay.h"
 
 #include <QGuiApplication>
 #include <QQmlApplicationEngine>
@@ -16,6 +17,9 @@ int main(int argc, char** argv)
     QQmlApplicationEngine engine;
 
     qmlRegisterType<CocoDetectionFilter>("machine.learning", 1, 0, "CocoDetectionFilter");
+    qmlRegisterType<DetectionOverlay>("machine.learning", 1, 0, "DetectionOverlay");
+    qmlRegisterUncreatableType<DetectionStats>("machine.learning", 1, 0, "DetectionStats",
+                                               QStringLiteral("DetectionStats is provided by CocoDetectionFilter.stats"));
 
     engine.load(QUrl(QStringLiteral("qrc:/main.qml")));
     return app.exec();
@@ -34,48 +34,47 @@ ApplicationWindow {
 
         CocoDetectionFilter {
             id: detectionFilter
+            orientation: camera.orientation
         }
 
-        Repeater {
-            id: detectionRepeater
+        DetectionOverlay {
+            id: detectionOverlay
+            anchors.fill: videoOutput
             model: detectionFilter.detectionModel
-            Item {
-                id: detectionItem
-                property rect location: videoOutput.mapNormalizedRectToItem(boundingRect)
-
-                implicitWidth: Math.max(objectLocation.width, objectDescription.width)
-                implicitHeight: objectLocation.height + objectDescription.height
-
-                Rectangle {
-                    id: objectLocation
-                    x: location.x
-                    y: location.y
-                    width: location.width
-                    height: location.height
-                    color: "transparent"
-                    border.width: 2
-                    border.color: boundingRectColor
-                }
+            contentRect: videoOutput.contentRect
+            orientation: videoOutput.orientation
+        }
 
-                Rectangle {
-                    id: objectDescription
-                    anchors.bottom: objectLocation.top
-                    anchors.left: objectLocation.left
-                    anchors.right: objectLocation.right
-                    height: 25
-                    color: objectLocation.border.color
+        Rectangle {
+            id: statsOverlay
+            anchors.top: parent.top
+            anchors.left: parent.left
+            anchors.margins: 8
+            width: statsText.implicitWidth + 16
+            height: statsText.implicitHeight + 8
+            color: "#80000000"
 
-                    Text {
-                        id: description
-                        anchors.fill: parent
-                        anchors.leftMargin: 16
-                        anchors.rightMargin: 16
-                        verticalAlignment: Text.AlignVCenter
-                        color: "white"
-                        text: detectedObject + " (" + score.toFixed(2) + ")"
+            Text {
+                id: statsText
+                anchors.centerIn: parent
+                color: "white"
+                font.pixelSize: 12
+                text: {
+                    switch (detectionFilter.status) {
+                    case CocoDetectionFilter.Loading:
+                        return "loading model ..."
+                    case CocoDetectionFilter.Warming:
+                        return "warming up (model loaded in " + detectionFilter.loadTime + " ms) ..."
+                    case CocoDetectionFilter.Error:
+                        return "the model could not be loaded"
                     }
-                }
 
+                    var stats = detectionFilter.stats
+                    var endToEnd = stats.stages.endToEnd || { p50: 0, p95: 0 }
+                    return "camera " + stats.cameraFps.toFixed(1) + " fps, inference " + stats.inferenceFps.toFixed(1)
+                            + " fps, dropped " + stats.droppedFrames
+                            + "\nlatency p50 " + endToEnd.p50.toFixed(1) + " ms, p95 " + endToEnd.p95.toFixed(1) + " ms"
+                }
             }
         }
 
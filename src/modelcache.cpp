@@ -0,0 +1,113 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "modelcache.h"
+#include "cocodetectionworker.h"
+
+#include "tensorflow/lite/kernels/register.h"
+#include "tensorflow/lite/schema/schema_utils.h"
+
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QMutexLocker>
+
+ModelCache& ModelCache::instance()
+{
+    static ModelCache cache;
+    return cache;
+}
+
+std::shared_ptr<const CachedModel> ModelCache::acquire(const QString& filename)
+{
+    const QFileInfo info(filename);
+    const QString path = info.canonicalFilePath();
+    if (path.isEmpty()) {
+        qCWarning(objectworker) << "Model" << filename << "does not exist";
+        return nullptr;
+    }
+
+    // loading under the lock keeps a second stream from mapping the same file again
+    QMutexLocker locker(&m_mutex);
+
+    auto it = m_entries.find(path);
+    if (it != m_entries.end()) {
+        if (it->lastModified == info.lastModified() && it->size == info.size()) {
+            return it->model;
+        }
+        qCInfo(objectworker) << "Model" << path << "changed on disk, loading it again";
+        m_entries.erase(it);
+    }
+
+    std::shared_ptr<const CachedModel> model = load(path);
+    if (model) {
+        m_entries.insert(path, Entry { info.lastModified(), info.size(), model });
+    }
+    return model;
+}
+
+void ModelCache::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_entries.clear();
+}
+
+const tflite::OpResolver& ModelCache::resolver(bool withDefaultDelegates)
+{
+    // thread-safe static initialization, registering all builtin ops is not free
+    static const tflite::ops::builtin::BuiltinOpResolver withDelegates;
+    static const tflite::ops::builtin::BuiltinOpResolverWithoutDefaultDelegates withoutDelegates;
+    if (withDefaultDelegates) {
+        return withDelegates;
+    }
+    return withoutDelegates;
+}
+
+std::shared_ptr<const CachedModel> ModelCache::load(const QString& filename)
+{
+    qCInfo(objectworker) << "Loading model" << filename << "...";
+    QElapsedTimer timer;
+    timer.start();
+
+    // mmaps the file; the verification runs once per process instead of once per interpreter
+    std::shared_ptr<tflite::FlatBufferModel> flatBuffer = tflite::FlatBufferModel::VerifyAndBuildFromFile(
+        filename.toLocal8Bit());
+    if (flatBuffer == nullptr) {
+        qCWarning(objectworker) << "Could not load model";
+        return nullptr;
+    }
+
+    // resolve the ops up front, so a model this build cannot run is reported once here
+    const tflite::OpResolver& opResolver = resolver(false);
+    const auto* operatorCodes = flatBuffer->GetModel()->operator_codes();
+    if (operatorCodes) {
+        for (const tflite::OperatorCode* operatorCode : *operatorCodes) {
+            const tflite::BuiltinOperator builtinCode = tflite::GetBuiltinCode(operatorCode);
+            const TfLiteRegistration* registration = nullptr;
+            if (builtinCode == tflite::BuiltinOperator_CUSTOM) {
+                const char* name = operatorCode->custom_code() ? operatorCode->custom_code()->c_str() : "";
+                registration = opResolver.FindOp(name, operatorCode->version());
+                if (!registration) {
+                    qCWarning(objectworker) << "Model uses the unsupported custom op" << name;
+                }
+            } else {
+                registration = opResolver.FindOp(builtinCode, operatorCode->version());
+                if (!registration) {
+                    qCWarning(objectworker) << "Model uses the unsupported op" << tflite::EnumNameBuiltinOperator(builtinCode)
+                                            << "version" << operatorCode->version();
+                }
+            }
+        }
+    }
+
+    std::shared_ptr<CachedModel> model = std::make_shared<CachedModel>();
+    model->filename = filename;
+    model->model = flatBuffer;
+    model->hasSsdOptions = SsdOptions::load(SsdOptions::fileFor(filename), &model->ssdOptions);
+
+    qCInfo(objectworker) << "Model loaded in" << timer.elapsed() << "ms";
+    return model;
+}
@@ -0,0 +1,75 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __MODEL_CACHE__
+#define __MODEL_CACHE__
+
+#include "detectiondecoder.h"
+
+#include "tensorflow/lite/core/api/op_resolver.h"
+#include "tensorflow/lite/model.h"
+
+#include <QDateTime>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+#include <memory>
+
+/*
+ * A model file as loaded once for the whole process: the memory mapped,
+ * verified flatbuffer and what else belongs to the file. Immutable, every
+ * interpreter of the model builds on the same instance.
+ */
+struct CachedModel
+{
+    QString filename;
+    std::shared_ptr<tflite::FlatBufferModel> model;
+    // SsdOptions::fileFor() the model, if there is one
+    bool hasSsdOptions = false;
+    SsdOptions ssdOptions;
+};
+
+/*
+ * Process-wide cache of loaded models keyed by the canonical path, the
+ * modification time and the size of the file. Every runnable, including the
+ * ones the video pipeline recreates after a scene graph reset, and every
+ * further stream of the same model share one mapping and only build their
+ * interpreters. A changed file is loaded again on the next acquire(); models
+ * stay cached until clear(), the mapping only costs address space and the
+ * page cache.
+ */
+class ModelCache
+{
+public:
+    static ModelCache& instance();
+
+    // null if the file cannot be loaded; thread-safe, concurrent calls for the same file load it once
+    std::shared_ptr<const CachedModel> acquire(const QString& filename);
+
+    // drops the cache's references, models still in use stay alive until their last interpreter is gone
+    void clear();
+
+    // the builtin ops, registered once and shared by all InterpreterBuilders (which only read them)
+    static const tflite::OpResolver& resolver(bool withDefaultDelegates);
+
+private:
+    ModelCache() = default;
+
+    static std::shared_ptr<const CachedModel> load(const QString& filename);
+
+    struct Entry {
+        QDateTime lastModified;
+        qint64 size;
+        std::shared_ptr<const CachedModel> model;
+    };
+
+    QMutex m_mutex;
+    QHash<QString, Entry> m_entries;
+};
+
+#endif // __MODEL_CACHE__
@@ -0,0 +1,138 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "motiondetector.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+// brightness difference (of 255) a cell needs to count as changed, above the sensor noise
+const int NoiseFloor = 10;
+
+inline int luma(int r, int g, int b)
+{
+    // BT.601 weights in 8 bit fixed point
+    return (77 * r + 150 * g + 29 * b) >> 8;
+}
+
+int lumaAt(const SourceImage& image, int x, int y)
+{
+    const uint8_t* row = image.data[0] + static_cast<qptrdiff>(y) * image.stride[0];
+
+    switch (image.layout) {
+    case PixelLayout::RGB888:
+        return luma(row[3 * x], row[3 * x + 1], row[3 * x + 2]);
+    case PixelLayout::BGR888:
+        return luma(row[3 * x + 2], row[3 * x + 1], row[3 * x]);
+    case PixelLayout::RGBX8888:
+        return luma(row[4 * x], row[4 * x + 1], row[4 * x + 2]);
+    case PixelLayout::BGRX8888:
+        return luma(row[4 * x + 2], row[4 * x + 1], row[4 * x]);
+    case PixelLayout::XRGB8888:
+        return luma(row[4 * x + 1], row[4 * x + 2], row[4 * x + 3]);
+    case PixelLayout::XBGR8888:
+        return luma(row[4 * x + 3], row[4 * x + 2], row[4 * x + 1]);
+    case PixelLayout::NV12:
+    case PixelLayout::NV21:
+    case PixelLayout::YUV420P:
+        return row[x];
+    case PixelLayout::YUYV:
+        return row[2 * x];
+    case PixelLayout::UYVY:
+        return row[2 * x + 1];
+    }
+    return 0;
+}
+
+} // namespace
+
+void MotionDetector::setGridSize(int columns)
+{
+    m_columns = std::max(1, columns);
+}
+
+void MotionDetector::setThreshold(double threshold)
+{
+    m_threshold = qBound(0.0, threshold, 1.0);
+}
+
+void MotionDetector::setMaxInterval(qint64 maxInterval)
+{
+    m_maxInterval = std::max<qint64>(0, maxInterval);
+}
+
+bool MotionDetector::isChanged(const SourceImage& image, qint64 time)
+{
+    if (!sampleGrid(image)) {
+        // nothing to compare, let the detector decide
+        m_lastScore = 1.0;
+        return true;
+    }
+
+    if (m_reference.size() != m_grid.size()) {
+        m_lastScore = 1.0;
+    } else {
+        int changedCells = 0;
+        for (size_t i = 0; i < m_grid.size(); i++) {
+            if (std::abs(int(m_grid[i]) - int(m_reference[i])) > NoiseFloor) {
+                changedCells++;
+            }
+        }
+        m_lastScore = double(changedCells) / m_grid.size();
+    }
+
+    const bool expired = m_maxInterval > 0 && (m_referenceTime < 0 || time - m_referenceTime >= m_maxInterval);
+    if (m_lastScore < m_threshold && !expired) {
+        return false;
+    }
+
+    // compare the next frames against this one, so slow changes add up
+    m_reference.swap(m_grid);
+    m_referenceTime = time;
+    return true;
+}
+
+void MotionDetector::reset()
+{
+    m_reference.clear();
+    m_referenceTime = -1;
+}
+
+bool MotionDetector::sampleGrid(const SourceImage& image)
+{
+    if (!image.isValid()) {
+        return false;
+    }
+
+    const int columns = std::min(m_columns, image.width / 2);
+    const int rows = std::max(1, std::min(columns * image.height / image.width, image.height / 2));
+    if (columns < 1) {
+        return false;
+    }
+    if (columns != m_gridColumns || rows != m_gridRows) {
+        // a new geometry invalidates the reference
+        m_gridColumns = columns;
+        m_gridRows = rows;
+        m_reference.clear();
+    }
+    m_grid.resize(static_cast<size_t>(columns) * rows);
+
+    // four samples per cell, at a quarter and three quarters of its width and height
+    for (int row = 0; row < rows; row++) {
+        const int y0 = (4 * row + 1) * image.height / (4 * rows);
+        const int y1 = (4 * row + 3) * image.height / (4 * rows);
+        for (int column = 0; column < columns; column++) {
+            const int x0 = (4 * column + 1) * image.width / (4 * columns);
+            const int x1 = (4 * column + 3) * image.width / (4 * columns);
+            const int sum = lumaAt(image, x0, y0) + lumaAt(image, x1, y0) + lumaAt(image, x0, y1) + lumaAt(image, x1, y1);
+            m_grid[static_cast<size_t>(row) * columns + column] = static_cast<uint8_t>(sum / 4);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __MOTION_DETECTOR__
+#define __MOTION_DETECTOR__
+
+#include "imagepreprocessor.h"
+
+#include <QtGlobal>
+
+#include <vector>
+
+/*
+ * Cheap change detector deciding whether a frame is worth an inference. It
+ * samples the luma of a coarse grid straight from the mapped frame (four
+ * pixels per cell, a few thousand reads per frame whatever the resolution)
+ * and compares it to the grid of the last frame that was let through. The
+ * change score is the fraction of cells whose brightness moved by more than
+ * the sensor noise, so a person walking into a corner counts as much as a
+ * global lighting change of the same area.
+ *
+ * Used on the video thread only.
+ */
+class MotionDetector
+{
+public:
+    // cells along the width, the rows follow the aspect ratio of the frame
+    void setGridSize(int columns);
+    // change score in [0, 1] from which a frame counts as changed
+    void setThreshold(double threshold);
+    // a frame is let through at the latest after this many ns, 0 never forces one
+    void setMaxInterval(qint64 maxInterval);
+
+    // true if the frame changed enough since the last one let through, or the
+    // re-check interval passed; the frame then becomes the new reference
+    bool isChanged(const SourceImage& image, qint64 time);
+
+    // score of the last frame passed to isChanged()
+    double lastScore() const { return m_lastScore; }
+
+    void reset();
+
+private:
+    bool sampleGrid(const SourceImage& image);
+
+    int m_columns = 32;
+    double m_threshold = 0.01;
+    qint64 m_maxInterval = 0;
+
+    int m_gridColumns = 0;
+    int m_gridRows = 0;
+    std::vector<uint8_t> m_grid;
+    std::vector<uint8_t> m_reference;
+    qint64 m_referenceTime = -1;
+    double m_lastScore = 0.0;
+};
+
+#endif // __MOTION_DETECTOR__
@@ -0,0 +1,73 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "nonmaximumsuppression.h"
+
+#include <QVarLengthArray>
+
+#include <algorithm>
+
+namespace NonMaximumSuppression {
+
+double overlap(const QRectF& a, const QRectF& b, Overlap overlap)
+{
+    if (overlap == Overlap::IntersectionOverUnion) {
+        return CocoDetectionModel::intersectionOverUnion(a, b);
+    }
+
+    const QRectF intersection = a.intersected(b);
+    const double smallerArea = std::min(a.width() * a.height(), b.width() * b.height());
+    return smallerArea > 0.0 ? intersection.width() * intersection.height() / smallerArea : 0.0;
+}
+
+void apply(QVector<CocoDetectionModel::DetectedObject>* detectedObjects, double threshold, Overlap overlapType,
+           bool mergeBoxes)
+{
+    using DetectedObject = CocoDetectionModel::DetectedObject;
+
+    // insertion sort: stable like std::stable_sort, but without its temporary buffer, and the lists are short
+    const auto higherScore = [](const DetectedObject& a, const DetectedObject& b) { return a.score > b.score; };
+    for (auto it = detectedObjects->begin(); it != detectedObjects->end(); ++it) {
+        std::rotate(std::upper_bound(detectedObjects->begin(), it, *it, higherScore), it, it + 1);
+    }
+
+    const int count = detectedObjects->size();
+    QVarLengthArray<bool, 64> suppressed(count);
+    std::fill(suppressed.begin(), suppressed.end(), false);
+
+    for (int i = 0; i < count; i++) {
+        if (suppressed[i]) {
+            continue;
+        }
+        DetectedObject& kept = (*detectedObjects)[i];
+        for (int j = i + 1; j < count; j++) {
+            const DetectedObject& other = detectedObjects->at(j);
+            if (suppressed[j] || other.classIndex != kept.classIndex) {
+                continue;
+            }
+            if (overlap(kept.boundingRect, other.boundingRect, overlapType) > threshold) {
+                suppressed[j] = true;
+                if (mergeBoxes) {
+                    kept.boundingRect = kept.boundingRect.united(other.boundingRect);
+                }
+            }
+        }
+    }
+
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (!suppressed[i]) {
+            if (kept != i) {
+                (*detectedObjects)[kept] = detectedObjects->at(i);
+            }
+            kept++;
+        }
+    }
+    detectedObjects->resize(kept);
+}
+
+} // namespace NonMaximumSuppression
@@ -0,0 +1,37 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __NON_MAXIMUM_SUPPRESSION__
+#define __NON_MAXIMUM_SUPPRESSION__
+
+#include "cocodetectionmodel.h"
+
+#include <QVector>
+
+/*
+ * Class-aware non-maximum suppression on decoded detections: of every group
+ * of boxes of the same class that overlap more than the threshold only the
+ * best scoring one is kept.
+ */
+namespace NonMaximumSuppression {
+
+enum class Overlap {
+    IntersectionOverUnion,
+    // intersection over the smaller box, also catches a partial box inside a full one (e.g. at tile seams)
+    IntersectionOverMinimum
+};
+
+// sorts the objects by descending score and removes the suppressed ones; with mergeBoxes
+// the kept box grows to the union of the boxes it suppressed
+void apply(QVector<CocoDetectionModel::DetectedObject>* detectedObjects, double threshold,
+           Overlap overlap = Overlap::IntersectionOverUnion, bool mergeBoxes = false);
+
+double overlap(const QRectF& a, const QRectF& b, Overlap overlap);
+
+} // namespace NonMaximumSuppression
+
+#endif // __NON_MAXIMUM_SUPPRESSION__
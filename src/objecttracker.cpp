@@ -0,0 +1,164 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "objecttracker.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+
+namespace {
+
+// gains of the alpha-beta filter: how much of the residual goes into the position and the velocity
+const double PositionGain = 0.6;
+const double VelocityGain = 0.2;
+
+// a track is not extrapolated further than this, a stalled detector must not fling boxes away
+const qint64 MaxPredictionTime = 500 * 1000 * 1000;
+// tracks that have not seen a detection for this long are gone, whatever maxMisses says
+const qint64 MaxTrackAge = 1000 * 1000 * 1000;
+
+double seconds(qint64 nsecs)
+{
+    return nsecs / 1e9;
+}
+
+} // namespace
+
+void ObjectTracker::update(const QVector<CocoDetectionModel::DetectedObject>& detectedObjects, qint64 time)
+{
+    QMutexLocker locker(&m_mutex);
+
+    // candidate pairs of track and detection, by their overlap with the predicted box
+    m_matcher.clear();
+    for (int track = 0; track < m_tracks.size(); track++) {
+        const QRectF predicted = boxAt(m_tracks.at(track), time);
+        for (int detection = 0; detection < detectedObjects.size(); detection++) {
+            const auto& detectedObject = detectedObjects.at(detection);
+            if (detectedObject.classIndex != m_tracks.at(track).classIndex) {
+                continue;
+            }
+            const double iou = CocoDetectionModel::intersectionOverUnion(predicted, detectedObject.boundingRect);
+            if (iou >= m_iouThreshold) {
+                m_matcher.addCandidate(track, detection, iou);
+            }
+        }
+    }
+    m_matcher.match(m_tracks.size(), detectedObjects.size());
+
+    const QVector<int>& trackToDetection = m_matcher.objectToDetection();
+    for (int index = 0; index < m_tracks.size(); index++) {
+        const int detection = trackToDetection.at(index);
+        if (detection < 0) {
+            continue;
+        }
+
+        Track& track = m_tracks[index];
+        const QRectF measured = detectedObjects.at(detection).boundingRect;
+        const double dt = seconds(qBound<qint64>(0, time - track.time, MaxPredictionTime));
+
+        // residual between the measured and the predicted center
+        const double predictedX = track.x + track.vx * dt;
+        const double predictedY = track.y + track.vy * dt;
+        const double residualX = measured.center().x() - predictedX;
+        const double residualY = measured.center().y() - predictedY;
+
+        track.x = predictedX + PositionGain * residualX;
+        track.y = predictedY + PositionGain * residualY;
+        if (dt > 0.0) {
+            track.vx += VelocityGain * residualX / dt;
+            track.vy += VelocityGain * residualY / dt;
+        }
+        track.width += PositionGain * (measured.width() - track.width);
+        track.height += PositionGain * (measured.height() - track.height);
+        track.score = detectedObjects.at(detection).score;
+        track.time = time;
+        track.misses = 0;
+    }
+
+    // tracks without a detection coast on their velocity until they missed too often
+    for (int track = m_tracks.size() - 1; track >= 0; track--) {
+        if (trackToDetection.at(track) < 0
+            && (++m_tracks[track].misses > m_maxMisses || time - m_tracks.at(track).time > MaxTrackAge)) {
+            m_tracks.remove(track);
+        }
+    }
+
+    for (int detection = 0; detection < detectedObjects.size(); detection++) {
+        if (m_matcher.isDetectionMatched(detection)) {
+            continue;
+        }
+        const auto& detectedObject = detectedObjects.at(detection);
+        const QRectF box = detectedObject.boundingRect;
+        m_tracks.append(Track { m_nextId++, detectedObject.classIndex, detectedObject.score,
+                                box.center().x(), box.center().y(), box.width(), box.height(), 0.0, 0.0, time, 0 });
+    }
+}
+
+void ObjectTracker::predict(qint64 time, QVector<CocoDetectionModel::DetectedObject>* detectedObjects) const
+{
+    detectedObjects->clear();
+
+    QMutexLocker locker(&m_mutex);
+    for (const Track& track : m_tracks) {
+        if (time - track.time > MaxTrackAge) {
+            continue;
+        }
+        CocoDetectionModel::DetectedObject detectedObject;
+        detectedObject.classIndex = track.classIndex;
+        detectedObject.score = track.score;
+        detectedObject.boundingRect = boxAt(track, time);
+        detectedObject.trackId = track.id;
+        if (!detectedObject.boundingRect.isEmpty()) {
+            detectedObjects->append(detectedObject);
+        }
+    }
+}
+
+void ObjectTracker::hold(qint64 time)
+{
+    QMutexLocker locker(&m_mutex);
+    for (Track& track : m_tracks) {
+        if (time <= track.time || time - track.time > MaxTrackAge) {
+            continue;
+        }
+        const QPointF center = boxAt(track, time).center();
+        track.x = center.x();
+        track.y = center.y();
+        track.vx = 0.0;
+        track.vy = 0.0;
+        track.time = time;
+    }
+}
+
+void ObjectTracker::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_tracks.clear();
+}
+
+void ObjectTracker::setIouThreshold(double iouThreshold)
+{
+    QMutexLocker locker(&m_mutex);
+    m_iouThreshold = iouThreshold;
+}
+
+void ObjectTracker::setMaxMisses(int maxMisses)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maxMisses = std::max(0, maxMisses);
+}
+
+QRectF ObjectTracker::boxAt(const Track& track, qint64 time)
+{
+    // frames older than the last detection get its box, there is nothing to interpolate from
+    const double dt = seconds(qBound<qint64>(0, time - track.time, MaxPredictionTime));
+    const double x = track.x + track.vx * dt;
+    const double y = track.y + track.vy * dt;
+    const QRectF box(x - track.width / 2, y - track.height / 2, track.width, track.height);
+    return box.intersected(QRectF(0.0, 0.0, 1.0, 1.0));
+}
@@ -0,0 +1,70 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __OBJECT_TRACKER__
+#define __OBJECT_TRACKER__
+
+#include "cocodetectionmodel.h"
+#include "greedymatcher.h"
+
+#include <QMutex>
+#include <QVector>
+
+/*
+ * Tracks detected objects between inferences. Detections are associated to
+ * the existing tracks by class and the overlap with the track's predicted
+ * box, every track follows its object with a constant velocity alpha-beta
+ * filter on the box center and size. predict() extrapolates all tracks to an
+ * arbitrary point in time, so boxes can be drawn for every camera frame while
+ * the detector runs on a fraction of them. Tracks keep their ID for as long
+ * as the object is found again within maxMisses detections (and a second).
+ *
+ * update() and predict() may be called from different threads.
+ */
+class ObjectTracker
+{
+public:
+    // all times are ns on the same clock, e.g. PipelineStats::now()
+    void update(const QVector<CocoDetectionModel::DetectedObject>& detectedObjects, qint64 time);
+    void predict(qint64 time, QVector<CocoDetectionModel::DetectedObject>* detectedObjects) const;
+    // the scene did not change up to time: stop the tracks where they are and keep them alive
+    void hold(qint64 time);
+
+    void clear();
+
+    // minimum IoU of a detection and a predicted box to continue the track
+    void setIouThreshold(double iouThreshold);
+    // detections a track may miss before it is dropped
+    void setMaxMisses(int maxMisses);
+
+private:
+    struct Track {
+        int id;
+        int classIndex;
+        float score;
+        // normalized center and size, velocities per second
+        double x;
+        double y;
+        double width;
+        double height;
+        double vx;
+        double vy;
+        qint64 time;
+        int misses;
+    };
+
+    static QRectF boxAt(const Track& track, qint64 time);
+
+    mutable QMutex m_mutex;
+    QVector<Track> m_tracks;
+    GreedyMatcher m_matcher;
+    int m_nextId = 0;
+    double m_iouThreshold = 0.3;
+    int m_maxMisses = 3;
+};
+
+#endif // __OBJECT_TRACKER__
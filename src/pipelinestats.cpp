@@ -0,0 +1,107 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pipelinestats.h"
+
+#include <QtAlgorithms>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const int LinearBuckets = 16;
+const int SubBucketBits = 3;
+const int SubBuckets = 1 << SubBucketBits;
+
+quint64 bucketLowerBound(int index)
+{
+    if (index < LinearBuckets) {
+        return static_cast<quint64>(index);
+    }
+    const int msb = (index - LinearBuckets) / SubBuckets + 4;
+    const int sub = (index - LinearBuckets) % SubBuckets;
+    return static_cast<quint64>(SubBuckets + sub) << (msb - SubBucketBits);
+}
+
+} // namespace
+
+void LatencyHistogram::record(qint64 nsecs)
+{
+    const quint64 usecs = nsecs > 0 ? static_cast<quint64>(nsecs) / 1000 : 0;
+    m_counts[bucketIndex(usecs)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::snapshot(Counts* counts) const
+{
+    for (int i = 0; i < BucketCount; i++) {
+        (*counts)[i] = m_counts[i].load(std::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::bucketIndex(quint64 usecs)
+{
+    if (usecs < LinearBuckets) {
+        return static_cast<int>(usecs);
+    }
+
+    // the three bits below the most significant one select the sub-bucket
+    const int msb = 63 - qCountLeadingZeroBits(usecs);
+    const int sub = static_cast<int>(usecs >> (msb - SubBucketBits)) & (SubBuckets - 1);
+    const int index = LinearBuckets + (msb - 4) * SubBuckets + sub;
+    return index < BucketCount ? index : BucketCount - 1;
+}
+
+quint64 LatencyHistogram::bucketUpperBound(int index)
+{
+    return index + 1 < BucketCount ? bucketLowerBound(index + 1) : bucketLowerBound(index) * 2;
+}
+
+double LatencyHistogram::percentile(const Counts& counts, double fraction)
+{
+    quint64 total = 0;
+    for (quint64 count : counts) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0.0;
+    }
+
+    const quint64 rank = std::max<quint64>(1, static_cast<quint64>(std::ceil(fraction * total)));
+    quint64 seen = 0;
+    for (int i = 0; i < BucketCount; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            // the middle of the bucket, the error is at most half a bucket
+            return 0.5 * (bucketLowerBound(i) + bucketUpperBound(i));
+        }
+    }
+    return static_cast<double>(bucketUpperBound(BucketCount - 1));
+}
+
+QString PipelineStats::stageName(Stage stage)
+{
+    switch (stage) {
+    case Conversion:
+        return QStringLiteral("conversion");
+    case Queued:
+        return QStringLiteral("queued");
+    case Preprocess:
+        return QStringLiteral("preprocess");
+    case Invoke:
+        return QStringLiteral("invoke");
+    case Decode:
+        return QStringLiteral("decode");
+    case ModelUpdate:
+        return QStringLiteral("modelUpdate");
+    case EndToEnd:
+        return QStringLiteral("endToEnd");
+    case StageCount:
+        break;
+    }
+    return QString();
+}
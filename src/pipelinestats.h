@@ -0,0 +1,94 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __PIPELINE_STATS__
+#define __PIPELINE_STATS__
+
+#include <QElapsedTimer>
+#include <QString>
+#include <QtGlobal>
+
+#include <array>
+#include <atomic>
+
+/*
+ * Latency histogram with fixed, logarithmic buckets in microseconds: exact
+ * below 16 us, then eight buckets per power of two, i.e. a value is off by at
+ * most 12.5%. record() is a single relaxed increment and can be called from
+ * any thread; readers take a snapshot of the counts and compute percentiles
+ * on their own copy.
+ */
+class LatencyHistogram
+{
+public:
+    static const int BucketCount = 256;
+    using Counts = std::array<quint64, BucketCount>;
+
+    void record(qint64 nsecs);
+
+    // relaxed copy of the counts, concurrent record() calls may or may not be in it
+    void snapshot(Counts* counts) const;
+
+    static int bucketIndex(quint64 usecs);
+    // smallest value in us that falls into the next bucket
+    static quint64 bucketUpperBound(int index);
+
+    // value in us below which the given fraction of the counts lie, 0 if empty
+    static double percentile(const Counts& counts, double fraction);
+
+private:
+    std::array<std::atomic<quint64>, BucketCount> m_counts {};
+};
+
+/*
+ * Counters and latency histograms of the detection pipeline, shared between
+ * the filter runnable on the video thread, the stage threads of the worker
+ * pool and the DetectionStats object that publishes them to QML. Everything
+ * is lock-free, the stages only ever increment.
+ */
+struct PipelineStats
+{
+    enum Stage {
+        // FrameBuffer::fill() in the filter runnable: map, copy or convert the video frame
+        Conversion,
+        // time a frame waits in the queues in front of the preprocessor and the interpreters
+        Queued,
+        // resize and conversion to the input tensor
+        Preprocess,
+        Invoke,
+        // decoding the output tensors
+        Decode,
+        // applying the detections to the model on the GUI thread, including the views updating
+        ModelUpdate,
+        // from the video frame reaching the filter to its detections being visible
+        EndToEnd,
+        StageCount
+    };
+
+    static QString stageName(Stage stage);
+
+    PipelineStats() { clock.start(); }
+
+    // all pipeline timestamps are ns on this clock
+    qint64 now() const { return clock.nsecsElapsed(); }
+    void record(Stage stage, qint64 nsecs) { histograms[stage].record(nsecs); }
+
+    QElapsedTimer clock;
+    std::array<LatencyHistogram, StageCount> histograms;
+
+    // frames the filter saw
+    std::atomic<quint64> capturedFrames { 0 };
+    // frames replaced by a newer one, or skipped as too old, before reaching an interpreter
+    std::atomic<quint64> droppedFrames { 0 };
+    // frames not sent to the detector because the scene did not change
+    std::atomic<quint64> unchangedFrames { 0 };
+    std::atomic<quint64> inferredFrames { 0 };
+    // results dropped because they exceeded CocoDetectionSettings::maxResultAge
+    std::atomic<quint64> discardedResults { 0 };
+};
+
+#endif // __PIPELINE_STATS__
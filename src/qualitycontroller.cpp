@@ -0,0 +1,121 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "qualitycontroller.h"
+
+#include <algorithm>
+
+namespace {
+
+// weight of a new frame in the smoothed latency
+const double Smoothing = 0.2;
+
+// the next better level is tried once the average is below this share of the budget
+const double RecoveryShare = 0.6;
+
+// ns the average has to stay over the budget (or under the recovery threshold) before a step
+const qint64 DegradeAfter = 500 * 1000 * 1000LL;
+const qint64 RecoverAfter = 5000 * 1000 * 1000LL;
+
+// a better level that had to be left again within this many ns is tried again only after twice the wait
+const qint64 FailedRecovery = 10 * 1000 * 1000 * 1000LL;
+const qint64 MaxRecoverAfter = 80 * 1000 * 1000 * 1000LL;
+
+// ns a new level runs before it may be left again
+const qint64 MinimumDwell = 1000 * 1000 * 1000LL;
+
+} // namespace
+
+void QualityController::setLevelCount(int count)
+{
+    m_levelCount = qBound(1, count, 64);
+    m_level = std::min(m_level, m_levelCount - 1);
+}
+
+void QualityController::setBudget(qint64 budget)
+{
+    m_budget = std::max<qint64>(0, budget);
+}
+
+void QualityController::disableLevel(int level)
+{
+    if (level > 0 && level < m_levelCount) {
+        m_disabledLevels |= quint64(1) << level;
+    }
+}
+
+int QualityController::nextLevel(int direction) const
+{
+    for (int level = m_level + direction; level >= 0 && level < m_levelCount; level += direction) {
+        if ((m_disabledLevels & (quint64(1) << level)) == 0) {
+            return level;
+        }
+    }
+    return m_level;
+}
+
+void QualityController::setLevel(int level, qint64 time)
+{
+    m_level = level;
+    m_levelSince = time;
+    m_average = -1.0;
+    m_overSince = -1;
+    m_underSince = -1;
+}
+
+int QualityController::update(qint64 latency, qint64 time)
+{
+    if (m_budget <= 0) {
+        if (m_level != 0) {
+            setLevel(0, time);
+        }
+        return m_level;
+    }
+
+    if (m_levelSince < 0) {
+        m_levelSince = time;
+    }
+    m_average = m_average < 0.0 ? double(latency) : m_average + Smoothing * (double(latency) - m_average);
+
+    if (m_average > double(m_budget)) {
+        m_underSince = -1;
+        if (m_overSince < 0) {
+            m_overSince = time;
+        }
+    } else if (m_average < RecoveryShare * double(m_budget)) {
+        m_overSince = -1;
+        if (m_underSince < 0) {
+            m_underSince = time;
+        }
+    } else {
+        // within the band, the level fits
+        m_overSince = -1;
+        m_underSince = -1;
+    }
+
+    if (time - m_levelSince < MinimumDwell) {
+        return m_level;
+    }
+
+    if (m_overSince >= 0 && time - m_overSince >= DegradeAfter) {
+        const int level = nextLevel(1);
+        if (level != m_level) {
+            // a level that only fits while the load is low should not be retried every few seconds
+            const bool failedRecovery = m_recoveredAt >= 0 && time - m_recoveredAt < FailedRecovery;
+            m_recoverAfter = failedRecovery ? std::min(2 * m_recoverAfter, MaxRecoverAfter) : RecoverAfter;
+            m_recoveredAt = -1;
+            setLevel(level, time);
+        }
+    } else if (m_underSince >= 0 && time - m_underSince >= m_recoverAfter) {
+        const int level = nextLevel(-1);
+        if (level != m_level) {
+            m_recoveredAt = time;
+            setLevel(level, time);
+        }
+    }
+    return m_level;
+}
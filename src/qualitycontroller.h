@@ -0,0 +1,61 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __QUALITY_CONTROLLER__
+#define __QUALITY_CONTROLLER__
+
+#include <QtGlobal>
+
+/*
+ * Picks a level of a quality ladder (0 is the best, every further level is
+ * lighter) from the measured frame latencies and a latency budget. The
+ * latencies are smoothed; the controller steps down one level once the
+ * average stayed above the budget for a while, and back up only after it
+ * stayed well below for much longer, so it does not flap between two levels
+ * that are both close to the budget. A better level that has to be left
+ * again right away is retried after twice the wait. After every step it
+ * waits for the new level to show its own latency.
+ *
+ * Used on the postprocess thread only.
+ */
+class QualityController
+{
+public:
+    void setLevelCount(int count);
+    int levelCount() const { return m_levelCount; }
+
+    // ns a frame may take, 0 disables the controller (it goes back to level 0)
+    void setBudget(qint64 budget);
+    // a level that cannot run (e.g. its model did not load) is skipped from now on
+    void disableLevel(int level);
+
+    // feeds the latency of a frame finished at time (both ns), returns the level to run at
+    int update(qint64 latency, qint64 time);
+    int level() const { return m_level; }
+    // continues at level, e.g. the one still running after a switch failed
+    void setLevel(int level, qint64 time);
+
+private:
+    int nextLevel(int direction) const;
+
+    int m_levelCount = 1;
+    quint64 m_disabledLevels = 0;
+    qint64 m_budget = 0;
+
+    int m_level = 0;
+    qint64 m_levelSince = -1;
+    // smoothed latency of the current level, negative until its first frame
+    double m_average = -1.0;
+    // since when the average is above the budget, or below the recovery threshold
+    qint64 m_overSince = -1;
+    qint64 m_underSince = -1;
+    // ns below the recovery threshold before stepping up, grows while recoveries fail
+    qint64 m_recoverAfter = 5000 * 1000 * 1000LL;
+    qint64 m_recoveredAt = -1;
+};
+
+#endif // __QUALITY_CONTROLLER__
@@ -0,0 +1,206 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "threadtuning.h"
+
+#include <QDir>
+#include <QFile>
+#include <QThread>
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const int MaxCpus = 64;
+
+#ifdef Q_OS_LINUX
+// nice values for the priorities that keep SCHED_OTHER, raising above normal needs CAP_SYS_NICE
+int niceValue(int priority)
+{
+    switch (priority) {
+    case QThread::LowestPriority:
+        return 19;
+    case QThread::LowPriority:
+        return 10;
+    case QThread::HighPriority:
+        return -5;
+    case QThread::HighestPriority:
+        return -10;
+    default:
+        return 0;
+    }
+}
+#endif
+
+} // namespace
+
+namespace ThreadTuning {
+
+quint64 cpuMask(const QList<int>& cpus)
+{
+    quint64 mask = 0;
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < MaxCpus) {
+            mask |= quint64(1) << cpu;
+        }
+    }
+    return mask;
+}
+
+QList<int> cpuList(quint64 mask)
+{
+    QList<int> cpus;
+    for (int cpu = 0; cpu < MaxCpus; cpu++) {
+        if (mask & (quint64(1) << cpu)) {
+            cpus << cpu;
+        }
+    }
+    return cpus;
+}
+
+qint64 currentThreadId()
+{
+#ifdef Q_OS_LINUX
+    return static_cast<qint64>(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+}
+
+QVector<qint64> threadIds()
+{
+    QVector<qint64> ids;
+#ifdef Q_OS_LINUX
+    const QStringList entries = QDir(QStringLiteral("/proc/self/task")).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    ids.reserve(entries.size());
+    for (const QString& entry : entries) {
+        bool ok = false;
+        const qint64 id = entry.toLongLong(&ok);
+        if (ok) {
+            ids << id;
+        }
+    }
+#endif
+    return ids;
+}
+
+QByteArray threadName(qint64 threadId)
+{
+#ifdef Q_OS_LINUX
+    QFile comm(QStringLiteral("/proc/self/task/%1/comm").arg(threadId));
+    if (comm.open(QIODevice::ReadOnly)) {
+        return comm.readAll().trimmed();
+    }
+#else
+    Q_UNUSED(threadId)
+#endif
+    return QByteArray();
+}
+
+QByteArray currentThreadName()
+{
+#ifdef Q_OS_LINUX
+    char name[16] = {};
+    if (prctl(PR_GET_NAME, name, 0, 0, 0) == 0) {
+        return QByteArray(name);
+    }
+#endif
+    return QByteArray();
+}
+
+bool setCurrentThreadName(const QByteArray& name)
+{
+#ifdef Q_OS_LINUX
+    // longer names are cut by the kernel
+    return prctl(PR_SET_NAME, name.constData(), 0, 0, 0) == 0;
+#else
+    Q_UNUSED(name)
+    return false;
+#endif
+}
+
+bool setAffinity(qint64 threadId, quint64 mask)
+{
+#ifdef Q_OS_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (mask == 0) {
+        // unpin: allow every configured CPU again
+        const long cpuCount = sysconf(_SC_NPROCESSORS_CONF);
+        for (long cpu = 0; cpu < cpuCount && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+    } else {
+        for (int cpu : cpuList(mask)) {
+            CPU_SET(cpu, &set);
+        }
+    }
+
+    return sched_setaffinity(static_cast<pid_t>(threadId), sizeof(set), &set) == 0;
+#else
+    Q_UNUSED(threadId)
+    Q_UNUSED(mask)
+    return false;
+#endif
+}
+
+bool setPriority(qint64 threadId, int priority)
+{
+#ifdef Q_OS_LINUX
+    // QThread::setPriority() is a no-op for SCHED_OTHER, so pick the class and nice value ourselves
+    const pid_t tid = static_cast<pid_t>(threadId);
+    sched_param param = {};
+
+    if (priority == QThread::InheritPriority) {
+        // back to what the main thread runs with, undoing an earlier setting at runtime
+        const pid_t mainThread = getpid();
+        const int policy = sched_getscheduler(mainThread);
+        if (policy < 0 || sched_getparam(mainThread, &param) != 0) {
+            return false;
+        }
+        errno = 0;
+        const int nice = getpriority(PRIO_PROCESS, static_cast<id_t>(mainThread));
+        if (errno != 0 || sched_setscheduler(tid, policy, &param) != 0) {
+            return false;
+        }
+        return policy == SCHED_FIFO || policy == SCHED_RR || setpriority(PRIO_PROCESS, static_cast<id_t>(tid), nice) == 0;
+    }
+
+    if (priority == QThread::IdlePriority) {
+        return sched_setscheduler(tid, SCHED_IDLE, &param) == 0;
+    }
+
+    if (priority == QThread::TimeCriticalPriority) {
+        param.sched_priority = sched_get_priority_min(SCHED_RR);
+        return sched_setscheduler(tid, SCHED_RR, &param) == 0;
+    }
+
+    if (sched_setscheduler(tid, SCHED_OTHER, &param) != 0) {
+        return false;
+    }
+    return setpriority(PRIO_PROCESS, static_cast<id_t>(tid), niceValue(priority)) == 0;
+#else
+    if (priority == QThread::InheritPriority) {
+        return true;
+    }
+    if (threadId != currentThreadId()) {
+        return false;
+    }
+    QThread::currentThread()->setPriority(static_cast<QThread::Priority>(priority));
+    return true;
+#endif
+}
+
+} // namespace ThreadTuning
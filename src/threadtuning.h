@@ -0,0 +1,44 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __THREAD_TUNING__
+#define __THREAD_TUNING__
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+#include <QtGlobal>
+
+/*
+ * Pins threads to CPUs and sets their scheduling class. Threads are
+ * addressed by their kernel thread id, so threads created inside TFLite can
+ * be tuned as well. Only Linux supports everything, elsewhere the affinity
+ * calls fail and only the calling thread's priority can be changed.
+ */
+namespace ThreadTuning {
+
+// bit n set means CPU n, an empty mask allows all CPUs
+quint64 cpuMask(const QList<int>& cpus);
+QList<int> cpuList(quint64 mask);
+
+qint64 currentThreadId();
+// ids of all threads of this process, empty if the platform cannot list them
+QVector<qint64> threadIds();
+
+// the kernel's name of a thread (at most 15 characters), which threads it starts inherit; empty
+// where it is unknown
+QByteArray threadName(qint64 threadId);
+QByteArray currentThreadName();
+bool setCurrentThreadName(const QByteArray& name);
+
+bool setAffinity(qint64 threadId, quint64 mask);
+// priority is a QThread::Priority, InheritPriority gives the thread the main thread's class and nice value back
+bool setPriority(qint64 threadId, int priority);
+
+} // namespace ThreadTuning
+
+#endif // __THREAD_TUNING__
@@ -0,0 +1,63 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __TRIPLE_BUFFER__
+#define __TRIPLE_BUFFER__
+
+#include <atomic>
+
+/*
+ * Lock-free hand-over of the latest value from one writer to one reader.
+ * The writer fills its buffer and publishes it by swapping it with the
+ * middle one, the reader swaps its buffer with the middle one when a newer
+ * value is there. Neither side ever waits for the other, values the reader
+ * did not get to are overwritten, and buffers are reused, so e.g. vectors
+ * keep their capacity.
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() = default;
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // writer: the buffer to fill, it may hold an older value
+    T& writeBuffer() { return m_buffers[m_writeIndex]; }
+
+    // writer: makes the write buffer the latest value and continues with another one
+    void publish()
+    {
+        const int previous = m_middle.exchange(m_writeIndex | NewValue, std::memory_order_acq_rel);
+        m_writeIndex = previous & IndexMask;
+    }
+
+    // reader: switches to the latest value, false if nothing was published since the last call
+    bool update()
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & NewValue) == 0) {
+            return false;
+        }
+        const int previous = m_middle.exchange(m_readIndex, std::memory_order_acq_rel);
+        m_readIndex = previous & IndexMask;
+        return true;
+    }
+
+    // reader: the value of the last successful update()
+    const T& readBuffer() const { return m_buffers[m_readIndex]; }
+
+private:
+    static const int IndexMask = 3;
+    static const int NewValue = 4;
+
+    T m_buffers[3];
+    int m_writeIndex = 0;
+    std::atomic<int> m_middle { 1 };
+    int m_readIndex = 2;
+};
+
+#endif // __TRIPLE_BUFFER__
@@ -0,0 +1,190 @@
+/**
+ * SPDX-FileCopyrightText: 2024 basysKom GmbH
+ * SPDX-FileContributor: Berthold Krevert <berthold.krevert@basyskom.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "allocationcounter.h"
+#include "cocodetectionfilter.h"
+#include "cocodetectionmodel.h"
+#include "pipelinestats.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QThread>
+#include <QTimer>
+#include <QVideoFrame>
+#include <QVideoSurfaceFormat>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+/*
+ * Regression test for the allocation-free steady state of the pipeline.
+ * Seeded synthetic camera frames go through CocoDetectionFilterRunnable::run()
+ * one after the other, each once the previous frame's detections reached the
+ * model. After the warm-up frames every heap allocation is counted: on the
+ * pipeline's threads, and on the main thread inside run() and the model
+ * update. Any allocation fails the test.
+ *
+ * Exits with 77 (skipped for CTest) if the model file is missing or the
+ * allocator cannot be hooked on this platform.
+ */
+
+namespace {
+
+const int SkipTest = 77;
+
+// memory backed NV12 frame with seeded noise, what most cameras deliver
+QVideoFrame syntheticFrame(const QSize& size, std::mt19937& random)
+{
+    QVideoFrame frame(size.width() * size.height() * 3 / 2, size, size.width(), QVideoFrame::Format_NV12);
+    if (frame.map(QAbstractVideoBuffer::WriteOnly)) {
+        uchar* data = frame.bits();
+        for (int i = 0; i < frame.mappedBytes(); i++) {
+            data[i] = static_cast<uchar>(random());
+        }
+        frame.unmap();
+    }
+    return frame;
+}
+
+// runs the event loop (which applies the model updates) until the model shows the frame run at runTime
+bool waitForFrame(CocoDetectionModel* model, qint64 runTime, int timeout)
+{
+    if (model->captureTime() >= runTime) {
+        return true;
+    }
+
+    QEventLoop loop;
+    QObject::connect(model, &CocoDetectionModel::rowsUpdated, &loop, [&]() {
+        if (model->captureTime() >= runTime) {
+            loop.quit();
+        }
+    });
+    QTimer::singleShot(timeout, Qt::PreciseTimer, &loop, &QEventLoop::quit);
+    loop.exec();
+    return model->captureTime() >= runTime;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("qmlmobilenet-allocation-test"));
+    QLoggingCategory::setFilterRules(QStringLiteral("tensorflow.*.info=false"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Fails if the detection pipeline allocates after warm-up."));
+    parser.addHelpOption();
+    const QCommandLineOption modelOption(QStringLiteral("model"), QStringLiteral("TFLite model file."), QStringLiteral("file"),
+                                         QStringLiteral("model/ssd_mobilenet_v1_1_metadata_1.tflite"));
+    const QCommandLineOption labelsOption(QStringLiteral("labels"), QStringLiteral("Label file."), QStringLiteral("file"),
+                                          QStringLiteral("model/coco_labels.txt"));
+    const QCommandLineOption warmupOption(QStringLiteral("warmup"), QStringLiteral("Frames before allocations are counted."),
+                                          QStringLiteral("frames"), QStringLiteral("30"));
+    const QCommandLineOption framesOption(QStringLiteral("frames"), QStringLiteral("Frames that must not allocate."),
+                                          QStringLiteral("frames"), QStringLiteral("60"));
+    parser.addOptions({ modelOption, labelsOption, warmupOption, framesOption });
+    parser.process(app);
+
+    const QString modelFile = parser.value(modelOption);
+    if (!QFileInfo::exists(modelFile)) {
+        fprintf(stderr, "Skipped: %s does not exist\n", qPrintable(modelFile));
+        return SkipTest;
+    }
+    if (!AllocationCounter::isSupported()) {
+        fprintf(stderr, "Skipped: allocations cannot be counted on this platform\n");
+        return SkipTest;
+    }
+    const int warmupFrames = std::max(0, parser.value(warmupOption).toInt());
+    const int checkedFrames = std::max(1, parser.value(framesOption).toInt());
+    const int timeout = 2000;
+
+    // the main thread only counts inside run() and the model update, not the test's own work
+    AllocationCounter::setThreadIgnored(true);
+
+    // a few different frames in turn, so the motion gate lets every one through
+    std::mt19937 random(42);
+    const QSize frameSize(640, 480);
+    std::vector<QVideoFrame> frames;
+    for (int i = 0; i < 4; i++) {
+        frames.push_back(syntheticFrame(frameSize, random));
+    }
+    const QVideoSurfaceFormat surfaceFormat(frameSize, QVideoFrame::Format_NV12);
+
+    auto settings = std::make_shared<CocoDetectionSettings>();
+    // waiting for a frame's detections must not make them too old to publish
+    settings->maxResultAge = 0;
+    auto stats = std::make_shared<PipelineStats>();
+
+    // incremental updates like the app, resetting the model allocates in Qt
+    CocoDetectionModel model(parser.value(labelsOption));
+    model.setIncrementalUpdates(true);
+    QObject::connect(&model, &CocoDetectionModel::rowsAboutToBeUpdated, []() {
+        AllocationCounter::setThreadIgnored(false);
+    });
+    QObject::connect(&model, &CocoDetectionModel::rowsUpdated, []() {
+        AllocationCounter::setThreadIgnored(true);
+    });
+
+    CocoDetectionFilterRunnable runnable(modelFile, QStringList(), QString(), settings, stats, &model);
+    CocoDetectionWorkerPool* pool = runnable.workerPool();
+    pool->start();
+
+    // frames before Ready would pass through undetected
+    while (pool->status() == CocoDetectionWorkerPool::Loading || pool->status() == CocoDetectionWorkerPool::Warming) {
+        QThread::msleep(10);
+    }
+    if (pool->status() != CocoDetectionWorkerPool::Ready) {
+        fprintf(stderr, "Cannot load %s\n", qPrintable(modelFile));
+        return 1;
+    }
+
+    int firstAllocatingFrame = -1;
+    int missedFrames = 0;
+    for (int i = 0; i < warmupFrames + checkedFrames; i++) {
+        if (i == warmupFrames) {
+            AllocationCounter::setEnabled(true);
+        }
+
+        QVideoFrame frame = frames[static_cast<size_t>(i) % frames.size()];
+        const qint64 runTime = stats->now();
+        AllocationCounter::setThreadIgnored(false);
+        runnable.run(&frame, surfaceFormat, QVideoFilterRunnable::RunFlags());
+        AllocationCounter::setThreadIgnored(true);
+
+        if (!waitForFrame(&model, runTime, timeout) && i >= warmupFrames) {
+            missedFrames++;
+        }
+        if (firstAllocatingFrame < 0 && AllocationCounter::count() > 0) {
+            firstAllocatingFrame = i;
+        }
+    }
+    AllocationCounter::setEnabled(false);
+    const quint64 allocations = AllocationCounter::count();
+
+    if (missedFrames == checkedFrames) {
+        fprintf(stderr, "FAIL: no frame after warm-up reached the model, nothing was checked\n");
+        return 1;
+    }
+    if (missedFrames > 0) {
+        fprintf(stderr, "%d frames did not reach the model within %d ms\n", missedFrames, timeout);
+    }
+    if (allocations > 0) {
+        fprintf(stderr, "FAIL: %llu allocations in the %d frames after warm-up, the first in frame %d\n",
+                static_cast<unsigned long long>(allocations), checkedFrames, firstAllocatingFrame);
+        return 1;
+    }
+    fprintf(stderr, "PASS: no allocations in the %d frames after %d warm-up frames\n", checkedFrames, warmupFrames);
+    return 0;
+}